@@ -10,6 +10,17 @@ const size_t BLOCK_SIZE = (1024 * 4 - 32);
 #define NUM_ELEMENTS (BLOCK_SIZE*16)
 #define ITERATIONS 1000
 
+// Random non-zero coefficients, the same for every run so the per-pair and fused numbers are comparable
+void init_coefficients(uint8_t m[8][8]) {
+    srand(1);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            m[i][j] = 2 + rand() % 254;
+        }
+    }
+}
+
+// Per (parity, data) pair: mul1/mul_add1 once per coefficient
 double benchmark() {
     uint8_t *a = (uint8_t*)aligned_alloc(32, NUM_ELEMENTS);
     uint8_t *res = (uint8_t*)aligned_alloc(32, NUM_ELEMENTS);
@@ -20,6 +31,7 @@ double benchmark() {
     }
 
     uint8_t m[8][8];
+    init_coefficients(m);
 
     clock_t start = clock();
 
@@ -34,13 +46,13 @@ double benchmark() {
                     if (coeff == 1) {
                         memcpy(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, BLOCK_SIZE);
                     } else {
-                        mul1_avx2(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*0, coeff, BLOCK_SIZE);
+                        mul1(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, coeff, BLOCK_SIZE);
                     }
                 } else {
                     if (coeff == 1) {
-                        add1_avx2(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, BLOCK_SIZE);
+                        add1(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, BLOCK_SIZE);
                     } else {
-                        mul_add1_avx2(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, coeff, BLOCK_SIZE);
+                        mul_add1(res + BLOCK_SIZE*(block+8), a + BLOCK_SIZE*j, coeff, BLOCK_SIZE);
                     }
                 }
             }
@@ -62,20 +74,58 @@ double benchmark() {
     return gb_per_second;
 }
 
+// Fused: mul_rows produces all 8 parity blocks in one pass over the 8 data blocks
+double benchmark_fused() {
+    uint8_t *a = (uint8_t*)aligned_alloc(32, NUM_ELEMENTS);
+    uint8_t *res = (uint8_t*)aligned_alloc(32, NUM_ELEMENTS);
+
+    // Initialize input data
+    for (int i = 0; i < NUM_ELEMENTS; i++) {
+        a[i] = rand() & 0xFF;
+    }
+
+    uint8_t m[8][8];
+    init_coefficients(m);
+    gf *src[8], *dst[8];
+    for (int j = 0; j < 8; j++) {
+        src[j] = a + BLOCK_SIZE*j;
+        dst[j] = res + BLOCK_SIZE*(j+8);
+    }
+
+    clock_t start = clock();
+
+    for (int iter = 0; iter < ITERATIONS; iter++) {
+        mul_rows(dst, 8, src, 8, &m[0][0], BLOCK_SIZE);
+    }
+
+    clock_t end = clock();
+
+    double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
+    double gb_processed = (double)(NUM_ELEMENTS) * (double)(ITERATIONS) / (1024 * 1024 * 1024);
+    double gb_per_second = gb_processed / time_spent;
+    printf("Time: %.2f us = %g us per iteration\n", time_spent * 1e6, time_spent * 1e6 / ITERATIONS);
+    printf("Processed: %.2f GB\n", gb_processed);
+    printf("Throughput: %.2f GB/s\n", gb_per_second);
+
+    free(a);
+    free(res);
+
+    return gb_per_second;
+}
+
 // Helper function for the original implementation
 void gf256_mul_original(uint8_t *res, const uint8_t *a, const uint8_t* b, int size) {
-    mul1_avx2(res, a, b[0], size);
+    mul1(res, a, b[0], size);
 }
 
 // Reference implementation for validation
 void gf256_mul_reference(uint8_t *res, const uint8_t *a, const uint8_t* b, int size) {
     for (int i = 0; i < size; i++) {
-        // res[i] = gf_mul_table_2d[a[i]][b[i & ~31]];
-        res[i] = gf_mul_table[a[i] * GF_SIZE + b[i]];
+        res[i] = gf_mul(a[i], b[i]);
     }
 }
 
-#define TEST_SIZE 32
+#define TEST_SIZE 4080
 
 // Unit test function
 void run_unit_tests() {
@@ -106,13 +156,37 @@ void run_unit_tests() {
     printf("All unit tests passed successfully!\n\n");
 }
 
-int main() {
-    init_gf();
+void run_backend() {
+    printf("== Backend: %s ==\n", gf_kernel->name);
 
     // Run unit tests
     run_unit_tests();
 
-    benchmark();
+    printf("Per-pair kernels:\n");
+    double before = benchmark();
+    printf("\nFused kernel:\n");
+    double after = benchmark_fused();
+    printf("\nFused speedup: %.2fx\n\n", after / before);
+}
+
+// Usage: benchavx2gf [backend], with no argument every backend this cpu supports is benchmarked
+int main(int argc, char** argv) {
+    init_gf();
+
+    if (argc > 1) {
+        if (!gf_select_kernels(argv[1])) {
+            fprintf(stderr, "Backend %s is unknown or not supported on this cpu\n", argv[1]);
+            return 1;
+        }
+        run_backend();
+        return 0;
+    }
+
+    for (int i = 0; gf_all_kernels[i] != NULL; i++) {
+        if (gf_select_kernels(gf_all_kernels[i]->name)) {
+            run_backend();
+        }
+    }
 
     return 0;
-}
\ No newline at end of file
+}
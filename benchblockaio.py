@@ -11,6 +11,7 @@ The benchmarking script includes the following functions:
 - `get_aio_stats()`: Retrieves AIO statistics such as the number of AIO requests and the maximum number of AIO requests.
 - `run_benchmark_on_drive(drive_path)`: Runs a benchmark on a specific drive by performing write operations and measuring the throughput.
 - `run_multi_drive_benchmark()`: Runs a benchmark on multiple drives concurrently and prints the results.
+- `run_engine_comparison(path)`: Runs the same write benchmark through each I/O engine (libaio, io_uring, io_uring with SQPOLL).
 The benchmarking script measures the throughput of disk writes by submitting write requests to the AIO context and checking for completed operations. It provides detailed information about system statistics, AIO statistics, and drive-specific results.
 Note: This script requires the `libblockaio.so` shared library and appropriate permissions to access the drives for benchmarking.
 """
@@ -287,5 +288,53 @@ def run_multi_drive_benchmark():
     print(f"Total Min Throughput: {total_min_throughput:.2f} MB/s")
     print(f"Total Max Throughput: {total_max_throughput:.2f} MB/s")
 
+def run_engine_benchmark(engine, file_path, total_pages=10000, iterations=10):
+    fd = os.open(file_path, os.O_WRONLY | os.O_CREAT | os.O_DIRECT)
+    engine.register_files([fd])
+    pages_per_write = blockaio.ENGINE_MAX_PAGES
+    throughputs = []
+
+    for _ in range(iterations):
+        submitted = 0
+        completed = 0
+
+        start_time = time.monotonic()
+        while completed < total_pages:
+            while submitted < total_pages:
+                pages_to_write = min(pages_per_write, total_pages - submitted)
+                ret = engine.submit_write(fd, submitted, pages_to_write)
+                if ret != 0:
+                    # -EAGAIN when the engine is full, anything else is an error
+                    if ret != -11:
+                        raise OSError(-ret, os.strerror(-ret))
+                    break
+                submitted += pages_to_write
+            completed += engine.check_completed()
+
+        duration = time.monotonic() - start_time
+        throughputs.append(total_pages * blockaio.PAGE_SIZE / duration / 1e6)
+
+    engine.register_files([])
+    os.close(fd)
+    return throughputs
+
+def run_engine_comparison(path="."):
+    file_path = os.path.join(path, "test_file")
+    configs = [("libaio", False), ("io_uring", False), ("io_uring", True)]
+    for name, sqpoll in configs:
+        try:
+            engine = blockaio.IoEngine(name, sqpoll=sqpoll)
+        except OSError as exc:
+            print(f"{name}{' sqpoll' if sqpoll else ''}: {exc}")
+            continue
+        throughputs = run_engine_benchmark(engine, file_path)
+        engine.close()
+        print(f"{name}{' sqpoll' if sqpoll else ''}: {statistics.mean(throughputs):.2f} MB/s "
+              f"(std dev {statistics.stdev(throughputs):.2f}, min {min(throughputs):.2f}, max {max(throughputs):.2f})")
+
 if __name__ == "__main__":
-    run_multi_drive_benchmark()
\ No newline at end of file
+    import sys
+    if len(sys.argv) > 1 and sys.argv[1] == "engines":
+        run_engine_comparison(sys.argv[2] if len(sys.argv) > 2 else ".")
+    else:
+        run_multi_drive_benchmark()
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc32c.hpp"
+
+// A cell is checksummed from its sequence number on, 4096 - 4 bytes
+const size_t CELL_BYTES = 4096 - 4;
+const size_t BATCH_CELLS = 12;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs fn until about 0.2 s have passed, returns GB/s
+template <typename Fn>
+static double throughput(size_t bytes_per_call, Fn fn) {
+    long calls = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int i = 0; i < 64; i++) {
+            fn();
+        }
+        calls += 64;
+        elapsed = now() - start;
+    } while (elapsed < 0.2);
+    return calls * bytes_per_call / elapsed / 1e9;
+}
+
+int main() {
+    const size_t max_bytes = 1 << 20;
+    unsigned char* buffer = (unsigned char*)aligned_alloc(4096, max_bytes + 4096);
+    for (size_t i = 0; i < max_bytes + 4096; i++) {
+        buffer[i] = rand() & 0xFF;
+    }
+    volatile uint32_t sink = 0;
+
+    printf("Running unit tests...\n");
+    for (size_t length = 0; length < 20000; length += 1 + length / 8) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            if (crc32c(buffer + offset, length, 7) != crc32cSerial(buffer + offset, length, 7)) {
+                printf("Interleaved crc32c differs at length %zu offset %zu\n", length, offset);
+                return 1;
+            }
+        }
+    }
+    printf("All unit tests passed successfully!\n\n");
+
+    printf("%10s %12s %12s %8s\n", "bytes", "serial GB/s", "3-way GB/s", "speedup");
+    const size_t sizes[] = {64, 256, 1024, CELL_BYTES, 16384, max_bytes};
+    for (size_t bytes : sizes) {
+        // Cells start 4 bytes into a page, like block_checksum does
+        const unsigned char* data = buffer + 4;
+        double serial = throughput(bytes, [&] { sink = sink + crc32cSerial(data, bytes, 0); });
+        double interleaved = throughput(bytes, [&] { sink = sink + crc32c(data, bytes, 0); });
+        printf("%10zu %12.2f %12.2f %7.2fx\n", bytes, serial, interleaved, interleaved / serial);
+    }
+
+    // A stripe's worth of cells at once
+    const void* cells[BATCH_CELLS];
+    uint32_t crcs[BATCH_CELLS];
+    for (size_t i = 0; i < BATCH_CELLS; i++) {
+        cells[i] = buffer + 4 + i * 4096 * 8;
+    }
+    double single = throughput(CELL_BYTES * BATCH_CELLS, [&] {
+        for (size_t i = 0; i < BATCH_CELLS; i++) {
+            crcs[i] = crc32c(cells[i], CELL_BYTES, 0);
+        }
+        sink = sink + crcs[0];
+    });
+    double batch = throughput(CELL_BYTES * BATCH_CELLS, [&] {
+        crc32cBatch(cells, CELL_BYTES, 0, crcs, BATCH_CELLS);
+        sink = sink + crcs[0];
+    });
+    printf("\n%zu cells: crc32c %.2f GB/s, crc32cBatch %.2f GB/s\n", BATCH_CELLS, single, batch);
+
+    free(buffer);
+    return 0;
+}
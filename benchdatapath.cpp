@@ -0,0 +1,187 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "blockaio.hpp"
+#include "crc32c.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Microbenchmarks of the stripe data path: crc32c, spreadData/unspreadData, the GF(256) kernels of every
+ * supported backend, rs_encode, and rs_decode for every erasure count, swept over k, m and cell sizes.
+ * Each reports bytes/s and the time per call, and bytes_per_cycle counted with the TSC.
+ *
+ *     ./benchdatapath --benchmark_out=bench.json --benchmark_out_format=json
+ *
+ * gives JSON to diff between releases (make bench), --benchmark_filter picks benchmarks by name.
+ */
+namespace {
+
+const int CELL_SIZES[] = {1024, 4080, 65536};
+
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Runs the benchmark loop, counting bytes per call
+template <typename Fn>
+void measure(benchmark::State& state, size_t bytes_per_call, Fn fn) {
+    const uint64_t start = cycles();
+    for (auto _ : state) {
+        fn();
+        benchmark::ClobberMemory();
+    }
+    const uint64_t elapsed = cycles() - start;
+    state.SetBytesProcessed(int64_t(state.iterations()) * bytes_per_call);
+    if (elapsed > 0) {
+        state.counters["bytes_per_cycle"] = double(state.iterations()) * bytes_per_call / elapsed;
+    }
+}
+
+struct Buffers {
+    std::vector<unsigned char*> cells;
+
+    Buffers(int count, size_t size) {
+        std::mt19937 gen(count * 31 + size);
+        for (int i = 0; i < count; i++) {
+            unsigned char* cell = allocAligned<unsigned char>(64, size);
+            for (size_t j = 0; j < size; j++) {
+                cell[j] = static_cast<unsigned char>(gen());
+            }
+            cells.push_back(cell);
+        }
+    }
+    ~Buffers() {
+        for (unsigned char* cell : cells) {
+            free(cell);
+        }
+    }
+};
+
+void BM_Crc32c(benchmark::State& state) {
+    const size_t size = state.range(0);
+    Buffers buffer(1, size);
+    uint32_t crc = 0;
+    measure(state, size, [&]() { benchmark::DoNotOptimize(crc = crc32c(buffer.cells[0], size, crc)); });
+}
+BENCHMARK(BM_Crc32c)->RangeMultiplier(4)->Range(64, 64 << 10);
+
+// The k + m cells of a stripe, checksummed together as validateBlocks() does
+void BM_Crc32cBatch(benchmark::State& state) {
+    const int count = state.range(0);
+    const size_t size = sizeof(Block) - sizeof(uint32_t);
+    Buffers buffers(count, size);
+    std::vector<uint32_t> crcs(count);
+    measure(state, size * count, [&]() {
+        crc32cBatch(reinterpret_cast<const void* const*>(buffers.cells.data()), size, 0, crcs.data(), count);
+    });
+}
+BENCHMARK(BM_Crc32cBatch)->DenseRange(4, 16, 4);
+
+void BM_SpreadData(benchmark::State& state) {
+    const int k = state.range(0);
+    const size_t cell_size = state.range(1) & ~size_t(15);
+    Buffers input(1, k * cell_size);
+    Buffers cells(k, cell_size);
+    std::vector<void*> outputs(cells.cells.begin(), cells.cells.end());
+    measure(state, k * cell_size, [&]() { spreadData(input.cells[0], outputs, k * cell_size, k); });
+}
+BENCHMARK(BM_SpreadData)->ArgsProduct({{4, 8, 16}, {1024, 4080, 65536}});
+
+void BM_UnspreadData(benchmark::State& state) {
+    const int k = state.range(0);
+    const size_t cell_size = state.range(1) & ~size_t(15);
+    Buffers output(1, k * cell_size);
+    Buffers cells(k, cell_size);
+    std::vector<void*> inputs(cells.cells.begin(), cells.cells.end());
+    measure(state, k * cell_size, [&]() { unspreadData(inputs, output.cells[0], k * cell_size, k); });
+}
+BENCHMARK(BM_UnspreadData)->ArgsProduct({{4, 8, 16}, {1024, 4080, 65536}});
+
+void BM_Mul1(benchmark::State& state, const gf_kernels* kernels) {
+    const int size = state.range(0);
+    Buffers buffers(2, size);
+    measure(state, size, [&]() { kernels->mul1(buffers.cells[0], buffers.cells[1], 0x8e, size); });
+}
+
+void BM_MulAdd1(benchmark::State& state, const gf_kernels* kernels) {
+    const int size = state.range(0);
+    Buffers buffers(2, size);
+    measure(state, size, [&]() { kernels->mul_add1(buffers.cells[0], buffers.cells[1], 0x8e, size); });
+}
+
+// Bytes are the data cells encoded
+void BM_RsEncode(benchmark::State& state) {
+    const int k = state.range(0), m = state.range(1), size = state.range(2);
+    reed_solomon* rs = rs_new(k, m);
+    Buffers cells(k + m, size);
+    measure(state, size_t(k) * size, [&]() { rs_encode(rs, cells.cells.data(), cells.cells.data() + k, size); });
+    rs_free(rs);
+}
+BENCHMARK(BM_RsEncode)->ArgsProduct({{4, 8, 16}, {2, 4, 8}, {1024, 4080, 65536}});
+
+// The first erasures data cells are lost, bytes are the cells rebuilt
+void BM_RsDecode(benchmark::State& state) {
+    const int k = state.range(0), m = state.range(1), erased = state.range(2), size = state.range(3);
+    if (erased > m) {
+        state.SkipWithError("more erasures than parity");
+        return;
+    }
+    reed_solomon* rs = rs_new(k, m);
+    Buffers cells(k + m, size);
+    rs_encode(rs, cells.cells.data(), cells.cells.data() + k, size);
+    std::vector<int> erasures(k + m, 0);
+    std::fill(erasures.begin(), erasures.begin() + erased, 1);
+    measure(state, size_t(erased) * size, [&]() {
+        benchmark::DoNotOptimize(rs_decode(rs, cells.cells.data(), erasures.data(), erased, size));
+    });
+    rs_free(rs);
+}
+
+void decodeArgs(benchmark::internal::Benchmark* bench) {
+    for (int k : {4, 8, 16}) {
+        for (int m : {2, 4, 8}) {
+            for (int erased = 1; erased <= m; erased++) {
+                for (int size : CELL_SIZES) {
+                    bench->Args({k, m, erased, size});
+                }
+            }
+        }
+    }
+}
+BENCHMARK(BM_RsDecode)->Apply(decodeArgs)->ArgNames({"k", "m", "erasures", "size"});
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    init_gf();
+    // The kernels of every backend this cpu supports, e.g. BM_Mul1/avx2/4080
+    for (int i = 0; gf_all_kernels[i] != NULL; i++) {
+        const gf_kernels* kernels = gf_all_kernels[i];
+        if (!kernels->supported()) {
+            continue;
+        }
+        for (int size : CELL_SIZES) {
+            benchmark::RegisterBenchmark((std::string("BM_Mul1/") + kernels->name).c_str(), BM_Mul1, kernels)->Arg(size);
+            benchmark::RegisterBenchmark((std::string("BM_MulAdd1/") + kernels->name).c_str(), BM_MulAdd1, kernels)->Arg(size);
+        }
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
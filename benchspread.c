@@ -4,6 +4,7 @@
 #include <time.h>
 #include <immintrin.h>
 #include <x86intrin.h>
+#include "spread.h"
 
 // Original version
 void spread_data_original(void *input, void **output_blocks, size_t input_size, int k) {
@@ -57,182 +58,161 @@ void spread_data_simd(void *input, void **output_blocks, size_t input_size, int
     }
 }
 
-// Benchmark function
-double benchmark(void (*func)(void*, void**, size_t, int), void *input, void **output_blocks, size_t input_size, int k, int iterations) {
-    clock_t start, end;
-    double cpu_time_used;
-
-    start = clock();
-    for (int i = 0; i < iterations; i++) {
-        func(input, output_blocks, input_size, k);
-    }
-    end = clock();
-
-    // compare output_blocks against the original output_blocks
-    // make copy of output_blocks
-    void **output_blocks_copy = malloc(k * sizeof(void*));
-    const int output_size = ((input_size / k) + 0x1f) & ~0x1F;
-    for (int i = 0; i < k; i++) {
-        output_blocks_copy[i] = malloc(output_size);
-        memset(output_blocks_copy[i], 0, output_size);
-        memcpy(output_blocks_copy[i], output_blocks[i], output_size);
-    }
-
-    // call original function
-    void **output_blocks_original = malloc(k * sizeof(void*));
-    for (int i = 0; i < k; i++) {
-        output_blocks_original[i] = malloc(output_size);
-    }
-    spread_data_original(input, output_blocks_original, input_size, k);
-
-    // compare output_blocks and output_blocks_original
-    for (int i = 0; i < k; i++) {
-        if (memcmp(output_blocks_copy[i], output_blocks_original[i], output_size) != 0) {
-            printf("Error: output_blocks and output_blocks_original are not equal\n");
-            // print first 16 bytes of each block
-            for (int j = 0; j < k; j++) {
-                printf("Block %d:\n original:   ", j);
-                for (int l = 0; l < 16; l++) {
-                    printf("%02x", ((unsigned char*)output_blocks_original[j])[l]);
-                }
-                printf("...");
-                for (int l = output_size - 16; l < output_size; l++) {
-                    printf("%02x", ((unsigned char*)output_blocks_original[j])[l]);
-                }
-                printf("\n optimised:  ");
-                for (int l = 0; l < 16; l++) {
-                    printf("%02x", ((unsigned char*)output_blocks_copy[j])[l]);
-                }
-                printf("...");
-                for (int l = output_size - 16; l < output_size; l++) {
-                    printf("%02x", ((unsigned char*)output_blocks_copy[j])[l]);
-                }
-                printf("\n");
-                // show the point where the two blocks differ ( 16 bytes before and after)
-                for (int l = 0; l < output_size; l++) {
-                    if (((unsigned char*)output_blocks_copy[j])[l] != ((unsigned char*)output_blocks_original[j])[l]) {
-                        printf("Difference at index %d\n", l);
-                        for (int m = l - 16; m < l + 16; m++) {
-                            printf("%02x", ((unsigned char*)output_blocks_original[j])[m]);
-                        }
-                        
-                        printf("\n");
-                        // put caret at the point of difference
-                        for (int m = l - 16; m < l; m++) {
-                            printf("  ");
-                        }
-                        printf("^^");
-                        for (int m = l + 1; m < l + 16; m++) {
-                            printf("  ");
-                        }
-                        printf("\n");
-                        for (int m = l - 16; m < l + 16; m++) {
-                            printf("%02x", ((unsigned char*)output_blocks_copy[j])[m]);
-                        }
-                        printf("\n");
-                        break;
-                    }
-                }
-            }
-            break;
+// Unspread counterparts of the two above
+void unspread_data_original(void **input_blocks, void *output, size_t output_size, int k) {
+    unsigned char **src = (unsigned char **)input_blocks;
+    unsigned char *dest = (unsigned char *)output;
+    size_t offset = 0;
+    int current_block = 0;
+    for (size_t copied = 0; copied < output_size; copied += 16) {
+        memcpy(dest + copied, src[current_block] + offset, 16);
+        current_block = (current_block + 1) % k;
+        if (current_block == 0) {
+            offset += 16;
         }
     }
+}
 
-    // free memory
-    for (int i = 0; i < k; i++) {
-        free(output_blocks_copy[i]);
-        free(output_blocks_original[i]);
+void unspread_data_simd(void **input_blocks, void *output, size_t output_size, int k) {
+    unsigned char **src = (unsigned char **)input_blocks;
+    unsigned char *dest = (unsigned char *)output;
+    size_t offset = 0;
+    while (output_size >= 16 * k) {
+        for (int i = 0; i < k; i++) {
+            _mm_storeu_si128((__m128i*)dest, _mm_loadu_si128((__m128i*)(src[i] + offset)));
+            dest += 16;
+        }
+        offset += 16;
+        output_size -= 16 * k;
     }
-    free(output_blocks_copy);
-    free(output_blocks_original);
-
-
+}
 
-    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-    return cpu_time_used / iterations;
+// Everything in the kernel signature, the old versions ignore nontemporal
+static void spread_c(const void *input, void *const *cells, size_t size, int k, int nt) { spread_data_original((void*)input, (void**)cells, size, k); }
+static void spread_simd(const void *input, void *const *cells, size_t size, int k, int nt) { spread_data_simd((void*)input, (void**)cells, size, k); }
+static void unspread_c(void *const *cells, void *output, size_t size, int k, int nt) { unspread_data_original((void**)cells, output, size, k); }
+static void unspread_simd(void *const *cells, void *output, size_t size, int k, int nt) { unspread_data_simd((void**)cells, output, size, k); }
+
+typedef struct {
+    const char *name;
+    void (*spread)(const void *input, void *const *cells, size_t size, int k, int nt);
+    void (*unspread)(void *const *cells, void *output, size_t size, int k, int nt);
+    int nt;
+    int (*supported)(void);
+} version;
+
+static int always(void) { return 1; }
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-int main() {
-    const int NUM_SIZES = 4;
-    // const size_t input_sizes[] = {1024, 10240, 102400, 1024000, 4096 * 8};
-    const size_t input_sizes[] = {4096};
-    const int NUM_K = 5;
-    const int k_values[] = {1, 2, 4, 8, 16};
-    const int iterations = 1000;
-
-    for (int size_index = 0; size_index < NUM_SIZES; size_index++) {
-        size_t input_size = input_sizes[size_index];
-        void *input_alloc = malloc(input_size*16 + 37);
-        void *input = input_alloc + 37; // Align input to 37 bytes
-        
-        // Initialize input with random data
-        for (size_t i = 0; i < input_size*16; i++) {
-            ((unsigned char*)input)[i] = rand() % 256;
+// GB/s of payload moved, running for about 50 ms
+static double time_spread(const version *v, const void *input, void **cells, size_t size, int k) {
+    long calls = 0;
+    double start = now(), elapsed;
+    do {
+        for (int i = 0; i < 16; i++) {
+            v->spread(input, cells, size, k, v->nt);
         }
+        calls += 16;
+        elapsed = now() - start;
+    } while (elapsed < 0.05);
+    return calls * size / elapsed / 1e9;
+}
 
-        // print first and last 16 bytes of input
-        // printf("Input: ");
-        // for (int i = 0; i < 16; i++) {
-        //     printf("%02x", ((unsigned char*)input)[i]);
-        // }
-        // printf("...");
-        // for (int i = input_size*16 - 16; i < input_size*16; i++) {
-        //     printf("%02x", ((unsigned char*)input)[i]);
-        // }
-        // printf("\n");
-
-        printf("Input size: %zu bytes\n", input_size);
-
-        for (int k_index = 0; k_index < NUM_K; k_index++) {
-            int k = k_values[k_index];
-            void **output_blocks = malloc(k * sizeof(void*));
-            for (int i = 0; i < k; i++) {
-                output_blocks[i] = malloc(input_size);
-            }
-
-            printf("  Number of blocks (k): %d\n", k);
-
-            double time_original = benchmark(spread_data_original, input, output_blocks, input_size, k, iterations) * 1000000;
-            double time_simd = benchmark(spread_data_simd, input, output_blocks, input_size, k, iterations) * 1000000;
-            double data_size_B = (double)input_size;
+static double time_unspread(const version *v, void **cells, void *output, size_t size, int k) {
+    long calls = 0;
+    double start = now(), elapsed;
+    do {
+        for (int i = 0; i < 16; i++) {
+            v->unspread(cells, output, size, k, v->nt);
+        }
+        calls += 16;
+        elapsed = now() - start;
+    } while (elapsed < 0.05);
+    return calls * size / elapsed / 1e9;
+}
 
-            printf("data_size: %f\n", data_size_B);
+int main(int argc, char **argv) {
+    const version versions[] = {
+        {"C", spread_c, unspread_c, 0, always},
+        {"SIMD", spread_simd, unspread_simd, 0, always},
+        {"sse2", spread_kernels_sse2.spread, spread_kernels_sse2.unspread, 0, spread_kernels_sse2.supported},
+        {"avx2", spread_kernels_avx2.spread, spread_kernels_avx2.unspread, 0, spread_kernels_avx2.supported},
+        {"avx512", spread_kernels_avx512.spread, spread_kernels_avx512.unspread, 0, spread_kernels_avx512.supported},
+        {"avx2-nt", spread_kernels_avx2.spread, spread_kernels_avx2.unspread, 1, spread_kernels_avx2.supported},
+        {"avx512-nt", spread_kernels_avx512.spread, spread_kernels_avx512.unspread, 1, spread_kernels_avx512.supported},
+    };
+    const int NUM_VERSIONS = sizeof(versions) / sizeof(versions[0]);
+    const int k_values[] = {1, 2, 4, 6, 8, 12, 16};
+    const size_t cell_sizes[] = {4080, 64 * 1024, 1024 * 1024};
+
+    __builtin_cpu_init();
+    printf("GB/s of payload, C and SIMD are the 16 byte loops the kernels replace\n");
+    for (int direction = 0; direction < 2; direction++) {
+        printf("\n%s\n%4s %9s", direction == 0 ? "spread" : "unspread", "k", "cell");
+        for (int v = 0; v < NUM_VERSIONS; v++) {
+            printf(" %10s", versions[v].name);
+        }
+        printf("\n");
 
-            printf("    Original:       %f us = %f GB/s\n", time_original, data_size_B / time_original);
-            printf("    SIMD:           %f us (%.2f%% faster) = %f GB/s\n", time_simd, (time_original/time_simd - 1) * 100, data_size_B / time_simd);
+        for (size_t c = 0; c < sizeof(cell_sizes) / sizeof(cell_sizes[0]); c++) {
+            for (size_t ki = 0; ki < sizeof(k_values) / sizeof(k_values[0]); ki++) {
+                const int k = k_values[ki];
+                const size_t cell_size = cell_sizes[c];
+                const size_t size = cell_size * k;
+                unsigned char *payload = aligned_alloc(4096, size);
+                unsigned char *output = aligned_alloc(4096, size);
+                unsigned char *expected = aligned_alloc(4096, size);
+                void *cells[16];
+                void *expected_cells[16];
+                for (int i = 0; i < k; i++) {
+                    cells[i] = aligned_alloc(4096, (cell_size + 4095) & ~(size_t)4095);
+                    expected_cells[i] = aligned_alloc(4096, (cell_size + 4095) & ~(size_t)4095);
+                }
+                for (size_t i = 0; i < size; i++) {
+                    payload[i] = rand() & 0xFF;
+                }
+                spread_data_original(payload, expected_cells, size, k);
+                unspread_data_original(expected_cells, expected, size, k);
+
+                printf("%4d %9zu", k, cell_size);
+                for (int v = 0; v < NUM_VERSIONS; v++) {
+                    if (!versions[v].supported()) {
+                        printf(" %10s", "-");
+                        continue;
+                    }
+                    double gbs;
+                    int ok = 1;
+                    if (direction == 0) {
+                        gbs = time_spread(&versions[v], payload, cells, size, k);
+                        for (int i = 0; i < k; i++) {
+                            ok = ok && memcmp(cells[i], expected_cells[i], cell_size) == 0;
+                        }
+                    } else {
+                        gbs = time_unspread(&versions[v], expected_cells, output, size, k);
+                        ok = memcmp(output, expected, size) == 0;
+                    }
+                    if (!ok) {
+                        printf("\nError: %s output differs from the original\n", versions[v].name);
+                        return 1;
+                    }
+                    printf(" %10.2f", gbs);
+                }
+                printf("\n");
 
-            for (int i = 0; i < k; i++) {
-                free(output_blocks[i]);
+                for (int i = 0; i < k; i++) {
+                    free(cells[i]);
+                    free(expected_cells[i]);
+                }
+                free(payload);
+                free(output);
+                free(expected);
             }
-            free(output_blocks);
         }
-
-        free(input_alloc);
-        printf("\n");
     }
-
-    // // show the output for a single run of the original function on just 100 bytes into 4 blocks with input data of 0x00 to 0x64
-    // const int k = 4;
-    // const block_size = 32;
-    // void *input = malloc(block_size*k);
-    // for (size_t i = 0; i < block_size*k; i++) {
-    //     ((unsigned char*)input)[i] = i % 0xff;
-    // }
-    // void **output_blocks = malloc(k * sizeof(void*));
-    // for (int i = 0; i < k; i++) {
-    //     output_blocks[i] = malloc(block_size);
-    // }
-    // spread_data_original(input, output_blocks, 100, k);
-    // for (int i = 0; i < k; i++) {
-    //     printf("Block %d: ", i);
-    //     for (int j = 0; j < block_size; j+=16) {
-    //         for(int b = 0; b < 16; b++) {
-    //             printf("%02x", ((unsigned char*)output_blocks[i])[j+b]);
-    //         }
-    //         printf(" ");
-    //     }
-    //     printf("\n");
-    // }
-
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,247 @@
+#include "blobindex.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+namespace {
+
+struct IndexPage {
+    uint32_t checksum;  // crc32c of the rest of the page, seeded with the page number
+    uint32_t count;     // entries in use, a page that isn't full is the last one
+    uint64_t generation;
+    BlobEntry entries[BlobIndex::ENTRIES_PER_PAGE];
+};
+static_assert(sizeof(IndexPage) == PAGE_SIZE, "an index page is one page");
+
+// Pages read or written with one syscall
+const uint32_t CHUNK_PAGES = 256;
+
+uint32_t pageChecksum(const IndexPage& page, uint32_t page_number) {
+    return crc32c(&page.count, sizeof(IndexPage) - sizeof(page.checksum), page_number);
+}
+
+bool validPage(const IndexPage& page, uint32_t page_number) {
+    return page.count <= uint32_t(BlobIndex::ENTRIES_PER_PAGE) && page.checksum == pageChecksum(page, page_number);
+}
+
+// Reads whole pages, short reads are zeros that don't validate
+int readPages(int fd, uint64_t offset, IndexPage* pages, uint32_t count) {
+    ssize_t ret = pread(fd, pages, size_t(count) * sizeof(IndexPage), offset);
+    if (ret < 0) {
+        return -errno;
+    }
+    std::memset(reinterpret_cast<unsigned char*>(pages) + ret, 0, size_t(count) * sizeof(IndexPage) - ret);
+    return 0;
+}
+
+bool live(const BlobEntry& entry) {
+    return entry.size != 0 && !(entry.flags & BlobIndex::DELETED);
+}
+
+}  // namespace
+
+BlobIndex::BlobIndex(const Volume& volume, uint32_t max_pages) : volume_(volume), max_pages_(max_pages), generation_(0) {}
+
+void BlobIndex::markDirty(uint32_t id) {
+    const size_t page = id / ENTRIES_PER_PAGE;
+    if (page >= dirty_.size()) {
+        dirty_.resize(page + 1, false);
+    }
+    dirty_[page] = true;
+}
+
+void BlobIndex::insertSorted(uint32_t id) {
+    if (!live(entries_[id])) {
+        return;
+    }
+    Sorted item = {entries_[id].offset, id};
+    // Appends at the tail are the common case and stay a push_back
+    if (sorted_.empty() || sorted_.back() < item) {
+        sorted_.push_back(item);
+    } else {
+        sorted_.insert(std::lower_bound(sorted_.begin(), sorted_.end(), item), item);
+    }
+}
+
+void BlobIndex::eraseSorted(uint32_t id) {
+    if (!live(entries_[id])) {
+        return;
+    }
+    Sorted item = {entries_[id].offset, id};
+    auto it = std::lower_bound(sorted_.begin(), sorted_.end(), item);
+    if (it != sorted_.end() && it->id == id) {
+        sorted_.erase(it);
+    }
+}
+
+int BlobIndex::load() {
+    IndexPage* primary = nullptr;
+    IndexPage* secondary = nullptr;
+    if (posix_memalign(reinterpret_cast<void**>(&primary), PAGE_SIZE, CHUNK_PAGES * sizeof(IndexPage)) != 0
+        || posix_memalign(reinterpret_cast<void**>(&secondary), PAGE_SIZE, CHUNK_PAGES * sizeof(IndexPage)) != 0) {
+        free(primary);
+        return -ENOMEM;
+    }
+    entries_.clear();
+    dirty_.clear();
+    sorted_.clear();
+    generation_ = 0;
+
+    int ret = 0;
+    bool last = false;
+    for (uint32_t first = 0; first < max_pages_ && !last; first += CHUNK_PAGES) {
+        const uint32_t count = std::min(CHUNK_PAGES, max_pages_ - first);
+        const uint64_t skip = uint64_t(first) * sizeof(IndexPage);
+        if ((ret = readPages(volume_.fd, volume_.header.primary_index_offset + skip, primary, count)) != 0
+            || (ret = readPages(volume_.fd, volume_.header.secondary_index_offset + skip, secondary, count)) != 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < count && !last; i++) {
+            const uint32_t page_number = first + i;
+            const bool a = validPage(primary[i], page_number);
+            const bool b = validPage(secondary[i], page_number);
+            if (!a && !b) {
+                last = true;
+                break;
+            }
+            // The newer copy wins, the primary when both are current
+            const IndexPage& page = a && (!b || primary[i].generation >= secondary[i].generation) ? primary[i] : secondary[i];
+            entries_.insert(entries_.end(), page.entries, page.entries + page.count);
+            generation_ = std::max(generation_, page.generation);
+            // Copies that disagree are rewritten by the next save
+            dirty_.push_back(!a || !b || primary[i].generation != secondary[i].generation);
+            last = page.count < uint32_t(ENTRIES_PER_PAGE);
+        }
+    }
+    free(primary);
+    free(secondary);
+    if (ret != 0) {
+        entries_.clear();
+        dirty_.clear();
+        return ret;
+    }
+
+    sorted_.reserve(entries_.size());
+    for (uint32_t id = 0; id < entries_.size(); id++) {
+        if (live(entries_[id])) {
+            sorted_.push_back({entries_[id].offset, id});
+        }
+    }
+    // Blobs are mostly appended in offset order, so this is usually just the check
+    if (!std::is_sorted(sorted_.begin(), sorted_.end())) {
+        std::sort(sorted_.begin(), sorted_.end());
+    }
+    return entries_.size();
+}
+
+int BlobIndex::writeCopy(uint64_t base) {
+    IndexPage* pages = nullptr;
+    if (posix_memalign(reinterpret_cast<void**>(&pages), PAGE_SIZE, CHUNK_PAGES * sizeof(IndexPage)) != 0) {
+        return -ENOMEM;
+    }
+    int ret = 0;
+    // Each run of consecutive dirty pages goes out with one pwrite
+    for (uint32_t page = 0; page < dirty_.size() && ret == 0;) {
+        if (!dirty_[page]) {
+            page++;
+            continue;
+        }
+        uint32_t run = 0;
+        while (page + run < dirty_.size() && dirty_[page + run] && run < CHUNK_PAGES) {
+            IndexPage& out = pages[run];
+            const size_t first = size_t(page + run) * ENTRIES_PER_PAGE;
+            const size_t count = first < entries_.size() ? std::min<size_t>(ENTRIES_PER_PAGE, entries_.size() - first) : 0;
+            std::memset(&out, 0, sizeof(out));
+            out.count = count;
+            out.generation = generation_;
+            std::memcpy(out.entries, entries_.data() + first, count * sizeof(BlobEntry));
+            out.checksum = pageChecksum(out, page + run);
+            run++;
+        }
+        const ssize_t bytes = ssize_t(run) * sizeof(IndexPage);
+        if (pwrite(volume_.fd, pages, bytes, base + uint64_t(page) * sizeof(IndexPage)) != bytes) {
+            ret = errno != 0 ? -errno : -EIO;
+        }
+        page += run;
+    }
+    free(pages);
+    if (ret == 0 && fdatasync(volume_.fd) != 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+int BlobIndex::save() {
+    const int pages = dirtyPages();
+    if (pages == 0) {
+        return 0;
+    }
+    generation_++;
+    int ret = writeCopy(volume_.header.primary_index_offset);
+    if (ret == 0) {
+        ret = writeCopy(volume_.header.secondary_index_offset);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    std::fill(dirty_.begin(), dirty_.end(), false);
+    return pages;
+}
+
+int BlobIndex::add(uint64_t offset, uint32_t size, uint32_t flags) {
+    if (entries_.size() >= size_t(max_pages_) * ENTRIES_PER_PAGE) {
+        return -ENOSPC;
+    }
+    const uint32_t id = entries_.size();
+    entries_.push_back({offset, size, flags});
+    markDirty(id);
+    // Filling a page also writes out an empty one after it, so load() stops there and not at a stale page
+    if ((id + 1) % ENTRIES_PER_PAGE == 0 && (id + 1) / ENTRIES_PER_PAGE < max_pages_) {
+        markDirty(id + 1);
+    }
+    insertSorted(id);
+    return id;
+}
+
+int BlobIndex::update(uint32_t id, const BlobEntry& entry) {
+    if (id >= entries_.size()) {
+        return -ENOENT;
+    }
+    eraseSorted(id);
+    entries_[id] = entry;
+    insertSorted(id);
+    markDirty(id);
+    return 0;
+}
+
+int BlobIndex::remove(uint32_t id) {
+    if (id >= entries_.size()) {
+        return -ENOENT;
+    }
+    BlobEntry entry = entries_[id];
+    entry.flags |= DELETED;
+    entry.size = 0;
+    return update(id, entry);
+}
+
+int BlobIndex::find(uint64_t offset) const {
+    // The last live blob starting at or before offset is the only one that can hold it
+    auto it = std::upper_bound(sorted_.begin(), sorted_.end(), Sorted{offset, UINT32_MAX});
+    if (it == sorted_.begin()) {
+        return -ENOENT;
+    }
+    --it;
+    const BlobEntry& entry = entries_[it->id];
+    return offset < entry.offset + entry.size ? int(it->id) : -ENOENT;
+}
+
+uint64_t BlobIndex::nextOffset(uint64_t offset) const {
+    auto it = std::upper_bound(sorted_.begin(), sorted_.end(), Sorted{offset, UINT32_MAX});
+    return it == sorted_.end() ? UINT64_MAX : it->offset;
+}
+
+size_t BlobIndex::dirtyPages() const {
+    return std::count(dirty_.begin(), dirty_.end(), true);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * A blob index entry, the same 16 bytes as blobindex4.py's INDEX_ENTRY_DTYPE.
+ */
+struct BlobEntry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+static_assert(sizeof(BlobEntry) == 16, "BlobEntry is the on-disk entry");
+
+/**
+ * Native version of blobindex4.py's BlobVolume index.  Blob IDs index a dense array of entries, and a
+ * sorted array of (offset, id) of the live blobs, not deleted and not empty, answers which blob holds a
+ * byte offset in O(log n).
+ *
+ * The index is persisted as 4096 byte pages of ENTRIES_PER_PAGE entries, twice: at the volume's
+ * primary_index_offset and its secondary_index_offset.  Only the pages changed since the last save are
+ * written, first all to the primary copy and synced, then to the secondary, so a crash leaves every page
+ * whole in at least one copy.  Loading is one sequential read of each copy and a crc32c per page.
+ */
+class BlobIndex {
+public:
+    // The flags, as in blobindex4.py
+    static constexpr uint32_t METADATA = 0x01;
+    static constexpr uint32_t GROWABLE = 0x02;
+    static constexpr uint32_t COMPRESSED = 0x04;
+    static constexpr uint32_t BLAKE3 = 0x08;
+    static constexpr uint32_t MAGICED = 0x10;
+    static constexpr uint32_t DELETED = 0x80;
+
+    // A page is a 16 byte page header and the entries
+    static constexpr int ENTRIES_PER_PAGE = (PAGE_SIZE - 16) / sizeof(BlobEntry);
+
+    /**
+     * @param volume The volume, the index lives at header.primary_index_offset and
+     *        header.secondary_index_offset (page aligned).  Must outlive the index.
+     * @param max_pages The room for index pages at each offset.
+     */
+    BlobIndex(const Volume& volume, uint32_t max_pages);
+
+    /**
+     * Replaces the entries with the ones on disk, taking each page from whichever copy is valid
+     * and newer.  A missing or blank index loads as empty.
+     * @return Returns the number of entries, or a negative error code.
+     */
+    int load();
+
+    /**
+     * Writes the pages changed since the last load() or save() to both copies.
+     * @return Returns the number of pages written to each copy, or a negative error code.
+     */
+    int save();
+
+    /**
+     * Adds a blob, blob IDs are never reused.
+     * @return Returns the new blob ID, or -ENOSPC if the index pages are full.
+     */
+    int add(uint64_t offset, uint32_t size, uint32_t flags);
+
+    /**
+     * Replaces a blob's entry, e.g. after a resize or move.
+     * @return Returns 0, or -ENOENT for an unknown blob ID.
+     */
+    int update(uint32_t id, const BlobEntry& entry);
+
+    /**
+     * Marks a blob deleted with size 0, like BlobVolume.delete_blob.
+     * @return Returns 0, or -ENOENT for an unknown blob ID.
+     */
+    int remove(uint32_t id);
+
+    /**
+     * @return Returns the blob's entry, or nullptr for an unknown blob ID.
+     */
+    const BlobEntry* get(uint32_t id) const { return id < entries_.size() ? &entries_[id] : nullptr; }
+
+    /**
+     * Finds the live blob holding a byte of the volume.
+     * @param offset The byte offset.
+     * @return Returns the blob ID, or -ENOENT if no blob holds the byte.
+     */
+    int find(uint64_t offset) const;
+
+    /**
+     * Finds where the next live blob after a blob's offset starts, how far the blob can grow in place.
+     * @param offset The byte offset.
+     * @return Returns the offset of the first live blob starting after offset, or UINT64_MAX if none does.
+     */
+    uint64_t nextOffset(uint64_t offset) const;
+
+    size_t size() const { return entries_.size(); }
+    size_t dirtyPages() const;
+
+private:
+    struct Sorted {
+        uint64_t offset;
+        uint32_t id;
+        bool operator<(const Sorted& other) const { return offset < other.offset || (offset == other.offset && id < other.id); }
+    };
+
+    void markDirty(uint32_t id);
+    void insertSorted(uint32_t id);
+    void eraseSorted(uint32_t id);
+    int writeCopy(uint64_t base);
+
+    const Volume& volume_;
+    uint32_t max_pages_;
+    uint64_t generation_;  // of the last save
+    std::vector<BlobEntry> entries_;
+    std::vector<bool> dirty_;  // per page
+    std::vector<Sorted> sorted_;  // live blobs by offset
+};
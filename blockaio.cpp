@@ -1,9 +1,15 @@
 #include "blockaio.hpp"
+#include "latency.hpp"
+#include "metrics.h"
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
 #include <immintrin.h>
 #include <cassert>
+#include <cstddef>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
 
 int getKBlocksInStripe(const HeaderBlock& header) {
     int count = 8;
@@ -14,10 +20,10 @@ int getKBlocksInStripe(const HeaderBlock& header) {
     return count;
 }
 
-int computeOffsetToBlock(const HeaderBlock& header, int stripe_number, int shard_id) {
-    size_t offset = 0;
-    // Calculate offset based on stripe number
-    offset += 4096 * getKBlocksInStripe(header) * stripe_number;
+uint64_t computeOffsetToBlock(const HeaderBlock& header, uint64_t stripe_number, int shard_id) {
+    uint64_t offset = 0;
+    // Calculate offset based on stripe number, in 64 bits as volumes are well past 2 GiB
+    offset += uint64_t(4096) * getKBlocksInStripe(header) * stripe_number;
     // Find the correct shard and calculate its offset
     for (int i = 0; i < 8; i++) {
         if (header.shard_ids[i] == shard_id) {
@@ -30,69 +36,231 @@ int computeOffsetToBlock(const HeaderBlock& header, int stripe_number, int shard
     return offset;
 }
 
-uint32_t crc32c(const void* data, size_t length, uint32_t previousCrc32) {
-    uint32_t crc = ~previousCrc32;  // Invert initial value
-    const uint8_t* current = static_cast<const uint8_t*>(data);
+void spreadData(void* input, std::vector<void*>& output_blocks, size_t input_size, int k) {
+    spread_cells(input, output_blocks.data(), input_size, k, 0);
+}
+
+void unspreadData(std::vector<void*>& input_blocks, void* output, size_t output_size, int k) {
+    unspread_cells(input_blocks.data(), output, output_size, k, 0);
+}
+
+// Bytes of each cell built per pass, 16 chunks of the 4080 byte cell (the last one is short)
+constexpr size_t STRIPE_CHUNK = 256;
+
+void buildStripe(reed_solomon* rs, const void* payload, uint64_t stripe_number, uint32_t sequence_number, Block* blocks) {
+    const int k = rs->data_shards;
+    const int n = rs->data_shards + rs->parity_shards;
+    const unsigned char* src = static_cast<const unsigned char*>(payload);
+    unsigned char* cells[MAX_TOTAL_SHARDS];
+    uint32_t crcs[MAX_TOTAL_SHARDS];
+    constexpr size_t cell_size = sizeof(Block::data);
+
+    // Headers first, the checksum covers everything after the checksum field
+    for (int i = 0; i < n; i++) {
+        blocks[i].block_sequence_number = sequence_number;
+        blocks[i].stripe_number = (stripe_number << 8) | static_cast<uint8_t>(i);
+        cells[i] = blocks[i].data.data();
+        crcs[i] = crc32c(reinterpret_cast<const unsigned char*>(&blocks[i]) + 4, offsetof(Block, data) - 4, 0);
+    }
+
+    for (size_t offset = 0; offset < cell_size; offset += STRIPE_CHUNK) {
+        size_t len = std::min(STRIPE_CHUNK, cell_size - offset);
+
+        // Spread this chunk of the payload across the data cells
+        for (size_t pos = offset; pos < offset + len; pos += 16) {
+            for (int i = 0; i < k; i++) {
+                __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(cells[i] + pos), data);
+                src += 16;
+            }
+        }
+
+        // Parity for the chunk while the data cells are still in L1
+        unsigned char* data[MAX_DATA_SHARDS];
+        unsigned char* parity[MAX_TOTAL_SHARDS];
+        for (int i = 0; i < k; i++) {
+            data[i] = cells[i] + offset;
+        }
+        for (int i = k; i < n; i++) {
+            parity[i - k] = cells[i] + offset;
+        }
+        rs_encode(rs, data, parity, len);
+
+        for (int i = 0; i < n; i++) {
+            crcs[i] = crc32c(cells[i] + offset, len, crcs[i]);
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        blocks[i].block_checksum = crcs[i];
+    }
+}
+
+bool readStripeRange(reed_solomon* rs, unsigned char* const* cells, int* erasures, size_t start, size_t length, void* output) {
+    const int k = rs->data_shards;
+    const int n = rs->data_shards + rs->parity_shards;
+    constexpr size_t cell_size = sizeof(Block::data);
+    const size_t end = start + length;
 
-    // Process individual bytes until we reach 8-byte alignment
-    while (length && ((uintptr_t)current & 7)) {
-        crc = _mm_crc32_u8(crc, *current++);
-        length--;
+    if (end > k * cell_size) {
+        return false;
     }
+    if (length == 0) {
+        return true;
+    }
+
+    // The 16 byte chunks [c0, c1] cover the range, rows [row0, row1] of each cell
+    const size_t c0 = start / 16;
+    const size_t c1 = (end - 1) / 16;
+    const size_t row0 = c0 / k;
+    const size_t row1 = c1 / k;
 
-    // Process 8 bytes at a time
-    while (length >= 8) {
-        crc = _mm_crc32_u64(crc, *reinterpret_cast<const uint64_t*>(current));
-        current += 8;
-        length -= 8;
+    // Only reconstruct missing data cells the range actually touches
+    int wanted[MAX_TOTAL_SHARDS] = {0};
+    int erasure_count = 0;
+    int wanted_count = 0;
+    for (int i = 0; i < n; i++) {
+        erasure_count += erasures[i] != 0;
+    }
+    for (size_t c = c0; c <= c1 && c < c0 + k; c++) {
+        int cell = c % k;
+        if (erasures[cell] && !wanted[cell]) {
+            wanted[cell] = 1;
+            wanted_count++;
+        }
+    }
+    if (wanted_count > 0) {
+        if (!rs_decode_range(rs, const_cast<unsigned char**>(cells), erasures, erasure_count, wanted,
+                             row0 * 16, (row1 - row0 + 1) * 16)) {
+            return false;
+        }
     }
 
-    // Process any remaining bytes
-    while (length--) {
-        crc = _mm_crc32_u8(crc, *current++);
+    // Unspread just the range
+    unsigned char* dest = static_cast<unsigned char*>(output);
+    for (size_t p = start; p < end;) {
+        size_t c = p / 16;
+        size_t len = std::min<size_t>(16 - p % 16, end - p);
+        std::memcpy(dest, cells[c % k] + (c / k) * 16 + p % 16, len);
+        dest += len;
+        p += len;
     }
+    return true;
+}
 
-    return ~crc;  // Invert final value
+void sealBlock(Block& block) {
+    block.block_checksum = crc32c(reinterpret_cast<const unsigned char*>(&block) + 4, sizeof(Block) - 4, 0);
 }
 
-void spreadData(void* input, std::vector<void*>& output_blocks, size_t input_size, int k) {
-    unsigned char* src = static_cast<unsigned char*>(input);
-    std::vector<unsigned char*> dest(k);
-    for (int i = 0; i < k; i++) {
-        dest[i] = static_cast<unsigned char*>(output_blocks[i]);
+void sealHeader(HeaderBlock& header) {
+    header.header_crc32c = 0;
+    header.header_crc32c = crc32c(&header, sizeof(HeaderBlock) - 4, 0);
+}
+
+int findVolumeForShard(const VolumeMap& map, int shard_id) {
+    for (size_t v = 0; v < map.volumes.size(); v++) {
+        const HeaderBlock& header = map.volumes[v].header;
+        int count = getKBlocksInStripe(header);
+        for (int i = 0; i < count; i++) {
+            if (header.shard_ids[i] == shard_id) {
+                return v;
+            }
+        }
     }
-    std::vector<size_t> offset(k, 0);
+    return -1;
+}
 
-    // Spread data across k blocks in round-robin fashion
-    while (input_size >= 16 * k) {
-        for (int i = 0; i < k; i++) {
-            __m128i data = _mm_loadu_si128(reinterpret_cast<__m128i*>(src));
-            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest[i] + offset[i]), data);
-            src += 16;
-            offset[i] += 16;
+bool updateCell(reed_solomon* rs, Block& cell, Block* const* parity_cells, const void* new_data, uint32_t sequence_number) {
+    const int k = rs->data_shards;
+    const uint64_t stripe = cell.stripe_number >> 8;
+    const int shard_id = cell.stripe_number & 0xff;
+
+    if (shard_id >= k || !validateBlock(cell)) {
+        return false;
+    }
+    unsigned char* parity[MAX_TOTAL_SHARDS];
+    for (int i = 0; i < rs->parity_shards; i++) {
+        Block* p = parity_cells[i];
+        parity[i] = nullptr;
+        if (p == nullptr) {
+            continue;
+        }
+        if (!validateBlock(*p) || p->stripe_number != ((stripe << 8) | (k + i))) {
+            return false;
+        }
+        parity[i] = p->data.data();
+    }
+
+    rs_update_parity(rs, shard_id, cell.data.data(), static_cast<const unsigned char*>(new_data), parity, cell.data.size());
+    std::memcpy(cell.data.data(), new_data, cell.data.size());
+    cell.block_sequence_number = sequence_number;
+    sealBlock(cell);
+    for (int i = 0; i < rs->parity_shards; i++) {
+        if (parity_cells[i] != nullptr) {
+            parity_cells[i]->block_sequence_number = sequence_number;
+            sealBlock(*parity_cells[i]);
         }
-        input_size -= 16 * k;
     }
+    return true;
 }
 
-void unspreadData(std::vector<void*>& input_blocks, void* output, size_t output_size, int k) {
-    std::vector<unsigned char*> src(k);
-    for (int i = 0; i < k; i++) {
-        src[i] = static_cast<unsigned char*>(input_blocks[i]);
+int updateStripeCell(VolumeMap& map, reed_solomon* rs, uint64_t stripe_number, int shard_id, const void* new_data, uint32_t sequence_number) {
+    const int k = rs->data_shards;
+    const int m = rs->parity_shards;
+    if (shard_id < 0 || shard_id >= k) {
+        return -EINVAL;
+    }
+    int data_volume = findVolumeForShard(map, shard_id);
+    if (data_volume < 0) {
+        return -ENOENT;
     }
-    unsigned char* dest = static_cast<unsigned char*>(output);
-    std::vector<size_t> offset(k, 0);
 
-    // Unspread data from k blocks in round-robin fashion
-    while (output_size >= 16 * k) {
-        for (int i = 0; i < k; i++) {
-            __m128i data = _mm_loadu_si128(reinterpret_cast<__m128i*>(src[i] + offset[i]));
-            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), data);
-            dest += 16;
-            offset[i] += 16;
+    // Cell 0 is the data cell, then the parity cells
+    Block* cells;
+    if (posix_memalign(reinterpret_cast<void**>(&cells), PAGE_SIZE, sizeof(Block) * (1 + m)) != 0) {
+        return -ENOMEM;
+    }
+    std::vector<int> volumes(1 + m, -1);
+    std::vector<Block*> parity_cells(m, nullptr);
+    volumes[0] = data_volume;
+
+    int ret = 0;
+    const Volume& data_vol = map.volumes[data_volume];
+    if (pread(data_vol.fd, &cells[0], sizeof(Block), computeOffsetToBlock(data_vol.header, stripe_number, shard_id)) != sizeof(Block)) {
+        ret = -EIO;
+    }
+    for (int i = 0; ret == 0 && i < m; i++) {
+        int v = findVolumeForShard(map, k + i);
+        if (v < 0) {
+            continue;
+        }
+        const Volume& vol = map.volumes[v];
+        if (pread(vol.fd, &cells[1 + i], sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, k + i)) == sizeof(Block)
+            && validateBlock(cells[1 + i])) {
+            volumes[1 + i] = v;
+            parity_cells[i] = &cells[1 + i];
+        }
+    }
+    if (ret == 0 && !updateCell(rs, cells[0], parity_cells.data(), new_data, sequence_number)) {
+        ret = -EIO;
+    }
+
+    int updated = 0;
+    for (int i = 0; ret == 0 && i < 1 + m; i++) {
+        if (volumes[i] < 0) {
+            continue;
+        }
+        const Volume& vol = map.volumes[volumes[i]];
+        int shard = i == 0 ? shard_id : k + i - 1;
+        if (pwrite(vol.fd, &cells[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, shard)) != sizeof(Block)) {
+            ret = -EIO;
+        } else if (i > 0) {
+            updated++;
         }
-        output_size -= 16 * k;
     }
+
+    free(cells);
+    return ret == 0 ? updated : ret;
 }
 
 bool validateHeader(const HeaderBlock& header) {
@@ -104,8 +272,10 @@ bool validateHeader(const HeaderBlock& header) {
     if (header.volume_prefix_id < (1 << 24)) {
         return false;
     }
-    // Validate header checksum
-    uint32_t computed_checksum = crc32c(&header, sizeof(HeaderBlock) - 4, 0);
+    // Validate header checksum, computed with the checksum field zeroed
+    HeaderBlock unsealed = header;
+    unsealed.header_crc32c = 0;
+    uint32_t computed_checksum = crc32c(&unsealed, sizeof(HeaderBlock) - 4, 0);
     if (computed_checksum != header.header_crc32c) {
         return false;
     }
@@ -115,7 +285,32 @@ bool validateHeader(const HeaderBlock& header) {
 bool validateBlock(const Block& block) {
     // Validate crc32c checksum
     uint32_t computed_checksum = crc32c(reinterpret_cast<const unsigned char*>(&block) + 4, sizeof(Block) - 4, 0);
-    return computed_checksum == block.block_checksum;
+    if (computed_checksum != block.block_checksum) {
+        kelp_metric_add(KELP_METRIC_CRC_FAILURES, 1);
+        return false;
+    }
+    return true;
+}
+
+int validateBlocks(const Block* const* blocks, int count, bool* valid) {
+    const void* data[MAX_TOTAL_SHARDS];
+    uint32_t checksums[MAX_TOTAL_SHARDS];
+    int valid_count = 0;
+    for (int first = 0; first < count; first += MAX_TOTAL_SHARDS) {
+        const int batch = std::min(count - first, MAX_TOTAL_SHARDS);
+        for (int i = 0; i < batch; i++) {
+            data[i] = reinterpret_cast<const unsigned char*>(blocks[first + i]) + 4;
+        }
+        crc32cBatch(data, sizeof(Block) - 4, 0, checksums, batch);
+        for (int i = 0; i < batch; i++) {
+            valid[first + i] = checksums[i] == blocks[first + i]->block_checksum;
+            valid_count += valid[first + i];
+        }
+    }
+    if (valid_count < count) {
+        kelp_metric_add(KELP_METRIC_CRC_FAILURES, count - valid_count);
+    }
+    return valid_count;
 }
 
 void submitRead(io_context_t io_ctx, int fd, int start_page, int num_pages) {
@@ -137,6 +332,8 @@ void submitRead(io_context_t io_ctx, int fd, int start_page, int num_pages) {
         perror("io_submit");
         exit(1);
     }
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, 1);
+    KELP_TRACE2(io_submit, io_ctx, 1);
 }
 
 int submitWrite(io_context_t io_ctx, int fd, int start_page, int num_pages) {
@@ -169,6 +366,8 @@ int submitWrite(io_context_t io_ctx, int fd, int start_page, int num_pages) {
         delete ctx;
         return ret;
     }
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, 1);
+    KELP_TRACE2(io_submit, io_ctx, 1);
     return 0;
 }
 
@@ -187,5 +386,292 @@ int checkCompleted(io_context_t io_ctx) {
         free(ctx->buffer);
         delete ctx;
     }
+    if (completed > 0) {
+        kelp_metric_add(KELP_METRIC_IO_COMPLETED, completed);
+        KELP_TRACE2(io_complete, io_ctx, completed);
+    }
     return total_written;
 }
+
+IoPool::IoPool(io_context_t io_ctx, int small_slots, int large_slots)
+    : io_ctx_(io_ctx), arena_(nullptr), arena_bytes_(0), slots_(nullptr), small_free_(nullptr), large_free_(nullptr), stats_(), tracker_(nullptr) {
+    size_t arena_pages = size_t(small_slots) * SMALL_PAGES + size_t(large_slots) * LARGE_PAGES;
+    arena_bytes_ = arena_pages * PAGE_SIZE;
+    if (arena_pages > 0) {
+        arena_ = allocAligned(PAGE_SIZE, PAGE_SIZE * arena_pages);
+    }
+    slots_ = new WriteContext[small_slots + large_slots];
+
+    // Thread the slots onto the free lists in address order
+    unsigned char* buffer = static_cast<unsigned char*>(arena_);
+    for (int i = small_slots + large_slots - 1; i >= 0; i--) {
+        WriteContext* ctx = &slots_[i];
+        bool small = i < small_slots;
+        ctx->capacity_pages = small ? SMALL_PAGES : LARGE_PAGES;
+        ctx->buffer = small ? buffer + size_t(i) * SMALL_PAGES * PAGE_SIZE
+                            : buffer + (size_t(small_slots) * SMALL_PAGES + size_t(i - small_slots) * LARGE_PAGES) * PAGE_SIZE;
+        WriteContext*& head = small ? small_free_ : large_free_;
+        ctx->next = head;
+        head = ctx;
+    }
+    stats_.small_capacity = small_slots;
+    stats_.large_capacity = large_slots;
+}
+
+IoPool::~IoPool() {
+    delete[] slots_;
+    free(arena_);
+}
+
+WriteContext* IoPool::acquire(int num_pages) {
+    if (num_pages <= 0 || num_pages > LARGE_PAGES) {
+        return nullptr;
+    }
+    bool small = num_pages <= SMALL_PAGES && small_free_ != nullptr;
+    WriteContext*& head = small ? small_free_ : large_free_;
+    WriteContext* ctx = head;
+    if (ctx == nullptr) {
+        stats_.exhausted++;
+        return nullptr;
+    }
+    head = ctx->next;
+    ctx->next = nullptr;
+    ctx->num_pages = num_pages;
+    stats_.acquired++;
+    if (small) {
+        stats_.small_high_water = std::max(stats_.small_high_water, ++stats_.small_in_use);
+    } else {
+        stats_.large_high_water = std::max(stats_.large_high_water, ++stats_.large_in_use);
+    }
+    return ctx;
+}
+
+void IoPool::release(WriteContext* ctx) {
+    if (ctx->capacity_pages == SMALL_PAGES) {
+        ctx->next = small_free_;
+        small_free_ = ctx;
+        stats_.small_in_use--;
+    } else {
+        ctx->next = large_free_;
+        large_free_ = ctx;
+        stats_.large_in_use--;
+    }
+}
+
+int submitRead(IoPool& pool, int fd, int start_page, int num_pages) {
+    WriteContext* ctx = pool.acquire(num_pages);
+    if (ctx == nullptr) {
+        return -EAGAIN;
+    }
+    ctx->start_page = start_page;
+    ctx->fd = fd;
+    ctx->submit_ns = pool.latencyTracker() != nullptr ? monotonicNs() : 0;
+
+    struct iocb* cbs[1] = {&ctx->cb};
+    io_prep_pread(&ctx->cb, fd, ctx->buffer, PAGE_SIZE * num_pages, (long long)start_page * PAGE_SIZE);
+    ctx->cb.data = ctx;
+    int ret = io_submit(pool.context(), 1, cbs);
+    if (ret != 1) {
+        pool.release(ctx);
+        return ret < 0 ? ret : -EIO;
+    }
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, 1);
+    KELP_TRACE2(io_submit, &pool, 1);
+    return 0;
+}
+
+int submitWrite(IoPool& pool, int fd, int start_page, int num_pages) {
+    WriteContext* ctx = pool.acquire(num_pages);
+    if (ctx == nullptr) {
+        return -EAGAIN;
+    }
+    ctx->start_page = start_page;
+    ctx->fd = fd;
+    // Fill buffer with dummy data
+    std::memset(ctx->buffer, 'A' + (start_page % 26), PAGE_SIZE * num_pages);
+    ctx->submit_ns = pool.latencyTracker() != nullptr ? monotonicNs() : 0;
+
+    struct iocb* cbs[1] = {&ctx->cb};
+    io_prep_pwrite(&ctx->cb, fd, ctx->buffer, PAGE_SIZE * num_pages, (long long)start_page * PAGE_SIZE);
+    ctx->cb.data = ctx;
+    int ret = io_submit(pool.context(), 1, cbs);
+    if (ret != 1) {
+        pool.release(ctx);
+        return ret < 0 ? ret : -EIO;
+    }
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, 1);
+    KELP_TRACE2(io_submit, &pool, 1);
+    return 0;
+}
+
+void countReap(const IoPool& pool, int completed) {
+    // Slots in use are in flight, or about to be
+    IoPool::Stats stats = pool.stats();
+    kelp_metric_add(KELP_METRIC_IO_DEPTH_SAMPLES, 1);
+    kelp_metric_add(KELP_METRIC_IO_DEPTH_SUM, stats.small_in_use + stats.large_in_use);
+    if (completed > 0) {
+        kelp_metric_add(KELP_METRIC_IO_COMPLETED, completed);
+        KELP_TRACE2(io_complete, &pool, completed);
+    }
+}
+
+int checkCompleted(IoPool& pool) {
+    struct io_event events[MAX_EVENTS];
+    struct timespec timeout = {0, 0};  // Non-blocking
+
+    int completed = io_getevents(pool.context(), 0, MAX_EVENTS, events, &timeout);
+    int total_written = 0;
+    countReap(pool, completed);
+    LatencyTracker* tracker = pool.latencyTracker();
+    uint64_t now = tracker != nullptr && completed > 0 ? monotonicNs() : 0;
+    for (int i = 0; i < completed; i++) {
+        auto* ctx = static_cast<WriteContext*>(events[i].data);
+        total_written += ctx->num_pages;
+        if (tracker != nullptr) {
+            tracker->record(ctx->fd, now - ctx->submit_ns);
+        }
+        pool.release(ctx);
+    }
+    return total_written;
+}
+
+IoBatch::IoBatch(io_context_t io_ctx, int capacity)
+    : io_ctx_(io_ctx), capacity_(capacity), queued_(0), in_flight_(0), requests_(capacity),
+      cbs_(capacity), cb_ptrs_(capacity), iovecs_(size_t(capacity) * MAX_IOVECS), events_(capacity) {}
+
+IoBatch::Request* IoBatch::prepare() {
+    if (queued_ >= capacity_) {
+        return nullptr;
+    }
+    return &requests_[queued_];
+}
+
+bool IoBatch::queueRead(int fd, uint64_t offset, void* buffer, size_t length, uint64_t user_tag) {
+    Request* req = prepare();
+    if (req == nullptr) {
+        return false;
+    }
+    *req = {fd, IO_CMD_PREAD, 0, offset, buffer, length, user_tag};
+    queued_++;
+    return true;
+}
+
+bool IoBatch::queueWrite(int fd, uint64_t offset, const void* buffer, size_t length, uint64_t user_tag) {
+    Request* req = prepare();
+    if (req == nullptr) {
+        return false;
+    }
+    *req = {fd, IO_CMD_PWRITE, 0, offset, const_cast<void*>(buffer), length, user_tag};
+    queued_++;
+    return true;
+}
+
+bool IoBatch::queueReadv(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, uint64_t user_tag) {
+    Request* req = prepare();
+    if (req == nullptr || iovcnt < 1 || iovcnt > MAX_IOVECS) {
+        return false;
+    }
+    *req = {fd, IO_CMD_PREADV, iovcnt, offset, nullptr, 0, user_tag};
+    std::copy(iov, iov + iovcnt, &iovecs_[size_t(queued_) * MAX_IOVECS]);
+    queued_++;
+    return true;
+}
+
+bool IoBatch::queueWritev(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, uint64_t user_tag) {
+    Request* req = prepare();
+    if (req == nullptr || iovcnt < 1 || iovcnt > MAX_IOVECS) {
+        return false;
+    }
+    *req = {fd, IO_CMD_PWRITEV, iovcnt, offset, nullptr, 0, user_tag};
+    std::copy(iov, iov + iovcnt, &iovecs_[size_t(queued_) * MAX_IOVECS]);
+    queued_++;
+    return true;
+}
+
+int IoBatch::flush() {
+    if (queued_ == 0) {
+        return 0;
+    }
+    // The kernel copies the iocbs and iovecs during io_submit, so they're only needed until it returns
+    for (int i = 0; i < queued_; i++) {
+        const Request& req = requests_[i];
+        struct iocb* cb = &cbs_[i];
+        struct iovec* iov = &iovecs_[size_t(i) * MAX_IOVECS];
+        switch (req.opcode) {
+        case IO_CMD_PREAD:
+            io_prep_pread(cb, req.fd, req.buffer, req.length, req.offset);
+            break;
+        case IO_CMD_PWRITE:
+            io_prep_pwrite(cb, req.fd, req.buffer, req.length, req.offset);
+            break;
+        case IO_CMD_PREADV:
+            io_prep_preadv(cb, req.fd, iov, req.iovcnt, req.offset);
+            break;
+        default:
+            io_prep_pwritev(cb, req.fd, iov, req.iovcnt, req.offset);
+            break;
+        }
+        cb->data = reinterpret_cast<void*>(static_cast<uintptr_t>(req.user_tag));
+        cb_ptrs_[i] = cb;
+    }
+
+    int ret = io_submit(io_ctx_, queued_, cb_ptrs_.data());
+    if (ret <= 0) {
+        return ret;
+    }
+    // Keep what the kernel didn't take at the front of the queue
+    for (int i = ret; i < queued_; i++) {
+        requests_[i - ret] = requests_[i];
+        std::copy(&iovecs_[size_t(i) * MAX_IOVECS], &iovecs_[size_t(i + 1) * MAX_IOVECS], &iovecs_[size_t(i - ret) * MAX_IOVECS]);
+    }
+    queued_ -= ret;
+    in_flight_ += ret;
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, ret);
+    KELP_TRACE2(io_submit, io_ctx_, ret);
+    return ret;
+}
+
+int IoBatch::reap(IoCompletion* out, int max, int min_nr, const struct timespec* timeout) {
+    struct timespec poll = {0, 0};  // Non-blocking unless we're waiting for completions
+    max = std::min(max, capacity_);
+    int completed = io_getevents(io_ctx_, std::min(min_nr, max), max, events_.data(), min_nr > 0 ? const_cast<struct timespec*>(timeout) : &poll);
+    for (int i = 0; i < completed; i++) {
+        out[i].user_tag = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(events_[i].data));
+        out[i].result = static_cast<long>(events_[i].res);
+    }
+    kelp_metric_add(KELP_METRIC_IO_DEPTH_SAMPLES, 1);
+    kelp_metric_add(KELP_METRIC_IO_DEPTH_SUM, in_flight_);
+    if (completed > 0) {
+        in_flight_ -= completed;
+        kelp_metric_add(KELP_METRIC_IO_COMPLETED, completed);
+        KELP_TRACE2(io_complete, io_ctx_, completed);
+    }
+    return completed;
+}
+
+const Block* droppedCell() {
+    alignas(PAGE_SIZE) static Block zero;
+    return &zero;
+}
+
+int queueStripeWrite(IoBatch& batch, const VolumeMap& map, uint64_t stripe_number, const Block* blocks, int shard_count, uint64_t user_tag) {
+    int queued = 0;
+    for (const Volume& vol : map.volumes) {
+        // The volume's cells of this stripe are contiguous, in shard_ids order
+        struct iovec iov[IoBatch::MAX_IOVECS];
+        int count = getKBlocksInStripe(vol.header);
+        for (int i = 0; i < count; i++) {
+            const int shard = vol.header.shard_ids[i];
+            if (!isDroppedShard(shard) && shard >= shard_count) {
+                return -1;
+            }
+            iov[i].iov_base = const_cast<Block*>(isDroppedShard(shard) ? droppedCell() : &blocks[shard]);
+            iov[i].iov_len = sizeof(Block);
+        }
+        if (!batch.queueWritev(vol.fd, computeOffsetToBlock(vol.header, stripe_number, vol.header.shard_ids[0]), iov, count, user_tag)) {
+            return -1;
+        }
+        queued++;
+    }
+    return queued;
+}
@@ -1,17 +1,119 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
 #include <vector>
 #include <array>
 #include <libaio.h>
+#include <sys/uio.h>
+#include "crc32c.hpp"
+#include "spread.h"
+
+extern "C" {
+#include "rs.h"
+}
 
 constexpr int PAGE_SIZE = 4096;
 constexpr int MAX_EVENTS = 128;
 
+/**
+ * Allocates a buffer an object can't work without, aborting if posix_memalign fails.  Free it with free().
+ * @param alignment The alignment, a power of two multiple of sizeof(void*).
+ * @param size The size in bytes.
+ * @return Returns the buffer.
+ */
+template <typename T = void>
+inline T* allocAligned(size_t alignment, size_t size) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, alignment, size) != 0) {
+        abort();
+    }
+    return static_cast<T*>(buffer);
+}
+
 struct WriteContext {
     int start_page;
     int num_pages;
     void* buffer;
+    // Used by IoPool slots, the iocb lives as long as the slot so it stays valid until completion
+    struct iocb cb;
+    int capacity_pages;
+    WriteContext* next;
+    // Stamped at submit when the pool has a latency tracker
+    int fd;
+    uint64_t submit_ns;
+};
+
+class LatencyTracker;
+
+/**
+ * Fixed capacity pool of I/O slots for one io_context_t, so submitting and completing I/O never
+ * touches the allocator.  All the buffers are carved from one page aligned arena at construction,
+ * small slots hold a 4 KiB block and large slots a 32 KiB run of 8 blocks.  Free slots are kept on
+ * intrusive free lists.  Like the io_context_t it wraps, a pool is owned by one thread.
+ */
+class IoPool {
+public:
+    static constexpr int SMALL_PAGES = 1;
+    static constexpr int LARGE_PAGES = 8;
+
+    struct Stats {
+        int small_capacity;
+        int small_in_use;
+        int small_high_water;
+        int large_capacity;
+        int large_in_use;
+        int large_high_water;
+        uint64_t acquired;
+        uint64_t exhausted;  // acquires that failed because the pool was empty
+    };
+
+    /**
+     * Allocates the arena and slots, aborts if the allocation fails.
+     * @param io_ctx The I/O context the slots are submitted to.
+     * @param small_slots The number of 4 KiB slots.
+     * @param large_slots The number of 32 KiB slots.
+     */
+    IoPool(io_context_t io_ctx, int small_slots, int large_slots);
+    ~IoPool();
+    IoPool(const IoPool&) = delete;
+    IoPool& operator=(const IoPool&) = delete;
+
+    /**
+     * Takes a free slot with room for num_pages pages, preferring a small slot for single pages.
+     * @param num_pages The number of pages needed.
+     * @return Returns the slot, or nullptr if num_pages > LARGE_PAGES or no slot is free.
+     */
+    WriteContext* acquire(int num_pages);
+
+    /**
+     * Returns a slot to its free list.
+     * @param ctx A slot from acquire().
+     */
+    void release(WriteContext* ctx);
+
+    /**
+     * Feeds completion latencies of this pool's I/O into a tracker, nullptr to stop.
+     * @param tracker The tracker, must outlive its use by the pool.
+     */
+    void setLatencyTracker(LatencyTracker* tracker) { tracker_ = tracker; }
+    LatencyTracker* latencyTracker() const { return tracker_; }
+
+    Stats stats() const { return stats_; }
+    io_context_t context() const { return io_ctx_; }
+    // The buffer arena, for engines that register it with the kernel
+    void* arena() const { return arena_; }
+    size_t arenaBytes() const { return arena_bytes_; }
+
+private:
+    io_context_t io_ctx_;
+    void* arena_;
+    size_t arena_bytes_;
+    WriteContext* slots_;
+    WriteContext* small_free_;
+    WriteContext* large_free_;
+    Stats stats_;
+    LatencyTracker* tracker_;
 };
 
 /**
@@ -81,17 +183,7 @@ int getKBlocksInStripe(const HeaderBlock& header);
  * @param shard_id The shard ID.
  * @return The offset to the block.
  */
-int computeOffsetToBlock(const HeaderBlock& header, int stripe_number, int shard_id);
-
-/**
- * CRC32C implementation
- * SSE4.2 hardware-accelerated implementation (CRC32C)
- * @param data: pointer to the data
- * @param length: length of the data
- * @param previousCrc32: previous crc32 value
- * @return: crc32c checksum
- */
-uint32_t crc32c(const void* data, size_t length, uint32_t previousCrc32);
+uint64_t computeOffsetToBlock(const HeaderBlock& header, uint64_t stripe_number, int shard_id);
 
 /**
  * Given k*16*x = input_size, spread the data into k blocks of size x
@@ -99,6 +191,7 @@ uint32_t crc32c(const void* data, size_t length, uint32_t previousCrc32);
  * The output is an array of k byte arrays of size x
  * The input is spread across the k blocks in a round-robin fashion
  * The input is assumed to be aligned to 16 bytes, and input_size is a multiple of 16*k
+ * Runs the spread_kernel() backend, see spread.h for the kernels and non-temporal stores
  */
 void spreadData(void* input, std::vector<void*>& output_blocks, size_t input_size, int k);
 
@@ -108,9 +201,100 @@ void spreadData(void* input, std::vector<void*>& output_blocks, size_t input_siz
  * The output is a byte array of size k*x
  * The input is unspread from the k blocks in a round-robin fashion
  * The output is assumed to be aligned to 16 bytes, and k*x is a multiple of 16
+ * Runs the spread_kernel() backend, see spread.h for the kernels and non-temporal stores
  */
 void unspreadData(std::vector<void*>& input_blocks, void* output, size_t output_size, int k);
 
+/**
+ * Builds all the cells of a stripe in one pass over the payload.
+ * The payload is spread across the k data cells, encoded into the m parity cells and checksummed
+ * in chunks small enough to stay in L1, rather than a separate pass over the stripe for each step.
+ * @param rs The Reed-Solomon codec, k = rs->data_shards and m = rs->parity_shards.
+ * @param payload The stripe payload, k * 4080 bytes (32640 for k = 8), aligned to 16 bytes.
+ * @param stripe_number The stripe number, the shard ID is stored in the bottom byte.
+ * @param sequence_number The block sequence number written to every cell.
+ * @param blocks Output array of k + m blocks, shard i is blocks[i].
+ */
+void buildStripe(reed_solomon* rs, const void* payload, uint64_t stripe_number, uint32_t sequence_number, Block* blocks);
+
+/**
+ * Reads bytes [start, start + length) of a stripe payload out of its cells.
+ * Payload byte p lives in cell (p / 16) % k at offset (p / (16 * k)) * 16 + p % 16, so the range only
+ * touches a 16 byte aligned window of each cell.  Missing data cells that hold part of the range are
+ * reconstructed over that window only, then the window is unspread into the output, so a small
+ * degraded read costs about the same as a healthy one.
+ * @param rs The Reed-Solomon codec.
+ * @param cells k + m pointers to 4080 byte cell data, erased cells must still be writable buffers.
+ * @param erasures k + m flags, non-zero marks a missing cell.
+ * @param start The first payload byte to read.
+ * @param length The number of bytes to read, start + length must be at most k * 4080.
+ * @param output Receives the length bytes read.
+ * @return Returns false if the range is out of bounds or the missing cells can't be reconstructed.
+ */
+bool readStripeRange(reed_solomon* rs, unsigned char* const* cells, int* erasures, size_t start, size_t length, void* output);
+
+/**
+ * Sets the block checksum from the rest of the block.
+ * @param block The block to be sealed.
+ */
+void sealBlock(Block& block);
+
+/**
+ * Sets the header checksum, see validateHeader().
+ * @param header The header to be sealed.
+ */
+void sealHeader(HeaderBlock& header);
+
+// shard_ids of parity shards dropped by dropParityShards, which keep their cells' place in the layout.
+// Neighbouring dropped slots alternate between the two so getKBlocksInStripe doesn't fold them together.
+constexpr uint8_t DROPPED_SHARD_EVEN = 0xfe;
+constexpr uint8_t DROPPED_SHARD_ODD = 0xff;
+
+inline bool isDroppedShard(int shard_id) {
+    return shard_id == DROPPED_SHARD_EVEN || shard_id == DROPPED_SHARD_ODD;
+}
+
+/**
+ * @return Returns a zeroed, page aligned cell for writers to put in a dropped shard's slot, so a volume's
+ *         cells of a stripe still go out as one contiguous write.
+ */
+const Block* droppedCell();
+
+/**
+ * Finds the volume holding a shard.
+ * @param map The volume map.
+ * @param shard_id The shard ID.
+ * @return The index into map.volumes, or -1 if no volume holds the shard.
+ */
+int findVolumeForShard(const VolumeMap& map, int shard_id);
+
+/**
+ * Replaces the data of one data cell, updating the parity cells with the delta
+ * parity_i += coeff(i, shard) * (new ^ old), so the other k - 1 data cells aren't needed.
+ * All updated cells get the new sequence number and checksum.
+ * @param rs The Reed-Solomon codec.
+ * @param cell The data cell to update, as read from disk.
+ * @param parity_cells rs->parity_shards pointers to the parity cells of the same stripe, NULL for parity we don't have.
+ * @param new_data The new 4080 bytes of cell data.
+ * @param sequence_number The new block sequence number.
+ * @return Returns false (and changes nothing) if a cell fails validation or doesn't belong to the stripe.
+ */
+bool updateCell(reed_solomon* rs, Block& cell, Block* const* parity_cells, const void* new_data, uint32_t sequence_number);
+
+/**
+ * Holdfast read-modify-write of a single data cell: reads the old cell and the parity cells
+ * (1 + m reads instead of k + m), updates them with updateCell and writes them back.
+ * Parity cells that are missing or fail validation are skipped and left for repair.
+ * @param map The volume map.
+ * @param rs The Reed-Solomon codec.
+ * @param stripe_number The stripe number.
+ * @param shard_id The data shard to update.
+ * @param new_data The new 4080 bytes of cell data.
+ * @param sequence_number The new block sequence number.
+ * @return Returns the number of parity cells updated, or a negative error code on failure.
+ */
+int updateStripeCell(VolumeMap& map, reed_solomon* rs, uint64_t stripe_number, int shard_id, const void* new_data, uint32_t sequence_number);
+
 /**
  * Validates the header block.
  * @param header A reference to the header block structure.
@@ -125,6 +309,15 @@ bool validateHeader(const HeaderBlock& header);
  */
 bool validateBlock(const Block& block);
 
+/**
+ * Validates blocks together, checksumming several at once with crc32cBatch().
+ * @param blocks The blocks to be validated.
+ * @param count The number of blocks.
+ * @param valid Receives count validation results.
+ * @return Returns the number of valid blocks.
+ */
+int validateBlocks(const Block* const* blocks, int count, bool* valid);
+
 /**
  * Submits an asynchronous read operation.
  * @param io_ctx The I/O context.
@@ -150,3 +343,141 @@ int submitWrite(io_context_t io_ctx, int fd, int start_page, int num_pages);
  * @return Returns the number of pages written/read in completed operations.
  */
 int checkCompleted(io_context_t io_ctx);
+
+/**
+ * Submits an asynchronous read into a pool slot.
+ * @param pool The I/O pool, the read goes to pool.context().
+ * @param fd The file descriptor.
+ * @param start_page The starting page number.
+ * @param num_pages The number of pages to read, at most IoPool::LARGE_PAGES.
+ * @return Returns 0 on success, -EAGAIN if no slot is free, or a negative error code from io_submit.
+ */
+int submitRead(IoPool& pool, int fd, int start_page, int num_pages);
+
+/**
+ * Submits an asynchronous write from a pool slot.
+ * @param pool The I/O pool, the write goes to pool.context().
+ * @param fd The file descriptor.
+ * @param start_page The starting page number.
+ * @param num_pages The number of pages to write, at most IoPool::LARGE_PAGES.
+ * @return Returns 0 on success, -EAGAIN if no slot is free, or a negative error code from io_submit.
+ */
+int submitWrite(IoPool& pool, int fd, int start_page, int num_pages);
+
+/**
+ * Checks for completed I/O operations submitted through a pool, returning their slots to the pool.
+ * @param pool The I/O pool.
+ * @return Returns the number of pages written/read in completed operations.
+ */
+int checkCompleted(IoPool& pool);
+
+/**
+ * Counts a reap of a pool's completions into the metrics of metrics.h, the queue depth is the pool's slots
+ * in use.  For engines that reap a pool's completions themselves.
+ * @param pool The pool.
+ * @param completed The number of completions reaped.
+ */
+void countReap(const IoPool& pool, int completed);
+
+/**
+ * A completed batched I/O: the tag it was queued with and the io_event result,
+ * the number of bytes transferred or a negative error code.
+ */
+struct IoCompletion {
+    uint64_t user_tag;
+    long result;
+};
+
+/**
+ * Queues reads and writes of caller owned buffers and submits them all with one io_submit.
+ * Buffers must stay valid until the completion is reaped, iovec arrays are copied when queued.
+ * Capacity is fixed at construction, queueing never allocates.
+ */
+class IoBatch {
+public:
+    // Most iovecs in one request, a volume holds at most 8 cells of a stripe
+    static constexpr int MAX_IOVECS = 8;
+
+    /**
+     * @param io_ctx The I/O context to submit to.
+     * @param capacity The most requests queued at once.
+     */
+    IoBatch(io_context_t io_ctx, int capacity);
+
+    /**
+     * Queues a read or write of one buffer.
+     * @return Returns false if the batch is full.
+     */
+    bool queueRead(int fd, uint64_t offset, void* buffer, size_t length, uint64_t user_tag);
+    bool queueWrite(int fd, uint64_t offset, const void* buffer, size_t length, uint64_t user_tag);
+
+    /**
+     * Queues a vectored read or write (preadv/pwritev) of contiguous file bytes.
+     * @return Returns false if the batch is full or iovcnt is not in [1, MAX_IOVECS].
+     */
+    bool queueReadv(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, uint64_t user_tag);
+    bool queueWritev(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, uint64_t user_tag);
+
+    /**
+     * Submits everything queued with a single io_submit.  Requests the kernel didn't take stay
+     * queued for the next flush.
+     * @return Returns the number of requests submitted, or a negative error code.
+     */
+    int flush();
+
+    /**
+     * Reaps completions of submitted requests.
+     * @param out Receives up to max completions.
+     * @param max The size of out.
+     * @param min_nr Wait for at least this many completions.
+     * @param timeout How long to wait for them, or nullptr to wait as long as it takes.
+     * @return Returns the number of completions, or a negative error code.
+     */
+    int reap(IoCompletion* out, int max, int min_nr = 0, const struct timespec* timeout = nullptr);
+
+    /**
+     * Drops the requests queued but not yet submitted.
+     */
+    void clear() { queued_ = 0; }
+
+    int queued() const { return queued_; }
+    int inFlight() const { return in_flight_; }
+
+private:
+    struct Request {
+        int fd;
+        short opcode;
+        int iovcnt;  // 0 for a single buffer
+        uint64_t offset;
+        void* buffer;
+        size_t length;
+        uint64_t user_tag;
+    };
+
+    Request* prepare();
+
+    io_context_t io_ctx_;
+    int capacity_;
+    int queued_;
+    int in_flight_;
+    std::vector<Request> requests_;
+    std::vector<struct iocb> cbs_;
+    std::vector<struct iocb*> cb_ptrs_;
+    std::vector<struct iovec> iovecs_;
+    std::vector<struct io_event> events_;
+};
+
+/**
+ * Queues the writes of all the cells of a stripe, one pwritev per volume since the cells of a
+ * stripe on one volume are contiguous, so the whole stripe goes out with one flush().  Dropped shards'
+ * slots are written with droppedCell().
+ * @param batch The batch to queue on.
+ * @param map The volume map.
+ * @param stripe_number The stripe number.
+ * @param blocks The stripe cells, shard i is blocks[i], from buildStripe.
+ * @param shard_count The number of cells, k + m.
+ * @param user_tag The tag for every volume's write.
+ * @return Returns the number of requests queued, or -1 if a volume holds a shard >= shard_count or the batch
+ *         is full (requests already queued for other volumes stay queued).
+ */
+int queueStripeWrite(IoBatch& batch, const VolumeMap& map, uint64_t stripe_number, const Block* blocks, int shard_count, uint64_t user_tag);
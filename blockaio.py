@@ -6,6 +6,7 @@ This file is the itnerface for teh libblockaio.so shared library. It provides th
 - io_destroy(ctx): Destroy the AIO context
 - submit_write(ctx, fd, start_page, num_pages): Submit a write request
 - check_completed(ctx): Check for completed requests
+- IoEngine(name): libaio or io_uring engine with the same submit_read/submit_write/check_completed calls
 
 The functions are implemented using the ctypes library to call the corresponding functions in the shared library.
 """
@@ -64,6 +65,57 @@ libblockaio.submit_write.restype = c_int
 libblockaio.check_completed.argtypes = [io_context_t]
 libblockaio.check_completed.restype = c_int
 
+libblockaio.io_engine_new.argtypes = [ctypes.c_char_p, c_int, c_int, c_int]
+libblockaio.io_engine_new.restype = c_void_p
+
+libblockaio.io_engine_free.argtypes = [c_void_p]
+libblockaio.io_engine_free.restype = None
+
+libblockaio.io_engine_name.argtypes = [c_void_p]
+libblockaio.io_engine_name.restype = ctypes.c_char_p
+
+libblockaio.io_engine_register_files.argtypes = [c_void_p, POINTER(c_int), c_int]
+libblockaio.io_engine_register_files.restype = c_int
+
+libblockaio.io_engine_submit_read.argtypes = [c_void_p, c_int, c_int, c_int]
+libblockaio.io_engine_submit_read.restype = c_int
+
+libblockaio.io_engine_submit_write.argtypes = [c_void_p, c_int, c_int, c_int]
+libblockaio.io_engine_submit_write.restype = c_int
+
+libblockaio.io_engine_check_completed.argtypes = [c_void_p]
+libblockaio.io_engine_check_completed.restype = c_int
+
+IO_ENGINES = ["libaio", "io_uring"]
+# Largest request an engine takes, its buffers are pooled 32 KiB slots
+ENGINE_MAX_PAGES = 8
+
+class IoEngine:
+    """An I/O engine from ioengine.hpp, name is "libaio", "io_uring" or None for $KELP_IO_ENGINE."""
+    def __init__(self, name=None, small_slots=MAX_EVENTS, large_slots=MAX_EVENTS, sqpoll=False):
+        self.ptr = libblockaio.io_engine_new(name.encode() if name else None, small_slots, large_slots, int(sqpoll))
+        if not self.ptr:
+            raise OSError(f"io engine {name} is not available")
+        self.name = libblockaio.io_engine_name(self.ptr).decode()
+
+    def register_files(self, fds):
+        arr = (c_int * len(fds))(*fds)
+        return libblockaio.io_engine_register_files(self.ptr, arr, len(fds))
+
+    def submit_read(self, fd, start_page, num_pages):
+        return libblockaio.io_engine_submit_read(self.ptr, fd, start_page, num_pages)
+
+    def submit_write(self, fd, start_page, num_pages):
+        return libblockaio.io_engine_submit_write(self.ptr, fd, start_page, num_pages)
+
+    def check_completed(self):
+        return libblockaio.io_engine_check_completed(self.ptr)
+
+    def close(self):
+        if self.ptr:
+            libblockaio.io_engine_free(self.ptr)
+            self.ptr = None
+
 # Python wrapper functions
 def io_setup(max_events):
     ctx = io_context_t()
@@ -0,0 +1,347 @@
+#include "compactor.hpp"
+#include "latency.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// Tags of stripe writes, reads are tagged with their slot
+const uint64_t STRIPE_TAG = uint64_t(1) << 32;
+
+// The new index's two copies, index_pages each, must be set, apart and clear of the index volume's header stripe
+bool validIndexOffsets(const CompactConfig& config, const HeaderBlock& header) {
+    const uint64_t bytes = uint64_t(config.index_pages) * PAGE_SIZE;
+    const uint64_t header_bytes = uint64_t(getKBlocksInStripe(header)) * sizeof(Block);
+    const uint64_t primary = config.index_primary_offset;
+    const uint64_t secondary = config.index_secondary_offset;
+    return config.index_pages > 0 && primary % PAGE_SIZE == 0 && secondary % PAGE_SIZE == 0 && primary >= header_bytes
+           && secondary >= header_bytes && (primary + bytes <= secondary || secondary + bytes <= primary);
+}
+
+bool live(const BlobEntry& entry) {
+    return entry.size != 0 && !(entry.flags & BlobIndex::DELETED);
+}
+
+}  // namespace
+
+Compactor::Compactor(const Volume& source, const BlobIndex& index, const VolumeMap& target, reed_solomon* rs,
+                     Volume& index_volume, io_context_t io_ctx, const CompactConfig& config)
+    : source_(source), index_(index), target_(target), rs_(rs), index_volume_(index_volume), config_(config),
+      batch_(io_ctx, config.read_depth + config.stripe_depth * int(target.volumes.size())),
+      budget_(config.bytes_per_sec, config.burst_bytes), stripe_bytes_(size_t(rs->data_shards) * sizeof(Block::data)),
+      payload_(nullptr), payload_used_(0), next_stripe_(config.first_stripe), error_(0) {
+    std::memset(&stats_, 0, sizeof(stats_));
+    events_.resize(config.read_depth + config.stripe_depth * target.volumes.size());
+    payload_ = allocAligned<unsigned char>(64, stripe_bytes_);
+    stripes_.resize(config.stripe_depth);
+    for (StripeSlot& slot : stripes_) {
+        slot.blocks = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * (rs->data_shards + rs->parity_shards));
+        slot.writes = 0;
+        slot.busy = false;
+    }
+}
+
+Compactor::~Compactor() {
+    free(payload_);
+    for (StripeSlot& slot : stripes_) {
+        free(slot.blocks);
+    }
+    for (ReadSlot& slot : reads_) {
+        free(slot.buffer);
+    }
+}
+
+void Compactor::planExtents() {
+    order_.clear();
+    extents_.clear();
+    new_offsets_.assign(index_.size(), 0);
+    for (uint32_t id = 0; id < index_.size(); id++) {
+        if (live(*index_.get(id))) {
+            order_.push_back(id);
+        } else {
+            stats_.dropped++;
+        }
+    }
+    std::sort(order_.begin(), order_.end(), [&](uint32_t a, uint32_t b) { return index_.get(a)->offset < index_.get(b)->offset; });
+
+    // Merge neighbours into one read while the gap is small and the read stays under read_bytes
+    for (size_t i = 0; i < order_.size(); i++) {
+        const BlobEntry& entry = *index_.get(order_[i]);
+        const uint64_t end = entry.offset + entry.size;
+        if (!extents_.empty()) {
+            Extent& last = extents_.back();
+            const uint64_t last_end = last.offset + last.length;
+            if (entry.offset <= last_end + config_.max_gap && std::max(end, last_end) - last.offset <= config_.read_bytes) {
+                last.length = std::max(end, last_end) - last.offset;
+                last.count++;
+                continue;
+            }
+        }
+        extents_.push_back({entry.offset, entry.size, i, 1});
+    }
+}
+
+void Compactor::throttle(double bytes) {
+    uint64_t now = monotonicNs();
+    uint64_t wait = budget_.delayNs(bytes, now);
+    if (wait > 0) {
+        // In flight I/O carries on while the pipeline waits
+        stats_.throttled++;
+        struct timespec ts = {time_t(wait / 1000000000), long(wait % 1000000000)};
+        nanosleep(&ts, nullptr);
+        now = monotonicNs();
+    }
+    budget_.consume(bytes, now);
+}
+
+int Compactor::submitRead(size_t extent) {
+    ReadSlot& slot = reads_[extent % reads_.size()];
+    const Extent& e = extents_[extent];
+    throttle(e.length);
+    slot.extent = extent;
+    slot.done = false;
+    slot.result = 0;
+    if (!batch_.queueRead(source_.fd, e.offset, slot.buffer, e.length, extent % reads_.size())) {
+        return -EAGAIN;
+    }
+    int ret = batch_.flush();
+    if (ret < 0) {
+        return ret;
+    }
+    stats_.reads++;
+    stats_.bytes_read += e.length;
+    return 0;
+}
+
+int Compactor::reap(bool wait) {
+    int completed = batch_.reap(events_.data(), events_.size(), wait ? 1 : 0);
+    if (completed < 0) {
+        return completed;
+    }
+    for (int i = 0; i < completed; i++) {
+        const IoCompletion& c = events_[i];
+        if (c.user_tag & STRIPE_TAG) {
+            StripeSlot& slot = stripes_[c.user_tag & (STRIPE_TAG - 1)];
+            if (c.result <= 0 || c.result % sizeof(Block) != 0) {
+                error_ = error_ != 0 ? error_ : (c.result < 0 ? int(c.result) : -EIO);
+            }
+            if (--slot.writes == 0) {
+                slot.busy = false;
+            }
+        } else {
+            ReadSlot& slot = reads_[c.user_tag];
+            slot.done = true;
+            slot.result = c.result;
+        }
+    }
+    return completed;
+}
+
+int Compactor::emitStripe() {
+    const int n = rs_->data_shards + rs_->parity_shards;
+    std::memset(payload_ + payload_used_, 0, stripe_bytes_ - payload_used_);
+    size_t s = 0;
+    while (stripes_[s].busy) {
+        if (++s == stripes_.size()) {
+            int ret = reap(true);
+            if (ret < 0) {
+                return ret;
+            }
+            s = 0;
+        }
+    }
+    StripeSlot& slot = stripes_[s];
+    buildStripe(rs_, payload_, next_stripe_, config_.sequence_number, slot.blocks);
+    throttle(double(n) * sizeof(Block));
+    int queued = queueStripeWrite(batch_, target_, next_stripe_, slot.blocks, n, STRIPE_TAG | s);
+    if (queued < 0) {
+        batch_.clear();
+        return -EINVAL;
+    }
+    int ret = batch_.flush();
+    if (ret < 0) {
+        return ret;
+    }
+    slot.writes = queued;
+    slot.busy = queued > 0;
+    stats_.stripes++;
+    next_stripe_++;
+    payload_used_ = 0;
+    return 0;
+}
+
+int Compactor::packExtent(const ReadSlot& slot) {
+    const Extent& e = extents_[slot.extent];
+    if (slot.result < 0) {
+        return slot.result;
+    }
+    if (size_t(slot.result) != e.length) {
+        return -EIO;
+    }
+    for (size_t i = e.first; i < e.first + e.count; i++) {
+        const uint32_t id = order_[i];
+        const BlobEntry& entry = *index_.get(id);
+        new_offsets_[id] = next_stripe_ * stripe_bytes_ + payload_used_;
+        // A frond runs on into the next stripe's payload when it doesn't fit
+        const unsigned char* data = slot.buffer + (entry.offset - e.offset);
+        size_t left = entry.size;
+        while (left > 0) {
+            const size_t chunk = std::min(left, stripe_bytes_ - payload_used_);
+            std::memcpy(payload_ + payload_used_, data, chunk);
+            payload_used_ += chunk;
+            data += chunk;
+            left -= chunk;
+            if (payload_used_ == stripe_bytes_) {
+                int ret = emitStripe();
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+        // Pad to 8 bytes, which never crosses a stripe since a payload is a multiple of 8
+        const size_t padded = (payload_used_ + 7) & ~size_t(7);
+        std::memset(payload_ + payload_used_, 0, padded - payload_used_);
+        payload_used_ = padded;
+        if (payload_used_ == stripe_bytes_) {
+            int ret = emitStripe();
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        stats_.fronds++;
+        stats_.bytes += entry.size;
+    }
+    return 0;
+}
+
+int Compactor::finish() {
+    int ret = payload_used_ > 0 ? emitStripe() : 0;
+    for (bool busy = true; busy && ret >= 0;) {
+        busy = false;
+        for (const StripeSlot& slot : stripes_) {
+            busy = busy || slot.busy;
+        }
+        if (busy) {
+            ret = reap(true);
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (error_ != 0) {
+        return error_;
+    }
+    for (const Volume& vol : target_.volumes) {
+        if (fdatasync(vol.fd) != 0) {
+            return -errno;
+        }
+    }
+
+    // Save the new index next to the old one
+    Volume staged = index_volume_;
+    staged.header.primary_index_offset = config_.index_primary_offset;
+    staged.header.secondary_index_offset = config_.index_secondary_offset;
+    BlobIndex index(staged, config_.index_pages);
+    for (uint32_t id = 0; id < index_.size(); id++) {
+        const BlobEntry& entry = *index_.get(id);
+        ret = live(entry) ? index.add(new_offsets_[id], entry.size, entry.flags) : index.add(0, 0, entry.flags);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = index.save();
+    if (ret < 0) {
+        return ret;
+    }
+
+    // The swap: one header write points the volume at the new index
+    sealHeader(staged.header);
+    if (pwrite(index_volume_.fd, &staged.header, sizeof(HeaderBlock), 0) != sizeof(HeaderBlock)) {
+        return errno != 0 ? -errno : -EIO;
+    }
+    if (fdatasync(index_volume_.fd) != 0) {
+        return -errno;
+    }
+    index_volume_.header = staged.header;
+    return 0;
+}
+
+int Compactor::run() {
+    if (!validIndexOffsets(config_, index_volume_.header)) {
+        return -EINVAL;
+    }
+    planExtents();
+    size_t buffer_bytes = config_.read_bytes;
+    for (const Extent& e : extents_) {
+        buffer_bytes = std::max(buffer_bytes, e.length);
+    }
+    for (ReadSlot& slot : reads_) {
+        free(slot.buffer);
+    }
+    reads_.assign(std::max(config_.read_depth, 1), ReadSlot());
+    for (ReadSlot& slot : reads_) {
+        if (posix_memalign(reinterpret_cast<void**>(&slot.buffer), PAGE_SIZE, buffer_bytes) != 0) {
+            slot.buffer = nullptr;
+            return -ENOMEM;
+        }
+    }
+
+    // Extent i reads into slot i % read_depth, the reads run ahead of packing by up to read_depth
+    size_t submitted = 0;
+    int ret = 0;
+    for (size_t head = 0; head < extents_.size() && ret >= 0 && error_ == 0;) {
+        while (submitted < extents_.size() && submitted - head < reads_.size() && ret >= 0) {
+            ret = submitRead(submitted++);
+        }
+        if (ret < 0) {
+            break;
+        }
+        const ReadSlot& slot = reads_[head % reads_.size()];
+        if (!slot.done) {
+            ret = reap(true);
+            continue;
+        }
+        ret = packExtent(slot);
+        head++;
+    }
+
+    // Wait out the reads still in flight before giving up
+    while (batch_.inFlight() > 0 && reap(true) >= 0) {
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (error_ != 0) {
+        return error_;
+    }
+    return finish();
+}
+
+int compactVolumes(const std::vector<Compactor*>& compactors, int threads) {
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    int result = 0;
+    auto worker = [&]() {
+        for (size_t i = next++; i < compactors.size(); i = next++) {
+            int ret = compactors[i]->run();
+            std::lock_guard<std::mutex> lock(mutex);
+            result = result != 0 ? result : ret;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min<int>(threads, compactors.size()); t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    return result;
+}
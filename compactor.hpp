@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+#include "blobindex.hpp"
+#include "scrubber.hpp"
+
+/**
+ * Compaction settings.
+ */
+struct CompactConfig {
+    double bytes_per_sec = 64 << 20;     // read and write budget, to leave the drives to foreground I/O, <= 0 for unlimited
+    double burst_bytes = 8 << 20;
+    size_t read_bytes = 1 << 20;         // largest read, neighbouring fronds are read together up to this
+    size_t max_gap = 64 << 10;           // dead bytes worth reading through to merge two reads
+    int read_depth = 4;                  // reads in flight
+    int stripe_depth = 8;                // stripes being written
+    uint64_t first_stripe = 1;           // stripes from here on are trimmed, stripe 0 holds the headers
+    uint32_t sequence_number = 1;
+    // Where the new index goes on the index volume, no defaults: both must be set, page aligned, past
+    // the header stripe and index_pages apart
+    uint64_t index_primary_offset = 0;
+    uint64_t index_secondary_offset = 0;
+    uint32_t index_pages = 1024;
+};
+
+struct CompactStats {
+    uint64_t fronds;      // live fronds copied
+    uint64_t bytes;       // of live fronds
+    uint64_t dropped;     // deleted or empty fronds, only their index entries are kept
+    uint64_t reads;
+    uint64_t bytes_read;  // including the gaps read through
+    uint64_t stripes;
+    uint64_t throttled;   // times the budget made the pipeline wait
+};
+
+/**
+ * Compacts a blob volume into fresh stripes of a blade.  The live fronds are read in offset order with
+ * large batched reads, merging neighbours, and repacked back to back, 8 byte aligned, into the payloads
+ * of new stripes from first_stripe on, built with buildStripe and written with queueStripeWrite.
+ * Reads, packing and stripe writes are pipelined over one io_context_t with read_depth reads and
+ * stripe_depth stripes in flight, so memory is bounded by those buffers whatever the volume's size.
+ *
+ * The new index keeps every blob ID, a live frond's offset becomes its byte offset in the blade payload
+ * (stripe * k * 4080 + offset into the stripe, the address times 8).  Once every stripe is synced it is
+ * saved at the config's index offsets on the index volume, and only then is the index volume's
+ * HeaderBlock rewritten to point at it, so a crash before that leaves the old index in charge.
+ * Like the io_context_t it uses, a compactor is used by one thread.
+ */
+class Compactor {
+public:
+    /**
+     * @param source The blob volume to compact, fronds are at byte offsets of source.fd.
+     * @param index The source's blob index.
+     * @param target The blade to write.  The stripes from first_stripe on must be unused.
+     * @param rs The Reed-Solomon codec.
+     * @param index_volume The volume whose header gets the new index offsets.
+     * @param io_ctx The I/O context, set up for at least read_depth + stripe_depth * target volumes events.
+     * @param config The settings.
+     * All must outlive the compactor.
+     */
+    Compactor(const Volume& source, const BlobIndex& index, const VolumeMap& target, reed_solomon* rs,
+              Volume& index_volume, io_context_t io_ctx, const CompactConfig& config);
+    ~Compactor();
+    Compactor(const Compactor&) = delete;
+    Compactor& operator=(const Compactor&) = delete;
+
+    /**
+     * Runs the whole compaction.
+     * @return Returns 0, -EINVAL if the index offsets are unset, overlap or fall in the header stripe,
+     *         -EIO if a read comes back short, -ENOSPC if the new index doesn't fit its pages, or a negative
+     *         error code.  On an error the index volume's header is untouched.
+     */
+    int run();
+
+    const CompactStats& stats() const { return stats_; }
+
+    /**
+     * @return Returns the first stripe after the compacted ones.
+     */
+    uint64_t endStripe() const { return next_stripe_; }
+
+private:
+    struct Extent {
+        uint64_t offset;
+        size_t length;
+        size_t first;  // into order_
+        size_t count;
+    };
+    struct ReadSlot {
+        unsigned char* buffer;
+        size_t extent;
+        bool done;
+        long result;
+    };
+    struct StripeSlot {
+        Block* blocks;
+        int writes;  // outstanding
+        bool busy;
+    };
+
+    void planExtents();
+    int submitRead(size_t extent);
+    int reap(bool wait);
+    int packExtent(const ReadSlot& slot);
+    int emitStripe();
+    int finish();
+    void throttle(double bytes);
+
+    const Volume& source_;
+    const BlobIndex& index_;
+    const VolumeMap& target_;
+    reed_solomon* rs_;
+    Volume& index_volume_;
+    CompactConfig config_;
+    IoBatch batch_;
+    TokenBucket budget_;
+    size_t stripe_bytes_;
+
+    std::vector<uint32_t> order_;  // live blob IDs by offset
+    std::vector<Extent> extents_;
+    std::vector<uint64_t> new_offsets_;  // by blob ID
+    std::vector<ReadSlot> reads_;
+    std::vector<StripeSlot> stripes_;
+    std::vector<IoCompletion> events_;
+    unsigned char* payload_;
+    size_t payload_used_;
+    uint64_t next_stripe_;
+    CompactStats stats_;
+    int error_;
+};
+
+/**
+ * Runs compactors concurrently, each on one thread of a pool.
+ * @param compactors The compactors, each with its own io_context_t.
+ * @param threads The number of threads.
+ * @return Returns 0, or the first negative error code, the other compactions still run.
+ */
+int compactVolumes(const std::vector<Compactor*>& compactors, int threads);
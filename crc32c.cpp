@@ -0,0 +1,161 @@
+#include "crc32c.hpp"
+#include <cstring>
+#include <algorithm>
+#include <immintrin.h>
+
+namespace {
+
+const uint32_t POLY = 0x82f63b78;  // reflected 0x1edc6f41
+
+// Interleave buffers at least this long, below it the combine costs more than it saves
+const size_t MIN_INTERLEAVED = 192;
+const size_t MIN_INTERLEAVED_SOFTWARE = 2048;
+// Longest lane of an interleaved round, a multiple of 8
+const size_t MAX_LANE = 4096;
+
+// crc * x^(8n) mod P for a reflected k = x^(8n - 33) mod P: the 64 bit carryless product is
+// crc * k * x, and _mm_crc32_u64 of it multiplies by x^32 and reduces
+__attribute__((target("sse4.2,pclmul")))
+uint32_t shiftPclmul(uint32_t crc, uint32_t k) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+uint32_t shiftSoftware(uint32_t crc, uint32_t k) {
+    uint64_t product = 0;
+    for (int i = 0; i < 32; i++) {
+        if (k >> i & 1) {
+            product ^= uint64_t(crc) << i;
+        }
+    }
+    return _mm_crc32_u64(0, product);
+}
+
+struct Combine {
+    uint32_t (*shift)(uint32_t crc, uint32_t k);
+    size_t min_interleaved;
+    uint32_t k[2 * MAX_LANE / 8 + 1];  // k[i] shifts by 8 * i bytes
+
+    Combine() {
+        __builtin_cpu_init();
+        const bool pclmul = __builtin_cpu_supports("pclmul");
+        shift = pclmul ? shiftPclmul : shiftSoftware;
+        min_interleaved = pclmul ? MIN_INTERLEAVED : MIN_INTERLEAVED_SOFTWARE;
+        // Reflected, bit 31 is x^0, so multiplying by x is a right shift
+        auto timesX = [](uint32_t v) { return (v & 1) ? (v >> 1) ^ POLY : v >> 1; };
+        uint32_t v = 0x80000000;
+        for (int e = 0; e < 64 - 33; e++) {
+            v = timesX(v);
+        }
+        k[0] = 0;
+        for (size_t i = 1; i <= 2 * MAX_LANE / 8; i++) {
+            k[i] = v;
+            for (int e = 0; e < 64; e++) {
+                v = timesX(v);
+            }
+        }
+    }
+};
+
+const Combine& combine() {
+    static const Combine table;
+    return table;
+}
+
+}  // namespace
+
+uint32_t crc32c(const void* data, size_t length, uint32_t previousCrc32) {
+    uint32_t crc = ~previousCrc32;  // Invert initial value
+    const uint8_t* current = static_cast<const uint8_t*>(data);
+
+    // Process individual bytes until we reach 8-byte alignment
+    while (length && ((uintptr_t)current & 7)) {
+        crc = _mm_crc32_u8(crc, *current++);
+        length--;
+    }
+
+    // Three lanes at a time: the first continues crc, the others start from 0 and are shifted into
+    // place behind it once the lanes are done
+    if (length >= MIN_INTERLEAVED) {
+        const Combine& table = combine();
+        while (length >= table.min_interleaved) {
+            const size_t lane = std::min(MAX_LANE, length / 24 * 8);
+            const uint64_t* a = reinterpret_cast<const uint64_t*>(current);
+            const uint64_t* b = a + lane / 8;
+            const uint64_t* c = b + lane / 8;
+            uint64_t crc_a = crc, crc_b = 0, crc_c = 0;
+            for (size_t i = 0; i < lane / 8; i++) {
+                crc_a = _mm_crc32_u64(crc_a, a[i]);
+                crc_b = _mm_crc32_u64(crc_b, b[i]);
+                crc_c = _mm_crc32_u64(crc_c, c[i]);
+            }
+            crc = table.shift(crc_a, table.k[2 * lane / 8]) ^ table.shift(crc_b, table.k[lane / 8]) ^ uint32_t(crc_c);
+            current += 3 * lane;
+            length -= 3 * lane;
+        }
+    }
+
+    // Process 8 bytes at a time
+    while (length >= 8) {
+        crc = _mm_crc32_u64(crc, *reinterpret_cast<const uint64_t*>(current));
+        current += 8;
+        length -= 8;
+    }
+
+    // Process any remaining bytes
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *current++);
+    }
+
+    return ~crc;  // Invert final value
+}
+
+uint32_t crc32cSerial(const void* data, size_t length, uint32_t previousCrc32) {
+    uint32_t crc = ~previousCrc32;
+    const uint8_t* current = static_cast<const uint8_t*>(data);
+    while (length && ((uintptr_t)current & 7)) {
+        crc = _mm_crc32_u8(crc, *current++);
+        length--;
+    }
+    while (length >= 8) {
+        crc = _mm_crc32_u64(crc, *reinterpret_cast<const uint64_t*>(current));
+        current += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *current++);
+    }
+    return ~crc;
+}
+
+void crc32cBatch(const void* const* data, size_t length, uint32_t previousCrc32, uint32_t* crcs, int count) {
+    int i = 0;
+    for (; i + 3 <= count; i += 3) {
+        const uint8_t* a = static_cast<const uint8_t*>(data[i]);
+        const uint8_t* b = static_cast<const uint8_t*>(data[i + 1]);
+        const uint8_t* c = static_cast<const uint8_t*>(data[i + 2]);
+        uint64_t crc_a = uint32_t(~previousCrc32), crc_b = crc_a, crc_c = crc_a;
+        size_t pos = 0;
+        // The buffers needn't share an alignment, so the loads are unaligned
+        for (; pos + 8 <= length; pos += 8) {
+            uint64_t va, vb, vc;
+            std::memcpy(&va, a + pos, 8);
+            std::memcpy(&vb, b + pos, 8);
+            std::memcpy(&vc, c + pos, 8);
+            crc_a = _mm_crc32_u64(crc_a, va);
+            crc_b = _mm_crc32_u64(crc_b, vb);
+            crc_c = _mm_crc32_u64(crc_c, vc);
+        }
+        for (; pos < length; pos++) {
+            crc_a = _mm_crc32_u8(crc_a, a[pos]);
+            crc_b = _mm_crc32_u8(crc_b, b[pos]);
+            crc_c = _mm_crc32_u8(crc_c, c[pos]);
+        }
+        crcs[i] = ~uint32_t(crc_a);
+        crcs[i + 1] = ~uint32_t(crc_b);
+        crcs[i + 2] = ~uint32_t(crc_c);
+    }
+    for (; i < count; i++) {
+        crcs[i] = crc32c(data[i], length, previousCrc32);
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CRC32C implementation
+ * SSE4.2 hardware-accelerated implementation (CRC32C).  Buffers of a few hundred bytes or more are
+ * split into three lanes checksummed as independent _mm_crc32_u64 chains, which hides the instruction's
+ * 3 cycle latency, and the lane CRCs are combined with a PCLMULQDQ multiply (a table free software
+ * multiply on cpus without it).
+ * @param data: pointer to the data
+ * @param length: length of the data
+ * @param previousCrc32: previous crc32 value
+ * @return: crc32c checksum
+ */
+uint32_t crc32c(const void* data, size_t length, uint32_t previousCrc32);
+
+/**
+ * The single chain CRC32C, one _mm_crc32_u64 after another, for reference and benchmarks.
+ */
+uint32_t crc32cSerial(const void* data, size_t length, uint32_t previousCrc32);
+
+/**
+ * Checksums count buffers of the same length, such as the cells of a stripe, three buffers at a time
+ * so the chains overlap without a combine step.
+ * @param data count pointers to the buffers.
+ * @param length The length of each buffer.
+ * @param previousCrc32 The previous crc32 value for every buffer.
+ * @param crcs Receives count checksums, the same as crc32c() of each buffer.
+ * @param count The number of buffers.
+ */
+void crc32cBatch(const void* const* data, size_t length, uint32_t previousCrc32, uint32_t* crcs, int count);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * GF(256) tables built at compile time.  rs_tables.cpp bakes them into the binary as the gf_exp,
+ * gf_log, gf_nibble_table and gf_affine_table images, so nothing is computed at startup, and
+ * rscodec.hpp builds its fixed matrices from them.
+ */
+namespace gftables {
+
+struct GfTables {
+    std::array<uint8_t, 512> exp{};
+    std::array<int, 256> log{};
+};
+
+constexpr GfTables makeGfTables() {
+    GfTables t{};
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        t.exp[i] = x;
+        t.log[x] = i;
+        x = (x << 1) ^ ((x & 0x80) ? 0x1d : 0); // 0x1d is the primitive polynomial
+        x &= 0xff;
+    }
+    t.exp[255] = 1;
+    t.log[0] = -1;
+    for (int i = 256; i < 512; i++) {
+        t.exp[i] = t.exp[i - 255];
+    }
+    return t;
+}
+
+inline constexpr GfTables kGf = makeGfTables();
+
+constexpr uint8_t gfMul(uint8_t a, uint8_t b) {
+    return (a == 0 || b == 0) ? 0 : kGf.exp[(kGf.log[a] + kGf.log[b]) % 255];
+}
+
+constexpr uint8_t gfInv(uint8_t a) {
+    return kGf.exp[(255 - kGf.log[a]) % 255];
+}
+
+// Nibble shuffle tables for every coefficient: c * x for the low nibble, then c * (x << 4) for the high nibble
+constexpr std::array<uint8_t, 256 * 32> makeNibbleTables() {
+    std::array<uint8_t, 256 * 32> t{};
+    for (int c = 0; c < 256; c++) {
+        for (int x = 0; x < 16; x++) {
+            t[c * 32 + x] = gfMul(c, x);
+            t[c * 32 + 16 + x] = gfMul(c, x << 4);
+        }
+    }
+    return t;
+}
+
+alignas(32) inline constexpr std::array<uint8_t, 256 * 32> kNibble = makeNibbleTables();
+
+// GFNI affine matrices for every coefficient, row for output bit i in byte 7 - i
+constexpr std::array<uint64_t, 256> makeAffineTables() {
+    std::array<uint64_t, 256> t{};
+    for (int c = 0; c < 256; c++) {
+        uint64_t m = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            uint64_t row = 0;
+            for (int j = 0; j < 8; j++) {
+                row |= (uint64_t)((gfMul(c, 1 << j) >> bit) & 1) << j;
+            }
+            m |= row << (8 * (7 - bit));
+        }
+        t[c] = m;
+    }
+    return t;
+}
+
+inline constexpr std::array<uint64_t, 256> kAffine = makeAffineTables();
+
+} // namespace gftables
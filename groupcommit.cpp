@@ -0,0 +1,184 @@
+#include "groupcommit.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+// An address holds the offset into the blade in 8 byte units in its bottom 32 bits
+const uint64_t BLADE_UNITS = uint64_t(1) << 32;
+
+}  // namespace
+
+GroupCommit::Group::Group(size_t bytes) : stripe_number(0), payload(nullptr), used(0), written(false), result(0) {
+    payload = allocAligned<unsigned char>(64, bytes);
+}
+
+GroupCommit::Group::~Group() {
+    free(payload);
+}
+
+GroupCommit::GroupCommit(const VolumeMap& map, reed_solomon* rs, const GroupCommitConfig& config)
+    : map_(map), rs_(rs), config_(config), stripe_bytes_(size_t(rs->data_shards) * sizeof(Block::data)), error_(0),
+      next_stripe_(config.first_stripe), stopping_(false), blocks_(rs->data_shards + rs->parity_shards) {
+    std::memset(&stats_, 0, sizeof(stats_));
+    // Stripe 0 holds the volume headers
+    if (config.first_stripe == 0) {
+        error_ = -EINVAL;
+        return;
+    }
+    writer_ = std::thread(&GroupCommit::writerLoop, this);
+}
+
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    writer_cv_.notify_all();
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+}
+
+void GroupCommit::seal() {
+    pending_.push_back(current_);
+    last_sealed_ = current_;
+    current_ = nullptr;
+    writer_cv_.notify_all();
+}
+
+int GroupCommit::append(const void* data, size_t length, uint64_t* address) {
+    const size_t padded = (length + 7) & ~size_t(7);
+    if (error_ != 0 || length == 0 || padded > stripe_bytes_) {
+        return -EINVAL;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (stopping_) {
+            return -ESHUTDOWN;
+        }
+        if (current_ != nullptr && current_->used + padded > stripe_bytes_) {
+            stats_.full_stripes++;
+            seal();
+        }
+        if (current_ != nullptr || int(pending_.size()) < config_.max_pending) {
+            break;
+        }
+        done_cv_.wait(lock);
+    }
+    if (current_ == nullptr) {
+        if ((next_stripe_ + 1) * stripe_bytes_ / 8 > BLADE_UNITS) {
+            return -ENOSPC;
+        }
+        current_ = std::make_shared<Group>(stripe_bytes_);
+        current_->stripe_number = next_stripe_++;
+        current_->deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(config_.max_delay_us);
+        writer_cv_.notify_all();
+    }
+
+    std::shared_ptr<Group> group = current_;
+    std::memcpy(group->payload + group->used, data, length);
+    std::memset(group->payload + group->used + length, 0, padded - length);
+    *address = (uint64_t(config_.blade) << 32) | ((group->stripe_number * stripe_bytes_ + group->used) / 8);
+    group->used += padded;
+    stats_.appends++;
+    stats_.bytes += length;
+    if (group->used == stripe_bytes_) {
+        stats_.full_stripes++;
+        seal();
+    }
+    done_cv_.wait(lock, [&] { return group->written; });
+    return group->result;
+}
+
+void GroupCommit::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (current_ != nullptr) {
+        seal();
+    }
+    std::shared_ptr<Group> last = last_sealed_;
+    if (last != nullptr) {
+        done_cv_.wait(lock, [&] { return last->written; });
+    }
+}
+
+uint64_t GroupCommit::nextStripe() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_ != nullptr ? current_->stripe_number : next_stripe_;
+}
+
+GroupCommitStats GroupCommit::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void GroupCommit::decodeAddress(uint64_t address, uint64_t* stripe, size_t* offset) const {
+    const uint64_t bytes = (address & (BLADE_UNITS - 1)) * 8;
+    *stripe = bytes / stripe_bytes_;
+    *offset = bytes % stripe_bytes_;
+}
+
+void GroupCommit::writerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (pending_.empty()) {
+            if (current_ == nullptr) {
+                if (stopping_) {
+                    break;
+                }
+                writer_cv_.wait(lock);
+            } else if (stopping_ || std::chrono::steady_clock::now() >= current_->deadline) {
+                seal();
+            } else {
+                writer_cv_.wait_until(lock, current_->deadline);
+            }
+            continue;
+        }
+        std::shared_ptr<Group> group = pending_.front();
+        pending_.erase(pending_.begin());
+        done_cv_.notify_all();
+
+        lock.unlock();
+        const int result = writeGroup(*group);
+        lock.lock();
+        group->result = result;
+        group->written = true;
+        stats_.stripes++;
+        stats_.write_errors += result != 0;
+        done_cv_.notify_all();
+    }
+}
+
+int GroupCommit::writeGroup(Group& group) {
+    const int n = rs_->data_shards + rs_->parity_shards;
+    // Trim block mode: the stripe is new, so the cells go straight out, the unused tail as zeros
+    std::memset(group.payload + group.used, 0, stripe_bytes_ - group.used);
+    buildStripe(rs_, group.payload, group.stripe_number, config_.sequence_number, blocks_.data());
+
+    for (const Volume& vol : map_.volumes) {
+        // The volume's cells of this stripe are contiguous, in shard_ids order
+        struct iovec iov[8];
+        const int count = getKBlocksInStripe(vol.header);
+        for (int i = 0; i < count; i++) {
+            const int shard = vol.header.shard_ids[i];
+            if (!isDroppedShard(shard) && shard >= n) {
+                return -EINVAL;
+            }
+            iov[i].iov_base = const_cast<Block*>(isDroppedShard(shard) ? droppedCell() : &blocks_[shard]);
+            iov[i].iov_len = sizeof(Block);
+        }
+        const ssize_t bytes = ssize_t(count) * sizeof(Block);
+        if (pwritev(vol.fd, iov, count, computeOffsetToBlock(vol.header, group.stripe_number, vol.header.shard_ids[0])) != bytes) {
+            return errno != 0 ? -errno : -EIO;
+        }
+    }
+    for (const Volume& vol : map_.volumes) {
+        if (fdatasync(vol.fd) != 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Group commit settings.
+ */
+struct GroupCommitConfig {
+    uint32_t blade = 0;             // the top 32 bits of every address
+    uint64_t first_stripe = 1;      // stripes from here on are trimmed, never written, stripe 0 holds the headers
+    uint32_t sequence_number = 1;   // written to every cell
+    uint64_t max_delay_us = 200;    // longest an append waits for its stripe to fill
+    int max_pending = 4;            // full stripes queued for writing before appends block
+};
+
+struct GroupCommitStats {
+    uint64_t stripes;       // stripes written
+    uint64_t full_stripes;  // of which written because they filled, not on the deadline
+    uint64_t appends;
+    uint64_t bytes;         // appended, before padding
+    uint64_t write_errors;  // stripes that failed, every append in them failed
+};
+
+/**
+ * Holdfast side group commit of small appends.  Appends from any number of threads are packed,
+ * each padded to 8 bytes, into the payload of the next stripe, and once the stripe is full or the
+ * oldest append in it has waited max_delay_us, a writer thread encodes it and writes every cell in
+ * one go, one pwritev per volume.  The stripes are new ('trim block' mode), so nothing is read or
+ * backed up first, and a small append costs a share of one stripe write instead of a read-modify-write.
+ *
+ * An address is 64 bits in 8 byte units: the blade in the top 32 bits, then the offset into the
+ * blade, stripe * k * 4080 / 8 plus the offset into the stripe payload.  init_gf() must have been called.
+ */
+class GroupCommit {
+public:
+    /**
+     * Starts the writer thread.  A first_stripe of 0 is refused: no thread is started, error() says
+     * so and every append fails.
+     * @param map The volumes.  Must outlive the group commit.
+     * @param rs The Reed-Solomon codec.  Must outlive the group commit.
+     * @param config The settings.
+     */
+    GroupCommit(const VolumeMap& map, reed_solomon* rs, const GroupCommitConfig& config = GroupCommitConfig());
+    /**
+     * Writes whatever has been appended and stops the writer thread.
+     */
+    ~GroupCommit();
+    GroupCommit(const GroupCommit&) = delete;
+    GroupCommit& operator=(const GroupCommit&) = delete;
+
+    /**
+     * Appends data and waits until the stripe holding it is on disk.
+     * @param data The bytes to append.
+     * @param length The number of bytes, at most stripeBytes().
+     * @param address Receives the address of the first byte.
+     * @return Returns 0, -EINVAL if the append is empty or doesn't fit a stripe or the settings were
+     *         refused, -ENOSPC once the blade
+     *         is full, -ESHUTDOWN once the group commit is stopping, or the negative error code of the
+     *         stripe write.
+     */
+    int append(const void* data, size_t length, uint64_t* address);
+
+    /**
+     * Writes the partly filled stripe now rather than at its deadline, and waits for every stripe
+     * appended so far.
+     */
+    void flush();
+
+    /**
+     * @return Returns the payload bytes of a stripe, k * 4080.
+     */
+    size_t stripeBytes() const { return stripe_bytes_; }
+
+    /**
+     * @return Returns the stripe the next append goes to.
+     */
+    uint64_t nextStripe() const;
+
+    GroupCommitStats stats() const;
+
+    /**
+     * @return Returns 0, or -EINVAL if the settings were refused.
+     */
+    int error() const { return error_; }
+
+    /**
+     * @param address An address returned by append().
+     * @param stripe Receives the stripe number.
+     * @param offset Receives the byte offset into the stripe payload.
+     */
+    void decodeAddress(uint64_t address, uint64_t* stripe, size_t* offset) const;
+
+private:
+    struct Group {
+        uint64_t stripe_number;
+        unsigned char* payload;
+        size_t used;
+        std::chrono::steady_clock::time_point deadline;
+        bool written;
+        int result;
+        explicit Group(size_t bytes);
+        ~Group();
+    };
+
+    void writerLoop();
+    int writeGroup(Group& group);
+    void seal();
+
+    const VolumeMap& map_;
+    reed_solomon* rs_;
+    GroupCommitConfig config_;
+    size_t stripe_bytes_;
+    int error_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable writer_cv_;  // a group was sealed, started or the group commit is stopping
+    std::condition_variable done_cv_;    // a group was written, or a pending slot freed up
+    std::shared_ptr<Group> current_;     // being filled, nullptr until the first append
+    std::vector<std::shared_ptr<Group>> pending_;  // sealed, in stripe order
+    std::shared_ptr<Group> last_sealed_;
+    uint64_t next_stripe_;
+    bool stopping_;
+    GroupCommitStats stats_;
+
+    std::vector<Block> blocks_;  // writer thread only
+    std::thread writer_;
+};
@@ -0,0 +1,316 @@
+#include "ioengine.hpp"
+#include "latency.hpp"
+#include "metrics.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+class LibaioEngine : public IoEngine {
+public:
+    LibaioEngine(io_context_t io_ctx, const IoEngineConfig& config)
+        : io_ctx_(io_ctx), pool_(io_ctx, config.small_slots, config.large_slots) {}
+    ~LibaioEngine() override { io_destroy(io_ctx_); }
+
+    const char* name() const override { return "libaio"; }
+    // libaio has no fixed files, the fd is looked up on every io_submit
+    int registerFiles(const std::vector<int>&) override { return 0; }
+    int submitRead(int fd, int start_page, int num_pages) override { return ::submitRead(pool_, fd, start_page, num_pages); }
+    int submitWrite(int fd, int start_page, int num_pages) override { return ::submitWrite(pool_, fd, start_page, num_pages); }
+    int checkCompleted() override { return ::checkCompleted(pool_); }
+    void setLatencyTracker(LatencyTracker* tracker) override { pool_.setLatencyTracker(tracker); }
+    const IoPool& pool() const override { return pool_; }
+
+private:
+    io_context_t io_ctx_;
+    IoPool pool_;
+};
+
+// io_uring through the raw syscalls, so there's no liburing dependency.  The pool arena is
+// registered as fixed buffer 0, so reads and writes use READ_FIXED/WRITE_FIXED and the kernel
+// doesn't pin and unpin the pages on every I/O.
+class UringEngine : public IoEngine {
+public:
+    UringEngine(const IoEngineConfig& config)
+        : pool_(nullptr, config.small_slots, config.large_slots), sqpoll_(config.sqpoll) {}
+    ~UringEngine() override;
+
+    // Sets up the ring, returns 0 or a negative error code
+    int init();
+
+    const char* name() const override { return "io_uring"; }
+    int registerFiles(const std::vector<int>& fds) override;
+    int submitRead(int fd, int start_page, int num_pages) override { return submit(false, fd, start_page, num_pages); }
+    int submitWrite(int fd, int start_page, int num_pages) override { return submit(true, fd, start_page, num_pages); }
+    int checkCompleted() override;
+    void setLatencyTracker(LatencyTracker* tracker) override { pool_.setLatencyTracker(tracker); }
+    const IoPool& pool() const override { return pool_; }
+
+private:
+    int submit(bool write, int fd, int start_page, int num_pages);
+    int enter(unsigned to_submit, unsigned flags);
+
+    IoPool pool_;
+    bool sqpoll_;
+    int ring_fd_ = -1;
+    unsigned sq_entries_ = 0;
+    unsigned unsubmitted_ = 0;
+    std::vector<int> files_;
+
+    void* sq_ring_ = MAP_FAILED;
+    size_t sq_ring_bytes_ = 0;
+    void* cq_ring_ = MAP_FAILED;
+    size_t cq_ring_bytes_ = 0;
+    struct io_uring_sqe* sqes_ = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_bytes_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_flags_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    struct io_uring_cqe* cqes_ = nullptr;
+};
+
+UringEngine::~UringEngine() {
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_bytes_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_bytes_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_bytes_);
+    }
+    if (ring_fd_ >= 0) {
+        close(ring_fd_);
+    }
+}
+
+int UringEngine::init() {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    if (sqpoll_) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;  // ms before the poll thread sleeps
+    }
+    // In-flight I/O is bounded by the pool, so the completion queue can't overflow
+    unsigned entries = std::max(1, pool_.stats().small_capacity + pool_.stats().large_capacity);
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0) {
+        return -errno;
+    }
+    sq_entries_ = params.sq_entries;
+
+    sq_ring_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        return -errno;
+    }
+    cq_ring_ = single_mmap ? sq_ring_
+                           : mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+        return -errno;
+    }
+    sqes_bytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(
+        mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+        return -errno;
+    }
+
+    unsigned char* sq = static_cast<unsigned char*>(sq_ring_);
+    unsigned char* cq = static_cast<unsigned char*>(cq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    if (pool_.arenaBytes() > 0) {
+        struct iovec arena = {pool_.arena(), pool_.arenaBytes()};
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, &arena, 1) < 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+int UringEngine::registerFiles(const std::vector<int>& fds) {
+    if (!files_.empty()) {
+        syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_FILES, nullptr, 0);
+        files_.clear();
+    }
+    if (fds.empty()) {
+        return 0;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, fds.data(), fds.size()) < 0) {
+        return -errno;
+    }
+    files_ = fds;
+    return 0;
+}
+
+int UringEngine::enter(unsigned to_submit, unsigned flags) {
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, 0, flags, nullptr, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+int UringEngine::submit(bool write, int fd, int start_page, int num_pages) {
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        return -EAGAIN;
+    }
+    WriteContext* ctx = pool_.acquire(num_pages);
+    if (ctx == nullptr) {
+        return -EAGAIN;
+    }
+    ctx->start_page = start_page;
+    ctx->fd = fd;
+    if (write) {
+        // Fill buffer with dummy data
+        std::memset(ctx->buffer, 'A' + (start_page % 26), PAGE_SIZE * num_pages);
+    }
+
+    unsigned index = tail & *sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    auto file = std::find(files_.begin(), files_.end(), fd);
+    if (file != files_.end()) {
+        sqe->fd = file - files_.begin();
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(ctx->buffer);
+    sqe->len = PAGE_SIZE * num_pages;
+    sqe->off = uint64_t(start_page) * PAGE_SIZE;
+    sqe->buf_index = 0;
+    sqe->user_data = reinterpret_cast<uint64_t>(ctx);
+    ctx->submit_ns = pool_.latencyTracker() != nullptr ? monotonicNs() : 0;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    // Counted once it's on the ring, the kernel takes it with this enter or a later one
+    kelp_metric_add(KELP_METRIC_IO_SUBMITTED, 1);
+    KELP_TRACE2(io_submit, &pool_, 1);
+
+    if (sqpoll_) {
+        if (__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            enter(0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return 0;
+    }
+    // If the kernel doesn't take the entry now it stays on the ring for the next enter
+    unsubmitted_++;
+    int ret = enter(unsubmitted_, 0);
+    if (ret > 0) {
+        unsubmitted_ -= ret;
+    }
+    return 0;
+}
+
+int UringEngine::checkCompleted() {
+    if (unsubmitted_ > 0) {
+        int ret = enter(unsubmitted_, 0);
+        if (ret > 0) {
+            unsubmitted_ -= ret;
+        }
+    }
+
+    int total_written = 0;
+    LatencyTracker* tracker = pool_.latencyTracker();
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    countReap(pool_, tail - head);
+    uint64_t now = tracker != nullptr && head != tail ? monotonicNs() : 0;
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+        auto* ctx = reinterpret_cast<WriteContext*>(cqe->user_data);
+        total_written += ctx->num_pages;
+        if (tracker != nullptr) {
+            tracker->record(ctx->fd, now - ctx->submit_ns);
+        }
+        pool_.release(ctx);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return total_written;
+}
+
+}  // namespace
+
+std::unique_ptr<IoEngine> makeIoEngine(const char* name, const IoEngineConfig& config) {
+    if (name == nullptr) {
+        name = getenv("KELP_IO_ENGINE");
+    }
+    if (name == nullptr || strcmp(name, "libaio") == 0) {
+        io_context_t io_ctx = 0;
+        if (io_setup(std::max(1, config.small_slots + config.large_slots), &io_ctx) != 0) {
+            return nullptr;
+        }
+        return std::unique_ptr<IoEngine>(new LibaioEngine(io_ctx, config));
+    }
+    if (strcmp(name, "io_uring") == 0) {
+        std::unique_ptr<UringEngine> engine(new UringEngine(config));
+        if (engine->init() != 0) {
+            return nullptr;
+        }
+        return engine;
+    }
+    return nullptr;
+}
+
+// C interface for blockaio.py
+extern "C" {
+
+void* io_engine_new(const char* name, int small_slots, int large_slots, int sqpoll) {
+    IoEngineConfig config;
+    config.small_slots = small_slots;
+    config.large_slots = large_slots;
+    config.sqpoll = sqpoll != 0;
+    return makeIoEngine(name, config).release();
+}
+
+void io_engine_free(void* engine) {
+    delete static_cast<IoEngine*>(engine);
+}
+
+const char* io_engine_name(void* engine) {
+    return static_cast<IoEngine*>(engine)->name();
+}
+
+int io_engine_register_files(void* engine, const int* fds, int count) {
+    return static_cast<IoEngine*>(engine)->registerFiles(std::vector<int>(fds, fds + count));
+}
+
+int io_engine_submit_read(void* engine, int fd, int start_page, int num_pages) {
+    return static_cast<IoEngine*>(engine)->submitRead(fd, start_page, num_pages);
+}
+
+int io_engine_submit_write(void* engine, int fd, int start_page, int num_pages) {
+    return static_cast<IoEngine*>(engine)->submitWrite(fd, start_page, num_pages);
+}
+
+int io_engine_check_completed(void* engine) {
+    return static_cast<IoEngine*>(engine)->checkCompleted();
+}
+
+}
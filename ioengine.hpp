@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Engine configuration, the slot counts size the engine's IoPool and its queue depth.
+ * sqpoll only applies to io_uring: a kernel thread polls the submission queue, so submits
+ * don't need a syscall while the thread is awake.
+ */
+struct IoEngineConfig {
+    int small_slots = MAX_EVENTS;
+    int large_slots = MAX_EVENTS;
+    bool sqpoll = false;
+};
+
+/**
+ * Asynchronous block I/O engine, with the submitRead/submitWrite/checkCompleted semantics of the
+ * libaio functions in blockaio.hpp.  Buffers come from an IoPool owned by the engine.
+ * Like an io_context_t, an engine is used by one thread.
+ */
+class IoEngine {
+public:
+    virtual ~IoEngine() = default;
+
+    /**
+     * @return Returns the engine name, "libaio" or "io_uring".
+     */
+    virtual const char* name() const = 0;
+
+    /**
+     * Registers file descriptors with the kernel so I/O on them skips the per-I/O fd lookup.
+     * I/O on fds that aren't registered still works.
+     * @param fds The file descriptors, replacing any registered before.
+     * @return Returns 0 on success, or a negative error code on failure.
+     */
+    virtual int registerFiles(const std::vector<int>& fds) = 0;
+
+    /**
+     * Submits an asynchronous read operation.
+     * @param fd The file descriptor.
+     * @param start_page The starting page number.
+     * @param num_pages The number of pages to read, at most IoPool::LARGE_PAGES.
+     * @return Returns 0 on success, -EAGAIN if the engine is full, or a negative error code.
+     */
+    virtual int submitRead(int fd, int start_page, int num_pages) = 0;
+
+    /**
+     * Submits an asynchronous write operation of the same dummy data as submitWrite().
+     * @param fd The file descriptor.
+     * @param start_page The starting page number.
+     * @param num_pages The number of pages to write, at most IoPool::LARGE_PAGES.
+     * @return Returns 0 on success, -EAGAIN if the engine is full, or a negative error code.
+     */
+    virtual int submitWrite(int fd, int start_page, int num_pages) = 0;
+
+    /**
+     * Checks for completed I/O operations without blocking.
+     * @return Returns the number of pages written/read in completed operations.
+     */
+    virtual int checkCompleted() = 0;
+
+    /**
+     * Feeds completion latencies into a tracker, see IoPool::setLatencyTracker().
+     * @param tracker The tracker, or nullptr to stop.
+     */
+    virtual void setLatencyTracker(LatencyTracker* tracker) = 0;
+
+    virtual const IoPool& pool() const = 0;
+};
+
+/**
+ * Creates an engine.
+ * @param name "libaio" or "io_uring", or nullptr for the KELP_IO_ENGINE environment variable,
+ *             falling back to libaio.
+ * @param config The engine configuration.
+ * @return Returns the engine, or nullptr if the name is unknown or the kernel refused to set it up.
+ */
+std::unique_ptr<IoEngine> makeIoEngine(const char* name, const IoEngineConfig& config = IoEngineConfig());
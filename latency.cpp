@@ -0,0 +1,223 @@
+#include "latency.hpp"
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto& count : counts_) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucket(uint64_t latency_us) {
+    if (latency_us == 0) {
+        return 0;
+    }
+    // The top bit picks the doubling, the next two bits the linear sub-bucket within it
+    int msb = 63 - __builtin_clzll(latency_us);
+    int sub = msb >= 2 ? (latency_us >> (msb - 2)) & 3 : (latency_us << (2 - msb)) & 3;
+    return std::min(msb * SUB_BUCKETS + sub, BUCKETS - 1);
+}
+
+double LatencyHistogram::bucketMidUs(int bucket) {
+    int msb = bucket / SUB_BUCKETS;
+    int sub = bucket % SUB_BUCKETS;
+    double lo = std::ldexp(1.0 + sub / double(SUB_BUCKETS), msb);
+    double hi = std::ldexp(1.0 + (sub + 1) / double(SUB_BUCKETS), msb);
+    return std::sqrt(lo * hi);
+}
+
+void LatencyHistogram::record(uint64_t latency_ns) {
+    counts_[bucket(latency_ns / 1000)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::samples() const {
+    uint64_t total = 0;
+    for (const auto& count : counts_) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// ln(bucketMidUs(i)), so a fit is a pass over the counts
+static const std::vector<double>& logMids() {
+    static const std::vector<double> mids = [] {
+        std::vector<double> v(LatencyHistogram::BUCKETS);
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            v[i] = std::log(LatencyHistogram::bucketMidUs(i));
+        }
+        return v;
+    }();
+    return mids;
+}
+
+LatencyHistogram::Fit LatencyHistogram::fit() const {
+    const std::vector<double>& log_mids = logMids();
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    double sum = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+        sum += counts[i] * log_mids[i];
+    }
+    Fit fit = {total, 0, 0};
+    if (total == 0) {
+        return fit;
+    }
+    fit.mu = sum / total;
+    double var = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        double d = log_mids[i] - fit.mu;
+        var += counts[i] * d * d;
+    }
+    fit.sigma = std::sqrt(var / total);
+    return fit;
+}
+
+double LatencyHistogram::Fit::quantileUs(double z) const {
+    return std::exp(mu + z * sigma);
+}
+
+double LatencyHistogram::quantileUs(double q) const {
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    uint64_t rank = uint64_t(std::ceil(q * total));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (counts[i] > 0 && seen >= rank) {
+            return bucketMidUs(i);
+        }
+    }
+    return 0;
+}
+
+void LatencyHistogram::decay() {
+    for (auto& count : counts_) {
+        count.fetch_sub(count.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+}
+
+HdrHistogram::HdrHistogram() : counts_(BUCKETS, 0), samples_(0), sum_ns_(0), max_ns_(0) {}
+
+int HdrHistogram::bucket(uint64_t latency_ns) {
+    if (latency_ns < SUB_BUCKETS) {
+        return latency_ns;
+    }
+    // The top bit picks the doubling, the next SUB_BITS bits the linear sub-bucket within it
+    int msb = 63 - __builtin_clzll(latency_ns);
+    if (msb > MAX_BIT) {
+        return BUCKETS - 1;
+    }
+    int sub = (latency_ns >> (msb - SUB_BITS)) - SUB_BUCKETS;
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t HdrHistogram::bucketHighNs(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t low = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+}
+
+void HdrHistogram::record(uint64_t latency_ns) {
+    counts_[bucket(latency_ns)]++;
+    samples_++;
+    sum_ns_ += latency_ns;
+    max_ns_ = std::max(max_ns_, latency_ns);
+}
+
+void HdrHistogram::merge(const HdrHistogram& other) {
+    for (int i = 0; i < BUCKETS; i++) {
+        counts_[i] += other.counts_[i];
+    }
+    samples_ += other.samples_;
+    sum_ns_ += other.sum_ns_;
+    max_ns_ = std::max(max_ns_, other.max_ns_);
+}
+
+uint64_t HdrHistogram::quantileNs(double q) const {
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(q * samples_)));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts_[i];
+        if (counts_[i] > 0 && seen >= rank) {
+            // The top bucket is clamped, the max is exact
+            return std::min(bucketHighNs(i), max_ns_);
+        }
+    }
+    return 0;
+}
+
+LatencyTracker::LatencyTracker(const VolumeMap& map, double slow_factor)
+    : histograms_(map.volumes.size()), slow_factor_(slow_factor) {
+    for (const Volume& vol : map.volumes) {
+        fds_.push_back(vol.fd);
+    }
+}
+
+void LatencyTracker::record(int fd, uint64_t latency_ns) {
+    for (size_t i = 0; i < fds_.size(); i++) {
+        if (fds_[i] == fd) {
+            histograms_[i].record(latency_ns);
+            return;
+        }
+    }
+}
+
+double LatencyTracker::expectedUs(int volume) const {
+    LatencyHistogram::Fit fit = histograms_[volume].fit();
+    return fit.samples > 0 ? fit.quantileUs(1.2816) : 0;
+}
+
+std::vector<int> LatencyTracker::slowVolumes() const {
+    std::vector<LatencyHistogram::Fit> fits;
+    std::vector<double> medians;
+    std::vector<double> p99s;
+    for (const LatencyHistogram& histogram : histograms_) {
+        fits.push_back(histogram.fit());
+        if (fits.back().samples >= MIN_SAMPLES) {
+            medians.push_back(fits.back().quantileUs(0));
+            p99s.push_back(fits.back().quantileUs(2.326));
+        }
+    }
+    std::vector<int> slow;
+    if (medians.empty()) {
+        return slow;
+    }
+    // The lower median, so with two drives the slow one is compared against the healthy one
+    size_t mid = (medians.size() - 1) / 2;
+    std::nth_element(medians.begin(), medians.begin() + mid, medians.end());
+    std::nth_element(p99s.begin(), p99s.begin() + mid, p99s.end());
+    for (size_t v = 0; v < fits.size(); v++) {
+        if (fits[v].samples >= MIN_SAMPLES
+            && (fits[v].quantileUs(0) > slow_factor_ * medians[mid] || fits[v].quantileUs(2.326) > slow_factor_ * p99s[mid])) {
+            slow.push_back(v);
+        }
+    }
+    return slow;
+}
+
+bool LatencyTracker::isSlow(int volume) const {
+    std::vector<int> slow = slowVolumes();
+    return std::find(slow.begin(), slow.end(), volume) != slow.end();
+}
+
+void LatencyTracker::decay() {
+    for (LatencyHistogram& histogram : histograms_) {
+        histogram.decay();
+    }
+}
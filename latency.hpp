@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Lock-free log-linear latency histogram, 4 buckets per doubling from 1 us to 16 s.
+ * record() is a relaxed atomic increment so any number of threads can update it.  Disk latency is
+ * close to lognormal, so fit() gives the mu and sigma of ln(latency in us) from the bucket counts.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKETS = 4;
+    static constexpr int BUCKETS = 24 * SUB_BUCKETS;
+
+    struct Fit {
+        uint64_t samples;
+        double mu;     // mean of ln(latency_us)
+        double sigma;  // standard deviation of ln(latency_us)
+
+        /**
+         * @param z The standard normal quantile, e.g. 2.326 for p99.
+         * @return Returns the fitted latency quantile in microseconds.
+         */
+        double quantileUs(double z) const;
+    };
+
+    LatencyHistogram();
+
+    /**
+     * Adds a sample.
+     * @param latency_ns The latency in nanoseconds.
+     */
+    void record(uint64_t latency_ns);
+
+    /**
+     * @return Returns the lognormal fit of the samples.
+     */
+    Fit fit() const;
+
+    /**
+     * @param q The quantile, in [0, 1].
+     * @return Returns the quantile from the bucket counts, in microseconds.
+     */
+    double quantileUs(double q) const;
+
+    /**
+     * Halves every bucket so the fit follows a drive that is changing.  Races with record()
+     * only in which half a concurrent sample lands in.
+     */
+    void decay();
+
+    uint64_t samples() const;
+
+    static int bucket(uint64_t latency_us);
+    // Geometric middle of a bucket in microseconds
+    static double bucketMidUs(int bucket);
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS];
+};
+
+/**
+ * HdrHistogram-style latency histogram for reporting tail latency, exact below 128 ns and within 1/128
+ * (under 0.8%) from there to 2^42 ns, over an hour, where samples are clamped.  Unlike LatencyHistogram
+ * it is plain counters, each thread records into its own and they are merged for the report.
+ */
+class HdrHistogram {
+public:
+    static constexpr int SUB_BITS = 7;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int MAX_BIT = 41;
+    static constexpr int BUCKETS = (MAX_BIT - SUB_BITS + 2) * SUB_BUCKETS;  // the last doubling holds 2^MAX_BIT
+
+    HdrHistogram();
+
+    /**
+     * @param latency_ns The latency in nanoseconds.
+     */
+    void record(uint64_t latency_ns);
+
+    /**
+     * Adds another histogram's samples.
+     */
+    void merge(const HdrHistogram& other);
+
+    /**
+     * @param q The quantile, in [0, 1].
+     * @return Returns the highest latency in the bucket holding the quantile in nanoseconds, or 0 without
+     *         samples.
+     */
+    uint64_t quantileNs(double q) const;
+
+    uint64_t samples() const { return samples_; }
+    uint64_t maxNs() const { return max_ns_; }
+    double meanNs() const { return samples_ > 0 ? double(sum_ns_) / samples_ : 0; }
+
+    static int bucket(uint64_t latency_ns);
+    // The highest latency that lands in a bucket
+    static uint64_t bucketHighNs(int bucket);
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t samples_;
+    uint64_t sum_ns_;
+    uint64_t max_ns_;
+};
+
+/**
+ * A latency histogram per volume, fed from I/O completions, and slow drive detection.
+ * A drive is slow when it has enough samples and its fitted median or p99 is more than
+ * slow_factor times the median across the drives, so one sick disk is avoided before it fails.
+ */
+class LatencyTracker {
+public:
+    static constexpr uint64_t MIN_SAMPLES = 32;
+
+    /**
+     * @param map The volumes, completions are matched to volumes by fd.
+     * @param slow_factor How far above the other drives a drive must be to count as slow.
+     */
+    explicit LatencyTracker(const VolumeMap& map, double slow_factor = 3.0);
+    LatencyTracker(const LatencyTracker&) = delete;
+    LatencyTracker& operator=(const LatencyTracker&) = delete;
+
+    /**
+     * Records a completion on a volume's fd, fds of other files are ignored.
+     * @param fd The file descriptor the I/O was on.
+     * @param latency_ns The latency in nanoseconds.
+     */
+    void record(int fd, uint64_t latency_ns);
+
+    /**
+     * @param volume Index into map.volumes.
+     */
+    void recordVolume(int volume, uint64_t latency_ns) { histograms_[volume].record(latency_ns); }
+    const LatencyHistogram& volume(int volume) const { return histograms_[volume]; }
+    int volumeCount() const { return histograms_.size(); }
+
+    /**
+     * @param volume Index into map.volumes.
+     * @return Returns the expected read latency, the fitted p90, or 0 without samples.
+     */
+    double expectedUs(int volume) const;
+
+    /**
+     * @return Returns the indices of the slow volumes, one fit per volume.
+     */
+    std::vector<int> slowVolumes() const;
+
+    /**
+     * @param volume Index into map.volumes.
+     * @return Returns whether the drive is much slower than the others, see slowVolumes().
+     */
+    bool isSlow(int volume) const;
+
+    /**
+     * Decays every volume's histogram, call periodically.
+     */
+    void decay();
+
+private:
+    std::vector<int> fds_;
+    std::vector<LatencyHistogram> histograms_;
+    double slow_factor_;
+};
+
+uint64_t monotonicNs();
@@ -0,0 +1,405 @@
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "blockaio.hpp"
+#include "latency.hpp"
+#include "stripereader.hpp"
+
+/**
+ * Load generator for sizing hardware: a mix of full stripe writes, single cell overwrites, hedged stripe
+ * reads and degraded reads with some volumes masked, against real volumes, with an HdrHistogram of the
+ * latency of each operation type.
+ *
+ *     ./loadgen --format -k 8 -m 4 -q 16 -t 30 --mix 1,1,6,2 --masked 2 /dev/nvme0n1 /dev/nvme1n1 ...
+ *
+ * The queue depth is the number of workers, each keeping one operation in flight through the repo's own
+ * paths: queueStripeWrite() on an IoBatch, updateStripeCell(), and a StripeReader over all the volumes or
+ * over the map without the masked ones.  Each worker owns the stripes congruent to its index so writes
+ * never race with each other.  --format writes fresh headers, spreading the k + m shards over the paths
+ * round robin, and fills every stripe, so reads find valid cells.  It destroys what was on the paths.
+ */
+namespace {
+
+enum Op { WRITE, OVERWRITE, READ, DEGRADED, OPS };
+const char* const OP_NAMES[OPS] = {"write", "overwrite", "read", "degraded"};
+
+struct Options {
+    int k = 8;
+    int m = 4;
+    int depth = 4;
+    double seconds = 10;
+    uint64_t stripes = 4096;
+    int weights[OPS] = {1, 1, 6, 2};
+    int masked = 1;
+    int hedge = -1;
+    bool format = false;
+    bool direct = false;
+};
+
+// Starting from the time keeps sequence numbers increasing across runs
+const uint32_t SEQUENCE_BASE = uint32_t(time(nullptr));
+const uint64_t FIRST_STRIPE = 1;  // stripe 0 holds the headers
+
+struct WorkerResult {
+    HdrHistogram latency[OPS];
+    uint64_t errors[OPS] = {};
+    uint64_t cell_reads = 0;
+    uint64_t decoded_reads = 0;
+    int error = 0;
+};
+
+int usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [options] path...\n"
+            "  -k N            data shards (8)\n"
+            "  -m N            parity shards (4)\n"
+            "  -q N            queue depth, operations in flight (4)\n"
+            "  -t SECONDS      run time (10)\n"
+            "  -s N            stripes used from stripe 1 on (4096)\n"
+            "  --mix W,O,R,D   weights of writes, overwrites, reads and degraded reads (1,1,6,2)\n"
+            "  --masked N      volumes masked for degraded reads (1)\n"
+            "  --hedge N       extra cells per read, -1 to choose from the latency stats (-1)\n"
+            "  --format        write headers and fill the stripes, destroys the paths' data\n"
+            "  --direct        open with O_DIRECT\n",
+            argv0);
+    return 2;
+}
+
+int openVolumes(const Options& options, const std::vector<const char*>& paths, VolumeMap& map) {
+    const int n = options.k + options.m;
+    if (n > 8 * int(paths.size())) {
+        fprintf(stderr, "%d shards need at least %d paths\n", n, (n + 7) / 8);
+        return -EINVAL;
+    }
+    std::mt19937 gen(SEQUENCE_BASE);
+    for (size_t v = 0; v < paths.size(); v++) {
+        Volume vol;
+        vol.fd = open(paths[v], O_RDWR | O_CREAT | (options.direct ? O_DIRECT : 0), 0644);
+        if (vol.fd < 0) {
+            perror(paths[v]);
+            return -errno;
+        }
+        if (options.format) {
+            std::memset(&vol.header, 0, sizeof(vol.header));
+            std::strncpy(reinterpret_cast<char*>(vol.header.magic_number.data()), "kelp volume", vol.header.magic_number.size());
+            vol.header.version_number = 1;
+            vol.header.volume_prefix_id = (1 << 24) | (gen() & 0x7fffffff);
+            // Shards round robin, the last one repeated to fill shard_ids
+            int count = 0;
+            for (int shard = v; shard < n; shard += paths.size()) {
+                vol.header.shard_ids[count++] = shard;
+            }
+            std::fill(vol.header.shard_ids.begin() + count, vol.header.shard_ids.end(), vol.header.shard_ids[count - 1]);
+            sealHeader(vol.header);
+            // One aligned page so the write also works with O_DIRECT
+            Block* page = allocAligned<Block>(PAGE_SIZE, sizeof(Block));
+            std::memset(page, 0, sizeof(Block));
+            std::memcpy(page, &vol.header, sizeof(vol.header));
+            const ssize_t written = pwrite(vol.fd, page, sizeof(Block), 0);
+            free(page);
+            if (written != sizeof(Block)) {
+                perror(paths[v]);
+                return errno != 0 ? -errno : -EIO;
+            }
+        } else {
+            Block* page = allocAligned<Block>(PAGE_SIZE, sizeof(Block));
+            const ssize_t got = pread(vol.fd, page, sizeof(Block), 0);
+            std::memcpy(&vol.header, page, sizeof(vol.header));
+            free(page);
+            if (got != sizeof(Block) || !validateHeader(vol.header)) {
+                fprintf(stderr, "%s: no valid header, use --format\n", paths[v]);
+                return -EINVAL;
+            }
+        }
+        map.volumes.push_back(vol);
+    }
+    for (int shard = 0; shard < n; shard++) {
+        if (findVolumeForShard(map, shard) < 0) {
+            fprintf(stderr, "no volume holds shard %d\n", shard);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Submits everything queued and waits for it, returns 0 or the first error
+int submitAll(IoBatch& batch, std::vector<IoCompletion>& events) {
+    int ret = 0;
+    while (batch.queued() > 0 || batch.inFlight() > 0) {
+        if (batch.queued() > 0) {
+            int submitted = batch.flush();
+            if (submitted < 0) {
+                // The writes already in flight still have to finish before their buffers are reused
+                batch.clear();
+                ret = ret != 0 ? ret : submitted;
+                continue;
+            }
+        }
+        int got = batch.reap(events.data(), events.size(), 1);
+        if (got < 0) {
+            return got;
+        }
+        for (int i = 0; i < got; i++) {
+            if (events[i].result < 0 && ret == 0) {
+                ret = events[i].result;
+            }
+        }
+    }
+    return ret;
+}
+
+// Writes every stripe once, BATCH stripes per flush
+int fill(const Options& options, const VolumeMap& map, reed_solomon* rs) {
+    const int BATCH = 32;
+    const int n = options.k + options.m;
+    io_context_t io_ctx = 0;
+    if (io_setup(BATCH * map.volumes.size(), &io_ctx) != 0) {
+        return -errno;
+    }
+    IoBatch batch(io_ctx, BATCH * map.volumes.size());
+    std::vector<IoCompletion> events(BATCH * map.volumes.size());
+    Block* blocks = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * n * BATCH);
+    unsigned char* payload = allocAligned<unsigned char>(PAGE_SIZE, options.k * sizeof(Block::data));
+    std::mt19937 gen(1);
+    const uint64_t start = monotonicNs();
+    int ret = 0;
+    for (uint64_t first = FIRST_STRIPE; first < FIRST_STRIPE + options.stripes && ret == 0; first += BATCH) {
+        for (int j = 0; j < BATCH && first + j < FIRST_STRIPE + options.stripes && ret == 0; j++) {
+            for (size_t i = 0; i < options.k * sizeof(Block::data); i++) {
+                payload[i] = gen();
+            }
+            buildStripe(rs, payload, first + j, SEQUENCE_BASE, blocks + j * n);
+            if (queueStripeWrite(batch, map, first + j, blocks + j * n, n, first + j) < 0) {
+                ret = -EINVAL;
+            }
+        }
+        if (ret == 0) {
+            ret = submitAll(batch, events);
+        }
+    }
+    const double elapsed = (monotonicNs() - start) * 1e-9;
+    printf("filled %llu stripes in %.1f s, %.0f MB/s of payload\n", (unsigned long long)options.stripes, elapsed,
+           options.stripes * options.k * sizeof(Block::data) / elapsed / 1e6);
+    free(payload);
+    free(blocks);
+    io_destroy(io_ctx);
+    return ret;
+}
+
+void worker(int index, const Options& options, const VolumeMap& shared_map, const VolumeMap& degraded_map,
+            reed_solomon* rs, const std::atomic<bool>& stop, WorkerResult& result) {
+    const int k = options.k;
+    const int n = options.k + options.m;
+    // The reads and the writes each reap their own context, so neither sees the other's completions
+    const int max_reads = 4 * n;
+    io_context_t read_ctx = 0, degraded_ctx = 0, write_ctx = 0;
+    if (io_setup(max_reads, &read_ctx) != 0 || io_setup(max_reads, &degraded_ctx) != 0
+        || io_setup(shared_map.volumes.size(), &write_ctx) != 0) {
+        result.error = -errno;
+        return;
+    }
+    VolumeMap map = shared_map;  // updateStripeCell takes the map by reference
+    StripeReader reader(map, rs, read_ctx, max_reads);
+    StripeReader degraded(degraded_map, rs, degraded_ctx, max_reads);
+    IoBatch batch(write_ctx, shared_map.volumes.size());
+    std::vector<IoCompletion> events(shared_map.volumes.size());
+
+    Block* blocks = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * n);
+    unsigned char* payload = allocAligned<unsigned char>(PAGE_SIZE, k * sizeof(Block::data));
+    std::mt19937_64 gen(index + 1);
+    for (size_t i = 0; i < k * sizeof(Block::data); i++) {
+        payload[i] = gen();
+    }
+    int total_weight = 0;
+    for (int weight : options.weights) {
+        total_weight += weight;
+    }
+    const uint64_t owned = (options.stripes - index + options.depth - 1) / options.depth;
+    uint32_t sequence_number = SEQUENCE_BASE + 1;
+
+    while (!stop.load(std::memory_order_relaxed) && owned > 0) {
+        int pick = gen() % total_weight;
+        int op = 0;
+        while (pick >= options.weights[op]) {
+            pick -= options.weights[op++];
+        }
+        const uint64_t stripe_number = FIRST_STRIPE + index + (gen() % owned) * options.depth;
+        payload[gen() % (k * sizeof(Block::data))] = gen();
+
+        int ret = 0;
+        const uint64_t start = monotonicNs();
+        switch (op) {
+        case WRITE:
+            buildStripe(rs, payload, stripe_number, sequence_number++, blocks);
+            ret = queueStripeWrite(batch, map, stripe_number, blocks, n, stripe_number) < 0 ? -EINVAL : submitAll(batch, events);
+            break;
+        case OVERWRITE:
+            ret = updateStripeCell(map, rs, stripe_number, gen() % k, payload, sequence_number++);
+            break;
+        case READ:
+            ret = reader.readStripe(stripe_number, payload, options.hedge);
+            break;
+        case DEGRADED:
+            ret = degraded.readStripe(stripe_number, payload, 0);
+            break;
+        }
+        result.latency[op].record(monotonicNs() - start);
+        result.errors[op] += ret < 0;
+    }
+    result.cell_reads = reader.cellReads();
+    result.decoded_reads = reader.decodedReads();
+    free(payload);
+    free(blocks);
+    io_destroy(read_ctx);
+    io_destroy(degraded_ctx);
+    io_destroy(write_ctx);
+}
+
+void report(const Options& options, const std::vector<WorkerResult>& results, double elapsed) {
+    const uint64_t op_bytes[OPS] = {options.k * sizeof(Block::data), sizeof(Block::data), options.k * sizeof(Block::data),
+                                    options.k * sizeof(Block::data)};
+    printf("%-10s %10s %10s %9s %9s %9s %9s %9s %9s %8s\n", "op", "ops", "ops/s", "MB/s", "mean us", "p50 us", "p99 us",
+           "p99.9 us", "max us", "errors");
+    for (int op = 0; op < OPS; op++) {
+        HdrHistogram latency;
+        uint64_t errors = 0;
+        for (const WorkerResult& result : results) {
+            latency.merge(result.latency[op]);
+            errors += result.errors[op];
+        }
+        if (latency.samples() == 0) {
+            continue;
+        }
+        printf("%-10s %10llu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8llu\n", OP_NAMES[op],
+               (unsigned long long)latency.samples(), latency.samples() / elapsed, latency.samples() * op_bytes[op] / elapsed / 1e6,
+               latency.meanNs() / 1e3, latency.quantileNs(0.5) / 1e3, latency.quantileNs(0.99) / 1e3,
+               latency.quantileNs(0.999) / 1e3, latency.maxNs() / 1e3, (unsigned long long)errors);
+    }
+    uint64_t reads = 0, cell_reads = 0, decoded_reads = 0;
+    for (const WorkerResult& result : results) {
+        reads += result.latency[READ].samples();
+        cell_reads += result.cell_reads;
+        decoded_reads += result.decoded_reads;
+    }
+    if (reads > 0) {
+        printf("hedged reads: %.2f cells per stripe, %.1f%% decoded\n", double(cell_reads) / reads, 100.0 * decoded_reads / reads);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    const option long_options[] = {
+        {"mix", required_argument, nullptr, 'x'},  {"masked", required_argument, nullptr, 'M'},
+        {"hedge", required_argument, nullptr, 'h'}, {"format", no_argument, nullptr, 'f'},
+        {"direct", no_argument, nullptr, 'd'},     {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "k:m:q:t:s:", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'k': options.k = atoi(optarg); break;
+        case 'm': options.m = atoi(optarg); break;
+        case 'q': options.depth = atoi(optarg); break;
+        case 't': options.seconds = atof(optarg); break;
+        case 's': options.stripes = strtoull(optarg, nullptr, 0); break;
+        case 'x':
+            if (sscanf(optarg, "%d,%d,%d,%d", &options.weights[WRITE], &options.weights[OVERWRITE], &options.weights[READ],
+                       &options.weights[DEGRADED]) != OPS) {
+                return usage(argv[0]);
+            }
+            break;
+        case 'M': options.masked = atoi(optarg); break;
+        case 'h': options.hedge = atoi(optarg); break;
+        case 'f': options.format = true; break;
+        case 'd': options.direct = true; break;
+        default: return usage(argv[0]);
+        }
+    }
+    std::vector<const char*> paths(argv + optind, argv + argc);
+    int total_weight = 0;
+    for (int weight : options.weights) {
+        total_weight += weight;
+        if (weight < 0) {
+            return usage(argv[0]);
+        }
+    }
+    if (paths.empty() || options.k < 1 || options.m < 0 || options.depth < 1 || options.stripes < 1 || total_weight <= 0
+        || options.masked < 0 || options.masked >= int(paths.size())) {
+        return usage(argv[0]);
+    }
+
+    init_gf();
+    reed_solomon* rs = rs_new(options.k, options.m);
+    if (rs == nullptr) {
+        fprintf(stderr, "no code for k = %d, m = %d\n", options.k, options.m);
+        return 1;
+    }
+    VolumeMap map;
+    if (openVolumes(options, paths, map) != 0) {
+        return 1;
+    }
+
+    // The degraded reads see the map without its first masked volumes, volume 0 holds data shard 0
+    VolumeMap degraded_map;
+    degraded_map.volumes.assign(map.volumes.begin() + options.masked, map.volumes.end());
+    int surviving = 0;
+    for (int shard = 0; shard < options.k + options.m; shard++) {
+        surviving += findVolumeForShard(degraded_map, shard) >= 0;
+    }
+    if (options.weights[DEGRADED] > 0 && surviving < options.k) {
+        fprintf(stderr, "masking %d volumes leaves %d of the %d shards a read needs\n", options.masked, surviving, options.k);
+        return 1;
+    }
+
+    if (options.format) {
+        int ret = fill(options, map, rs);
+        if (ret != 0) {
+            fprintf(stderr, "fill failed: %s\n", strerror(-ret));
+            return 1;
+        }
+    }
+
+    std::atomic<bool> stop(false);
+    std::vector<WorkerResult> results(options.depth);
+    std::vector<std::thread> workers;
+    const uint64_t start = monotonicNs();
+    for (int w = 0; w < options.depth; w++) {
+        workers.emplace_back(worker, w, std::cref(options), std::cref(map), std::cref(degraded_map), rs, std::cref(stop),
+                             std::ref(results[w]));
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    const double elapsed = (monotonicNs() - start) * 1e-9;
+
+    printf("%zu volumes, k = %d, m = %d, queue depth %d, %d masked for degraded reads, %.1f s\n", map.volumes.size(), options.k,
+           options.m, options.depth, options.masked, elapsed);
+    report(options, results, elapsed);
+    int ret = 0;
+    for (const WorkerResult& result : results) {
+        if (result.error != 0) {
+            fprintf(stderr, "worker setup failed: %s\n", strerror(-result.error));
+            ret = 1;
+        }
+    }
+    for (const Volume& vol : map.volumes) {
+        close(vol.fd);
+    }
+    rs_free(rs);
+    return ret;
+}
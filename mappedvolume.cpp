@@ -0,0 +1,143 @@
+#include "mappedvolume.hpp"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedVolume::MappedVolume()
+    : base_(nullptr), length_(0), stripe_count_(0), cells_(0) {
+    std::memset(&header_, 0, sizeof(header_));
+}
+
+MappedVolume::~MappedVolume() {
+    close();
+}
+
+int MappedVolume::open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    int ret = open(fd);
+    ::close(fd);
+    return ret;
+}
+
+int MappedVolume::open(int fd) {
+    close();
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+    if (uint64_t(st.st_size) < sizeof(HeaderBlock)) {
+        return -EINVAL;
+    }
+
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -errno;
+    }
+    // Copied out so the header stays valid whatever happens to the file
+    std::memcpy(&header_, base, sizeof(HeaderBlock));
+    if (!validateHeader(header_)) {
+        munmap(base, st.st_size);
+        std::memset(&header_, 0, sizeof(header_));
+        return -EINVAL;
+    }
+
+    base_ = static_cast<unsigned char*>(base);
+    length_ = st.st_size;
+    cells_ = getKBlocksInStripe(header_);
+    stripe_count_ = length_ / (uint64_t(cells_) * sizeof(Block));
+    return 0;
+}
+
+void MappedVolume::close() {
+    if (base_ != nullptr) {
+        munmap(base_, length_);
+    }
+    base_ = nullptr;
+    length_ = 0;
+    stripe_count_ = 0;
+    cells_ = 0;
+}
+
+const Block* MappedVolume::stripe(uint64_t stripe_number) const {
+    if (stripe_number == 0 || stripe_number >= stripe_count_) {
+        return nullptr;
+    }
+    return reinterpret_cast<const Block*>(base_ + computeOffsetToBlock(header_, stripe_number, header_.shard_ids[0]));
+}
+
+const Block* MappedVolume::cell(uint64_t stripe_number, int shard_id) const {
+    const Block* cells = stripe(stripe_number);
+    if (cells == nullptr) {
+        return nullptr;
+    }
+    for (int i = 0; i < cells_; i++) {
+        if (header_.shard_ids[i] == shard_id) {
+            return cells + i;
+        }
+    }
+    return nullptr;
+}
+
+int MappedVolume::adviseSequential(bool sequential) {
+    if (base_ == nullptr) {
+        return -EBADF;
+    }
+    if (madvise(base_, length_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int MappedVolume::advise(uint64_t first_stripe, uint64_t count, int advice) const {
+    if (base_ == nullptr) {
+        return -EBADF;
+    }
+    if (first_stripe >= stripe_count_ || count == 0) {
+        return 0;
+    }
+    count = std::min(count, stripe_count_ - first_stripe);
+    // Stripes are whole pages, so the window is page aligned
+    const uint64_t stripe_bytes = uint64_t(cells_) * sizeof(Block);
+    if (madvise(base_ + computeOffsetToBlock(header_, first_stripe, header_.shard_ids[0]), count * stripe_bytes, advice) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int MappedVolume::prefetch(uint64_t first_stripe, uint64_t count) const {
+    return advise(first_stripe, count, MADV_WILLNEED);
+}
+
+int MappedVolume::release(uint64_t first_stripe, uint64_t count) const {
+    return advise(first_stripe, count, MADV_DONTNEED);
+}
+
+int mapStripeCells(const std::vector<const MappedVolume*>& volumes, uint64_t stripe_number, int total_shards,
+                   unsigned char* scratch, unsigned char** cells, int* erasures) {
+    int erased = 0;
+    for (int shard = 0; shard < total_shards; shard++) {
+        const Block* block = nullptr;
+        for (const MappedVolume* volume : volumes) {
+            block = volume->cell(stripe_number, shard);
+            if (block != nullptr) {
+                break;
+            }
+        }
+        if (block != nullptr && block->stripe_number == ((stripe_number << 8) | uint8_t(shard)) && validateBlock(*block)) {
+            cells[shard] = const_cast<unsigned char*>(block->data.data());
+            erasures[shard] = 0;
+        } else {
+            cells[shard] = scratch + size_t(shard) * sizeof(Block::data);
+            erasures[shard] = 1;
+            erased++;
+        }
+    }
+    return erased;
+}
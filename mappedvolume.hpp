@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Read-only memory-mapped access to a volume.  The HeaderBlock is read from the start of the file and
+ * validated once on open, after that a stripe is a pointer into the mapping: no read syscalls, no
+ * copies, and validateBlock() and the decoder run straight over the page cache.  The mapping is
+ * MAP_SHARED, so it sees writes made through the fd, but it can't be written through.
+ *
+ * Stripes are where computeOffsetToBlock() puts them, so stripe 0 is the header stripe and holds no cells.
+ */
+class MappedVolume {
+public:
+    MappedVolume();
+    ~MappedVolume();
+    MappedVolume(const MappedVolume&) = delete;
+    MappedVolume& operator=(const MappedVolume&) = delete;
+
+    /**
+     * Maps a volume file.
+     * @param path The volume file.
+     * @return Returns 0, -EINVAL if the header is invalid, or a negative error code.
+     */
+    int open(const char* path);
+
+    /**
+     * Maps an open volume, the fd stays owned by the caller and can be closed once this returns.
+     * @param fd The file descriptor, open for reading.
+     * @return Returns 0, -EINVAL if the header is invalid, or a negative error code.
+     */
+    int open(int fd);
+
+    /**
+     * Unmaps the volume, pointers from cell() and stripe() are invalid after this.
+     */
+    void close();
+
+    bool isOpen() const { return base_ != nullptr; }
+    const HeaderBlock& header() const { return header_; }
+    int cellsPerStripe() const { return cells_; }
+
+    /**
+     * @return Returns the number of whole stripes in the file when it was mapped, counting the header stripe.
+     */
+    uint64_t stripeCount() const { return stripe_count_; }
+
+    /**
+     * @param stripe_number The stripe number.
+     * @return Returns the volume's cells of the stripe, cellsPerStripe() blocks in shard_ids order,
+     *         or nullptr for the header stripe or past the end of the volume.
+     */
+    const Block* stripe(uint64_t stripe_number) const;
+
+    /**
+     * @param stripe_number The stripe number.
+     * @param shard_id The shard.
+     * @return Returns the cell, or nullptr if the volume doesn't hold the shard, or for the header stripe or
+     *         past the end.
+     *         The cell isn't validated.
+     */
+    const Block* cell(uint64_t stripe_number, int shard_id) const;
+
+    /**
+     * Tells the kernel how the mapping will be read, MADV_SEQUENTIAL for scans (aggressive readahead,
+     * pages dropped soon after use) or MADV_RANDOM for point reads (no readahead).
+     * @param sequential Whether the reads are sequential.
+     * @return Returns 0, or a negative error code.
+     */
+    int adviseSequential(bool sequential);
+
+    /**
+     * Starts reading stripes into the page cache with MADV_WILLNEED, without waiting.  A scan prefetches
+     * the next window while it works on the current one, so it rarely faults on a cold page.
+     * @param first_stripe The first stripe of the window.
+     * @param count The number of stripes, clipped to the end of the volume.
+     * @return Returns 0, or a negative error code.
+     */
+    int prefetch(uint64_t first_stripe, uint64_t count) const;
+
+    /**
+     * Drops stripes from the mapping with MADV_DONTNEED once a scan is past them.  The file is
+     * unchanged and later reads fault the pages back in.
+     * @param first_stripe The first stripe of the window.
+     * @param count The number of stripes, clipped to the end of the volume.
+     * @return Returns 0, or a negative error code.
+     */
+    int release(uint64_t first_stripe, uint64_t count) const;
+
+private:
+    int advise(uint64_t first_stripe, uint64_t count, int advice) const;
+
+    unsigned char* base_;
+    size_t length_;
+    uint64_t stripe_count_;
+    int cells_;
+    HeaderBlock header_;
+};
+
+/**
+ * Points cells at a stripe's cell data in the mappings, for readStripeRange() or rs_decode() without
+ * copying.  A cell is erased if no volume holds it, or it fails validateBlock() or carries another
+ * stripe or shard number.  Erased cells point into scratch instead, so the decoder has somewhere to
+ * write: mapped cells are only ever read, even though the decoder takes non-const pointers.
+ * @param volumes The mapped volumes of the stripe.
+ * @param stripe_number The stripe number.
+ * @param total_shards k + m.
+ * @param scratch total_shards * 4080 writable bytes.
+ * @param cells Receives total_shards cell pointers.
+ * @param erasures Receives total_shards flags, non-zero marks an erased cell.
+ * @return Returns the number of erased cells.
+ */
+int mapStripeCells(const std::vector<const MappedVolume*>& volumes, uint64_t stripe_number, int total_shards,
+                   unsigned char* scratch, unsigned char** cells, int* erasures);
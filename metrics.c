@@ -0,0 +1,70 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread kelp_metrics_slab* kelp_metrics_local = NULL;
+
+// Every slab ever registered, pushed with a compare and swap so readers can walk it at any time
+static kelp_metrics_slab* slabs = NULL;
+
+// Threads that couldn't allocate a slab share this one, and may lose counts to each other
+static kelp_metrics_slab fallback_slab;
+
+static const char* const metric_names[KELP_METRIC_COUNT] = {
+    "kelp_rs_encoded_bytes_total",
+    "kelp_rs_decoded_bytes_total",
+    "kelp_rs_decode_failures_total",
+    "kelp_rs_decode_cache_hits_total",
+    "kelp_rs_decode_cache_misses_total",
+    "kelp_crc_failures_total",
+    "kelp_io_submitted_total",
+    "kelp_io_completed_total",
+    "kelp_io_depth_samples_total",
+    "kelp_io_depth_sum_total",
+    "kelp_net_blocks_sent_total",
+    "kelp_net_blocks_received_total",
+};
+
+kelp_metrics_slab* kelp_metrics_register(void) {
+    kelp_metrics_slab* slab = NULL;
+    if (posix_memalign((void**)&slab, 64, sizeof(kelp_metrics_slab)) != 0) {
+        kelp_metrics_local = &fallback_slab;
+        return &fallback_slab;
+    }
+    memset(slab, 0, sizeof(*slab));
+    slab->next = __atomic_load_n(&slabs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slabs, &slab->next, slab, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    kelp_metrics_local = slab;
+    return slab;
+}
+
+uint64_t kelp_metric_read(kelp_metric metric) {
+    uint64_t total = __atomic_load_n(&fallback_slab.counters[metric], __ATOMIC_RELAXED);
+    for (kelp_metrics_slab* slab = __atomic_load_n(&slabs, __ATOMIC_ACQUIRE); NULL != slab; slab = slab->next) {
+        total += __atomic_load_n(&slab->counters[metric], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+const char* kelp_metric_name(kelp_metric metric) {
+    return metric_names[metric];
+}
+
+size_t kelp_metrics_prometheus(char* buf, size_t size) {
+    size_t length = 0;
+    uint64_t values[KELP_METRIC_COUNT];
+    for (int i = 0; i < KELP_METRIC_COUNT; i++) {
+        values[i] = kelp_metric_read((kelp_metric)i);
+    }
+    for (int i = 0; i < KELP_METRIC_COUNT; i++) {
+        length += snprintf(length < size ? buf + length : NULL, length < size ? size - length : 0,
+                           "# TYPE %s counter\n%s %llu\n", metric_names[i], metric_names[i], (unsigned long long)values[i]);
+    }
+    // Submits are read again after the completions, every completion counted has its submit counted
+    uint64_t in_flight = kelp_metric_read(KELP_METRIC_IO_SUBMITTED) - values[KELP_METRIC_IO_COMPLETED];
+    length += snprintf(length < size ? buf + length : NULL, length < size ? size - length : 0,
+                       "# TYPE kelp_io_in_flight gauge\nkelp_io_in_flight %llu\n", (unsigned long long)in_flight);
+    return length;
+}
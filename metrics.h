@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hot path counters
+// Each thread counts into its own slab of cache line aligned counters, so counting is a thread local
+// load and an add with no shared cache lines, and a reader sums the slabs of every thread that ever
+// counted without taking a lock.  Slabs are never freed, so a thread's counts outlive it.
+// Build with -DKELP_NO_METRICS to compile the counting out.
+typedef enum {
+    KELP_METRIC_RS_ENCODED_BYTES,     // data bytes into rs_encode
+    KELP_METRIC_RS_DECODED_BYTES,     // bytes rs_decode_range reconstructed
+    KELP_METRIC_RS_DECODE_FAILURES,   // too many erasures, or a submatrix that isn't invertible
+    KELP_METRIC_DECODE_CACHE_HITS,
+    KELP_METRIC_DECODE_CACHE_MISSES,
+    KELP_METRIC_CRC_FAILURES,         // cells failing validateBlock or validateBlocks
+    KELP_METRIC_IO_SUBMITTED,         // requests the kernel took
+    KELP_METRIC_IO_COMPLETED,         // completions reaped
+    KELP_METRIC_IO_DEPTH_SAMPLES,     // reaps that knew their queue depth
+    KELP_METRIC_IO_DEPTH_SUM,         // requests in flight at those reaps, over the samples is the mean depth
+    KELP_METRIC_NET_BLOCKS_SENT,      // cells sent by ShardSender
+    KELP_METRIC_NET_BLOCKS_RECEIVED,  // cells in whole messages ShardReceiver took
+    KELP_METRIC_COUNT
+} kelp_metric;
+
+typedef struct kelp_metrics_slab {
+    uint64_t counters[KELP_METRIC_COUNT];
+    struct kelp_metrics_slab* next;
+} __attribute__((aligned(64))) kelp_metrics_slab;
+
+extern __thread kelp_metrics_slab* kelp_metrics_local;
+
+// Sets up the calling thread's slab, done by the first count on each thread
+kelp_metrics_slab* kelp_metrics_register(void);
+
+static inline void kelp_metric_add(kelp_metric metric, uint64_t value) {
+#ifndef KELP_NO_METRICS
+    kelp_metrics_slab* slab = kelp_metrics_local;
+    if (__builtin_expect(NULL == slab, 0)) {
+        slab = kelp_metrics_register();
+    }
+    // Only this thread writes the slab, relaxed so readers see whole values, it compiles to a plain add
+    uint64_t* counter = &slab->counters[metric];
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+#else
+    (void)metric;
+    (void)value;
+#endif
+}
+
+// The sum over every thread's slab
+uint64_t kelp_metric_read(kelp_metric metric);
+
+// The Prometheus name, e.g. "kelp_rs_encoded_bytes_total"
+const char* kelp_metric_name(kelp_metric metric);
+
+// Writes every counter, and the kelp_io_in_flight gauge (submitted - completed), in the Prometheus text
+// exposition format.  Returns the length of the whole text like snprintf, it is truncated if that is
+// size or more
+size_t kelp_metrics_prometheus(char* buf, size_t size);
+
+// Tracepoints
+// With -DKELP_USDT these are USDT probes in the kelp provider, free until perf, bpftrace or SystemTap
+// attaches to them, e.g. bpftrace -e 'usdt:./test-blockaio:kelp:io_complete { @[arg1] = count(); }'.
+// io_submit and io_complete pass the io_context_t, or the IoPool for pool I/O, and the number of requests.
+#ifdef KELP_USDT
+#include <sys/sdt.h>
+#define KELP_TRACE2(name, a, b) DTRACE_PROBE2(kelp, name, a, b)
+#else
+#define KELP_TRACE2(name, a, b) do { } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,359 @@
+#include "reactor.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// How long an idle reactor waits in io_getevents before looking for new writes again, which bounds
+// how long cells handed over while its writes are in flight wait for their io_submit
+constexpr long REACTOR_WAIT_NS = 200000;
+
+struct StripeRuntime::Job {
+    enum Kind { STRIPE, TASK };
+    Kind kind;
+    const void* payload;
+    uint64_t stripe_number;
+    uint32_t sequence_number;
+    int (*fn)(void*);
+    void* arg;
+    uint64_t user_tag;
+    Block* blocks;  // k + m cells, page aligned
+    std::atomic<int> pending;  // volume writes still outstanding
+    std::atomic<int> result;
+};
+
+// Jobs queued on a worker, the owner takes the newest and thieves take the oldest
+struct StripeRuntime::Worker {
+    explicit Worker(size_t capacity) : jobs(capacity), done(capacity) {}
+
+    std::mutex lock;
+    std::vector<Job*> jobs;
+    size_t head = 0;
+    size_t tail = 0;
+    std::vector<SpscQueue<Job*>*> to_reactor;  // one per reactor
+    SpscQueue<Job*> done;                      // finished tasks back to the submitter
+    std::thread thread;
+};
+
+struct StripeRuntime::Reactor {
+    Reactor(const Volume& vol, io_context_t io_ctx, int capacity)
+        : volume(vol), io_ctx(io_ctx), batch(io_ctx, capacity), done(capacity), queued(capacity), events(capacity) {}
+
+    const Volume& volume;
+    io_context_t io_ctx;
+    IoBatch batch;
+    std::vector<SpscQueue<Job*>*> from_worker;  // owned by the workers
+    SpscQueue<Job*> done;                       // finished stripes back to the submitter
+    std::vector<Job*> queued;                   // jobs queued on the batch, in batch order
+    int queued_count = 0;
+    std::vector<IoCompletion> events;
+    std::thread thread;
+    // Where the reactor sleeps with no writes, workers wake it after handing cells over
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping{false};
+};
+
+static void pinThread(std::thread& thread, int index) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+StripeRuntime::StripeRuntime(const VolumeMap& map, reed_solomon* rs, int workers, int max_jobs, bool pin)
+    : map_(map), rs_(rs), error_(0), running_(true), reactors_running_(true), queued_jobs_(0), idle_workers_(0),
+      jobs_(nullptr), blocks_(nullptr), in_flight_(0), next_worker_(0) {
+    const int n = rs->data_shards + rs->parity_shards;
+    jobs_ = new Job[max_jobs];
+    blocks_ = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * n * max_jobs);
+    for (int i = max_jobs - 1; i >= 0; i--) {
+        jobs_[i].blocks = blocks_ + size_t(i) * n;
+        free_jobs_.push_back(&jobs_[i]);
+    }
+
+    for (const Volume& vol : map.volumes) {
+        io_context_t io_ctx = 0;
+        int ret = io_setup(max_jobs, &io_ctx);
+        if (ret != 0) {
+            error_ = ret < 0 ? ret : -EIO;
+            return;
+        }
+        reactors_.push_back(new Reactor(vol, io_ctx, max_jobs));
+    }
+    for (int w = 0; w < workers; w++) {
+        Worker* worker = new Worker(max_jobs);
+        for (Reactor* reactor : reactors_) {
+            worker->to_reactor.push_back(new SpscQueue<Job*>(max_jobs));
+            reactor->from_worker.push_back(worker->to_reactor.back());
+        }
+        workers_.push_back(worker);
+    }
+
+    int cpu = 0;
+    for (size_t r = 0; r < reactors_.size(); r++) {
+        reactors_[r]->thread = std::thread(&StripeRuntime::reactorLoop, this, r);
+        if (pin) {
+            pinThread(reactors_[r]->thread, cpu++);
+        }
+    }
+    for (size_t w = 0; w < workers_.size(); w++) {
+        workers_[w]->thread = std::thread(&StripeRuntime::workerLoop, this, w);
+        if (pin) {
+            pinThread(workers_[w]->thread, cpu++);
+        }
+    }
+}
+
+StripeRuntime::~StripeRuntime() {
+    // Workers empty their queues before they stop, then the reactors write what they were handed
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        running_.store(false, std::memory_order_release);
+    }
+    idle_.notify_all();
+    for (Worker* worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    reactors_running_.store(false, std::memory_order_release);
+    for (Reactor* reactor : reactors_) {
+        {
+            std::lock_guard<std::mutex> guard(reactor->lock);
+        }
+        reactor->wake.notify_one();
+        if (reactor->thread.joinable()) {
+            reactor->thread.join();
+        }
+        io_destroy(reactor->io_ctx);
+        delete reactor;
+    }
+    for (Worker* worker : workers_) {
+        for (SpscQueue<Job*>* queue : worker->to_reactor) {
+            delete queue;
+        }
+        delete worker;
+    }
+    free(blocks_);
+    delete[] jobs_;
+}
+
+bool StripeRuntime::submitJob(Job* job) {
+    // Round robin onto the workers, idle workers steal the rest
+    Worker* worker = workers_[next_worker_++ % workers_.size()];
+    {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        worker->jobs[worker->tail++ % worker->jobs.size()] = job;
+        queued_jobs_.fetch_add(1);
+    }
+    // Both sides are seq_cst, so either a worker going idle sees the job or we see it waiting
+    if (idle_workers_.load() > 0) {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock_);
+        }
+        idle_.notify_one();
+    }
+    return true;
+}
+
+bool StripeRuntime::submitStripe(const void* payload, uint64_t stripe_number, uint32_t sequence_number, uint64_t user_tag) {
+    if (error_ != 0 || free_jobs_.empty() || reactors_.empty() || workers_.empty()) {
+        return false;
+    }
+    Job* job = free_jobs_.back();
+    free_jobs_.pop_back();
+    job->kind = Job::STRIPE;
+    job->payload = payload;
+    job->stripe_number = stripe_number;
+    job->sequence_number = sequence_number;
+    job->user_tag = user_tag;
+    job->pending.store(reactors_.size(), std::memory_order_relaxed);
+    job->result.store(0, std::memory_order_relaxed);
+    in_flight_++;
+    return submitJob(job);
+}
+
+bool StripeRuntime::submitTask(int (*fn)(void*), void* arg, uint64_t user_tag) {
+    if (error_ != 0 || free_jobs_.empty() || workers_.empty()) {
+        return false;
+    }
+    Job* job = free_jobs_.back();
+    free_jobs_.pop_back();
+    job->kind = Job::TASK;
+    job->fn = fn;
+    job->arg = arg;
+    job->user_tag = user_tag;
+    job->result.store(0, std::memory_order_relaxed);
+    in_flight_++;
+    return submitJob(job);
+}
+
+int StripeRuntime::poll(JobCompletion* out, int max) {
+    int count = 0;
+    Job* job;
+    auto collect = [&](SpscQueue<Job*>& done) {
+        while (count < max && done.tryPop(job)) {
+            out[count].user_tag = job->user_tag;
+            out[count].result = job->result.load(std::memory_order_relaxed);
+            count++;
+            free_jobs_.push_back(job);
+            in_flight_--;
+        }
+    };
+    for (Reactor* reactor : reactors_) {
+        collect(reactor->done);
+    }
+    for (Worker* worker : workers_) {
+        collect(worker->done);
+    }
+    return count;
+}
+
+StripeRuntime::Job* StripeRuntime::popJob(int index) {
+    // The newest of our own, else steal the oldest of someone else's
+    for (size_t i = 0; i < workers_.size(); i++) {
+        Worker* worker = workers_[(index + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(worker->lock);
+        if (worker->head != worker->tail) {
+            queued_jobs_.fetch_sub(1);
+            return i == 0 ? worker->jobs[--worker->tail % worker->jobs.size()] : worker->jobs[worker->head++ % worker->jobs.size()];
+        }
+    }
+    return nullptr;
+}
+
+void StripeRuntime::wakeReactor(Reactor* reactor) {
+    // Pairs with the fence in reactorLoop, either it sees the cells or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (reactor->sleeping.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> guard(reactor->lock);
+        }
+        reactor->wake.notify_one();
+    }
+}
+
+void StripeRuntime::workerLoop(int index) {
+    Worker* self = workers_[index];
+    for (;;) {
+        Job* job = popJob(index);
+        if (job == nullptr) {
+            std::unique_lock<std::mutex> guard(idle_lock_);
+            if (!running_.load(std::memory_order_acquire) && queued_jobs_.load() == 0) {
+                break;
+            }
+            idle_workers_.fetch_add(1);
+            idle_.wait(guard, [&] { return queued_jobs_.load() > 0 || !running_.load(std::memory_order_acquire); });
+            idle_workers_.fetch_sub(1);
+            continue;
+        }
+
+        if (job->kind == Job::TASK) {
+            job->result.store(job->fn(job->arg), std::memory_order_relaxed);
+            // The queue holds max_jobs, so there's always room
+            self->done.tryPush(job);
+            continue;
+        }
+        buildStripe(rs_, job->payload, job->stripe_number, job->sequence_number, job->blocks);
+        for (size_t r = 0; r < self->to_reactor.size(); r++) {
+            self->to_reactor[r]->tryPush(job);
+            wakeReactor(reactors_[r]);
+        }
+    }
+}
+
+void StripeRuntime::reactorLoop(int index) {
+    Reactor* self = reactors_[index];
+    const HeaderBlock& header = self->volume.header;
+    const int n = rs_->data_shards + rs_->parity_shards;
+    const int cells = getKBlocksInStripe(header);
+    struct iovec iov[IoBatch::MAX_IOVECS];
+    bool valid = true;
+    for (int i = 0; i < cells; i++) {
+        valid = valid && (header.shard_ids[i] < n || isDroppedShard(header.shard_ids[i]));
+    }
+
+    // A job completes when the last volume's write finishes, with the first error seen
+    auto finish = [&](Job* job, int result) {
+        if (result != 0) {
+            int expected = 0;
+            job->result.compare_exchange_strong(expected, result);
+        }
+        if (job->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            self->done.tryPush(job);
+        }
+    };
+
+    auto handedOver = [&]() {
+        for (SpscQueue<Job*>* queue : self->from_worker) {
+            if (!queue->empty()) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    while (reactors_running_.load(std::memory_order_acquire) || self->batch.inFlight() > 0 || self->queued_count > 0
+           || handedOver()) {
+        bool progress = false;
+        Job* job;
+        for (SpscQueue<Job*>* queue : self->from_worker) {
+            while (queue->tryPop(job)) {
+                progress = true;
+                if (!valid) {
+                    finish(job, -EINVAL);
+                    continue;
+                }
+                // The volume's cells of this stripe are contiguous, in shard_ids order
+                for (int i = 0; i < cells; i++) {
+                    const int shard = header.shard_ids[i];
+                    iov[i].iov_base = const_cast<Block*>(isDroppedShard(shard) ? droppedCell() : &job->blocks[shard]);
+                    iov[i].iov_len = sizeof(Block);
+                }
+                self->batch.queueWritev(self->volume.fd, computeOffsetToBlock(header, job->stripe_number, header.shard_ids[0]),
+                                        iov, cells, reinterpret_cast<uintptr_t>(job));
+                self->queued[self->queued_count++] = job;
+            }
+        }
+
+        // One io_submit for everything the workers handed over, what the kernel doesn't take
+        // waits for the next round
+        if (self->queued_count > 0) {
+            int ret = self->batch.flush();
+            if (ret > 0) {
+                std::copy(self->queued.begin() + ret, self->queued.begin() + self->queued_count, self->queued.begin());
+                self->queued_count -= ret;
+            } else if (ret < 0 && ret != -EAGAIN) {
+                for (int i = 0; i < self->queued_count; i++) {
+                    finish(self->queued[i], ret);
+                }
+                self->batch.clear();
+                self->queued_count = 0;
+            }
+        }
+
+        // Nothing new came in, so wait for a write to complete, or with none in flight for cells
+        int completed = 0;
+        if (progress || (self->queued_count > 0 && self->batch.inFlight() == 0)) {
+            completed = self->batch.reap(self->events.data(), self->events.size());
+        } else if (self->batch.inFlight() > 0) {
+            const struct timespec wait = {0, REACTOR_WAIT_NS};
+            completed = self->batch.reap(self->events.data(), self->events.size(), 1, &wait);
+        } else {
+            std::unique_lock<std::mutex> guard(self->lock);
+            self->sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            self->wake.wait(guard, [&] { return handedOver() || !reactors_running_.load(std::memory_order_acquire); });
+            self->sleeping.store(false, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < completed; i++) {
+            long expected = long(cells) * sizeof(Block);
+            long result = self->events[i].result;
+            finish(reinterpret_cast<Job*>(self->events[i].user_tag), result == expected ? 0 : result < 0 ? int(result) : -EIO);
+        }
+    }
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "blockaio.hpp"
+
+constexpr size_t CACHE_LINE = 64;
+
+/**
+ * Bounded lock-free single producer single consumer queue.
+ * The capacity is rounded up to a power of two.  Each side caches the other side's index,
+ * so a push or pop only touches the shared cache line when the cached index runs out.
+ */
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        items_.resize(size);
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /**
+     * Called by the producer.
+     * @return Returns false if the queue is full.
+     */
+    bool tryPush(const T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) {
+                return false;
+            }
+        }
+        items_[tail & mask_] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Called by the consumer.
+     * @return Returns false if the queue is empty.
+     */
+    bool tryPop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return false;
+            }
+        }
+        item = items_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Called by the consumer.
+     */
+    bool empty() const {
+        return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    std::vector<T> items_;
+    size_t mask_;
+    alignas(CACHE_LINE) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;  // consumer's copy of tail_
+    alignas(CACHE_LINE) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;  // producer's copy of head_
+};
+
+/**
+ * A finished job: the tag it was submitted with, and 0 or a negative error code.
+ */
+struct JobCompletion {
+    uint64_t user_tag;
+    int result;
+};
+
+/**
+ * Stripe I/O runtime: one I/O reactor thread per volume (drive), pinned to a core, owning the
+ * volume's fd and its own io_context_t, and a pool of encoder workers that pull stripe builds
+ * and other CPU work (decodes) from per-worker queues, stealing from each other when idle.
+ *
+ * A stripe goes submitStripe -> a worker runs buildStripe and hands each volume's cells to that
+ * volume's reactor over an SPSC queue (one per worker and reactor) -> the reactor batches them into
+ * one io_submit per loop -> the reactor completing the last volume write hands the completion back
+ * over its SPSC queue to the submitting thread, which collects them with poll().
+ *
+ * Idle threads sleep: workers on a condition variable until a job is submitted, reactors in
+ * io_getevents while their writes are in flight and on a condition variable when they have none.
+ *
+ * submitStripe, submitTask and poll must all be called from one thread.  init_gf() must have been
+ * called before the runtime starts, the GF tables are only read afterwards.
+ */
+class StripeRuntime {
+public:
+    /**
+     * Starts the reactor and worker threads.  If a reactor's io_context_t can't be set up no threads
+     * are started, error() says why and every submit fails.
+     * @param map The volumes, stripes are written to every shard's volume.  Must outlive the runtime.
+     * @param rs The Reed-Solomon codec.  Must outlive the runtime.
+     * @param workers The number of encoder workers.
+     * @param max_jobs The most stripes and tasks in flight.
+     * @param pin Pin reactors and workers to cores (reactors first).
+     */
+    StripeRuntime(const VolumeMap& map, reed_solomon* rs, int workers, int max_jobs, bool pin = true);
+
+    /**
+     * Finishes the stripes and tasks already submitted, then stops the threads.  Their completions are
+     * dropped, so payloads only need to outlive the runtime.
+     */
+    ~StripeRuntime();
+    StripeRuntime(const StripeRuntime&) = delete;
+    StripeRuntime& operator=(const StripeRuntime&) = delete;
+
+    /**
+     * Queues a stripe build and write.
+     * @param payload The k * 4080 byte payload, must stay valid until the stripe completes.
+     * @param stripe_number The stripe number.
+     * @param sequence_number The block sequence number.
+     * @param user_tag The tag returned by poll().
+     * @return Returns false if max_jobs are already in flight.
+     */
+    bool submitStripe(const void* payload, uint64_t stripe_number, uint32_t sequence_number, uint64_t user_tag);
+
+    /**
+     * Queues CPU work, e.g. a decode, on the encoder workers.
+     * @param fn The work, its return value is the completion result.
+     * @param arg The argument passed to fn.
+     * @param user_tag The tag returned by poll().
+     * @return Returns false if max_jobs are already in flight.
+     */
+    bool submitTask(int (*fn)(void*), void* arg, uint64_t user_tag);
+
+    /**
+     * Collects finished stripes and tasks without blocking.
+     * @param out Receives up to max completions.
+     * @param max The size of out.
+     * @return Returns the number of completions.
+     */
+    int poll(JobCompletion* out, int max);
+
+    int inFlight() const { return in_flight_; }
+
+    /**
+     * @return Returns 0, or the negative error code io_setup failed with.
+     */
+    int error() const { return error_; }
+
+private:
+    struct Job;
+    struct Worker;
+    struct Reactor;
+
+    void workerLoop(int index);
+    void reactorLoop(int index);
+    bool submitJob(Job* job);
+    Job* popJob(int index);
+    void wakeReactor(Reactor* reactor);
+
+    const VolumeMap& map_;
+    reed_solomon* rs_;
+    int error_;
+    std::atomic<bool> running_;           // workers take new jobs, cleared first on shutdown
+    std::atomic<bool> reactors_running_;  // cleared once the workers have handed everything over
+    // Jobs in the workers' queues, and the workers waiting for one
+    std::atomic<int> queued_jobs_;
+    std::atomic<int> idle_workers_;
+    std::mutex idle_lock_;
+    std::condition_variable idle_;
+    std::vector<Job*> free_jobs_;
+    Job* jobs_;
+    Block* blocks_;
+    int in_flight_;
+    unsigned next_worker_;
+    std::vector<Worker*> workers_;
+    std::vector<Reactor*> reactors_;
+};
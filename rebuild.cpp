@@ -0,0 +1,395 @@
+#include "rebuild.hpp"
+#include "latency.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// Tags of spare writes, reads are tagged with their slot and volume
+const uint64_t WRITE_TAG = uint64_t(1) << 32;
+
+}  // namespace
+
+Rebuilder::Rebuilder(VolumeMap& map, int failed, const std::vector<Volume>& spares, reed_solomon* rs, io_context_t io_ctx,
+                     const RebuildConfig& config)
+    : map_(map), failed_(failed), spares_(spares), rs_(rs), config_(config),
+      batch_(io_ctx, std::max(config.depth, 1) * int(map.volumes.size() + spares.size())), scratch_(nullptr),
+      end_(0), error_(0), done_(0), read_bytes_(0), total_(0), start_ns_(0) {
+    std::memset(&stats_, 0, sizeof(stats_));
+    config_.depth = std::max(config_.depth, 1);
+    config_.batch_stripes = std::max(config_.batch_stripes, 1);
+    events_.resize(config_.depth * (map.volumes.size() + spares.size()));
+    const int n = rs->data_shards + rs->parity_shards;
+    read_.resize(n);
+    read_shard_.resize(n);
+    shards_.resize(n);
+    erasures_.resize(n);
+    wanted_.assign(n, 0);
+    valid_.reset(new bool[n]);
+    scratch_ = allocAligned<unsigned char>(64, sizeof(Block::data));
+}
+
+Rebuilder::~Rebuilder() {
+    for (Slot& slot : slots_) {
+        for (Block* cells : slot.cells) {
+            free(cells);
+        }
+    }
+    free(scratch_);
+}
+
+int Rebuilder::setup() {
+    const int n = rs_->data_shards + rs_->parity_shards;
+    const size_t drives = map_.volumes.size() + spares_.size();
+    if (failed_ < 0 || size_t(failed_) >= map_.volumes.size()) {
+        return -EINVAL;
+    }
+    shard_drive_.assign(n, -1);
+    shard_slot_.assign(n, 0);
+    cells_.clear();
+    budgets_.clear();
+    survivors_.clear();
+    lost_.clear();
+
+    // Drives are the volumes of the map, then the spares
+    for (size_t d = 0; d < drives; d++) {
+        const bool spare = d >= map_.volumes.size();
+        const HeaderBlock& header = spare ? spares_[d - map_.volumes.size()].header : map_.volumes[d].header;
+        cells_.push_back(getKBlocksInStripe(header));
+        budgets_.emplace_back(config_.bytes_per_sec, config_.burst_bytes);
+        bool holds = false;
+        for (int i = 0; i < cells_[d]; i++) {
+            const int shard = header.shard_ids[i];
+            if (isDroppedShard(shard)) {
+                continue;
+            }
+            if (shard >= n) {
+                return -EINVAL;
+            }
+            if (int(d) == failed_) {
+                lost_.push_back(shard);
+            } else if (spare) {
+                // Each lost shard goes to one spare, the failed volume is before the spares
+                if (std::find(lost_.begin(), lost_.end(), shard) == lost_.end() || shard_drive_[shard] >= int(map_.volumes.size())) {
+                    return -EINVAL;
+                }
+                shard_drive_[shard] = d;
+                shard_slot_[shard] = i;
+            } else if (shard_drive_[shard] < 0) {
+                shard_drive_[shard] = d;
+                shard_slot_[shard] = i;
+                holds = true;
+            }
+        }
+        if (holds) {
+            survivors_.push_back(d);
+        }
+    }
+    for (int shard : lost_) {
+        if (shard_drive_[shard] < int(map_.volumes.size())) {
+            return -EINVAL;
+        }
+        wanted_[shard] = 1;
+    }
+    if (survivors_.empty()) {
+        return -EINVAL;
+    }
+
+    end_ = config_.first_stripe + config_.stripe_count;
+    if (config_.stripe_count == 0) {
+        // The longest survivor sets the stripe count, shorter ones are missing their last cells
+        end_ = 0;
+        for (int d : survivors_) {
+            struct stat st;
+            if (fstat(map_.volumes[d].fd, &st) == 0) {
+                end_ = std::max(end_, uint64_t(st.st_size) / (cells_[d] * sizeof(Block)));
+            }
+        }
+    }
+
+    slots_.assign(config_.depth, Slot());
+    for (Slot& slot : slots_) {
+        slot.cells.assign(drives, nullptr);
+        slot.got.assign(drives, -1);
+        slot.reads = 0;
+        slot.writes = 0;
+        slot.busy = false;
+        for (size_t d = 0; d < drives; d++) {
+            if (int(d) != failed_ && posix_memalign(reinterpret_cast<void**>(&slot.cells[d]), PAGE_SIZE,
+                                                    size_t(config_.batch_stripes) * cells_[d] * sizeof(Block)) != 0) {
+                slot.cells[d] = nullptr;
+                return -ENOMEM;
+            }
+        }
+    }
+    return 0;
+}
+
+void Rebuilder::throttle(size_t drive, double bytes) {
+    uint64_t now = monotonicNs();
+    uint64_t wait = budgets_[drive].delayNs(bytes, now);
+    if (wait > 0) {
+        // In flight I/O carries on while the pipeline waits
+        stats_.throttled++;
+        struct timespec ts = {time_t(wait / 1000000000), long(wait % 1000000000)};
+        nanosleep(&ts, nullptr);
+        now = monotonicNs();
+    }
+    budgets_[drive].consume(bytes, now);
+}
+
+int Rebuilder::submitReads(Slot& slot, uint64_t first, size_t count, uint64_t batch) {
+    const size_t index = &slot - slots_.data();
+    slot.first = first;
+    slot.count = count;
+    slot.busy = true;
+    std::fill(slot.got.begin(), slot.got.end(), -1);
+
+    // Enough survivors for k shards, a different first one each batch
+    int shards = 0;
+    for (size_t i = 0; i < survivors_.size() && shards < rs_->data_shards; i++) {
+        const int d = survivors_[(batch + i) % survivors_.size()];
+        const Volume& vol = map_.volumes[d];
+        const size_t bytes = count * cells_[d] * sizeof(Block);
+        for (int c = 0; c < cells_[d]; c++) {
+            shards += !isDroppedShard(vol.header.shard_ids[c]);
+        }
+        throttle(d, bytes);
+        if (!batch_.queueRead(vol.fd, computeOffsetToBlock(vol.header, first, vol.header.shard_ids[0]), slot.cells[d], bytes, (index << 16) | d)) {
+            return -EAGAIN;
+        }
+        slot.got[d] = 0;
+        slot.reads++;
+    }
+    int ret = batch_.flush();
+    return ret < 0 ? ret : 0;
+}
+
+int Rebuilder::reap(bool wait) {
+    int completed = batch_.reap(events_.data(), events_.size(), wait ? 1 : 0);
+    if (completed < 0) {
+        return completed;
+    }
+    for (int i = 0; i < completed; i++) {
+        const IoCompletion& c = events_[i];
+        if (c.user_tag & WRITE_TAG) {
+            Slot& slot = slots_[c.user_tag & (WRITE_TAG - 1)];
+            if (c.result <= 0 || c.result % sizeof(Block) != 0) {
+                error_ = error_ != 0 ? error_ : (c.result < 0 ? int(c.result) : -EIO);
+            }
+            if (--slot.writes == 0) {
+                slot.busy = false;
+            }
+        } else {
+            // A survivor that fails a read is one more erasure, not the end of the rebuild
+            Slot& slot = slots_[c.user_tag >> 16];
+            const size_t d = c.user_tag & 0xffff;
+            slot.got[d] = std::max<long>(c.result, 0);
+            slot.reads--;
+            stats_.bytes_read += slot.got[d];
+            read_bytes_ += slot.got[d];
+        }
+    }
+    return completed;
+}
+
+void Rebuilder::rebuildStripe(Slot& slot, size_t j) {
+    const int k = rs_->data_shards;
+    const int n = k + rs_->parity_shards;
+    const uint64_t stripe_number = slot.first + j;
+    std::vector<bool> extra;
+    int good = 0;
+    uint32_t newest = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int count = 0;
+        for (int shard = 0; shard < n; shard++) {
+            const int d = shard_drive_[shard];
+            if (d >= 0 && !wanted_[shard] && (slot.got[d] >= 0 || (!extra.empty() && extra[d]))) {
+                read_[count] = slot.cells[d] + j * cells_[d] + shard_slot_[shard];
+                read_shard_[count++] = shard;
+            }
+        }
+        validateBlocks(read_.data(), count, valid_.get());
+
+        good = 0;
+        newest = 0;
+        std::fill(erasures_.begin(), erasures_.end(), 1);
+        std::fill(shards_.begin(), shards_.end(), scratch_);
+        for (int c = 0; c < count; c++) {
+            const int shard = read_shard_[c];
+            if (valid_[c] && read_[c]->stripe_number == ((stripe_number << 8) | uint8_t(shard))) {
+                shards_[shard] = const_cast<unsigned char*>(read_[c]->data.data());
+                erasures_[shard] = 0;
+                newest = std::max(newest, read_[c]->block_sequence_number);
+                good++;
+            }
+        }
+        if (good >= k || attempt > 0) {
+            break;
+        }
+
+        // Short of good cells: read the stripe from the survivors the batch didn't read
+        extra.assign(map_.volumes.size(), false);
+        for (int d : survivors_) {
+            if (slot.got[d] >= 0) {
+                continue;
+            }
+            const Volume& vol = map_.volumes[d];
+            const size_t bytes = cells_[d] * sizeof(Block);
+            Block* cells = slot.cells[d] + j * cells_[d];
+            throttle(d, bytes);
+            const ssize_t got = pread(vol.fd, cells, bytes, computeOffsetToBlock(vol.header, stripe_number, vol.header.shard_ids[0]));
+            std::memset(reinterpret_cast<unsigned char*>(cells) + std::max<ssize_t>(got, 0), 0, bytes - std::max<ssize_t>(got, 0));
+            stats_.extra_reads += cells_[d];
+            stats_.bytes_read += std::max<ssize_t>(got, 0);
+            read_bytes_ += std::max<ssize_t>(got, 0);
+            extra[d] = true;
+        }
+    }
+
+    int erased = 0;
+    for (int shard = 0; shard < n; shard++) {
+        erased += erasures_[shard];
+    }
+    for (int shard : lost_) {
+        const int d = shard_drive_[shard];
+        shards_[shard] = (slot.cells[d] + j * cells_[d] + shard_slot_[shard])->data.data();
+    }
+    const bool rebuilt = good >= k && rs_decode_range(rs_, shards_.data(), erasures_.data(), erased, wanted_.data(), 0, sizeof(Block::data)) == 1;
+    if (!rebuilt) {
+        stats_.empty += good == 0;
+        stats_.unrecoverable += good != 0;
+    }
+    for (int shard : lost_) {
+        const int d = shard_drive_[shard];
+        Block& cell = slot.cells[d][j * cells_[d] + shard_slot_[shard]];
+        if (!rebuilt) {
+            std::memset(&cell, 0, sizeof(Block));
+            continue;
+        }
+        cell.stripe_number = (stripe_number << 8) | uint8_t(shard);
+        cell.block_sequence_number = newest + 1;
+        sealBlock(cell);
+        stats_.cells++;
+    }
+}
+
+int Rebuilder::processSlot(Slot& slot, size_t index) {
+    for (size_t d = 0; d < map_.volumes.size(); d++) {
+        // Short reads, past the end of a volume, are zeros that don't validate
+        if (slot.got[d] >= 0) {
+            const size_t bytes = slot.count * cells_[d] * sizeof(Block);
+            std::memset(reinterpret_cast<unsigned char*>(slot.cells[d]) + slot.got[d], 0, bytes - slot.got[d]);
+        }
+    }
+    for (size_t j = 0; j < slot.count; j++) {
+        rebuildStripe(slot, j);
+    }
+
+    for (size_t t = 0; t < spares_.size(); t++) {
+        const size_t d = map_.volumes.size() + t;
+        const size_t bytes = slot.count * cells_[d] * sizeof(Block);
+        throttle(d, bytes);
+        if (!batch_.queueWrite(spares_[t].fd, computeOffsetToBlock(spares_[t].header, slot.first, spares_[t].header.shard_ids[0]), slot.cells[d], bytes, WRITE_TAG | index)) {
+            batch_.clear();
+            return -EAGAIN;
+        }
+        slot.writes++;
+        stats_.bytes_written += bytes;
+    }
+    int ret = batch_.flush();
+    if (ret < 0) {
+        return ret;
+    }
+    slot.busy = slot.writes > 0;
+    stats_.stripes += slot.count;
+    done_ += slot.count;
+    return 0;
+}
+
+int Rebuilder::finish() {
+    for (const Volume& vol : spares_) {
+        if (fdatasync(vol.fd) != 0) {
+            return -errno;
+        }
+    }
+    // Every cell is on disk, so the spares can take over from the failed volume
+    for (Volume& vol : spares_) {
+        sealHeader(vol.header);
+        if (pwrite(vol.fd, &vol.header, sizeof(HeaderBlock), 0) != sizeof(HeaderBlock)) {
+            return errno != 0 ? -errno : -EIO;
+        }
+        if (fdatasync(vol.fd) != 0) {
+            return -errno;
+        }
+    }
+    map_.volumes.erase(map_.volumes.begin() + failed_);
+    map_.volumes.insert(map_.volumes.end(), spares_.begin(), spares_.end());
+    return 0;
+}
+
+int Rebuilder::run() {
+    int ret = setup();
+    if (ret < 0) {
+        return ret;
+    }
+    const uint64_t first = config_.first_stripe;
+    const uint64_t total = end_ > first ? end_ - first : 0;
+    const uint64_t per_batch = config_.batch_stripes;
+    const uint64_t batches = (total + per_batch - 1) / per_batch;
+    total_ = total;
+    start_ns_ = monotonicNs();
+
+    // Batch i is in slot i % depth, its reads are submitted up to depth batches ahead of decoding
+    uint64_t submitted = 0;
+    for (uint64_t head = 0; head < batches && ret >= 0 && error_ == 0;) {
+        while (submitted < batches && submitted - head < slots_.size() && ret >= 0) {
+            Slot& slot = slots_[submitted % slots_.size()];
+            while (slot.busy && ret >= 0) {
+                ret = std::min(reap(true), 0);
+            }
+            if (ret >= 0) {
+                const uint64_t start = first + submitted * per_batch;
+                ret = submitReads(slot, start, std::min(per_batch, end_ - start), submitted);
+                submitted++;
+            }
+        }
+        Slot& slot = slots_[head % slots_.size()];
+        while (slot.reads > 0 && ret >= 0) {
+            ret = std::min(reap(true), 0);
+        }
+        if (ret >= 0) {
+            ret = processSlot(slot, head % slots_.size());
+            head++;
+        }
+    }
+
+    // Wait out the I/O still in flight, writes included, before syncing or giving up
+    while (batch_.inFlight() > 0 && reap(true) >= 0) {
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (error_ != 0) {
+        return error_;
+    }
+    return finish();
+}
+
+RebuildProgress Rebuilder::progress() const {
+    RebuildProgress progress;
+    progress.stripes_done = done_;
+    progress.stripes_total = total_;
+    const uint64_t start = start_ns_;
+    const double elapsed = start != 0 ? (monotonicNs() - start) / 1e9 : 0;
+    progress.bytes_per_sec = elapsed > 0 ? read_bytes_ / elapsed : 0;
+    progress.eta_sec = progress.stripes_done > 0 && elapsed > 0
+                           ? double(progress.stripes_total - progress.stripes_done) * elapsed / progress.stripes_done
+                           : -1;
+    return progress;
+}
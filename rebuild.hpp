@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "blockaio.hpp"
+#include "scrubber.hpp"
+
+/**
+ * Rebuild settings.
+ */
+struct RebuildConfig {
+    double bytes_per_sec = 0;            // per drive, reads and writes, 0 for no limit
+    double burst_bytes = 8 << 20;
+    uint64_t first_stripe = 1;           // stripe 0 holds the headers
+    uint64_t stripe_count = 0;           // 0 for every stripe up to the end of the longest surviving volume
+    int batch_stripes = 256;             // stripes per extent, each source drive gets one read per batch
+    int depth = 2;                       // batches in flight, the next batch is read while one is decoded
+};
+
+struct RebuildStats {
+    uint64_t stripes;
+    uint64_t cells;           // rebuilt and written
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t extra_reads;     // cells read one stripe at a time, when a batch's sources were short of good cells
+    uint64_t empty;           // stripes without a single good cell, never written, their cells are written zeroed
+    uint64_t unrecoverable;   // stripes with some but fewer than k good cells, also zeroed
+    uint64_t throttled;       // times a drive's budget made the pipeline wait
+};
+
+/**
+ * A snapshot of a rebuild, from any thread.
+ */
+struct RebuildProgress {
+    uint64_t stripes_done;
+    uint64_t stripes_total;
+    double bytes_per_sec;   // read so far over the time since run() started
+    double eta_sec;         // at that rate, -1 until a batch is done
+};
+
+/**
+ * Rebuilds every cell of a failed volume onto spares.  The lost (stripe, shard) pairs are the failed
+ * volume's shards in every stripe from first_stripe on, the spares' headers share those shards out, so a
+ * rebuild can spread one drive over several.
+ *
+ * Each batch of batch_stripes stripes reads only as many surviving volumes as it takes to cover k shards,
+ * starting from a different volume each batch so the reads are spread over every survivor, and each of
+ * those volumes is read with one large read of its contiguous cells.  The reads of up to depth batches
+ * are in flight on one io_context_t while a batch is checked with validateBlocks() and decoded with
+ * rs_decode_range(); the stripes of a batch mostly share their erasure pattern, so they share one
+ * inverted matrix from the codec's decode cache.  A stripe whose read cells don't have k good ones reads
+ * the other survivors' cells of that stripe.  The rebuilt cells get the newest sequence number of the
+ * stripe plus one, like the Scrubber's repairs, and go out with one write per spare and batch.  Every
+ * read and write is paid for from the drive's TokenBucket.
+ *
+ * Once every cell is synced the spares' headers are sealed and written at offset 0, and the spares
+ * replace the failed volume in the map.  A rebuilder is used by one thread, progress() by any.
+ */
+class Rebuilder {
+public:
+    /**
+     * @param map The volumes, the failed one is replaced by the spares when the rebuild completes.
+     * @param failed The index of the failed volume in map.volumes, its header says which shards it held.
+     * @param spares The volumes to rebuild onto, each lost shard on exactly one of them.
+     * @param rs The codec of the stripes.
+     * @param io_ctx The I/O context, set up for at least depth * map.volumes.size() + spares events.
+     * @param config The settings.
+     * All must outlive the rebuilder.
+     */
+    Rebuilder(VolumeMap& map, int failed, const std::vector<Volume>& spares, reed_solomon* rs, io_context_t io_ctx,
+              const RebuildConfig& config);
+    ~Rebuilder();
+    Rebuilder(const Rebuilder&) = delete;
+    Rebuilder& operator=(const Rebuilder&) = delete;
+
+    /**
+     * Runs the whole rebuild.
+     * @return Returns 0, -EINVAL if the spares don't hold exactly the failed volume's shards or a shard isn't
+     *         covered by rs, or a negative error code.  On an error the map is untouched.
+     */
+    int run();
+
+    RebuildProgress progress() const;
+    const RebuildStats& stats() const { return stats_; }
+
+private:
+    struct Slot {
+        uint64_t first;            // stripe
+        size_t count;              // stripes
+        std::vector<Block*> cells;  // by volume of map then spare, batch_stripes stripes each
+        std::vector<long> got;      // bytes read by survivor, -1 for volumes not read
+        int reads;                 // outstanding
+        int writes;
+        bool busy;
+    };
+
+    int setup();
+    void throttle(size_t drive, double bytes);
+    int submitReads(Slot& slot, uint64_t first, size_t count, uint64_t batch);
+    int reap(bool wait);
+    void rebuildStripe(Slot& slot, size_t j);
+    int processSlot(Slot& slot, size_t index);
+    int finish();
+
+    VolumeMap& map_;
+    int failed_;
+    std::vector<Volume> spares_;
+    reed_solomon* rs_;
+    RebuildConfig config_;
+    IoBatch batch_;
+    std::vector<TokenBucket> budgets_;   // by volume of map then spare
+    std::vector<int> cells_;             // per stripe, by volume of map then spare
+    std::vector<int> shard_drive_;       // by shard, -1 for shards no one holds
+    std::vector<int> shard_slot_;
+    std::vector<int> survivors_;
+    std::vector<int> lost_;
+    std::vector<Slot> slots_;
+    std::vector<IoCompletion> events_;
+    unsigned char* scratch_;             // erased cells that aren't wanted
+
+    // Per stripe decode state
+    std::vector<const Block*> read_;
+    std::vector<int> read_shard_;
+    std::vector<unsigned char*> shards_;
+    std::vector<int> erasures_;
+    std::vector<int> wanted_;
+    std::unique_ptr<bool[]> valid_;
+
+    RebuildStats stats_;
+    uint64_t end_;
+    int error_;
+    std::atomic<uint64_t> done_;
+    std::atomic<uint64_t> read_bytes_;
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> start_ns_;
+};
@@ -0,0 +1,369 @@
+#include "refscan.hpp"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+const uint64_t BITMAP_WORDS = 65536 / 64;
+
+// blobindex4.py frond framing: 32 byte magic and a 4 byte length in front, a 32 byte blake3 hash behind
+const size_t MAGIC_BYTES = 36;
+const size_t HASH_BYTES = 32;
+
+// Keeps the worse of two scan results: a skipped frond (-ENOTSUP) gives way to a malformed one
+// (-EBADMSG), which gives way to any other error
+int worseResult(int ret, int r) {
+    auto rank = [](int e) { return e == 0 ? 0 : e == -ENOTSUP ? 1 : e == -EBADMSG ? 2 : 3; };
+    return rank(r) > rank(ret) ? r : ret;
+}
+
+// Reads ahead the pages of the fronds scanMetadataReferences() will scan, overlapping and adjacent fronds
+// merged into one run, so a mapping advised MADV_RANDOM only pulls in its metadata
+void readAheadFronds(unsigned char* mapping, size_t length, const BlobIndex& index) {
+    std::vector<std::pair<uint64_t, uint64_t>> runs;
+    for (uint32_t id = 0; id < index.size(); id++) {
+        const BlobEntry& entry = *index.get(id);
+        if (!(entry.flags & BlobIndex::METADATA) || (entry.flags & (BlobIndex::DELETED | BlobIndex::COMPRESSED)) || entry.size == 0
+            || entry.offset > length || entry.size > length - entry.offset) {
+            continue;
+        }
+        runs.emplace_back(entry.offset / PAGE_SIZE * PAGE_SIZE, entry.offset + entry.size);
+    }
+    std::sort(runs.begin(), runs.end());
+    for (size_t i = 0; i < runs.size();) {
+        const uint64_t start = runs[i].first;
+        uint64_t end = runs[i].second;
+        for (i++; i < runs.size() && runs[i].first <= end; i++) {
+            end = std::max(end, runs[i].second);
+        }
+        madvise(mapping + start, end - start, MADV_WILLNEED);
+    }
+}
+
+}  // namespace
+
+bool ReferenceSet::addTo(Container& container, uint16_t low) {
+    if (!container.bitmap.empty()) {
+        uint64_t& word = container.bitmap[low >> 6];
+        const uint64_t bit = uint64_t(1) << (low & 63);
+        const bool added = !(word & bit);
+        word |= bit;
+        return added;
+    }
+    auto it = std::lower_bound(container.array.begin(), container.array.end(), low);
+    if (it != container.array.end() && *it == low) {
+        return false;
+    }
+    container.array.insert(it, low);
+    if (container.array.size() > ARRAY_MAX) {
+        container.bitmap.assign(BITMAP_WORDS, 0);
+        for (uint16_t value : container.array) {
+            container.bitmap[value >> 6] |= uint64_t(1) << (value & 63);
+        }
+        std::vector<uint16_t>().swap(container.array);
+    }
+    return true;
+}
+
+bool ReferenceSet::add(uint64_t address) {
+    const bool added = addTo(containers_[address >> 16], uint16_t(address));
+    size_ += added;
+    return added;
+}
+
+bool ReferenceSet::contains(uint64_t address) const {
+    auto it = containers_.find(address >> 16);
+    if (it == containers_.end()) {
+        return false;
+    }
+    const Container& container = it->second;
+    const uint16_t low = uint16_t(address);
+    if (!container.bitmap.empty()) {
+        return (container.bitmap[low >> 6] >> (low & 63)) & 1;
+    }
+    return std::binary_search(container.array.begin(), container.array.end(), low);
+}
+
+void ReferenceSet::merge(const ReferenceSet& other) {
+    for (const auto& entry : other.containers_) {
+        Container& container = containers_[entry.first];
+        const Container& from = entry.second;
+        if (!from.bitmap.empty()) {
+            for (uint64_t w = 0; w < BITMAP_WORDS; w++) {
+                for (uint64_t bits = from.bitmap[w]; bits != 0; bits &= bits - 1) {
+                    size_ += addTo(container, uint16_t(w * 64 + __builtin_ctzll(bits)));
+                }
+            }
+        } else if (container.array.empty() && container.bitmap.empty()) {
+            container.array = from.array;
+            size_ += from.array.size();
+        } else {
+            for (uint16_t low : from.array) {
+                size_ += addTo(container, low);
+            }
+        }
+    }
+}
+
+std::vector<uint64_t> ReferenceSet::addresses() const {
+    std::vector<uint64_t> out;
+    out.reserve(size_);
+    for (const auto& entry : containers_) {
+        const uint64_t high = entry.first << 16;
+        const Container& container = entry.second;
+        if (!container.bitmap.empty()) {
+            for (uint64_t w = 0; w < BITMAP_WORDS; w++) {
+                for (uint64_t bits = container.bitmap[w]; bits != 0; bits &= bits - 1) {
+                    out.push_back(high | (w * 64 + __builtin_ctzll(bits)));
+                }
+            }
+        } else {
+            for (uint16_t low : container.array) {
+                out.push_back(high | low);
+            }
+        }
+    }
+    return out;
+}
+
+size_t ReferenceSet::memoryBytes() const {
+    size_t bytes = 0;
+    for (const auto& entry : containers_) {
+        bytes += entry.second.array.capacity() * sizeof(uint16_t) + entry.second.bitmap.capacity() * sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+int scanCborReferences(const unsigned char* data, size_t length, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats) {
+    // Items left in each open container, UINT64_MAX for indefinite ones and the top level
+    std::vector<uint64_t> open(1, UINT64_MAX);
+    const unsigned char* p = data;
+    const unsigned char* end = data + length;
+    int found = 0;
+    uint64_t pending_tag = 0;  // a reference tag waiting for its string
+    bool malformed = false;
+
+    while (p < end) {
+        const unsigned char initial = *p++;
+        const int major = initial >> 5;
+        const int info = initial & 31;
+        uint64_t value = info;
+        if (info >= 24 && info <= 27) {
+            const size_t bytes = size_t(1) << (info - 24);
+            if (size_t(end - p) < bytes) {
+                malformed = true;
+                break;
+            }
+            value = 0;
+            for (size_t i = 0; i < bytes; i++) {
+                value = (value << 8) | *p++;
+            }
+        } else if (info >= 28 && (info != 31 || major == 0 || major == 1 || major == 6)) {
+            malformed = true;
+            break;
+        }
+        const bool indefinite = info == 31;
+        const uint64_t tag = pending_tag;
+        pending_tag = 0;
+
+        bool complete = true;  // the item isn't a container left open
+        switch (major) {
+        case 2:
+        case 3:
+            if (indefinite) {
+                open.push_back(UINT64_MAX);
+                complete = false;
+            } else if (uint64_t(end - p) < value) {
+                malformed = true;
+            } else {
+                if (major == 2 && value == 8 && tag != 0) {
+                    uint64_t address = 0;
+                    for (int i = 0; i < 8; i++) {
+                        address = (address << 8) | p[i];
+                    }
+                    if (tag == CBOR_REF_TAG) {
+                        strong.add(address);
+                        found++;
+                        if (stats != nullptr) {
+                            stats->strong++;
+                        }
+                    } else if (weak != nullptr) {
+                        weak->add(address);
+                        found++;
+                        if (stats != nullptr) {
+                            stats->weak++;
+                        }
+                    }
+                }
+                p += value;
+            }
+            break;
+        case 4:
+        case 5:
+            if (indefinite) {
+                open.push_back(UINT64_MAX);
+                complete = false;
+            } else if (value > 0) {
+                // A map is key, value pairs, both scanned
+                if (major == 5 && value > UINT64_MAX / 2 - 1) {
+                    malformed = true;
+                    break;
+                }
+                open.push_back(major == 5 ? value * 2 : value);
+                complete = false;
+            }
+            break;
+        case 6:
+            // A tag wraps the next item, which completes it
+            if (value == CBOR_REF_TAG || value == CBOR_WEAK_REF_TAG) {
+                pending_tag = value;
+            }
+            complete = false;
+            break;
+        case 7:
+            if (indefinite) {
+                // A break closes the innermost indefinite container
+                if (open.size() < 2 || open.back() != UINT64_MAX) {
+                    malformed = true;
+                    break;
+                }
+                open.pop_back();
+            }
+            break;
+        default:
+            break;
+        }
+        if (malformed) {
+            break;
+        }
+        if (!complete) {
+            continue;
+        }
+        // Close the definite containers this item finished
+        while (open.back() != UINT64_MAX && --open.back() == 0) {
+            open.pop_back();
+        }
+    }
+    malformed = malformed || open.size() > 1 || pending_tag != 0;
+    if (stats != nullptr) {
+        stats->bytes += length;
+        stats->malformed += malformed;
+    }
+    return malformed ? -EINVAL : found;
+}
+
+int scanMetadataReferences(const unsigned char* data, size_t length, const BlobIndex& index, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats) {
+    ReferenceScanStats local;
+    std::memset(&local, 0, sizeof(local));
+    int ret = 0;
+    for (uint32_t id = 0; id < index.size(); id++) {
+        const BlobEntry& entry = *index.get(id);
+        if (!(entry.flags & BlobIndex::METADATA) || (entry.flags & BlobIndex::DELETED) || entry.size == 0) {
+            continue;
+        }
+        if (entry.offset > length || entry.size > length - entry.offset) {
+            ret = worseResult(ret, -EINVAL);
+            continue;
+        }
+        if (entry.flags & BlobIndex::COMPRESSED) {
+            // Its references are unknown, so the caller mustn't take the sets as complete
+            local.skipped++;
+            ret = worseResult(ret, -ENOTSUP);
+            continue;
+        }
+        size_t start = entry.offset;
+        size_t size = entry.size;
+        if (entry.flags & (BlobIndex::MAGICED | BlobIndex::BLAKE3)) {
+            const size_t framing = (entry.flags & BlobIndex::MAGICED ? MAGIC_BYTES : 0) + HASH_BYTES;
+            if (size < framing) {
+                local.malformed++;
+                ret = worseResult(ret, -EBADMSG);
+                continue;
+            }
+            start += entry.flags & BlobIndex::MAGICED ? MAGIC_BYTES : 0;
+            size -= framing;
+        }
+        local.fronds++;
+        if (scanCborReferences(data + start, size, strong, weak, &local) < 0) {
+            // References the broken part held are lost, so this fails the scan like a skipped frond
+            ret = worseResult(ret, -EBADMSG);
+        }
+    }
+    if (stats != nullptr) {
+        stats->fronds += local.fronds;
+        stats->bytes += local.bytes;
+        stats->strong += local.strong;
+        stats->weak += local.weak;
+        stats->skipped += local.skipped;
+        stats->malformed += local.malformed;
+    }
+    return ret;
+}
+
+int scanVolumeReferences(const std::vector<ReferenceSource>& sources, int threads, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats) {
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    int result = 0;
+    ReferenceScanStats total;
+    std::memset(&total, 0, sizeof(total));
+
+    auto worker = [&]() {
+        ReferenceSet local_strong, local_weak;
+        ReferenceScanStats local;
+        std::memset(&local, 0, sizeof(local));
+        int ret = 0;
+        for (size_t i = next++; i < sources.size(); i = next++) {
+            struct stat st;
+            if (fstat(sources[i].fd, &st) != 0) {
+                ret = worseResult(ret, -errno);
+                continue;
+            }
+            if (st.st_size == 0) {
+                continue;
+            }
+            void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, sources[i].fd, 0);
+            if (mapping == MAP_FAILED) {
+                ret = worseResult(ret, -errno);
+                continue;
+            }
+            // The fronds are a small part of the volume, don't read ahead the data around them
+            madvise(mapping, st.st_size, MADV_RANDOM);
+            readAheadFronds(static_cast<unsigned char*>(mapping), st.st_size, *sources[i].index);
+            int r = scanMetadataReferences(static_cast<const unsigned char*>(mapping), st.st_size, *sources[i].index, local_strong,
+                                           weak != nullptr ? &local_weak : nullptr, &local);
+            ret = worseResult(ret, r);
+            munmap(mapping, st.st_size);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        strong.merge(local_strong);
+        if (weak != nullptr) {
+            weak->merge(local_weak);
+        }
+        total.fronds += local.fronds;
+        total.bytes += local.bytes;
+        total.strong += local.strong;
+        total.weak += local.weak;
+        total.skipped += local.skipped;
+        total.malformed += local.malformed;
+        result = worseResult(result, ret);
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min<int>(threads, sources.size()); t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    if (stats != nullptr) {
+        *stats = total;
+    }
+    return result;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "blobindex.hpp"
+
+/**
+ * A set of 64-bit addresses, compressed like a roaring bitmap: addresses are grouped by their top 48
+ * bits (the blade and the top of the offset), each group a sorted array of the bottom 16 bits until it
+ * holds ARRAY_MAX of them, then an 8 KB bitmap.
+ */
+class ReferenceSet {
+public:
+    static constexpr size_t ARRAY_MAX = 4096;
+
+    /**
+     * @return Returns true if the address wasn't in the set.
+     */
+    bool add(uint64_t address);
+    bool contains(uint64_t address) const;
+
+    /**
+     * Adds every address of another set.
+     */
+    void merge(const ReferenceSet& other);
+
+    /**
+     * @return Returns the number of addresses.
+     */
+    uint64_t size() const { return size_; }
+
+    /**
+     * @return Returns the addresses in order.
+     */
+    std::vector<uint64_t> addresses() const;
+
+    /**
+     * @return Returns the bytes used by the containers.
+     */
+    size_t memoryBytes() const;
+
+private:
+    struct Container {
+        std::vector<uint16_t> array;  // sorted, while there is no bitmap
+        std::vector<uint64_t> bitmap;  // 1024 words once the array grows past ARRAY_MAX
+    };
+
+    static bool addTo(Container& container, uint16_t low);
+
+    std::map<uint64_t, Container> containers_;
+    uint64_t size_ = 0;
+};
+
+/**
+ * References found by a scan.
+ */
+struct ReferenceScanStats {
+    uint64_t fronds;      // metadata fronds scanned
+    uint64_t bytes;       // of CBOR scanned
+    uint64_t strong;      // references found, before deduplication
+    uint64_t weak;
+    uint64_t skipped;     // compressed fronds, which need decompressing first, so the scan is incomplete
+    uint64_t malformed;   // fronds that aren't valid CBOR, the references before the error still count
+};
+
+// The tags blobindex4.py uses for 8 byte references
+constexpr uint64_t CBOR_REF_TAG = 1000;
+constexpr uint64_t CBOR_WEAK_REF_TAG = 1001;
+
+/**
+ * Streaming scan of raw CBOR for references, a tag CBOR_REF_TAG or CBOR_WEAK_REF_TAG on an 8 byte
+ * string, read as a big-endian address.  No objects are built, the scan keeps a stack of the items left
+ * in each open array, map and indefinite string.  It is more conservative than blobindex4.py's
+ * extract_tagged_references: map keys and the contents of other tags are scanned too, and a sequence of
+ * top level items is scanned to the end.  A reference too many only keeps a frond alive.
+ * @param data The CBOR bytes.
+ * @param length The number of bytes.
+ * @param strong Receives the strong references.
+ * @param weak Receives the weak references, or nullptr to ignore them.
+ * @param stats Counts the references found, or nullptr.
+ * @return Returns the number of references found, or -EINVAL if the CBOR is malformed or truncated.
+ */
+int scanCborReferences(const unsigned char* data, size_t length, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats = nullptr);
+
+/**
+ * Scans every metadata frond of a blob volume for references.  The frond's magic and blake3 framing are
+ * stripped first.  There's no zstd here, so compressed fronds are skipped and counted, and the scan
+ * fails: a collector can't free anything on the strength of it.
+ * @param data The blob volume bytes, e.g. a mapping of the file.
+ * @param length The size of the volume.
+ * @param index The volume's blob index, offsets are into data.
+ * @return Returns 0, -EINVAL if a frond is outside the volume, or else -EBADMSG if a frond is shorter
+ *         than its framing or isn't valid CBOR, or else -ENOTSUP if a compressed frond was skipped.  The
+ *         references of the other fronds, and of a malformed frond up to the error, are found either way.
+ */
+int scanMetadataReferences(const unsigned char* data, size_t length, const BlobIndex& index, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats);
+
+/**
+ * A blob volume to scan.
+ */
+struct ReferenceSource {
+    int fd;
+    const BlobIndex* index;
+};
+
+/**
+ * Marks the references of many volumes in parallel: each thread maps one volume read-only at a time,
+ * scans it into sets of its own, and the sets are merged at the end.
+ * @param sources The volumes.
+ * @param threads The number of threads.
+ * @param strong Receives the strong references.
+ * @param weak Receives the weak references, or nullptr to ignore them.
+ * @param stats Receives the totals, or nullptr.
+ * @return Returns 0, or the worst error as scanMetadataReferences() ranks them, the other volumes are
+ *         still scanned.
+ */
+int scanVolumeReferences(const std::vector<ReferenceSource>& sources, int threads, ReferenceSet& strong, ReferenceSet* weak, ReferenceScanStats* stats = nullptr);
@@ -0,0 +1,303 @@
+#include "reparity.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+int writeHeader(Volume& vol, const HeaderBlock& header) {
+    HeaderBlock sealed = header;
+    sealHeader(sealed);
+    if (pwrite(vol.fd, &sealed, sizeof(HeaderBlock), 0) != sizeof(HeaderBlock)) {
+        return errno != 0 ? -errno : -EIO;
+    }
+    if (fdatasync(vol.fd) != 0) {
+        return -errno;
+    }
+    vol.header = sealed;
+    return 0;
+}
+
+}  // namespace
+
+int addParityShards(VolumeMap& map, reed_solomon* rs, const std::vector<Volume>& new_volumes, const ReparityConfig& config,
+                    ReparityStats* stats) {
+    const int k = rs->data_shards;
+    const int n = rs->shards;
+    const size_t batch = std::max(config.batch_stripes, 1);
+    ReparityStats local;
+    std::memset(&local, 0, sizeof(local));
+
+    // Where each shard's cell is within its volume's part of a stripe
+    std::vector<int> shard_volume(n, -1), shard_slot(n, 0);
+    std::vector<int> source_cells, target_cells;
+    for (size_t v = 0; v < map.volumes.size(); v++) {
+        const HeaderBlock& header = map.volumes[v].header;
+        source_cells.push_back(getKBlocksInStripe(header));
+        for (int i = 0; i < source_cells.back(); i++) {
+            const int shard = header.shard_ids[i];
+            if (isDroppedShard(shard)) {
+                continue;
+            }
+            if (shard >= n) {
+                return -EINVAL;
+            }
+            if (shard_volume[shard] < 0) {
+                shard_volume[shard] = v;
+                shard_slot[shard] = i;
+            }
+        }
+    }
+    std::vector<int> outputs, output_volume, output_slot;
+    for (size_t t = 0; t < new_volumes.size(); t++) {
+        const HeaderBlock& header = new_volumes[t].header;
+        target_cells.push_back(getKBlocksInStripe(header));
+        for (int i = 0; i < target_cells.back(); i++) {
+            const int shard = header.shard_ids[i];
+            if (shard < k || shard >= n || shard_volume[shard] >= 0
+                || std::find(outputs.begin(), outputs.end(), shard) != outputs.end()) {
+                return -EINVAL;
+            }
+            outputs.push_back(shard);
+            output_volume.push_back(t);
+            output_slot.push_back(i);
+        }
+    }
+    if (outputs.empty()) {
+        return 0;
+    }
+    const int m = outputs.size();
+
+    // The volumes of the data shards are streamed, the others are only read for stripes that need decoding
+    std::vector<bool> streamed(map.volumes.size(), false);
+    for (int shard = 0; shard < k; shard++) {
+        if (shard_volume[shard] >= 0) {
+            streamed[shard_volume[shard]] = true;
+        }
+    }
+
+    uint64_t end = config.first_stripe + config.stripe_count;
+    if (config.stripe_count == 0) {
+        // The longest volume sets the stripe count, shorter ones are missing their last cells
+        end = 0;
+        for (size_t v = 0; v < map.volumes.size(); v++) {
+            struct stat st;
+            if (fstat(map.volumes[v].fd, &st) == 0) {
+                end = std::max(end, uint64_t(st.st_size) / (source_cells[v] * sizeof(Block)));
+            }
+        }
+    }
+
+    // The data rows of the new shards, for stripes whose data cells are all valid
+    std::vector<gf> coeffs(size_t(m) * k);
+    for (int o = 0; o < m; o++) {
+        std::memcpy(&coeffs[size_t(o) * k], &rs->matrix[outputs[o] * k], k);
+    }
+
+    std::vector<Block*> sources(map.volumes.size(), nullptr), targets(new_volumes.size(), nullptr);
+    int ret = 0;
+    for (size_t v = 0; v < sources.size() && ret == 0; v++) {
+        if (posix_memalign(reinterpret_cast<void**>(&sources[v]), PAGE_SIZE, batch * source_cells[v] * sizeof(Block)) != 0) {
+            sources[v] = nullptr;
+            ret = -ENOMEM;
+        }
+    }
+    for (size_t t = 0; t < targets.size() && ret == 0; t++) {
+        if (posix_memalign(reinterpret_cast<void**>(&targets[t]), PAGE_SIZE, batch * target_cells[t] * sizeof(Block)) != 0) {
+            targets[t] = nullptr;
+            ret = -ENOMEM;
+        }
+    }
+    std::unique_ptr<bool[]> valid(new bool[size_t(n)]);
+    std::vector<const Block*> cells(n);
+    std::vector<int> cell_shards(n);
+    std::vector<int> ids(k + m);
+    std::vector<unsigned char*> shards(k + m);
+
+    for (uint64_t first = config.first_stripe; first < end && ret == 0; first += batch) {
+        const size_t count = std::min<uint64_t>(batch, end - first);
+        for (size_t v = 0; v < sources.size(); v++) {
+            if (!streamed[v]) {
+                continue;
+            }
+            // A volume's cells of consecutive stripes are contiguous, so a batch is one read
+            const Volume& vol = map.volumes[v];
+            const size_t bytes = count * source_cells[v] * sizeof(Block);
+            const ssize_t got = pread(vol.fd, sources[v], bytes, computeOffsetToBlock(vol.header, first, vol.header.shard_ids[0]));
+            if (got < 0) {
+                ret = -errno;
+                break;
+            }
+            // Short reads are zeros that don't validate
+            std::memset(reinterpret_cast<unsigned char*>(sources[v]) + got, 0, bytes - got);
+            local.bytes_read += got;
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        for (size_t j = 0; j < count && ret == 0; j++) {
+            const uint64_t stripe_number = first + j;
+            // The first k valid cells of the volumes read, the data cells when they are all there
+            int inputs = 0;
+            uint32_t newest = 0;
+            auto collect = [&](bool all) {
+                int present = 0;
+                for (int shard = 0; shard < n; shard++) {
+                    const int v = shard_volume[shard];
+                    if (v >= 0 && (all || streamed[v])) {
+                        cell_shards[present] = shard;
+                        cells[present++] = sources[v] + j * source_cells[v] + shard_slot[shard];
+                    }
+                }
+                validateBlocks(cells.data(), present, valid.get());
+                inputs = 0;
+                newest = 0;
+                for (int c = 0; c < present && inputs < k; c++) {
+                    if (valid[c] && cells[c]->stripe_number == ((stripe_number << 8) | uint8_t(cell_shards[c]))) {
+                        ids[inputs] = cell_shards[c];
+                        shards[inputs] = const_cast<unsigned char*>(cells[c]->data.data());
+                        newest = std::max(newest, cells[c]->block_sequence_number);
+                        inputs++;
+                    }
+                }
+            };
+            collect(false);
+            if (inputs < k || ids[k - 1] != k - 1) {
+                // A data cell is missing or bad, so read this stripe's cells from the other volumes too
+                for (size_t v = 0; v < sources.size(); v++) {
+                    if (streamed[v]) {
+                        continue;
+                    }
+                    const Volume& vol = map.volumes[v];
+                    Block* stripe_cells = sources[v] + j * source_cells[v];
+                    const size_t bytes = source_cells[v] * sizeof(Block);
+                    const ssize_t got = pread(vol.fd, stripe_cells, bytes, computeOffsetToBlock(vol.header, stripe_number, vol.header.shard_ids[0]));
+                    if (got < 0) {
+                        ret = -errno;
+                        break;
+                    }
+                    std::memset(reinterpret_cast<unsigned char*>(stripe_cells) + got, 0, bytes - got);
+                    local.bytes_read += got;
+                }
+                if (ret != 0) {
+                    break;
+                }
+                collect(true);
+            }
+            for (int o = 0; o < m; o++) {
+                Block* cell = targets[output_volume[o]] + j * target_cells[output_volume[o]] + output_slot[o];
+                ids[k + o] = outputs[o];
+                shards[k + o] = cell->data.data();
+            }
+
+            bool coded = false;
+            if (inputs == k && ids[k - 1] == k - 1) {
+                mul_rows(&shards[k], m, shards.data(), k, coeffs.data(), sizeof(Block::data));
+                coded = true;
+            } else if (inputs == k) {
+                coded = rs_generic_galois_coding(rs, ids.data(), k, m, sizeof(Block::data), shards.data()) == 1;
+                local.decoded += coded;
+            }
+            for (int o = 0; o < m; o++) {
+                Block* cell = targets[output_volume[o]] + j * target_cells[output_volume[o]] + output_slot[o];
+                if (!coded) {
+                    std::memset(cell, 0, sizeof(Block));
+                    continue;
+                }
+                cell->stripe_number = (stripe_number << 8) | uint8_t(outputs[o]);
+                cell->block_sequence_number = newest;
+                sealBlock(*cell);
+            }
+            local.unrecoverable += !coded;
+            local.cells_written += coded ? m : 0;
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        for (size_t t = 0; t < targets.size(); t++) {
+            const Volume& vol = new_volumes[t];
+            const ssize_t bytes = count * target_cells[t] * sizeof(Block);
+            if (pwrite(vol.fd, targets[t], bytes, computeOffsetToBlock(vol.header, first, vol.header.shard_ids[0])) != bytes) {
+                ret = errno != 0 ? -errno : -EIO;
+                break;
+            }
+        }
+        local.stripes += count;
+    }
+    for (Block* buffer : sources) {
+        free(buffer);
+    }
+    for (Block* buffer : targets) {
+        free(buffer);
+    }
+
+    for (size_t t = 0; t < new_volumes.size() && ret == 0; t++) {
+        if (fdatasync(new_volumes[t].fd) != 0) {
+            ret = -errno;
+        }
+    }
+    // Every new cell is on disk, so the new shards can join the map once all their headers are
+    std::vector<Volume> sealed(new_volumes);
+    for (size_t t = 0; t < sealed.size() && ret == 0; t++) {
+        ret = writeHeader(sealed[t], sealed[t].header);
+    }
+    if (ret == 0) {
+        map.volumes.insert(map.volumes.end(), sealed.begin(), sealed.end());
+    }
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return ret;
+}
+
+int dropParityShards(VolumeMap& map, int data_shards, const std::vector<int>& shards, std::vector<Volume>* retired) {
+    for (int shard : shards) {
+        if (shard < data_shards || isDroppedShard(shard) || findVolumeForShard(map, shard) < 0) {
+            return -EINVAL;
+        }
+    }
+    int rewritten = 0;
+    std::vector<Volume> kept;
+    for (size_t v = 0; v < map.volumes.size(); v++) {
+        Volume& vol = map.volumes[v];
+        HeaderBlock header = vol.header;
+        const int cells = getKBlocksInStripe(header);
+        int dropped = 0;
+        for (int i = 0; i < cells; i++) {
+            const int shard = header.shard_ids[i];
+            if (isDroppedShard(shard)) {
+                dropped++;
+            } else if (std::find(shards.begin(), shards.end(), shard) != shards.end()) {
+                header.shard_ids[i] = i & 1 ? DROPPED_SHARD_ODD : DROPPED_SHARD_EVEN;
+                dropped++;
+            }
+        }
+        if (header.shard_ids == vol.header.shard_ids) {
+            kept.push_back(vol);
+            continue;
+        }
+        // The fill after the last cell repeats it, dropped or not
+        std::fill(header.shard_ids.begin() + cells, header.shard_ids.end(), header.shard_ids[cells - 1]);
+        int ret = writeHeader(vol, header);
+        if (ret != 0) {
+            // The volumes before this one are rewritten, keep the map in step with the disks
+            kept.insert(kept.end(), map.volumes.begin() + v, map.volumes.end());
+            map.volumes.swap(kept);
+            return ret;
+        }
+        rewritten++;
+        if (dropped < cells) {
+            kept.push_back(vol);
+        } else if (retired != nullptr) {
+            retired->push_back(vol);
+        }
+    }
+    map.volumes.swap(kept);
+    return rewritten;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Parity reconfiguration settings.
+ */
+struct ReparityConfig {
+    uint64_t first_stripe = 1;   // stripe 0 holds the headers
+    uint64_t stripe_count = 0;   // 0 for every stripe up to the end of the longest volume
+    int batch_stripes = 64;      // stripes read and written with one syscall per volume
+};
+
+struct ReparityStats {
+    uint64_t stripes;
+    uint64_t bytes_read;
+    uint64_t cells_written;
+    uint64_t decoded;         // stripes whose data cells weren't all valid, coded from other cells
+    uint64_t unrecoverable;   // stripes with fewer than k valid cells, their new cells are left zeroed
+};
+
+/**
+ * Adds parity shards to existing stripes without rewriting them.  A stripe's new parity cells are coded
+ * from its k data cells with the rows of rs->matrix, or, if some are missing or fail validation, from any
+ * k valid cells with rs_generic_galois_coding.  Only the new cells are written, with the sequence number
+ * of the newest cell used.  The volumes of the data shards are streamed batch_stripes stripes at a time,
+ * one pread per volume and one pwrite per new volume, so the pass runs at sequential read speed.  The
+ * volumes holding only parity shards are read a stripe at a time, for the stripes that need decoding.
+ *
+ * The code has to be nested, see rs_new_nested: the stripes must have been built with
+ * rs_new_nested(k, m) and rs is rs_new_nested(k, m') for the m' parity shards wanted, so the old parity
+ * cells stay valid.  Once every new cell is synced the new volumes' headers are sealed and written at
+ * offset 0, and once every header is written the volumes are appended to the map.
+ * @param map The volumes of the stripes.
+ * @param rs The nested code, covering every shard of map and new_volumes.
+ * @param new_volumes The volumes of the new parity shards, their headers' shard_ids say which.  They
+ *                    must be new shards, at least rs->data_shards.
+ * @param config The settings.
+ * @param stats Receives the counts, or nullptr.
+ * @return Returns 0, -EINVAL if a new volume holds a data shard, a shard already in map or one rs doesn't
+ *         cover, or a negative error code.  On an error the map is untouched.  If writing a header failed
+ *         the new volumes before it are left with their headers on disk, harmless since the map doesn't
+ *         know them, and a retry rewrites them.
+ */
+int addParityShards(VolumeMap& map, reed_solomon* rs, const std::vector<Volume>& new_volumes, const ReparityConfig& config,
+                    ReparityStats* stats = nullptr);
+
+/**
+ * Drops parity shards.  Only headers change: a dropped shard's shard_ids entry becomes
+ * DROPPED_SHARD_EVEN or DROPPED_SHARD_ODD, so its cells keep their place in the layout until the volume
+ * is rebuilt or compacted, and a volume whose shards are all dropped is retired from the map.  Each
+ * changed header is sealed, written at offset 0 and synced, one volume at a time, since a stripe is
+ * decodable with any mix of dropped and kept shards.
+ *
+ * The stripes still decode with the nested code covering their highest remaining shard, dropping the
+ * top shards of rs_new_nested(k, m) leaves rs_new_nested(k, m - dropped) stripes.
+ * @param map The volumes.
+ * @param data_shards k, the data shards can't be dropped.
+ * @param shards The parity shards to drop.
+ * @param retired Receives the retired volumes, or nullptr.
+ * @return Returns the number of headers rewritten, -EINVAL if a shard is a data shard or isn't in map,
+ *         or a negative error code.
+ */
+int dropParityShards(VolumeMap& map, int data_shards, const std::vector<int>& shards, std::vector<Volume>* retired = nullptr);
@@ -12,72 +12,68 @@
  * LICENSE: MIT
  */
 #include "rs.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
 #include <stdint.h>
-
-gf gf_exp[GF_SIZE * 2];
-int gf_log[GF_SIZE];
-gf gf_mul_table[GF_SIZE * GF_SIZE];
-gf gf_div_table[GF_SIZE * GF_SIZE];
-
-
-gf gf_mul_direct(gf a, gf b);
-gf gf_div_direct(gf a, gf b);
-
-// Initialize Galois Field tables
+#include <pthread.h>
+
+// gf_exp, gf_log, gf_nibble_table and gf_affine_table are compile-time images, see rs_tables.cpp
+
+// Kernel backends, in order of preference
+const gf_kernels* const gf_all_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    &gf_kernels_avx512,
+    &gf_kernels_avx2,
+    &gf_kernels_ssse3,
+#endif
+#if defined(__aarch64__)
+    &gf_kernels_neon,
+#endif
+    &gf_kernels_scalar,
+    NULL
+};
+const gf_kernels* gf_kernel = &gf_kernels_scalar;
+
+
+// Initialize Galois Field kernels, the tables are built at compile time so this only picks the kernels
 void init_gf() {
-    int i, x = 1;
-    for (i = 0; i < GF_SIZE - 1; i++) {
-        gf_exp[i] = x;
-        gf_log[x] = i;
-        x = (x << 1) ^ ((x & 0x80) ? 0x1d : 0); // 0x1d is the primitive polynomial
-        x &= 0xFF; // Ensure x stays within 8 bits
-    }
-    gf_exp[GF_SIZE - 1] = 1; // Complete the cycle
-    gf_log[0] = -1; // Log of 0 is undefined, use -1 as a sentinel value
-    for (i = GF_SIZE; i < GF_SIZE * 2; i++) {
-        gf_exp[i] = gf_exp[i - (GF_SIZE - 1)];
+    const char* name = getenv("KELP_GF_BACKEND");
+    if (name == NULL || !gf_select_kernels(name)) {
+        gf_select_kernels(NULL);
     }
+}
 
-    // Generate multiplication table
-    for (i = 0; i < GF_SIZE; i++) {
-        for (int j = 0; j < GF_SIZE; j++) {
-            gf_mul_table[i * GF_SIZE + j] = gf_mul_direct(i, j);
-            if(j != 0)
-                gf_div_table[i * GF_SIZE + j] = gf_div_direct(i, j);
+// Select a kernel backend by name, or the best supported one for NULL
+// Returns 1 on success, 0 if the backend is unknown or not supported by this cpu
+int gf_select_kernels(const char* name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+    for (int i = 0; gf_all_kernels[i] != NULL; i++) {
+        const gf_kernels* kernels = gf_all_kernels[i];
+        if ((name == NULL || strcmp(name, kernels->name) == 0) && kernels->supported()) {
+            gf_kernel = kernels;
+            return 1;
         }
     }
+    return 0;
 }
 
 // Galois Field multiplication
-gf gf_mul_direct(gf a, gf b) {
-    if (a == 0 || b == 0) return 0;
-    return gf_exp[(gf_log[a] + gf_log[b]) % (GF_SIZE - 1)];
-}
-
-// Galois Field multiplication
-// table lookup version, about 2x faster than gf_mul_direct
+// gf_exp has two periods, so the sum of the logs needs no modulo
 gf gf_mul(gf a, gf b) {
-    return gf_mul_table[a * GF_SIZE + b];
-}
-
-// Galois Field division
-gf gf_div_direct(gf a, gf b) {
-    if (a == 0) return 0;
-    if (b == 0) {
-        fprintf(stderr, "Error: Division by zero in Galois Field\n");
-        exit(1);
-    }
-    return gf_exp[(gf_log[a] - gf_log[b] + (GF_SIZE - 1)) % (GF_SIZE - 1)];
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
 }
 
-// Galois Field division
+// Galois Field division, 0 for division by zero
 gf gf_div(gf a, gf b) {
-    return gf_div_table[a * GF_SIZE + b];
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + (GF_SIZE - 1) - gf_log[b]];
 }
 
 // Galois Field power
@@ -145,8 +141,7 @@ gf* cauchy(int rows, int cols) {
 
     for (int i = 0; i < rows; i++) {
         for (int j = 0; j < cols; j++) {
-            // matrix[i * cols + j] = gf_div(1, i ^ (rows + j));
-            matrix[i * cols + j] = gf_div_table[256*1 + i ^ (rows + j)];
+            matrix[i * cols + j] = gf_div(1, i ^ (rows + j));
         }
     }
     // print_matrix(matrix, rows, cols);
@@ -169,7 +164,7 @@ gf* cauchy_submatrix(int systematic_rows, int rows, int cols, uint8_t* row_list)
             }
         } else {
             for (int j = 0; j < cols; j++) {
-                matrix[i * cols + j] = gf_div_table[256*1 + row_list[i] ^ (rows + j)];
+                matrix[i * cols + j] = gf_div(1, row_list[i] ^ (rows + j));
             }
         }
     }
@@ -291,9 +286,8 @@ int matrix_invert(gf* matrix, int n) {
         }
         
         // Scale row
-        // temp = gf_div(1, matrix[i * n + i]);
         if (matrix[i * n + i] != 1) {
-            temp = gf_div_table[256*1 + matrix[i * n + i]];
+            temp = gf_div(1, matrix[i * n + i]);
             for (j = 0; j < n; j++) {
                 matrix[i * n + j] = gf_mul(matrix[i * n + j], temp);
                 inverse[i * n + j] = gf_mul(inverse[i * n + j], temp);
@@ -320,9 +314,219 @@ int matrix_invert(gf* matrix, int n) {
 }
 
 
+// Decode matrix cache
+// Inverting the k x k submatrix dominates small decodes, and in practice we see the same few erasure
+// patterns (one dead disk, one slow disk) over and over.  Each entry holds, for one erasure pattern,
+// the k shards we read from and one row of k coefficients per erased shard, so a decode is just
+// mul_add passes over the surviving shards.
+// Entries are reference counted: lookups take the read lock and bump the count, eviction takes the
+// write lock and drops the cache's reference, and the last user frees the entry.
+typedef struct {
+    uint64_t pattern[4];    // bitmap of erased shards
+    int erased_count;
+    int* valid_shards;      // data_shards ids of the shards we reconstruct from
+    int* erased_shards;     // erased_count ids of the shards to rebuild
+    gf* rows;               // erased_count x data_shards decode coefficients
+    uint64_t last_used;
+    int refs;
+} rs_decode_entry;
+
+struct rs_decode_cache {
+    pthread_rwlock_t lock;
+    int capacity;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    rs_decode_entry* entries[];
+};
+
+static rs_decode_cache* decode_cache_new(int capacity) {
+    rs_decode_cache* cache = (rs_decode_cache*)calloc(1, sizeof(rs_decode_cache) + capacity * sizeof(rs_decode_entry*));
+    if (NULL == cache) {
+        return NULL;
+    }
+    if (pthread_rwlock_init(&cache->lock, NULL) != 0) {
+        free((void*)cache);
+        return NULL;
+    }
+    cache->capacity = capacity;
+    return cache;
+}
+
+static void decode_entry_release(rs_decode_entry* entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free((void*)entry);
+    }
+}
+
+static void decode_cache_free(rs_decode_cache* cache) {
+    if (NULL == cache) {
+        return;
+    }
+    for (int i = 0; i < cache->capacity; i++) {
+        if (NULL != cache->entries[i]) {
+            decode_entry_release(cache->entries[i]);
+        }
+    }
+    pthread_rwlock_destroy(&cache->lock);
+    free((void*)cache);
+}
+
+static void erasure_pattern(int* erasures, int total_shards, uint64_t pattern[4]) {
+    memset(pattern, 0, 4 * sizeof(uint64_t));
+    for (int i = 0; i < total_shards; i++) {
+        if (erasures[i] != 0) {
+            pattern[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+}
+
+// Build the decode rows for an erasure pattern, returns NULL if there aren't enough shards or the
+// submatrix is not invertible.  The entry is a single allocation, and is returned holding one reference.
+static rs_decode_entry* decode_entry_build(reed_solomon* rs, const uint64_t pattern[4]) {
+    int i, j, l;
+    int data_shards = rs->data_shards;
+    int erased_count = 0, valid_count = 0;
+
+    for (i = 0; i < rs->shards; i++) {
+        if (pattern[i >> 6] & (1ULL << (i & 63))) {
+            erased_count++;
+        }
+    }
+    if (rs->shards - erased_count < data_shards) {
+        return NULL;
+    }
+
+    size_t size = sizeof(rs_decode_entry) + (data_shards + erased_count) * sizeof(int) + erased_count * data_shards;
+    rs_decode_entry* entry = (rs_decode_entry*)malloc(size);
+    gf* submatrix = (gf*)malloc(data_shards * data_shards * sizeof(gf));
+    if (NULL == entry || NULL == submatrix) {
+        free((void*)entry);
+        free((void*)submatrix);
+        return NULL;
+    }
+    memcpy(entry->pattern, pattern, sizeof(entry->pattern));
+    entry->erased_count = erased_count;
+    entry->valid_shards = (int*)(entry + 1);
+    entry->erased_shards = entry->valid_shards + data_shards;
+    entry->rows = (gf*)(entry->erased_shards + erased_count);
+    entry->last_used = 0;
+    entry->refs = 1;
+
+    erased_count = 0;
+    for (i = 0; i < rs->shards; i++) {
+        if (pattern[i >> 6] & (1ULL << (i & 63))) {
+            entry->erased_shards[erased_count++] = i;
+        } else if (valid_count < data_shards) {
+            memcpy(&submatrix[valid_count * data_shards], &rs->matrix[i * data_shards], data_shards);
+            entry->valid_shards[valid_count++] = i;
+        }
+    }
+
+    if (!matrix_invert(submatrix, data_shards)) {
+        free((void*)submatrix);
+        free((void*)entry);
+        return NULL;
+    }
+
+    // Data shards are a row of the inverse, parity shards are their encoding row times the inverse
+    for (i = 0; i < erased_count; i++) {
+        int shard = entry->erased_shards[i];
+        gf* row = &entry->rows[i * data_shards];
+        if (shard < data_shards) {
+            memcpy(row, &submatrix[shard * data_shards], data_shards);
+        } else {
+            for (j = 0; j < data_shards; j++) {
+                gf coeff = 0;
+                for (l = 0; l < data_shards; l++) {
+                    coeff ^= gf_mul(rs->matrix[shard * data_shards + l], submatrix[l * data_shards + j]);
+                }
+                row[j] = coeff;
+            }
+        }
+    }
+
+    free((void*)submatrix);
+    return entry;
+}
+
+// Look up (or build and insert) the decode entry for a pattern, the caller must decode_entry_release it
+static rs_decode_entry* decode_cache_acquire(reed_solomon* rs, const uint64_t pattern[4]) {
+    rs_decode_cache* cache = rs->decode_cache;
+    rs_decode_entry* entry = NULL;
+    int i;
+
+    if (NULL == cache) {
+        return decode_entry_build(rs, pattern);
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+    for (i = 0; i < cache->capacity; i++) {
+        rs_decode_entry* e = cache->entries[i];
+        if (NULL != e && memcmp(e->pattern, pattern, sizeof(e->pattern)) == 0) {
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&e->last_used, __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+            entry = e;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    if (NULL != entry) {
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        kelp_metric_add(KELP_METRIC_DECODE_CACHE_HITS, 1);
+        return entry;
+    }
+
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    kelp_metric_add(KELP_METRIC_DECODE_CACHE_MISSES, 1);
+    entry = decode_entry_build(rs, pattern);
+    if (NULL == entry) {
+        return NULL;
+    }
+
+    // Insert, evicting the least recently used entry.  Another thread may have beaten us to it.
+    pthread_rwlock_wrlock(&cache->lock);
+    int victim = 0;
+    for (i = 0; i < cache->capacity; i++) {
+        rs_decode_entry* e = cache->entries[i];
+        if (NULL == e) {
+            victim = i;
+            break;
+        }
+        if (memcmp(e->pattern, pattern, sizeof(e->pattern)) == 0) {
+            victim = -1;
+            break;
+        }
+        if (e->last_used < cache->entries[victim]->last_used) {
+            victim = i;
+        }
+    }
+    if (victim >= 0) {
+        if (NULL != cache->entries[victim]) {
+            decode_entry_release(cache->entries[victim]);
+        }
+        entry->last_used = __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED);
+        entry->refs++;
+        cache->entries[victim] = entry;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    return entry;
+}
+
+void rs_decode_cache_stats(reed_solomon* rs, uint64_t* hits, uint64_t* misses) {
+    *hits = 0;
+    *misses = 0;
+    if (NULL != rs->decode_cache) {
+        *hits = __atomic_load_n(&rs->decode_cache->hits, __ATOMIC_RELAXED);
+        *misses = __atomic_load_n(&rs->decode_cache->misses, __ATOMIC_RELAXED);
+    }
+}
+
+
 const int DATA_SHARDS_MAX = 255;
 
-reed_solomon* rs_new(int data_shards, int parity_shards) {
+// Builds the first data_shards + parity_shards rows of the systematic code made from cauchy(rows, data_shards)
+static reed_solomon* rs_build(int data_shards, int parity_shards, int rows) {
     gf* vm = NULL;
     gf* top = NULL;
     int err = 0;
@@ -341,37 +545,34 @@ reed_solomon* rs_new(int data_shards, int parity_shards) {
         rs->shards = (data_shards + parity_shards);
         rs->matrix = NULL;
         rs->parity = NULL;
+        rs->decode_cache = NULL;
 
-        if(rs->shards > DATA_SHARDS_MAX || data_shards <= 0 || parity_shards <= 0) {
+        // The Cauchy x's are the rows and the y's follow them, all must be distinct elements of GF(256)
+        if(rs->shards > DATA_SHARDS_MAX || data_shards <= 0 || parity_shards <= 0 || rs->shards > rows || rows + data_shards > GF_SIZE) {
             err = 1;
             break;
         }
 
         // vm = vandermonde(rs->shards, rs->data_shards);
-        vm = cauchy(rs->shards, rs->data_shards);
+        vm = cauchy(rows, rs->data_shards);
         if(NULL == vm) {
             err = 2;
             break;
         }
-        printf("Vandermonde matrix:\n");
-        print_matrix(vm, rs->shards, rs->data_shards);
 
-        top = sub_matrix(vm, 0, 0, data_shards, data_shards, rs->shards, data_shards);
+        top = sub_matrix(vm, 0, 0, data_shards, data_shards, rows, data_shards);
         if(NULL == top) {
             err = 3;
             break;
         }
-        printf("Top submatrix:\n");
-        print_matrix(top, data_shards, data_shards);
 
         err = matrix_invert(top, data_shards);
         if (err == 0) {
-            printf("Matrix inversion failed with error code: %d\n", err);
+            fprintf(stderr, "Matrix inversion failed\n");
             break;
         }
-        printf("Inverted matrix:\n");
-        print_matrix(top, data_shards, data_shards);
 
+        // Only the rows in use, vm is row major so its first rs->shards rows are a matrix of their own
         rs->matrix = multiply1(vm, rs->shards, data_shards, top, data_shards, data_shards);
         // rs->matrix = (gf*)malloc(rs->shards * data_shards);
         // matrix_multiply(vm, top, rs->matrix, rs->shards);
@@ -386,6 +587,12 @@ reed_solomon* rs_new(int data_shards, int parity_shards) {
             break;
         }
 
+        rs->decode_cache = decode_cache_new(RS_DECODE_CACHE_ENTRIES);
+        if(NULL == rs->decode_cache) {
+            err = 6;
+            break;
+        }
+
         free((void*)vm);
         free((void*)top);
         vm = NULL;
@@ -408,93 +615,115 @@ reed_solomon* rs_new(int data_shards, int parity_shards) {
         if(NULL != rs->parity) {
             free((void*)rs->parity);
         }
+        decode_cache_free(rs->decode_cache);
         free((void*)rs);
     }
 
     return NULL;
 }
 
+reed_solomon* rs_new(int data_shards, int parity_shards) {
+    return rs_build(data_shards, parity_shards, data_shards + parity_shards);
+}
+
+reed_solomon* rs_new_nested(int data_shards, int parity_shards) {
+    return rs_build(data_shards, parity_shards, rs_nested_max_shards(data_shards));
+}
+
+int rs_nested_max_shards(int data_shards) {
+    return GF_SIZE - data_shards < MAX_TOTAL_SHARDS ? GF_SIZE - data_shards : MAX_TOTAL_SHARDS;
+}
+
 // Encode data
 // data is an array of pointers to the data shards
 // parity is an array of pointers to the parity shards
+// All parity shards are produced in one fused pass over the data shards
 void rs_encode(reed_solomon* rs, unsigned char** data, unsigned char** parity, int shard_size) {
-    for (int i = 0; i < rs->parity_shards; i++) {
-        int first = 1;
-        for (int j = 0; j < rs->data_shards; j++) {
-            gf coeff = rs->matrix[(rs->data_shards + i) * rs->data_shards + j];
-            if(coeff == 0) continue;
-            if (first) {
-                first = 0;
-                if(coeff == 1) {
-                    memcpy(parity[i], data[j], shard_size);
-                } else {
-                    mul1_avx2(parity[i], data[j], coeff, shard_size);
-                }
-            } else {
-                if(coeff == 1) {
-                    add1_avx2(parity[i], data[j], shard_size);
-                } else {
-                    mul_add1_avx2(parity[i], data[j], coeff, shard_size);
-                }
+    mul_rows(parity, rs->parity_shards, data, rs->data_shards, rs->parity, shard_size);
+    kelp_metric_add(KELP_METRIC_RS_ENCODED_BYTES, (uint64_t)rs->data_shards * shard_size);
+}
+
+
+// Update parity for a change to one data shard, using the linearity of the code:
+// parity_i += coeff(i, shard_idx) * (new ^ old), so none of the other data shards need to be read.
+// parity is an array of parity_shards pointers, NULL entries are skipped.
+// Returns 1 on success, 0 if shard_idx is not a data shard
+int rs_update_parity(reed_solomon* rs, int shard_idx, const unsigned char* old_data, const unsigned char* new_data, unsigned char** parity, int shard_size) {
+    gf delta[1024];
+
+    if (shard_idx < 0 || shard_idx >= rs->data_shards) {
+        return 0;
+    }
+
+    for (int offset = 0; offset < shard_size; offset += sizeof(delta)) {
+        int len = shard_size - offset < (int)sizeof(delta) ? shard_size - offset : (int)sizeof(delta);
+        memcpy(delta, &new_data[offset], len);
+        add1(delta, &old_data[offset], len);
+        for (int i = 0; i < rs->parity_shards; i++) {
+            if (NULL != parity[i]) {
+                mul_add1(&parity[i][offset], delta, rs->parity[i * rs->data_shards + shard_idx], len);
             }
         }
     }
+    return 1;
 }
 
 
 // Decode data
+// erasures is an array of total_shards flags, non-zero marks a shard to be reconstructed
+// The decode coefficients for each erasure pattern are cached on the codec, so repeated decodes of
+// the same pattern skip the matrix inversion.
 int rs_decode(reed_solomon* rs, unsigned char** shards, int* erasures, int erasure_count, int shard_size) {
-    int i, j, k;
+    return rs_decode_range(rs, shards, erasures, erasure_count, NULL, 0, shard_size);
+}
+
+// Decode only bytes [offset, offset + length) of the erased shards flagged in wanted (all erased shards
+// if wanted is NULL).  erasures must still flag every missing shard, so none of them is used as an input,
+// but erased shards we don't want aren't touched.  Only the window of the input shards is read, so a
+// small degraded read costs about length * k multiply-adds per wanted shard.
+int rs_decode_range(reed_solomon* rs, unsigned char** shards, int* erasures, int erasure_count, int* wanted, int offset, int length) {
+    int i, j, decoded = 0;
     int data_shards = rs->data_shards;
     int total_shards = data_shards + rs->parity_shards;
-    
+    uint64_t pattern[4];
+
     // Check if we have enough shards to reconstruct
     if (total_shards - erasure_count < data_shards) {
-        printf("Not enough shards to reconstruct data\n");
+        kelp_metric_add(KELP_METRIC_RS_DECODE_FAILURES, 1);
         return 0; // Not enough shards to reconstruct
     }
-    
-    // Create submatrix
-    gf* submatrix = malloc(data_shards * data_shards * sizeof(gf));
-    int* valid_shards = malloc(data_shards * sizeof(int));
-    int valid_count = 0;
-    
-    for (i = 0; i < total_shards && valid_count < data_shards; i++) {
-        if (erasures[i] == 0) {
-            for (j = 0; j < data_shards; j++) {
-                submatrix[valid_count * data_shards + j] = rs->matrix[i * data_shards + j];
-            }
-            valid_shards[valid_count] = i;
-            valid_count++;
-        }
+    if (erasure_count == 0) {
+        return 1;
     }
-    
-    // Invert the submatrix
-    if (!matrix_invert(submatrix, data_shards)) {
-        free((void*)submatrix);
-        free((void*)valid_shards);
-        print_matrix(rs->matrix, total_shards, data_shards);
-        printf("Submatrix is not invertible\n");
+
+    erasure_pattern(erasures, total_shards, pattern);
+    rs_decode_entry* entry = decode_cache_acquire(rs, pattern);
+    if (NULL == entry) {
+        kelp_metric_add(KELP_METRIC_RS_DECODE_FAILURES, 1);
         return 0; // Submatrix is not invertible
     }
-    
-    // Reconstruct missing shards
-    for (i = 0; i < total_shards; i++) {
-        if (erasures[i] == 1) {
-            memset(shards[i], 0, shard_size);
-            for (j = 0; j < data_shards; j++) {
-                gf* shard = shards[valid_shards[j]];
-                gf coeff = submatrix[i * data_shards + j];
-                mul_add1_avx2(shards[i], shard, coeff, shard_size);
-                // for (k = 0; k < shard_size; k++) {
-                //     shards[i][k] ^= gf_mul(coeff, shard[k]);
-                // }
-            }
+
+    // Reconstruct missing shards, in runs of consecutive wanted rows so the fused kernel
+    // still reads each input once per run
+    gf* inputs[MAX_DATA_SHARDS];
+    gf* outputs[MAX_TOTAL_SHARDS];
+    for (i = 0; i < data_shards; i++) {
+        inputs[i] = shards[entry->valid_shards[i]] + offset;
+    }
+    for (i = 0; i < entry->erased_count; i = j) {
+        if (NULL != wanted && !wanted[entry->erased_shards[i]]) {
+            j = i + 1;
+            continue;
         }
+        for (j = i; j < entry->erased_count && (NULL == wanted || wanted[entry->erased_shards[j]]); j++) {
+            outputs[j - i] = shards[entry->erased_shards[j]] + offset;
+        }
+        mul_rows(outputs, j - i, inputs, data_shards, entry->rows + i * data_shards, length);
+        decoded += j - i;
     }
-    
-    free((void*)submatrix);
-    free((void*)valid_shards);
+    kelp_metric_add(KELP_METRIC_RS_DECODED_BYTES, (uint64_t)decoded * length);
+
+    decode_entry_release(entry);
     return 1;
 }
 
@@ -502,77 +731,66 @@ int rs_decode(reed_solomon* rs, unsigned char** shards, int* erasures, int erasu
 // compute the coding coefficients and perform the coding operation.
 // The input shards are read-only, and the output shards are modified in place.
 // The input and output lists must be disjoint.
-// The input must contain a linear span of the output shards. (partial decode is fine as long as the input is a subset of the output)
+// The first data_shards inputs are used, they must be distinct so they span the code.
 // The input and output lists may be in any order.
 // input and outputs can include both data and parity shards.
-// the code should handle various identity cases fast enough to need special casing
-// the length of shard_ids and shards is input_count + output_count
+// the length of shard_ids and shards is input_count + output_count, inputs first
 
 int rs_generic_galois_coding(reed_solomon *rs, int* shard_ids, int input_count, int output_count, size_t shard_size, unsigned char** shards) {
-    int i, j, k;
-    int data_shards = input_count;
-    int total_shards = input_count + output_count;
+    int i, j, l;
+    int data_shards = rs->data_shards;
+
+    if (input_count < data_shards) {
+        return 0; // Not enough shards to span the code
+    }
+
     gf* input_matrix = malloc(data_shards * data_shards * sizeof(gf));
-    gf* output_matrix = malloc(output_count * data_shards * sizeof(gf));
-    
+    gf* reconstruction_matrix = malloc(output_count * data_shards * sizeof(gf));
+    if (NULL == input_matrix || NULL == reconstruction_matrix) {
+        free((void*)input_matrix);
+        free((void*)reconstruction_matrix);
+        return 0;
+    }
+
     // Create submatrix
     for (i = 0; i < data_shards; i++) {
-        if (shard_ids[i] < data_shards) {
-            memcpy(&input_matrix[i * data_shards], &rs->matrix[shard_ids[i] * data_shards], data_shards);
-        }
+        memcpy(&input_matrix[i * data_shards], &rs->matrix[shard_ids[i] * data_shards], data_shards);
     }
-    
+
     // Invert the submatrix
     if (!matrix_invert(input_matrix, data_shards)) {
         free((void*)input_matrix);
-        free((void*)output_matrix);
+        free((void*)reconstruction_matrix);
         return 0; // Submatrix is not invertible
     }
 
-    // construct output matrix
+    // multiply the output rows by the inverse matrix
     for (i = 0; i < output_count; i++) {
-        memcpy(&output_matrix[i * data_shards], &rs->matrix[(data_shards + shard_ids[i]) * data_shards], data_shards);
-    }
-    // multiply the output shards by the inverse matrix
-    gf* reconstruction_matrix = malloc(output_count * data_shards * sizeof(gf));
-    matrix_multiply(output_matrix, input_matrix, reconstruction_matrix, output_count);
-    free((void*)output_matrix);
-    output_matrix = NULL;
-    
-    
-    // Reconstruct missing shards
-    for (int i = 0; i < output_count; i++) {
-        int first = 1;
-        for (int j = 0; j < data_shards; j++) {
-            int coeff = reconstruction_matrix[i * data_shards + j];
-            if(coeff == 0) continue;
-            if (first) {
-                first = 0;
-                if(coeff == 1) {
-                    memcpy(shards[i], shards[j], shard_size);
-                } else {
-                    mul1_avx2(shards[i], shards[j], coeff, shard_size);
-                }
-            } else {
-                if(coeff == 1) {
-                    add1_avx2(shards[i], shards[j], shard_size);
-                } else {
-                    mul_add1_avx2(shards[i], shards[j], coeff, shard_size);
-                }
+        const gf* row = &rs->matrix[shard_ids[input_count + i] * data_shards];
+        for (j = 0; j < data_shards; j++) {
+            gf coeff = 0;
+            for (l = 0; l < data_shards; l++) {
+                coeff ^= gf_mul(row[l], input_matrix[l * data_shards + j]);
             }
+            reconstruction_matrix[i * data_shards + j] = coeff;
         }
     }
-    
+
+    // Reconstruct output shards
+    mul_rows(&shards[input_count], output_count, shards, data_shards, reconstruction_matrix, shard_size);
+
     free((void*)input_matrix);
     free((void*)reconstruction_matrix);
-    
+
     return 1;
 }
 
 
 // Free Reed-Solomon codec
 void rs_free(reed_solomon* rs) {
+    decode_cache_free(rs->decode_cache);
     free((void*)rs->matrix);
+    free((void*)rs->parity);
     free((void*)rs);
 }
 
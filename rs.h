@@ -1,18 +1,32 @@
+#pragma once
+
 #include <stdint.h>
+#include <stddef.h>
 
 #define GF_SIZE 256
 #define MAX_DATA_SHARDS 255
 #define MAX_TOTAL_SHARDS 255
+#define RS_DECODE_CACHE_ENTRIES 32
 
 typedef unsigned char gf; // Galois Field element
 
 
-// Galois Field tables
-extern gf gf_exp[GF_SIZE * 2];
-extern int gf_log[GF_SIZE];
-extern gf gf_mul_table[GF_SIZE * GF_SIZE];
-extern gf gf_div_table[GF_SIZE * GF_SIZE];
+// Galois Field tables, images built at compile time by rs_tables.cpp, under 12 KB in all
+extern const gf gf_exp[GF_SIZE * 2];
+extern const int gf_log[GF_SIZE];
+// Per coefficient shuffle tables for the SIMD kernels: c * x for the low nibble, then c * (x << 4) for the high nibble
+extern const gf gf_nibble_table[GF_SIZE * 32];
+// Per coefficient 8x8 bit matrices for GFNI affine multiplies, row for output bit i in byte 7 - i
+extern const uint64_t gf_affine_table[GF_SIZE];
+
+// c * x from c's 32 bytes of nibble table, for the scalar kernels and the SIMD kernels' tails
+static inline gf gf_mul_nibble(const gf* lut, gf x) {
+    return lut[x & 15] ^ lut[16 + (x >> 4)];
+}
+
 
+// Cache of inverted decode matrices keyed by erasure pattern, see rs.c
+typedef struct rs_decode_cache rs_decode_cache;
 
 // Reed-Solomon structure
 typedef struct  {
@@ -21,6 +35,7 @@ typedef struct  {
     int shards;
     unsigned char* matrix;
     unsigned char* parity;
+    rs_decode_cache* decode_cache;
 } reed_solomon;
 
 
@@ -37,18 +52,61 @@ static gf* sub_matrix(gf* matrix, int rmin, int cmin, int rmax, int cmax, int nr
 // static gf* multiply1(gf *a, int ar, int ac, gf *b, int br, int bc);
 static inline int code_some_shards(gf* matrixRows, gf** inputs, gf** outputs, int dataShards, int outputCount, int byteCount);
 reed_solomon* rs_new(int data_shards, int parity_shards);
+// Like rs_new, but parity row i doesn't depend on parity_shards: every rs_new_nested(k, m) is the first k + m
+// rows of the same code, so parity shards can be added to or dropped from existing stripes without
+// touching the others.  Not compatible with rs_new(k, m) parity, data_shards + parity_shards is at most
+// rs_nested_max_shards(k).
+reed_solomon* rs_new_nested(int data_shards, int parity_shards);
+int rs_nested_max_shards(int data_shards);
 void rs_encode(reed_solomon* rs, unsigned char** data, unsigned char** parity, int shard_size);
+int rs_update_parity(reed_solomon* rs, int shard_idx, const unsigned char* old_data, const unsigned char* new_data, unsigned char** parity, int shard_size);
 void matrix_multiply(gf* a, gf* b, gf* result, int n);
 int is_identity(gf* matrix, int n);
 int matrix_invert(gf* matrix, int n);
 int rs_decode(reed_solomon* rs, unsigned char** shards, int* erasures, int erasure_count, int shard_size);
+int rs_decode_range(reed_solomon* rs, unsigned char** shards, int* erasures, int erasure_count, int* wanted, int offset, int length);
+int rs_generic_galois_coding(reed_solomon *rs, int* shard_ids, int input_count, int output_count, size_t shard_size, unsigned char** shards);
+void rs_decode_cache_stats(reed_solomon* rs, uint64_t* hits, uint64_t* misses);
 void rs_free(reed_solomon* rs);
 
+// Fixed RS(8, m) geometries (m = 4, 8, 12) from rscodec.hpp, return 0 for other m
+int rs8_encode(int parity_shards, unsigned char** data, unsigned char** parity, int shard_size);
+int rs8_decode(int parity_shards, unsigned char** shards, int* erasures, int shard_size);
+
+// Kernel backends
+// Each backend implements the same four kernels, init_gf() picks the best one the cpu supports
+// (overridable with the KELP_GF_BACKEND environment variable) and the wrappers below call it.
+typedef struct {
+    const char* name;
+    int (*supported)(void);
+    void (*mul1)(gf *dst, const gf *src, gf c, int sz);         // dst = src * c
+    void (*mul_add1)(gf *dst, const gf *src, gf c, int sz);     // dst += src * c
+    void (*add1)(gf *dst, const gf *src, int sz);               // dst += src
+    void (*mul_rows)(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz); // dst[r] = sum_j coeffs[r][j] * src[j]
+} gf_kernels;
+
+extern const gf_kernels gf_kernels_scalar;
+extern const gf_kernels gf_kernels_ssse3;
+extern const gf_kernels gf_kernels_avx2;
+extern const gf_kernels gf_kernels_avx512;
+extern const gf_kernels gf_kernels_neon;
+
+extern const gf_kernels* const gf_all_kernels[];  // in order of preference, NULL terminated
+extern const gf_kernels* gf_kernel;               // the selected backend
+
+int gf_select_kernels(const char* name);
+
+static inline void mul1(gf *dst, const gf *src, gf c, int sz) { gf_kernel->mul1(dst, src, c, sz); }
+static inline void mul_add1(gf *dst, const gf *src, gf c, int sz) { gf_kernel->mul_add1(dst, src, c, sz); }
+static inline void add1(gf *dst, const gf *src, int sz) { gf_kernel->add1(dst, src, sz); }
+static inline void mul_rows(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) { gf_kernel->mul_rows(dst, dst_count, src, src_count, coeffs, sz); }
+
 // AVX2 accelerated functions
 void mul1_avx2_orig(gf *dst, const gf *src, gf c, int sz);
 void mul1_avx2(gf *dst, const gf *src, gf c, int sz);
 void mul_add1_avx2(gf *dst, const gf *src, gf c, int sz);
 void add1_avx2(gf *dst, const gf *src, int sz);
+void mul_rows_avx2(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz);
 
 // Utility functions
 void print_matrix(gf* matrix, int rows, int cols);
\ No newline at end of file
@@ -12,98 +12,70 @@
  * LICENSE: MIT
  */
 #include "rs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("avx2")
 #include <immintrin.h>
 
 
 
-// Assuming you have these tables precomputed
+// The tables are precomputed per coefficient in gf_nibble_table, see rs_tables.cpp
+// Each byte is split into nibbles and looked up with a shuffle: c * x = c * (x & 0xf) ^ c * (x & 0xf0)
 
 // AVX2 optimized version of mul1: dst = src * c (c is a single byte) in GF(256)
 // Note that it's faster to pad the table to 64 bytes and ignore the tail than the clean up loop
 void mul1_avx2(gf *dst, const gf *src, gf c, int sz) {
-    const gf* lut = &gf_mul_table[c << 8];
+    const gf* lut = &gf_nibble_table[c * 32];
     int i;
-    __m256i t0_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[0]));
-    __m256i t1_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[16]));
-    __m256i t2_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[32]));
-    __m256i t3_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[48]));
-
-    __m256i t0_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[64]));
-    __m256i t1_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[80]));
-    __m256i t2_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[96]));
-    __m256i t3_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[112]));
+    __m256i t_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[0]));
+    __m256i t_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[16]));
     __m256i clr_mask = _mm256_set1_epi8(0x0f);
     for (i = 0; i + 64 <= sz; i += 64) {
-        __m256i src_lo = _mm256_loadu_si256((__m256i*)&src[i]);
-        __m256i src_hi = _mm256_loadu_si256((__m256i*)&src[i + 32]);
-        
-        __m256i data_0 = _mm256_and_si256(src_lo, clr_mask);
-        __m256i dst_lo_0 = _mm256_shuffle_epi8(t0_lo, data_0);
-        __m256i dst_hi_0 = _mm256_shuffle_epi8(t0_hi, data_0);
-
-        __m256i data_1 = _mm256_and_si256(_mm256_srli_epi64(src_lo, 4), clr_mask);
-        __m256i dst_lo_1 = _mm256_shuffle_epi8(t1_lo, data_1);
-        __m256i dst_hi_1 = _mm256_shuffle_epi8(t1_hi, data_1);
-
-        data_0 = _mm256_and_si256(src_hi, clr_mask);
-        dst_lo_0 = _mm256_xor_si256(dst_lo_0, _mm256_shuffle_epi8(t2_lo, data_0));
-        dst_hi_0 = _mm256_xor_si256(dst_hi_0, _mm256_shuffle_epi8(t2_hi, data_0));
-
-        data_1 = _mm256_and_si256(_mm256_srli_epi64(src_hi, 4), clr_mask);
-        dst_lo_1 = _mm256_xor_si256(dst_lo_1, _mm256_shuffle_epi8(t3_lo, data_1));
-        dst_hi_1 = _mm256_xor_si256(dst_hi_1, _mm256_shuffle_epi8(t3_hi, data_1));
-    
-        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(dst_lo_0, dst_lo_1));
-        _mm256_storeu_si256((__m256i*)&dst[i + 32], _mm256_xor_si256(dst_hi_0, dst_hi_1));
+        __m256i src_0 = _mm256_loadu_si256((__m256i*)&src[i]);
+        __m256i src_1 = _mm256_loadu_si256((__m256i*)&src[i + 32]);
+
+        __m256i dst_0 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(t_lo, _mm256_and_si256(src_0, clr_mask)),
+            _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(src_0, 4), clr_mask)));
+        __m256i dst_1 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(t_lo, _mm256_and_si256(src_1, clr_mask)),
+            _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(src_1, 4), clr_mask)));
+
+        _mm256_storeu_si256((__m256i*)&dst[i], dst_0);
+        _mm256_storeu_si256((__m256i*)&dst[i + 32], dst_1);
     }
     
     // Handle remaining elements
     for (; i < sz; i++) {
-        dst[i] = gf_mul_table[(c << 8) + src[i]];
+        dst[i] = gf_mul_nibble(lut, src[i]);
     }
 }
 
 // AVX2 optimized version of dst += src * c (c is a single byte) in GF(256)
 void mul_add1_avx2(gf *dst, const gf *src, gf c, int sz) {
-    const gf* lut = &gf_mul_table[c << 8];
+    const gf* lut = &gf_nibble_table[c * 32];
     int i;
-    __m256i t0_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[0]));
-    __m256i t1_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[16]));
-    __m256i t2_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[32]));
-    __m256i t3_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[48]));
-
-    __m256i t0_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[64]));
-    __m256i t1_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[80]));
-    __m256i t2_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[96]));
-    __m256i t3_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[112]));
+    __m256i t_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[0]));
+    __m256i t_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[16]));
     __m256i clr_mask = _mm256_set1_epi8(0x0f);
     for (i = 0; i + 64 <= sz; i += 64) {
-        __m256i src_lo = _mm256_loadu_si256((__m256i*)&src[i]);
-        __m256i src_hi = _mm256_loadu_si256((__m256i*)&src[i + 32]);
-        
-        __m256i data_0 = _mm256_and_si256(src_lo, clr_mask);
-        __m256i dst_lo_0 = _mm256_shuffle_epi8(t0_lo, data_0);
-        __m256i dst_hi_0 = _mm256_shuffle_epi8(t0_hi, data_0);
-
-        __m256i data_1 = _mm256_and_si256(_mm256_srli_epi64(src_lo, 4), clr_mask);
-        __m256i dst_lo_1 = _mm256_shuffle_epi8(t1_lo, data_1);
-        __m256i dst_hi_1 = _mm256_shuffle_epi8(t1_hi, data_1);
-
-        data_0 = _mm256_and_si256(src_hi, clr_mask);
-        dst_lo_0 = _mm256_xor_si256(dst_lo_0, _mm256_shuffle_epi8(t2_lo, data_0));
-        dst_hi_0 = _mm256_xor_si256(dst_hi_0, _mm256_shuffle_epi8(t2_hi, data_0));
-
-        data_1 = _mm256_and_si256(_mm256_srli_epi64(src_hi, 4), clr_mask);
-        dst_lo_1 = _mm256_xor_si256(dst_lo_1, _mm256_shuffle_epi8(t3_lo, data_1));
-        dst_hi_1 = _mm256_xor_si256(dst_hi_1, _mm256_shuffle_epi8(t3_hi, data_1));
-    
-        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(*(__m256i*)&dst[i], _mm256_xor_si256(dst_lo_0, dst_lo_1)));
-        _mm256_storeu_si256((__m256i*)&dst[i + 32], _mm256_xor_si256(*(__m256i*)&dst[i+32], _mm256_xor_si256(dst_hi_0, dst_hi_1)));
+        __m256i src_0 = _mm256_loadu_si256((__m256i*)&src[i]);
+        __m256i src_1 = _mm256_loadu_si256((__m256i*)&src[i + 32]);
+
+        __m256i dst_0 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(t_lo, _mm256_and_si256(src_0, clr_mask)),
+            _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(src_0, 4), clr_mask)));
+        __m256i dst_1 = _mm256_xor_si256(
+            _mm256_shuffle_epi8(t_lo, _mm256_and_si256(src_1, clr_mask)),
+            _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(src_1, 4), clr_mask)));
+
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(_mm256_loadu_si256((__m256i*)&dst[i]), dst_0));
+        _mm256_storeu_si256((__m256i*)&dst[i + 32], _mm256_xor_si256(_mm256_loadu_si256((__m256i*)&dst[i + 32]), dst_1));
     }
     
     // Handle remaining elements
     for (; i < sz; i++) {
-        dst[i] ^= gf_mul_table[(c << 8) + src[i]];
+        dst[i] ^= gf_mul_nibble(lut, src[i]);
     }
 }
 
@@ -122,4 +94,78 @@ void add1_avx2(gf *dst, const gf *src, int sz) {
     for (; i < sz; i++) {
         dst[i] ^= src[i];
     }
-}
\ No newline at end of file
+}
+
+// Fused multi-source kernel: dst[r] = sum_j coeffs[r * src_count + j] * src[j] for r < dst_count
+// Each 64 byte column is loaded once per group of up to 4 outputs, and the outputs are accumulated
+// in registers and stored once, rather than load/store of the destination for every source.
+static inline __attribute__((always_inline)) void mul_rows_block_avx2(gf **dst, gf **src, int src_count, const gf *coeffs, int stride, int n, int sz) {
+    __m256i clr_mask = _mm256_set1_epi8(0x0f);
+    int i, j, r;
+    for (i = 0; i + 64 <= sz; i += 64) {
+        __m256i acc_0[4], acc_1[4];
+        for (r = 0; r < n; r++) {
+            acc_0[r] = _mm256_setzero_si256();
+            acc_1[r] = _mm256_setzero_si256();
+        }
+        for (j = 0; j < src_count; j++) {
+            __m256i src_0 = _mm256_loadu_si256((__m256i*)&src[j][i]);
+            __m256i src_1 = _mm256_loadu_si256((__m256i*)&src[j][i + 32]);
+            __m256i lo_0 = _mm256_and_si256(src_0, clr_mask);
+            __m256i hi_0 = _mm256_and_si256(_mm256_srli_epi64(src_0, 4), clr_mask);
+            __m256i lo_1 = _mm256_and_si256(src_1, clr_mask);
+            __m256i hi_1 = _mm256_and_si256(_mm256_srli_epi64(src_1, 4), clr_mask);
+            for (r = 0; r < n; r++) {
+                const gf* lut = &gf_nibble_table[coeffs[r * stride + j] * 32];
+                __m256i t_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[0]));
+                __m256i t_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&lut[16]));
+                acc_0[r] = _mm256_xor_si256(acc_0[r], _mm256_xor_si256(_mm256_shuffle_epi8(t_lo, lo_0), _mm256_shuffle_epi8(t_hi, hi_0)));
+                acc_1[r] = _mm256_xor_si256(acc_1[r], _mm256_xor_si256(_mm256_shuffle_epi8(t_lo, lo_1), _mm256_shuffle_epi8(t_hi, hi_1)));
+            }
+        }
+        for (r = 0; r < n; r++) {
+            _mm256_storeu_si256((__m256i*)&dst[r][i], acc_0[r]);
+            _mm256_storeu_si256((__m256i*)&dst[r][i + 32], acc_1[r]);
+        }
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        for (r = 0; r < n; r++) {
+            gf acc = 0;
+            for (j = 0; j < src_count; j++) {
+                acc ^= gf_mul_nibble(&gf_nibble_table[coeffs[r * stride + j] * 32], src[j][i]);
+            }
+            dst[r][i] = acc;
+        }
+    }
+}
+
+void mul_rows_avx2(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) {
+    int r = 0;
+    // Blocks of 4 outputs use 8 accumulators, which with the sources and tables fits the 16 ymm registers
+    for (; r + 4 <= dst_count; r += 4) {
+        mul_rows_block_avx2(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 4, sz);
+    }
+    switch (dst_count - r) {
+    case 3:
+        mul_rows_block_avx2(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 3, sz);
+        break;
+    case 2:
+        mul_rows_block_avx2(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 2, sz);
+        break;
+    case 1:
+        mul_rows_block_avx2(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 1, sz);
+        break;
+    }
+}
+
+static int avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+const gf_kernels gf_kernels_avx2 = {
+    "avx2", avx2_supported, mul1_avx2, mul_add1_avx2, add1_avx2, mul_rows_avx2
+};
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * Reed-Solomon Erasure Code AVX-512 + GFNI kernels
+ * 
+ * vgf2p8mulb multiplies modulo the AES polynomial (0x11b) rather than our 0x11d, so instead we use
+ * vgf2p8affineqb: multiplying by a constant c is linear over GF(2), so it is an 8x8 bit matrix
+ * (gf_affine_table[c], built at compile time) and one instruction multiplies 64 bytes.
+ * The tail of each buffer is done with masked loads and stores rather than a scalar loop.
+ * 
+ * LICENSE: MIT
+ */
+#include "rs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("avx512f,avx512bw,gfni")
+#include <immintrin.h>
+
+static inline __mmask64 tail_mask(int n) {
+    return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+static void mul1_avx512(gf *dst, const gf *src, gf c, int sz) {
+    __m512i m = _mm512_set1_epi64(gf_affine_table[c]);
+    for (int i = 0; i < sz; i += 64) {
+        __mmask64 k = tail_mask(sz - i);
+        __m512i x = _mm512_maskz_loadu_epi8(k, &src[i]);
+        _mm512_mask_storeu_epi8(&dst[i], k, _mm512_gf2p8affine_epi64_epi8(x, m, 0));
+    }
+}
+
+static void mul_add1_avx512(gf *dst, const gf *src, gf c, int sz) {
+    __m512i m = _mm512_set1_epi64(gf_affine_table[c]);
+    for (int i = 0; i < sz; i += 64) {
+        __mmask64 k = tail_mask(sz - i);
+        __m512i x = _mm512_maskz_loadu_epi8(k, &src[i]);
+        __m512i d = _mm512_maskz_loadu_epi8(k, &dst[i]);
+        _mm512_mask_storeu_epi8(&dst[i], k, _mm512_xor_si512(d, _mm512_gf2p8affine_epi64_epi8(x, m, 0)));
+    }
+}
+
+static void add1_avx512(gf *dst, const gf *src, int sz) {
+    for (int i = 0; i < sz; i += 64) {
+        __mmask64 k = tail_mask(sz - i);
+        __m512i x = _mm512_maskz_loadu_epi8(k, &src[i]);
+        __m512i d = _mm512_maskz_loadu_epi8(k, &dst[i]);
+        _mm512_mask_storeu_epi8(&dst[i], k, _mm512_xor_si512(d, x));
+    }
+}
+
+// See mul_rows_block_avx2, 128 byte columns in two zmm registers per output
+static inline __attribute__((always_inline)) void mul_rows_block_avx512(gf **dst, gf **src, int src_count, const gf *coeffs, int stride, int n, int sz) {
+    int i, j, r;
+    for (i = 0; i < sz; i += 128) {
+        __mmask64 k_0 = tail_mask(sz - i);
+        __mmask64 k_1 = sz - i > 64 ? tail_mask(sz - i - 64) : 0;
+        __m512i acc_0[4], acc_1[4];
+        for (r = 0; r < n; r++) {
+            acc_0[r] = _mm512_setzero_si512();
+            acc_1[r] = _mm512_setzero_si512();
+        }
+        for (j = 0; j < src_count; j++) {
+            __m512i src_0 = _mm512_maskz_loadu_epi8(k_0, &src[j][i]);
+            __m512i src_1 = _mm512_maskz_loadu_epi8(k_1, &src[j][i + 64]);
+            for (r = 0; r < n; r++) {
+                __m512i m = _mm512_set1_epi64(gf_affine_table[coeffs[r * stride + j]]);
+                acc_0[r] = _mm512_xor_si512(acc_0[r], _mm512_gf2p8affine_epi64_epi8(src_0, m, 0));
+                acc_1[r] = _mm512_xor_si512(acc_1[r], _mm512_gf2p8affine_epi64_epi8(src_1, m, 0));
+            }
+        }
+        for (r = 0; r < n; r++) {
+            _mm512_mask_storeu_epi8(&dst[r][i], k_0, acc_0[r]);
+            _mm512_mask_storeu_epi8(&dst[r][i + 64], k_1, acc_1[r]);
+        }
+    }
+}
+
+static void mul_rows_avx512(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) {
+    int r = 0;
+    for (; r + 4 <= dst_count; r += 4) {
+        mul_rows_block_avx512(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 4, sz);
+    }
+    switch (dst_count - r) {
+    case 3:
+        mul_rows_block_avx512(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 3, sz);
+        break;
+    case 2:
+        mul_rows_block_avx512(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 2, sz);
+        break;
+    case 1:
+        mul_rows_block_avx512(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 1, sz);
+        break;
+    }
+}
+
+static int avx512_supported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("gfni");
+}
+
+const gf_kernels gf_kernels_avx512 = {
+    "avx512", avx512_supported, mul1_avx512, mul_add1_avx512, add1_avx512, mul_rows_avx512
+};
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * Reed-Solomon Erasure Code NEON kernels
+ * 
+ * aarch64 versions of the nibble table kernels, tbl does the same job as pshufb.
+ * 
+ * LICENSE: MIT
+ */
+#include "rs.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+static inline uint8x16_t mul_neon(uint8x16_t x, uint8x16_t t_lo, uint8x16_t t_hi, uint8x16_t clr_mask) {
+    return veorq_u8(vqtbl1q_u8(t_lo, vandq_u8(x, clr_mask)), vqtbl1q_u8(t_hi, vshrq_n_u8(x, 4)));
+}
+
+static void mul1_neon(gf *dst, const gf *src, gf c, int sz) {
+    const gf* lut = &gf_nibble_table[c * 32];
+    int i;
+    uint8x16_t t_lo = vld1q_u8(&lut[0]);
+    uint8x16_t t_hi = vld1q_u8(&lut[16]);
+    uint8x16_t clr_mask = vdupq_n_u8(0x0f);
+    for (i = 0; i + 32 <= sz; i += 32) {
+        vst1q_u8(&dst[i], mul_neon(vld1q_u8(&src[i]), t_lo, t_hi, clr_mask));
+        vst1q_u8(&dst[i + 16], mul_neon(vld1q_u8(&src[i + 16]), t_lo, t_hi, clr_mask));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] = gf_mul_nibble(lut, src[i]);
+    }
+}
+
+static void mul_add1_neon(gf *dst, const gf *src, gf c, int sz) {
+    const gf* lut = &gf_nibble_table[c * 32];
+    int i;
+    uint8x16_t t_lo = vld1q_u8(&lut[0]);
+    uint8x16_t t_hi = vld1q_u8(&lut[16]);
+    uint8x16_t clr_mask = vdupq_n_u8(0x0f);
+    for (i = 0; i + 32 <= sz; i += 32) {
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&dst[i]), mul_neon(vld1q_u8(&src[i]), t_lo, t_hi, clr_mask)));
+        vst1q_u8(&dst[i + 16], veorq_u8(vld1q_u8(&dst[i + 16]), mul_neon(vld1q_u8(&src[i + 16]), t_lo, t_hi, clr_mask)));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] ^= gf_mul_nibble(lut, src[i]);
+    }
+}
+
+static void add1_neon(gf *dst, const gf *src, int sz) {
+    int i;
+    for (i = 0; i + 32 <= sz; i += 32) {
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&dst[i]), vld1q_u8(&src[i])));
+        vst1q_u8(&dst[i + 16], veorq_u8(vld1q_u8(&dst[i + 16]), vld1q_u8(&src[i + 16])));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// See mul_rows_block_avx2, 32 byte columns in two q registers per output
+static inline __attribute__((always_inline)) void mul_rows_block_neon(gf **dst, gf **src, int src_count, const gf *coeffs, int stride, int n, int sz) {
+    uint8x16_t clr_mask = vdupq_n_u8(0x0f);
+    int i, j, r;
+    for (i = 0; i + 32 <= sz; i += 32) {
+        uint8x16_t acc_0[4], acc_1[4];
+        for (r = 0; r < n; r++) {
+            acc_0[r] = vdupq_n_u8(0);
+            acc_1[r] = vdupq_n_u8(0);
+        }
+        for (j = 0; j < src_count; j++) {
+            uint8x16_t src_0 = vld1q_u8(&src[j][i]);
+            uint8x16_t src_1 = vld1q_u8(&src[j][i + 16]);
+            for (r = 0; r < n; r++) {
+                const gf* lut = &gf_nibble_table[coeffs[r * stride + j] * 32];
+                uint8x16_t t_lo = vld1q_u8(&lut[0]);
+                uint8x16_t t_hi = vld1q_u8(&lut[16]);
+                acc_0[r] = veorq_u8(acc_0[r], mul_neon(src_0, t_lo, t_hi, clr_mask));
+                acc_1[r] = veorq_u8(acc_1[r], mul_neon(src_1, t_lo, t_hi, clr_mask));
+            }
+        }
+        for (r = 0; r < n; r++) {
+            vst1q_u8(&dst[r][i], acc_0[r]);
+            vst1q_u8(&dst[r][i + 16], acc_1[r]);
+        }
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        for (r = 0; r < n; r++) {
+            gf acc = 0;
+            for (j = 0; j < src_count; j++) {
+                acc ^= gf_mul_nibble(&gf_nibble_table[coeffs[r * stride + j] * 32], src[j][i]);
+            }
+            dst[r][i] = acc;
+        }
+    }
+}
+
+static void mul_rows_neon(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) {
+    int r = 0;
+    for (; r + 4 <= dst_count; r += 4) {
+        mul_rows_block_neon(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 4, sz);
+    }
+    switch (dst_count - r) {
+    case 3:
+        mul_rows_block_neon(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 3, sz);
+        break;
+    case 2:
+        mul_rows_block_neon(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 2, sz);
+        break;
+    case 1:
+        mul_rows_block_neon(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 1, sz);
+        break;
+    }
+}
+
+// NEON is mandatory on aarch64
+static int neon_supported(void) {
+    return 1;
+}
+
+const gf_kernels gf_kernels_neon = {
+    "neon", neon_supported, mul1_neon, mul_add1_neon, add1_neon, mul_rows_neon
+};
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Reed-Solomon Erasure Code portable kernels
+ * 
+ * Plain C versions of the GF(256) kernels, used when the cpu has none of the SIMD extensions we
+ * have kernels for.  Each call expands the coefficient's 32 byte nibble table into a 256 byte row on
+ * the stack, so there is one lookup per byte and no 64 KB multiplication table evicting the data.
+ * 
+ * LICENSE: MIT
+ */
+#include "rs.h"
+#include <string.h>
+
+// row[x] = c * x, 256 XORs against the thousands of bytes a call multiplies
+static void expand_row(gf *row, gf c) {
+    const gf* lut = &gf_nibble_table[c * 32];
+    for (int hi = 0; hi < 16; hi++) {
+        for (int lo = 0; lo < 16; lo++) {
+            row[hi << 4 | lo] = lut[lo] ^ lut[16 + hi];
+        }
+    }
+}
+
+static void mul1_scalar(gf *dst, const gf *src, gf c, int sz) {
+    gf lut[256];
+    expand_row(lut, c);
+    for (int i = 0; i < sz; i++) {
+        dst[i] = lut[src[i]];
+    }
+}
+
+static void mul_add1_scalar(gf *dst, const gf *src, gf c, int sz) {
+    gf lut[256];
+    expand_row(lut, c);
+    for (int i = 0; i < sz; i++) {
+        dst[i] ^= lut[src[i]];
+    }
+}
+
+static void add1_scalar(gf *dst, const gf *src, int sz) {
+    int i;
+    for (i = 0; i + 8 <= sz; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, &dst[i], 8);
+        memcpy(&b, &src[i], 8);
+        a ^= b;
+        memcpy(&dst[i], &a, 8);
+    }
+    for (; i < sz; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// Sources are taken 8 at a time, so each output byte is loaded and stored once per 8 sources
+#define ROWS_PER_PASS 8
+
+static void mul_rows_scalar(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) {
+    gf rows[ROWS_PER_PASS][256];
+    for (int r = 0; r < dst_count; r++) {
+        for (int j0 = 0; j0 < src_count; j0 += ROWS_PER_PASS) {
+            const int n = src_count - j0 < ROWS_PER_PASS ? src_count - j0 : ROWS_PER_PASS;
+            for (int j = 0; j < n; j++) {
+                expand_row(rows[j], coeffs[r * src_count + j0 + j]);
+            }
+            gf *out = dst[r];
+            gf **s = &src[j0];
+            int i = 0;
+            if (n == ROWS_PER_PASS) {
+                const gf *s0 = s[0], *s1 = s[1], *s2 = s[2], *s3 = s[3], *s4 = s[4], *s5 = s[5], *s6 = s[6], *s7 = s[7];
+                for (; i < sz; i++) {
+                    gf acc = rows[0][s0[i]] ^ rows[1][s1[i]] ^ rows[2][s2[i]] ^ rows[3][s3[i]]
+                           ^ rows[4][s4[i]] ^ rows[5][s5[i]] ^ rows[6][s6[i]] ^ rows[7][s7[i]];
+                    out[i] = j0 == 0 ? acc : out[i] ^ acc;
+                }
+            }
+            for (; i < sz; i++) {
+                gf acc = j0 == 0 ? 0 : out[i];
+                for (int j = 0; j < n; j++) {
+                    acc ^= rows[j][s[j][i]];
+                }
+                out[i] = acc;
+            }
+        }
+    }
+}
+
+static int scalar_supported(void) {
+    return 1;
+}
+
+const gf_kernels gf_kernels_scalar = {
+    "scalar", scalar_supported, mul1_scalar, mul_add1_scalar, add1_scalar, mul_rows_scalar
+};
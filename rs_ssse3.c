@@ -0,0 +1,138 @@
+/**
+ * Reed-Solomon Erasure Code SSSE3 kernels
+ * 
+ * 128 bit versions of the AVX2 kernels for older x86 machines, same nibble table approach.
+ * 
+ * LICENSE: MIT
+ */
+#include "rs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("ssse3")
+#include <immintrin.h>
+
+static inline __m128i mul_ssse3(__m128i x, __m128i t_lo, __m128i t_hi, __m128i clr_mask) {
+    return _mm_xor_si128(
+        _mm_shuffle_epi8(t_lo, _mm_and_si128(x, clr_mask)),
+        _mm_shuffle_epi8(t_hi, _mm_and_si128(_mm_srli_epi64(x, 4), clr_mask)));
+}
+
+static void mul1_ssse3(gf *dst, const gf *src, gf c, int sz) {
+    const gf* lut = &gf_nibble_table[c * 32];
+    int i;
+    __m128i t_lo = _mm_loadu_si128((const __m128i*)&lut[0]);
+    __m128i t_hi = _mm_loadu_si128((const __m128i*)&lut[16]);
+    __m128i clr_mask = _mm_set1_epi8(0x0f);
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m128i src_0 = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i src_1 = _mm_loadu_si128((__m128i*)&src[i + 16]);
+        _mm_storeu_si128((__m128i*)&dst[i], mul_ssse3(src_0, t_lo, t_hi, clr_mask));
+        _mm_storeu_si128((__m128i*)&dst[i + 16], mul_ssse3(src_1, t_lo, t_hi, clr_mask));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] = gf_mul_nibble(lut, src[i]);
+    }
+}
+
+static void mul_add1_ssse3(gf *dst, const gf *src, gf c, int sz) {
+    const gf* lut = &gf_nibble_table[c * 32];
+    int i;
+    __m128i t_lo = _mm_loadu_si128((const __m128i*)&lut[0]);
+    __m128i t_hi = _mm_loadu_si128((const __m128i*)&lut[16]);
+    __m128i clr_mask = _mm_set1_epi8(0x0f);
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m128i src_0 = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i src_1 = _mm_loadu_si128((__m128i*)&src[i + 16]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(_mm_loadu_si128((__m128i*)&dst[i]), mul_ssse3(src_0, t_lo, t_hi, clr_mask)));
+        _mm_storeu_si128((__m128i*)&dst[i + 16], _mm_xor_si128(_mm_loadu_si128((__m128i*)&dst[i + 16]), mul_ssse3(src_1, t_lo, t_hi, clr_mask)));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] ^= gf_mul_nibble(lut, src[i]);
+    }
+}
+
+static void add1_ssse3(gf *dst, const gf *src, int sz) {
+    int i;
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m128i src_0 = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i src_1 = _mm_loadu_si128((__m128i*)&src[i + 16]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(_mm_loadu_si128((__m128i*)&dst[i]), src_0));
+        _mm_storeu_si128((__m128i*)&dst[i + 16], _mm_xor_si128(_mm_loadu_si128((__m128i*)&dst[i + 16]), src_1));
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// See mul_rows_block_avx2, 32 byte columns in two xmm registers per output
+static inline __attribute__((always_inline)) void mul_rows_block_ssse3(gf **dst, gf **src, int src_count, const gf *coeffs, int stride, int n, int sz) {
+    __m128i clr_mask = _mm_set1_epi8(0x0f);
+    int i, j, r;
+    for (i = 0; i + 32 <= sz; i += 32) {
+        __m128i acc_0[4], acc_1[4];
+        for (r = 0; r < n; r++) {
+            acc_0[r] = _mm_setzero_si128();
+            acc_1[r] = _mm_setzero_si128();
+        }
+        for (j = 0; j < src_count; j++) {
+            __m128i src_0 = _mm_loadu_si128((__m128i*)&src[j][i]);
+            __m128i src_1 = _mm_loadu_si128((__m128i*)&src[j][i + 16]);
+            for (r = 0; r < n; r++) {
+                const gf* lut = &gf_nibble_table[coeffs[r * stride + j] * 32];
+                __m128i t_lo = _mm_loadu_si128((const __m128i*)&lut[0]);
+                __m128i t_hi = _mm_loadu_si128((const __m128i*)&lut[16]);
+                acc_0[r] = _mm_xor_si128(acc_0[r], mul_ssse3(src_0, t_lo, t_hi, clr_mask));
+                acc_1[r] = _mm_xor_si128(acc_1[r], mul_ssse3(src_1, t_lo, t_hi, clr_mask));
+            }
+        }
+        for (r = 0; r < n; r++) {
+            _mm_storeu_si128((__m128i*)&dst[r][i], acc_0[r]);
+            _mm_storeu_si128((__m128i*)&dst[r][i + 16], acc_1[r]);
+        }
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        for (r = 0; r < n; r++) {
+            gf acc = 0;
+            for (j = 0; j < src_count; j++) {
+                acc ^= gf_mul_nibble(&gf_nibble_table[coeffs[r * stride + j] * 32], src[j][i]);
+            }
+            dst[r][i] = acc;
+        }
+    }
+}
+
+static void mul_rows_ssse3(gf **dst, int dst_count, gf **src, int src_count, const gf *coeffs, int sz) {
+    int r = 0;
+    for (; r + 4 <= dst_count; r += 4) {
+        mul_rows_block_ssse3(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 4, sz);
+    }
+    switch (dst_count - r) {
+    case 3:
+        mul_rows_block_ssse3(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 3, sz);
+        break;
+    case 2:
+        mul_rows_block_ssse3(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 2, sz);
+        break;
+    case 1:
+        mul_rows_block_ssse3(&dst[r], src, src_count, &coeffs[r * src_count], src_count, 1, sz);
+        break;
+    }
+}
+
+static int ssse3_supported(void) {
+    return __builtin_cpu_supports("ssse3");
+}
+
+const gf_kernels gf_kernels_ssse3 = {
+    "ssse3", ssse3_supported, mul1_ssse3, mul_add1_ssse3, add1_ssse3, mul_rows_ssse3
+};
+
+#endif
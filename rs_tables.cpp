@@ -0,0 +1,25 @@
+/**
+ * Reed-Solomon Erasure Code GF(256) tables
+ *
+ * The tables rs.c and the kernels use, as images computed by the compiler from gftables.hpp, so they
+ * are in .rodata and init_gf() has nothing to build.  rs.h declares them as the C arrays these are laid
+ * out as.  Built with the C sources, it needs no C++ runtime.
+ *
+ * LICENSE: MIT
+ */
+#include "gftables.hpp"
+
+static_assert(sizeof(std::array<uint8_t, 256 * 32>) == 256 * 32, "an image is laid out like its C array");
+static_assert(sizeof(std::array<uint64_t, 256>) == 256 * sizeof(uint64_t), "an image is laid out like its C array");
+
+extern "C" {
+extern const std::array<uint8_t, 512> gf_exp;
+extern const std::array<int, 256> gf_log;
+extern const std::array<uint8_t, 256 * 32> gf_nibble_table;
+extern const std::array<uint64_t, 256> gf_affine_table;
+
+const std::array<uint8_t, 512> gf_exp = gftables::kGf.exp;
+const std::array<int, 256> gf_log = gftables::kGf.log;
+alignas(64) const std::array<uint8_t, 256 * 32> gf_nibble_table = gftables::kNibble;
+alignas(64) const std::array<uint64_t, 256> gf_affine_table = gftables::kAffine;
+}
@@ -0,0 +1,49 @@
+#include "rscodec.hpp"
+#include "metrics.h"
+
+// C entry points for the fixed geometry codecs, so the C code and test-rs can use them
+
+extern "C" int rs8_encode(int parity_shards, unsigned char** data, unsigned char** parity, int shard_size) {
+    switch (parity_shards) {
+    case 4:
+        RsCodec8x4::encode(data, parity, shard_size);
+        break;
+    case 8:
+        RsCodec8x8::encode(data, parity, shard_size);
+        break;
+    case 12:
+        RsCodec8x12::encode(data, parity, shard_size);
+        break;
+    default:
+        return 0;
+    }
+    kelp_metric_add(KELP_METRIC_RS_ENCODED_BYTES, uint64_t(8) * shard_size);
+    return 1;
+}
+
+extern "C" int rs8_decode(int parity_shards, unsigned char** shards, int* erasures, int shard_size) {
+    int ret = 0;
+    switch (parity_shards) {
+    case 4:
+        ret = RsCodec8x4::decode(shards, erasures, shard_size);
+        break;
+    case 8:
+        ret = RsCodec8x8::decode(shards, erasures, shard_size);
+        break;
+    case 12:
+        ret = RsCodec8x12::decode(shards, erasures, shard_size);
+        break;
+    default:
+        return 0;
+    }
+    if (ret) {
+        int erased = 0;
+        for (int i = 0; i < 8 + parity_shards; i++) {
+            erased += erasures[i] != 0;
+        }
+        kelp_metric_add(KELP_METRIC_RS_DECODED_BYTES, uint64_t(erased) * shard_size);
+    } else {
+        kelp_metric_add(KELP_METRIC_RS_DECODE_FAILURES, 1);
+    }
+    return ret;
+}
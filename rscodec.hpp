@@ -0,0 +1,378 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "gftables.hpp"
+
+extern "C" {
+#include "rs.h"
+}
+
+/**
+ * Compile-time specialised Reed-Solomon codec for fixed RS(K, M) geometries
+ *
+ * Builds the same systematic Cauchy matrix as rs_new(K, M), but as constexpr tables, so the parity
+ * coefficients and their nibble tables are baked into the binary and the encode loops are fully
+ * unrolled over the K data shards with the 0/1 coefficient checks folded away.
+ * The output is byte for byte the same as rs_encode.
+ *
+ * On x86 there are unrolled AVX-512/GFNI and AVX2 paths, chosen to match the backend init_gf() selected,
+ * otherwise (and on other architectures, e.g. NEON) the dispatched mul_rows kernels are used.  init_gf() must have been called.
+ */
+namespace rscodec_detail {
+
+using namespace gftables;
+
+template <int N>
+using Matrix = std::array<std::array<uint8_t, N>, N>;
+
+// Gauss-Jordan inversion, returns false if the matrix is singular
+template <int N>
+constexpr bool invert(Matrix<N>& m) {
+    Matrix<N> inv{};
+    for (int i = 0; i < N; i++) {
+        inv[i][i] = 1;
+    }
+    for (int i = 0; i < N; i++) {
+        if (m[i][i] == 0) {
+            int j = i + 1;
+            for (; j < N && m[j][i] == 0; j++) {
+            }
+            if (j == N) {
+                return false;
+            }
+            for (int k = 0; k < N; k++) {
+                uint8_t t = m[i][k]; m[i][k] = m[j][k]; m[j][k] = t;
+                t = inv[i][k]; inv[i][k] = inv[j][k]; inv[j][k] = t;
+            }
+        }
+        uint8_t scale = gfInv(m[i][i]);
+        for (int k = 0; k < N; k++) {
+            m[i][k] = gfMul(m[i][k], scale);
+            inv[i][k] = gfMul(inv[i][k], scale);
+        }
+        for (int j = 0; j < N; j++) {
+            uint8_t f = m[j][i];
+            if (j != i && f != 0) {
+                for (int k = 0; k < N; k++) {
+                    m[j][k] ^= gfMul(f, m[i][k]);
+                    inv[j][k] ^= gfMul(f, inv[i][k]);
+                }
+            }
+        }
+    }
+    m = inv;
+    return true;
+}
+
+// Systematic encoding matrix, the same construction as rs_new(): cauchy(K + M, K) times the inverse of its top K rows
+template <int K, int M>
+constexpr std::array<std::array<uint8_t, K>, K + M> makeEncodingMatrix() {
+    constexpr int N = K + M;
+    std::array<std::array<uint8_t, K>, N> cauchy{};
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < K; j++) {
+            cauchy[i][j] = gfInv(i ^ (N + j));
+        }
+    }
+    Matrix<K> top{};
+    for (int i = 0; i < K; i++) {
+        top[i] = cauchy[i];
+    }
+    invert<K>(top);
+    std::array<std::array<uint8_t, K>, N> result{};
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < K; j++) {
+            uint8_t acc = 0;
+            for (int l = 0; l < K; l++) {
+                acc ^= gfMul(cauchy[i][l], top[l][j]);
+            }
+            result[i][j] = acc;
+        }
+    }
+    return result;
+}
+
+inline uint8_t mulNibble(const uint8_t* lut, uint8_t x) {
+    return lut[x & 0x0f] ^ lut[16 + (x >> 4)];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2"))) inline __m256i mulAvx2(__m256i x, const uint8_t* lut, __m256i clr_mask) {
+    __m256i t_lo = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(&lut[0])));
+    __m256i t_hi = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(&lut[16])));
+    return _mm256_xor_si256(
+        _mm256_shuffle_epi8(t_lo, _mm256_and_si256(x, clr_mask)),
+        _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), clr_mask)));
+}
+
+/**
+ * dst[r] = sum_j coeff(r, j) * src[j] for r < N, over K sources, in 64 byte columns
+ * Coeff returns the coefficient for (r, j); when it is a constant expression the 0/1 checks fold away.
+ */
+template <int N, int K, typename Coeff>
+__attribute__((target("avx2"))) inline void mulRowsAvx2(gf* const* dst, gf* const* src, Coeff coeff, int sz) {
+    __m256i clr_mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 64 <= sz; i += 64) {
+        __m256i acc_0[N], acc_1[N];
+#pragma GCC unroll 16
+        for (int r = 0; r < N; r++) {
+            acc_0[r] = _mm256_setzero_si256();
+            acc_1[r] = _mm256_setzero_si256();
+        }
+#pragma GCC unroll 16
+        for (int j = 0; j < K; j++) {
+            __m256i src_0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[j][i]));
+            __m256i src_1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[j][i + 32]));
+#pragma GCC unroll 16
+            for (int r = 0; r < N; r++) {
+                uint8_t c = coeff(r, j);
+                if (c == 0) {
+                    continue;
+                }
+                if (c == 1) {
+                    acc_0[r] = _mm256_xor_si256(acc_0[r], src_0);
+                    acc_1[r] = _mm256_xor_si256(acc_1[r], src_1);
+                } else {
+                    const uint8_t* lut = &kNibble[c * 32];
+                    // Keep the table loads in the loop, hoisting all K * N of them just spills them to the stack
+                    asm("" : "+r"(lut));
+                    acc_0[r] = _mm256_xor_si256(acc_0[r], mulAvx2(src_0, lut, clr_mask));
+                    acc_1[r] = _mm256_xor_si256(acc_1[r], mulAvx2(src_1, lut, clr_mask));
+                }
+            }
+        }
+#pragma GCC unroll 16
+        for (int r = 0; r < N; r++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[r][i]), acc_0[r]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[r][i + 32]), acc_1[r]);
+        }
+    }
+
+    // Handle remaining elements
+    for (; i < sz; i++) {
+        for (int r = 0; r < N; r++) {
+            uint8_t acc = 0;
+            for (int j = 0; j < K; j++) {
+                acc ^= mulNibble(&kNibble[coeff(r, j) * 32], src[j][i]);
+            }
+            dst[r][i] = acc;
+        }
+    }
+}
+
+// AVX-512 + GFNI version of mulRowsAvx2, 128 byte columns with masked tails
+template <int N, int K, typename Coeff>
+__attribute__((target("avx512f,avx512bw,gfni"))) inline void mulRowsGfni(gf* const* dst, gf* const* src, Coeff coeff, int sz) {
+    for (int i = 0; i < sz; i += 128) {
+        int left = sz - i;
+        __mmask64 k_0 = left >= 64 ? ~0ULL : (1ULL << left) - 1;
+        __mmask64 k_1 = left >= 128 ? ~0ULL : left > 64 ? (1ULL << (left - 64)) - 1 : 0;
+        __m512i acc_0[N], acc_1[N];
+#pragma GCC unroll 16
+        for (int r = 0; r < N; r++) {
+            acc_0[r] = _mm512_setzero_si512();
+            acc_1[r] = _mm512_setzero_si512();
+        }
+#pragma GCC unroll 16
+        for (int j = 0; j < K; j++) {
+            __m512i src_0 = _mm512_maskz_loadu_epi8(k_0, &src[j][i]);
+            __m512i src_1 = _mm512_maskz_loadu_epi8(k_1, &src[j][i + 64]);
+#pragma GCC unroll 16
+            for (int r = 0; r < N; r++) {
+                uint8_t c = coeff(r, j);
+                if (c == 0) {
+                    continue;
+                }
+                if (c == 1) {
+                    acc_0[r] = _mm512_xor_si512(acc_0[r], src_0);
+                    acc_1[r] = _mm512_xor_si512(acc_1[r], src_1);
+                } else {
+                    __m512i m = _mm512_set1_epi64(kAffine[c]);
+                    acc_0[r] = _mm512_xor_si512(acc_0[r], _mm512_gf2p8affine_epi64_epi8(src_0, m, 0));
+                    acc_1[r] = _mm512_xor_si512(acc_1[r], _mm512_gf2p8affine_epi64_epi8(src_1, m, 0));
+                }
+            }
+        }
+#pragma GCC unroll 16
+        for (int r = 0; r < N; r++) {
+            _mm512_mask_storeu_epi8(&dst[r][i], k_0, acc_0[r]);
+            _mm512_mask_storeu_epi8(&dst[r][i + 64], k_1, acc_1[r]);
+        }
+    }
+}
+
+#endif
+
+// Follow the backend init_gf() picked, so KELP_GF_BACKEND applies here too
+enum class Path { Gfni, Avx2, Generic };
+
+inline Path selectedPath() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (gf_kernel == &gf_kernels_avx512) {
+        return Path::Gfni;
+    }
+    if (gf_kernel == &gf_kernels_avx2) {
+        return Path::Avx2;
+    }
+#endif
+    return Path::Generic;
+}
+
+// Apply rows R0..R0+N of coeff in blocks of 4 outputs, unrolled at compile time, Rows is the total row count
+template <int Rows, int K, int R0 = 0, typename Coeff>
+inline void mulRowsFixed(Path path, gf* const* dst, gf* const* src, Coeff coeff, int sz) {
+#if defined(__x86_64__) || defined(__i386__)
+    if constexpr (R0 < Rows) {
+        constexpr int N = (Rows - R0) < 4 ? (Rows - R0) : 4;
+        auto block = [&](int r, int j) { return coeff(R0 + r, j); };
+        if (path == Path::Gfni) {
+            mulRowsGfni<N, K>(&dst[R0], src, block, sz);
+        } else {
+            mulRowsAvx2<N, K>(&dst[R0], src, block, sz);
+        }
+        mulRowsFixed<Rows, K, R0 + N>(path, dst, src, coeff, sz);
+    }
+#else
+    // selectedPath() is always Generic here, but keep a correct fallback on the dispatched kernels
+    (void)path;
+    gf flat[Rows * K];
+    for (int r = 0; r < Rows; r++) {
+        for (int j = 0; j < K; j++) {
+            flat[r * K + j] = coeff(r, j);
+        }
+    }
+    mul_rows(const_cast<gf**>(dst), Rows, const_cast<gf**>(src), K, flat, sz);
+#endif
+}
+
+} // namespace rscodec_detail
+
+/**
+ * RS(K, M) codec with the geometry fixed at compile time
+ * Shard arrays and erasure flags have the same layout as rs_encode / rs_decode.
+ */
+template <int K, int M>
+struct RsCodec {
+    static_assert(K > 0 && M > 0 && K + M <= MAX_TOTAL_SHARDS, "invalid RS geometry");
+
+    static constexpr int data_shards = K;
+    static constexpr int parity_shards = M;
+    static constexpr int total_shards = K + M;
+
+    // Full systematic encoding matrix, rows 0..K-1 are the identity
+    static constexpr std::array<std::array<uint8_t, K>, K + M> matrix = rscodec_detail::makeEncodingMatrix<K, M>();
+
+    /**
+     * Encodes the M parity shards from the K data shards.
+     * @param data K pointers to the data shards.
+     * @param parity M pointers to the parity shards.
+     * @param shard_size The size of each shard in bytes.
+     */
+    static void encode(unsigned char** data, unsigned char** parity, int shard_size) {
+        using namespace rscodec_detail;
+        Path path = selectedPath();
+        if (path == Path::Generic) {
+            static constexpr std::array<uint8_t, K * M> flat = flatParity();
+            mul_rows(parity, M, data, K, flat.data(), shard_size);
+            return;
+        }
+        mulRowsFixed<M, K>(path, parity, data, [](int r, int j) { return matrix[K + r][j]; }, shard_size);
+    }
+
+    /**
+     * Reconstructs the erased shards in place.
+     * @param shards K + M pointers to the shards.
+     * @param erasures K + M flags, non-zero marks a shard to be reconstructed.
+     * @param shard_size The size of each shard in bytes.
+     * @return Returns true on success, false if too many shards are erased.
+     */
+    static bool decode(unsigned char** shards, const int* erasures, int shard_size) {
+        using namespace rscodec_detail;
+        Matrix<K> sub{};
+        int valid[K];
+        int erased[K + M];
+        int valid_count = 0, erased_count = 0;
+        for (int i = 0; i < K + M; i++) {
+            if (erasures[i] != 0) {
+                erased[erased_count++] = i;
+            } else if (valid_count < K) {
+                sub[valid_count] = matrix[i];
+                valid[valid_count++] = i;
+            }
+        }
+        if (valid_count < K) {
+            return false;
+        }
+        if (erased_count == 0) {
+            return true;
+        }
+        if (!invert<K>(sub)) {
+            return false;
+        }
+
+        // Data shards are a row of the inverse, parity shards are their encoding row times the inverse
+        uint8_t rows[K + M][K];
+        gf* inputs[K];
+        gf* outputs[K + M];
+        for (int j = 0; j < K; j++) {
+            inputs[j] = shards[valid[j]];
+        }
+        for (int e = 0; e < erased_count; e++) {
+            outputs[e] = shards[erased[e]];
+            for (int j = 0; j < K; j++) {
+                uint8_t acc = 0;
+                for (int l = 0; l < K; l++) {
+                    acc ^= gfMul(matrix[erased[e]][l], sub[l][j]);
+                }
+                rows[e][j] = acc;
+            }
+        }
+
+        Path path = selectedPath();
+        if (path == Path::Generic) {
+            mul_rows(outputs, erased_count, inputs, K, &rows[0][0], shard_size);
+            return true;
+        }
+        // The erased count is only known at run time, so pick the block sizes here
+        auto coeff = [&](int r, int j) { return rows[r][j]; };
+        int e = 0;
+        for (; e + 4 <= erased_count; e += 4) {
+            mulRowsFixed<4, K>(path, &outputs[e], inputs, [&](int r, int j) { return coeff(e + r, j); }, shard_size);
+        }
+        switch (erased_count - e) {
+        case 3:
+            mulRowsFixed<3, K>(path, &outputs[e], inputs, [&](int r, int j) { return coeff(e + r, j); }, shard_size);
+            break;
+        case 2:
+            mulRowsFixed<2, K>(path, &outputs[e], inputs, [&](int r, int j) { return coeff(e + r, j); }, shard_size);
+            break;
+        case 1:
+            mulRowsFixed<1, K>(path, &outputs[e], inputs, [&](int r, int j) { return coeff(e + r, j); }, shard_size);
+            break;
+        }
+        return true;
+    }
+
+private:
+    static constexpr std::array<uint8_t, K * M> flatParity() {
+        std::array<uint8_t, K * M> flat{};
+        for (int r = 0; r < M; r++) {
+            for (int j = 0; j < K; j++) {
+                flat[r * K + j] = matrix[K + r][j];
+            }
+        }
+        return flat;
+    }
+};
+
+// The geometries we deploy
+using RsCodec8x4 = RsCodec<8, 4>;
+using RsCodec8x8 = RsCodec<8, 8>;
+using RsCodec8x12 = RsCodec<8, 12>;
@@ -0,0 +1,322 @@
+#include "scrubber.hpp"
+#include "latency.hpp"
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+TokenBucket::TokenBucket(double rate, double burst) : rate_(rate), burst_(burst), tokens_(burst), last_ns_(0) {}
+
+void TokenBucket::refill(uint64_t now_ns) {
+    if (now_ns > last_ns_) {
+        if (last_ns_ != 0) {
+            tokens_ = std::min(burst_, tokens_ + (now_ns - last_ns_) * 1e-9 * rate_);
+        }
+        last_ns_ = now_ns;
+    }
+}
+
+uint64_t TokenBucket::delayNs(double tokens, uint64_t now_ns) {
+    if (rate_ <= 0) {
+        return 0;
+    }
+    refill(now_ns);
+    const double needed = std::min(tokens, burst_);
+    if (tokens_ >= needed) {
+        return 0;
+    }
+    return uint64_t(std::ceil((needed - tokens_) / rate_ * 1e9));
+}
+
+void TokenBucket::consume(double tokens, uint64_t now_ns) {
+    if (rate_ <= 0) {
+        return;
+    }
+    refill(now_ns);
+    tokens_ -= tokens;
+}
+
+bool TokenBucket::tryConsume(double tokens, uint64_t now_ns) {
+    if (delayNs(tokens, now_ns) != 0) {
+        return false;
+    }
+    consume(tokens, now_ns);
+    return true;
+}
+
+namespace {
+
+const uint32_t CHECKPOINT_MAGIC = 0x6b736372;  // "rcsk"
+
+struct ScrubCheckpoint {
+    uint32_t magic;
+    uint32_t crc;  // crc32c of the fields after it
+    uint64_t pass;
+    uint64_t next_stripe;
+};
+
+uint32_t checkpointCrc(const ScrubCheckpoint& checkpoint) {
+    return crc32c(&checkpoint.pass, sizeof(ScrubCheckpoint) - offsetof(ScrubCheckpoint, pass), 0);
+}
+
+}  // namespace
+
+Scrubber::Scrubber(const VolumeMap& map, reed_solomon* rs, const ScrubConfig& config)
+    : map_(map), rs_(rs), config_(config), blocks_(nullptr), scratch_(nullptr),
+      stripe_count_(0), next_stripe_(config.first_stripe), pass_(0), since_checkpoint_(0) {
+    const int n = rs->data_shards + rs->parity_shards;
+    std::memset(&stats_, 0, sizeof(stats_));
+    shard_block_.assign(n, nullptr);
+    shard_volume_.assign(n, -1);
+    shard_index_.assign(n, 0);
+    shards_.assign(n, nullptr);
+    erasures_.assign(n, 0);
+
+    int total_cells = 0;
+    for (const Volume& vol : map.volumes) {
+        int cells = getKBlocksInStripe(vol.header);
+        bool usable = validateHeader(vol.header);
+        for (int i = 0; i < cells; i++) {
+            usable = usable && (vol.header.shard_ids[i] < n || isDroppedShard(vol.header.shard_ids[i]));
+        }
+        usable_.push_back(usable);
+        cells_.push_back(cells);
+        budgets_.emplace_back(config.bytes_per_sec, config.burst_bytes);
+        total_cells += usable ? cells : 0;
+    }
+    read_cells_.assign(map.volumes.size(), 0);
+    blocks_ = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * std::max(total_cells, 1));
+    scratch_ = allocAligned<unsigned char>(64, sizeof(Block::data) * n);
+
+    Block* slot = blocks_;
+    for (size_t v = 0; v < map.volumes.size(); v++) {
+        if (!usable_[v]) {
+            continue;
+        }
+        for (int i = 0; i < cells_[v]; i++) {
+            int shard = map.volumes[v].header.shard_ids[i];
+            if (!isDroppedShard(shard) && shard_volume_[shard] < 0) {
+                shard_volume_[shard] = v;
+                shard_index_[shard] = i;
+                shard_block_[shard] = slot + i;
+            }
+        }
+        slot += cells_[v];
+    }
+    stripe_count_ = countStripes();
+}
+
+Scrubber::~Scrubber() {
+    free(blocks_);
+    free(scratch_);
+}
+
+uint64_t Scrubber::countStripes() const {
+    // The longest volume sets the stripe count, shorter ones are missing their last cells
+    uint64_t count = 0;
+    for (size_t v = 0; v < map_.volumes.size(); v++) {
+        struct stat st;
+        if (usable_[v] && fstat(map_.volumes[v].fd, &st) == 0) {
+            count = std::max(count, uint64_t(st.st_size) / (cells_[v] * sizeof(Block)));
+        }
+    }
+    return count;
+}
+
+int Scrubber::loadCheckpoint() {
+    if (config_.checkpoint_path.empty()) {
+        return -ENOENT;
+    }
+    int fd = open(config_.checkpoint_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    ScrubCheckpoint checkpoint;
+    ssize_t ret = pread(fd, &checkpoint, sizeof(checkpoint), 0);
+    close(fd);
+    if (ret != sizeof(checkpoint) || checkpoint.magic != CHECKPOINT_MAGIC || checkpoint.crc != checkpointCrc(checkpoint)) {
+        return -EINVAL;
+    }
+    pass_ = checkpoint.pass;
+    next_stripe_ = std::max(checkpoint.next_stripe, config_.first_stripe);
+    since_checkpoint_ = 0;
+    return 0;
+}
+
+int Scrubber::saveCheckpoint() {
+    if (config_.checkpoint_path.empty()) {
+        return -ENOENT;
+    }
+    ScrubCheckpoint checkpoint;
+    std::memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    checkpoint.pass = pass_;
+    checkpoint.next_stripe = next_stripe_;
+    checkpoint.crc = checkpointCrc(checkpoint);
+
+    // Write a new file and rename it over the old one, so a crash leaves one checkpoint or the other
+    std::string tmp = config_.checkpoint_path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    int ret = 0;
+    if (pwrite(fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint) || fsync(fd) != 0) {
+        ret = errno != 0 ? -errno : -EIO;
+    }
+    close(fd);
+    if (ret == 0 && rename(tmp.c_str(), config_.checkpoint_path.c_str()) != 0) {
+        ret = -errno;
+    }
+    if (ret != 0) {
+        unlink(tmp.c_str());
+        return ret;
+    }
+    since_checkpoint_ = 0;
+    return 0;
+}
+
+void Scrubber::scrubStripe(uint64_t stripe_number, uint64_t now_ns) {
+    const int n = rs_->data_shards + rs_->parity_shards;
+    Block* slot = blocks_;
+    for (size_t v = 0; v < map_.volumes.size(); v++) {
+        if (!usable_[v]) {
+            continue;
+        }
+        const Volume& vol = map_.volumes[v];
+        // The volume's cells of this stripe are contiguous, in shard_ids order
+        ssize_t ret = pread(vol.fd, slot, cells_[v] * sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, vol.header.shard_ids[0]));
+        read_cells_[v] = ret < 0 ? -1 : int(ret / sizeof(Block));
+        stats_.bytes_read += std::max<ssize_t>(ret, 0);
+        slot += cells_[v];
+    }
+
+    // Checksum every cell that was read in one batch
+    const Block* read[MAX_TOTAL_SHARDS];
+    bool valid[MAX_TOTAL_SHARDS];
+    int read_count = 0;
+    for (int shard = 0; shard < n; shard++) {
+        const int v = shard_volume_[shard];
+        if (v >= 0 && shard_index_[shard] < read_cells_[v]) {
+            read[read_count++] = shard_block_[shard];
+        }
+    }
+    validateBlocks(read, read_count, valid);
+
+    int erased = 0;
+    uint32_t newest = 0;
+    for (int shard = 0, r = 0; shard < n; shard++) {
+        stats_.cells++;
+        const int v = shard_volume_[shard];
+        Block* block = shard_block_[shard];
+        const bool was_read = v >= 0 && shard_index_[shard] < read_cells_[v];
+        if (was_read && valid[r++] && block->stripe_number == ((stripe_number << 8) | uint8_t(shard))) {
+            shards_[shard] = block->data.data();
+            erasures_[shard] = 0;
+            newest = std::max(newest, block->block_sequence_number);
+            continue;
+        }
+        if (!was_read && v >= 0 && read_cells_[v] >= 0) {
+            stats_.missing_cells++;
+        } else {
+            stats_.bad_cells++;
+        }
+        shards_[shard] = scratch_ + size_t(shard) * sizeof(Block::data);
+        erasures_[shard] = 1;
+        erased++;
+    }
+    stats_.stripes++;
+    if (erased == 0) {
+        return;
+    }
+    if (erased > rs_->parity_shards || !rs_decode(rs_, shards_.data(), erasures_.data(), erased, sizeof(Block::data))) {
+        stats_.unrecoverable_stripes++;
+        return;
+    }
+
+    // Rewrite the reconstructed cells, newer than anything left in the stripe
+    for (int shard = 0; shard < n; shard++) {
+        const int v = shard_volume_[shard];
+        if (!erasures_[shard] || v < 0) {
+            continue;
+        }
+        const Volume& vol = map_.volumes[v];
+        Block& cell = *shard_block_[shard];
+        std::memcpy(cell.data.data(), shards_[shard], sizeof(Block::data));
+        cell.stripe_number = (stripe_number << 8) | uint8_t(shard);
+        cell.block_sequence_number = newest + 1;
+        sealBlock(cell);
+        budgets_[v].consume(sizeof(Block), now_ns);
+        if (pwrite(vol.fd, &cell, sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, shard)) == sizeof(Block)) {
+            stats_.repaired_cells++;
+        } else {
+            stats_.write_errors++;
+        }
+    }
+}
+
+uint64_t Scrubber::step(uint64_t now_ns) {
+    for (int i = 0; i < config_.stripes_per_step && !done(); i++) {
+        // Only read the stripe once every drive it touches can afford it
+        uint64_t wait = 0;
+        for (size_t v = 0; v < map_.volumes.size(); v++) {
+            if (usable_[v]) {
+                wait = std::max(wait, budgets_[v].delayNs(cells_[v] * sizeof(Block), now_ns));
+            }
+        }
+        if (wait > 0) {
+            if (i > 0) {
+                return 0;
+            }
+            stats_.throttled++;
+            return wait;
+        }
+        for (size_t v = 0; v < map_.volumes.size(); v++) {
+            if (usable_[v]) {
+                budgets_[v].consume(cells_[v] * sizeof(Block), now_ns);
+            }
+        }
+        scrubStripe(next_stripe_++, now_ns);
+        if (!config_.checkpoint_path.empty() && ++since_checkpoint_ >= config_.checkpoint_interval) {
+            saveCheckpoint();
+        }
+    }
+    if (done() && since_checkpoint_ > 0 && !config_.checkpoint_path.empty()) {
+        saveCheckpoint();
+    }
+    return 0;
+}
+
+int Scrubber::run(const std::atomic<bool>* stop) {
+    const uint64_t MAX_SLEEP_NS = 100000000;
+    while (!done()) {
+        if (stop != nullptr && stop->load(std::memory_order_relaxed)) {
+            if (!config_.checkpoint_path.empty()) {
+                saveCheckpoint();
+            }
+            return -EINTR;
+        }
+        uint64_t wait = std::min(step(monotonicNs()), MAX_SLEEP_NS);
+        if (wait > 0) {
+            struct timespec ts = {time_t(wait / 1000000000), long(wait % 1000000000)};
+            nanosleep(&ts, nullptr);
+        }
+    }
+    return 0;
+}
+
+void Scrubber::restart() {
+    pass_++;
+    next_stripe_ = config_.first_stripe;
+    stripe_count_ = countStripes();
+    if (!config_.checkpoint_path.empty()) {
+        saveCheckpoint();
+    }
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Token bucket, tokens are bytes.  A request bigger than the bucket is let through once the bucket is
+ * full and leaves it in debt, so large requests are slowed down rather than starved.
+ */
+class TokenBucket {
+public:
+    /**
+     * @param rate Tokens added per second.
+     * @param burst Bucket size, the bucket starts full.
+     */
+    TokenBucket(double rate, double burst);
+
+    /**
+     * @param tokens The tokens wanted.
+     * @param now_ns The current monotonicNs().
+     * @return Returns how long until tokens can be taken, 0 if they can be taken now.
+     */
+    uint64_t delayNs(double tokens, uint64_t now_ns);
+
+    /**
+     * Takes tokens, whether or not there are enough, for work that can't wait such as repair writes.
+     */
+    void consume(double tokens, uint64_t now_ns);
+
+    /**
+     * Takes tokens if delayNs() is 0.
+     * @return Returns whether the tokens were taken.
+     */
+    bool tryConsume(double tokens, uint64_t now_ns);
+
+    double tokens() const { return tokens_; }
+
+private:
+    void refill(uint64_t now_ns);
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    uint64_t last_ns_;
+};
+
+struct ScrubConfig {
+    double bytes_per_sec = 32.0 * 1024 * 1024;  // per drive, 0 for no limit
+    double burst_bytes = 4.0 * 1024 * 1024;
+    int stripes_per_step = 64;
+    uint64_t first_stripe = 1;  // stripe 0 holds the headers
+    std::string checkpoint_path;  // empty for no checkpoints
+    uint64_t checkpoint_interval = 1024;  // stripes between checkpoints
+};
+
+struct ScrubStats {
+    uint64_t stripes;
+    uint64_t cells;
+    uint64_t bytes_read;
+    uint64_t bad_cells;       // corrupt, misplaced or unreadable
+    uint64_t missing_cells;   // short reads, past the end of a volume
+    uint64_t repaired_cells;
+    uint64_t unrecoverable_stripes;  // more bad cells than parity
+    uint64_t write_errors;
+    uint64_t throttled;       // steps that waited for a drive's budget
+};
+
+/**
+ * Background scrubber.  Stripes are scrubbed in order, so each volume is read sequentially, one pread
+ * of a volume's contiguous cells per stripe.  Every cell is checked with validateBlocks() and against
+ * its stripe and shard number.  When a stripe has bad or missing cells and enough good ones, the bad
+ * cells are reconstructed with rs_decode() and rewritten with a block_sequence_number one past the
+ * newest in the stripe.
+ *
+ * Each drive has a token bucket, a stripe is only read when every drive it touches has budget for it,
+ * so scrubbing stays below a fixed share of each drive however fast it goes.  Progress is checkpointed
+ * to a file every checkpoint_interval stripes, a new scrubber resumes from there.
+ *
+ * Volumes whose header fails validateHeader() aren't read or written, their cells count as bad.
+ * Like the fds it uses, a scrubber isn't shared between threads, run it on its own.
+ */
+class Scrubber {
+public:
+    /**
+     * @param map The volumes.  Must outlive the scrubber.
+     * @param rs The Reed-Solomon codec.  Must outlive the scrubber.
+     * @param config The budget and checkpoint settings.
+     */
+    Scrubber(const VolumeMap& map, reed_solomon* rs, const ScrubConfig& config = ScrubConfig());
+    ~Scrubber();
+    Scrubber(const Scrubber&) = delete;
+    Scrubber& operator=(const Scrubber&) = delete;
+
+    /**
+     * Loads the checkpoint, if there is one.
+     * @return Returns 0, -ENOENT without a checkpoint, -EINVAL if it is corrupt, or a negative error code.
+     */
+    int loadCheckpoint();
+
+    /**
+     * Writes the checkpoint, atomically replacing the last one.
+     * @return Returns 0, or a negative error code.
+     */
+    int saveCheckpoint();
+
+    /**
+     * Scrubs up to stripes_per_step stripes, as far as the budgets allow.
+     * @param now_ns The current monotonicNs().
+     * @return Returns 0 to call again now, or how long to wait for budget.
+     */
+    uint64_t step(uint64_t now_ns);
+
+    /**
+     * Scrubs the rest of the pass, sleeping when the budget runs out.
+     * @param stop Checked between steps, the scrubber checkpoints and returns when it becomes true.
+     * @return Returns 0 when the pass is complete, or -EINTR if stopped.
+     */
+    int run(const std::atomic<bool>* stop = nullptr);
+
+    /**
+     * Starts the next pass from first_stripe, and updates the stripe count as volumes grow.
+     */
+    void restart();
+
+    bool done() const { return next_stripe_ >= stripe_count_; }
+    uint64_t nextStripe() const { return next_stripe_; }
+    uint64_t stripeCount() const { return stripe_count_; }
+    uint64_t pass() const { return pass_; }
+    const ScrubStats& stats() const { return stats_; }
+
+private:
+    void scrubStripe(uint64_t stripe_number, uint64_t now_ns);
+    uint64_t countStripes() const;
+
+    const VolumeMap& map_;
+    reed_solomon* rs_;
+    ScrubConfig config_;
+    std::vector<bool> usable_;       // header is valid and covers the shards
+    std::vector<int> cells_;         // cells per stripe of each volume
+    std::vector<TokenBucket> budgets_;
+    std::vector<int> read_cells_;    // cells read from each volume for the current stripe
+    Block* blocks_;                  // one stripe of reads, volume by volume
+    std::vector<Block*> shard_block_;  // where each shard lands in blocks_
+    std::vector<int> shard_volume_;  // -1 if no usable volume holds the shard
+    std::vector<int> shard_index_;   // position of the shard in its volume's cells
+    std::vector<unsigned char*> shards_;
+    std::vector<int> erasures_;
+    unsigned char* scratch_;         // k + m cells to decode bad cells into
+    uint64_t stripe_count_;
+    uint64_t next_stripe_;
+    uint64_t pass_;
+    uint64_t since_checkpoint_;
+    ScrubStats stats_;
+};
@@ -0,0 +1,264 @@
+#include "shardtransport.hpp"
+#include "metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+namespace {
+
+uint32_t headerChecksum(const ShardHeader& header) {
+    return crc32c(&header, offsetof(ShardHeader, header_crc32c), 0);
+}
+
+// Where a cell goes, from the stripe number and shard in its Block.  Stripe 0 holds the volume headers
+// and dropped shards keep their slots, so cells claiming either are refused.
+bool locateCell(const VolumeMap& map, const Block& block, int* volume, uint64_t* offset) {
+    const uint64_t stripe = block.stripe_number >> 8;
+    const int shard = block.stripe_number & 0xff;
+    *volume = stripe != 0 && !isDroppedShard(shard) ? findVolumeForShard(map, shard) : -1;
+    if (*volume < 0) {
+        return false;
+    }
+    // findVolumeForShard only picks a volume with the shard among its cells, so this finds its slot
+    *offset = computeOffsetToBlock(map.volumes[*volume].header, stripe, shard);
+    return true;
+}
+
+}  // namespace
+
+ShardSender::ShardSender(int fd, int capacity, bool zerocopy)
+    : fd_(fd), zerocopy_(false), entries_(capacity), msgs_(capacity), head_(0), unsent_(0), tail_(0),
+      next_zerocopy_id_(0) {
+    std::memset(&stats_, 0, sizeof(stats_));
+    const int one = 1;
+    zerocopy_ = zerocopy && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+bool ShardSender::queue(const struct sockaddr* addr, socklen_t addr_len, uint64_t tag, const Block* const* blocks, int count) {
+    if (tail_ - head_ >= entries_.size() || count < 1 || count > SHARD_MAX_BLOCKS || addr_len > sizeof(Entry::addr)) {
+        return false;
+    }
+    Entry& entry = entries_[tail_ % entries_.size()];
+    entry.header = {SHARD_MAGIC, SHARD_VERSION, uint16_t(count), tag, 0, 0};
+    entry.header.header_crc32c = headerChecksum(entry.header);
+    entry.addr_len = addr != nullptr ? addr_len : 0;
+    if (addr != nullptr) {
+        std::memcpy(&entry.addr, addr, addr_len);
+    }
+    entry.iov[0] = {&entry.header, sizeof(ShardHeader)};
+    for (int i = 0; i < count; i++) {
+        entry.iov[1 + i] = {const_cast<Block*>(blocks[i]), sizeof(Block)};
+    }
+    entry.iovcnt = 1 + count;
+    entry.tag = tag;
+    tail_++;
+    return true;
+}
+
+int ShardSender::flush() {
+    const int count = queued();
+    if (count == 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        Entry& entry = entries_[(unsent_ + i) % entries_.size()];
+        struct msghdr& hdr = msgs_[i].msg_hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = entry.addr_len > 0 ? &entry.addr : nullptr;
+        hdr.msg_namelen = entry.addr_len;
+        hdr.msg_iov = entry.iov;
+        hdr.msg_iovlen = entry.iovcnt;
+    }
+    int ret = sendmmsg(fd_, msgs_.data(), count, MSG_DONTWAIT | (zerocopy_ ? MSG_ZEROCOPY : 0));
+    if (ret < 0) {
+        // A full socket buffer, or under zero copy the pinned memory limit, clears as sends complete
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return 0;
+        }
+        Entry& entry = entries_[unsent_ % entries_.size()];
+        entry.state = DONE;
+        entry.result = -errno;
+        unsent_++;
+        stats_.errors++;
+        return entry.result;
+    }
+    for (int i = 0; i < ret; i++) {
+        Entry& entry = entries_[(unsent_ + i) % entries_.size()];
+        entry.result = msgs_[i].msg_len;
+        // Each zero copy send takes the socket's next notification id
+        entry.state = zerocopy_ ? SENT : DONE;
+        entry.zerocopy_id = zerocopy_ ? next_zerocopy_id_++ : 0;
+        stats_.blocks += entry.iovcnt - 1;
+        kelp_metric_add(KELP_METRIC_NET_BLOCKS_SENT, entry.iovcnt - 1);
+    }
+    stats_.messages += ret;
+    unsent_ += ret;
+    return ret;
+}
+
+void ShardSender::readErrorQueue() {
+    char control[128];
+    for (;;) {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // The kernel is done with the sends ee_info to ee_data, wrapping at 2^32
+            const uint32_t first = err.ee_info;
+            const uint32_t span = err.ee_data - first;
+            for (uint64_t i = head_; i < unsent_; i++) {
+                Entry& entry = entries_[i % entries_.size()];
+                if (entry.state == SENT && entry.zerocopy_id - first <= span) {
+                    entry.state = DONE;
+                    stats_.zerocopy_copied += (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+                }
+            }
+        }
+    }
+}
+
+int ShardSender::reap(IoCompletion* out, int max) {
+    if (zerocopy_ && head_ != unsent_) {
+        readErrorQueue();
+    }
+    int count = 0;
+    while (count < max && head_ != unsent_) {
+        const Entry& entry = entries_[head_ % entries_.size()];
+        if (entry.state != DONE) {
+            break;
+        }
+        out[count++] = {entry.tag, entry.result};
+        head_++;
+    }
+    return count;
+}
+
+ShardReceiver::ShardReceiver(int fd, int slots)
+    : fd_(fd), headers_(slots), iov_(size_t(slots) * 2), msgs_(slots), from_(slots), receiving_(slots) {
+    arena_ = allocAligned<Block>(PAGE_SIZE, size_t(slots) * SHARD_MAX_BLOCKS * sizeof(Block));
+    std::memset(&stats_, 0, sizeof(stats_));
+    for (int slot = slots - 1; slot >= 0; slot--) {
+        free_.push_back(slot);
+    }
+}
+
+ShardReceiver::~ShardReceiver() {
+    free(arena_);
+}
+
+int ShardReceiver::receive(ShardMessage* out, int max) {
+    const int count = std::min<int>(max, free_.size());
+    if (count == 0) {
+        return 0;
+    }
+    // The header lands in its own buffer, so the cells start on a page of the slot
+    for (int i = 0; i < count; i++) {
+        const int slot = free_[free_.size() - 1 - i];
+        receiving_[i] = slot;
+        iov_[2 * i] = {&headers_[slot], sizeof(ShardHeader)};
+        iov_[2 * i + 1] = {arena_ + size_t(slot) * SHARD_MAX_BLOCKS, SHARD_MAX_BLOCKS * sizeof(Block)};
+        struct msghdr& hdr = msgs_[i].msg_hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &from_[i];
+        hdr.msg_namelen = sizeof(from_[i]);
+        hdr.msg_iov = &iov_[2 * i];
+        hdr.msg_iovlen = 2;
+    }
+    int got = recvmmsg(fd_, msgs_.data(), count, MSG_DONTWAIT, nullptr);
+    if (got < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+    }
+
+    free_.resize(free_.size() - count);
+    int messages = 0;
+    for (int i = 0; i < count; i++) {
+        const int slot = receiving_[i];
+        const ShardHeader& header = headers_[slot];
+        const size_t length = i < got ? msgs_[i].msg_len : 0;
+        if (i >= got || (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) || length < sizeof(ShardHeader) || header.magic != SHARD_MAGIC
+            || header.version != SHARD_VERSION || header.header_crc32c != headerChecksum(header) || header.count < 1
+            || header.count > SHARD_MAX_BLOCKS || length != sizeof(ShardHeader) + header.count * sizeof(Block)) {
+            stats_.dropped += i < got;
+            free_.push_back(slot);
+            continue;
+        }
+        ShardMessage& message = out[messages++];
+        message.tag = header.tag;
+        message.from = from_[i];
+        message.from_len = msgs_[i].msg_hdr.msg_namelen;
+        message.blocks = arena_ + size_t(slot) * SHARD_MAX_BLOCKS;
+        message.count = header.count;
+        message.slot = slot;
+        const Block* cells[SHARD_MAX_BLOCKS];
+        bool valid[SHARD_MAX_BLOCKS];
+        for (int c = 0; c < message.count; c++) {
+            cells[c] = &message.blocks[c];
+        }
+        const int valid_count = validateBlocks(cells, message.count, valid);
+        message.valid_mask = 0;
+        for (int c = 0; c < message.count; c++) {
+            message.valid_mask |= uint32_t(valid[c]) << c;
+        }
+        stats_.messages++;
+        stats_.blocks += message.count;
+        stats_.invalid_blocks += message.count - valid_count;
+        kelp_metric_add(KELP_METRIC_NET_BLOCKS_RECEIVED, message.count);
+    }
+    return messages;
+}
+
+void ShardReceiver::release(int slot) {
+    free_.push_back(slot);
+}
+
+int queueCellWrites(IoBatch& batch, const VolumeMap& map, const ShardMessage& message, uint64_t user_tag) {
+    int queued = 0;
+    for (int i = 0; i < message.count;) {
+        int volume;
+        uint64_t offset;
+        if (!(message.valid_mask >> i & 1) || !locateCell(map, message.blocks[i], &volume, &offset)) {
+            i++;
+            continue;
+        }
+        // Extend the run while the next cell follows this one on the same volume
+        int end = i + 1;
+        for (; end < message.count && (message.valid_mask >> end & 1); end++) {
+            int next_volume;
+            uint64_t next_offset;
+            if (!locateCell(map, message.blocks[end], &next_volume, &next_offset) || next_volume != volume
+                || next_offset != offset + (end - i) * sizeof(Block)) {
+                break;
+            }
+        }
+        if (!batch.queueWrite(map.volumes[volume].fd, offset, &message.blocks[i], (end - i) * sizeof(Block), user_tag)) {
+            return -1;
+        }
+        queued++;
+        i = end;
+    }
+    return queued;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "blockaio.hpp"
+
+/**
+ * The wire header of a shard message, followed by count whole Blocks.  Cells are self describing, the
+ * stripe number, shard and checksum are in each Block, so nothing about them is encoded here.
+ */
+struct ShardHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;          // Blocks after the header
+    uint64_t tag;            // the sender's, for the layer above to match requests and replies
+    uint32_t header_crc32c;  // of the bytes before it
+    uint32_t reserved;
+};
+
+constexpr uint32_t SHARD_MAGIC = 0x4b534844;  // "KSHD"
+constexpr uint16_t SHARD_VERSION = 1;
+// Cells per message, a message is one UDP datagram of at most 65507 bytes
+constexpr int SHARD_MAX_BLOCKS = 15;
+
+struct ShardSenderStats {
+    uint64_t messages;
+    uint64_t blocks;
+    uint64_t zerocopy_copied;  // sends the kernel copied after all, e.g. over loopback
+    uint64_t errors;           // messages dropped by a send error, their completion has the error
+};
+
+/**
+ * Sends batches of cells as UDP datagrams, header and cells gathered straight from the caller's buffers
+ * with sendmmsg, so several messages go out with one syscall.  With MSG_ZEROCOPY the kernel sends from
+ * the buffers in place, so they must stay untouched until reap() hands back the message's tag, which
+ * happens once the error queue says the kernel is done with them.  Without zero copy (SO_ZEROCOPY
+ * isn't supported, or was not asked for) the tag comes back on the next reap().
+ *
+ * Delivery is not retried, like the rest of the RPC design reliability is the layer above's job.  Like
+ * an IoBatch, a sender is used by one thread and never allocates after construction.
+ */
+class ShardSender {
+public:
+    /**
+     * @param fd A UDP socket, connected or not.  Must outlive the sender.
+     * @param capacity The most messages queued or in flight at once.
+     * @param zerocopy Whether to try MSG_ZEROCOPY, see zeroCopy().
+     */
+    ShardSender(int fd, int capacity, bool zerocopy = true);
+    ShardSender(const ShardSender&) = delete;
+    ShardSender& operator=(const ShardSender&) = delete;
+
+    /**
+     * Queues a message.  The cells are read in place, from an IoPool slot, an IoBatch read or anywhere.
+     * @param addr The destination, or nullptr for a connected socket.
+     * @param addr_len The size of addr.
+     * @param tag Sent in the header and returned by reap().
+     * @param blocks The cells.
+     * @param count The number of cells, in [1, SHARD_MAX_BLOCKS].
+     * @return Returns false if the sender is full or count is out of range.
+     */
+    bool queue(const struct sockaddr* addr, socklen_t addr_len, uint64_t tag, const Block* const* blocks, int count);
+
+    /**
+     * Sends everything queued with one sendmmsg.  Messages the socket had no room for stay queued.
+     * @return Returns the number of messages sent, or a negative error code.  A message the kernel
+     *         rejects is dropped, its completion has the error.
+     */
+    int flush();
+
+    /**
+     * Returns the messages whose buffers the kernel is done with, in the order they were queued.
+     * @param out Receives up to max completions, result is the bytes sent or a negative error code.
+     * @param max The size of out.
+     * @return Returns the number of completions.
+     */
+    int reap(IoCompletion* out, int max);
+
+    bool zeroCopy() const { return zerocopy_; }
+    int queued() const { return int(tail_ - unsent_); }
+    int inFlight() const { return int(unsent_ - head_); }
+    const ShardSenderStats& stats() const { return stats_; }
+
+private:
+    enum State { SENT, DONE };
+
+    struct Entry {
+        ShardHeader header;  // pinned with the cells under zero copy
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        struct iovec iov[1 + SHARD_MAX_BLOCKS];
+        int iovcnt;
+        uint64_t tag;
+        uint32_t zerocopy_id;
+        State state;
+        long result;
+    };
+
+    void readErrorQueue();
+
+    int fd_;
+    bool zerocopy_;
+    std::vector<Entry> entries_;
+    std::vector<struct mmsghdr> msgs_;
+    // Messages in [head_, unsent_) are sent, in [unsent_, tail_) queued, entry is the count mod capacity
+    uint64_t head_;
+    uint64_t unsent_;
+    uint64_t tail_;
+    uint32_t next_zerocopy_id_;
+    ShardSenderStats stats_;
+};
+
+/**
+ * A received message.  Its cells are contiguous and page aligned in one of the receiver's slots, ready
+ * to be written to a volume as they are, see queueCellWrites().
+ */
+struct ShardMessage {
+    uint64_t tag;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    Block* blocks;
+    int count;
+    uint32_t valid_mask;  // bit i set if blocks[i] passes validateBlocks
+    int slot;             // give back with ShardReceiver::release()
+};
+
+struct ShardReceiverStats {
+    uint64_t messages;
+    uint64_t blocks;
+    uint64_t invalid_blocks;
+    uint64_t dropped;  // datagrams that weren't whole shard messages
+};
+
+/**
+ * Receives shard messages with recvmmsg, scattering each datagram's header into a small buffer and its
+ * cells straight into a page aligned slot of SHARD_MAX_BLOCKS cells, so the payload is never copied or
+ * decoded.  A slot stays with the caller until release(), usually once the cells' writes complete.
+ * Used by one thread.
+ */
+class ShardReceiver {
+public:
+    /**
+     * Allocates the slots, aborts if the allocation fails.
+     * @param fd A bound UDP socket.  Must outlive the receiver.
+     * @param slots The most messages held at once.
+     */
+    ShardReceiver(int fd, int slots);
+    ~ShardReceiver();
+    ShardReceiver(const ShardReceiver&) = delete;
+    ShardReceiver& operator=(const ShardReceiver&) = delete;
+
+    /**
+     * Receives the datagrams waiting on the socket, without blocking.
+     * @param out Receives up to max messages.
+     * @param max The size of out.
+     * @return Returns the number of messages, 0 if none are waiting or every slot is held, or a negative
+     *         error code.
+     */
+    int receive(ShardMessage* out, int max);
+
+    /**
+     * Gives back a message's slot.
+     * @param slot ShardMessage::slot.
+     */
+    void release(int slot);
+
+    int freeSlots() const { return int(free_.size()); }
+    const ShardReceiverStats& stats() const { return stats_; }
+
+private:
+    int fd_;
+    Block* arena_;
+    std::vector<ShardHeader> headers_;
+    std::vector<int> free_;
+    std::vector<struct iovec> iov_;
+    std::vector<struct mmsghdr> msgs_;
+    std::vector<struct sockaddr_storage> from_;
+    std::vector<int> receiving_;
+    ShardReceiverStats stats_;
+};
+
+/**
+ * Queues the writes of a message's valid cells to where their headers place them in the map, runs of
+ * cells that are adjacent on a volume as one write straight from the receiver's slot.
+ * @param batch The batch to queue on.
+ * @param map The volume map.
+ * @param message The message.
+ * @param user_tag The tag for every write.
+ * @return Returns the number of writes queued, or -1 if the batch is full (writes already queued stay
+ *         queued).  Cells of shards no volume holds, dropped shards and stripe 0, where the headers
+ *         are, are skipped.
+ */
+int queueCellWrites(IoBatch& batch, const VolumeMap& map, const ShardMessage& message, uint64_t user_tag);
@@ -0,0 +1,354 @@
+/**
+ * Spreading payloads over cells and back, see spread.h
+ *
+ * The widest registers win because one side of the copy is always a strided 16 byte access: spread
+ * gathers several rounds of a lane into one wide store to the cell, unspread loads several rounds of
+ * neighbouring cells and transposes them into wide stores to the payload.
+ */
+#include "spread.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// Generic, one memcpy per lane
+static int generic_supported(void) { return 1; }
+
+static void spread_generic(const void* input, void* const* cells, size_t input_size, int k, int nontemporal) {
+    const uint8_t* src = (const uint8_t*)input;
+    (void)nontemporal;
+    for (size_t r = 0; input_size >= (size_t)16 * k; r++, input_size -= (size_t)16 * k) {
+        for (int i = 0; i < k; i++) {
+            memcpy((uint8_t*)cells[i] + r * 16, src, 16);
+            src += 16;
+        }
+    }
+}
+
+static void unspread_generic(void* const* cells, void* output, size_t output_size, int k, int nontemporal) {
+    uint8_t* dest = (uint8_t*)output;
+    (void)nontemporal;
+    for (size_t r = 0; output_size >= (size_t)16 * k; r++, output_size -= (size_t)16 * k) {
+        for (int i = 0; i < k; i++) {
+            memcpy(dest, (const uint8_t*)cells[i] + r * 16, 16);
+            dest += 16;
+        }
+    }
+}
+
+const spread_kernels spread_kernels_generic = {"generic", generic_supported, spread_generic, unspread_generic};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static int aligned(const void* p, size_t alignment) { return ((uintptr_t)p & (alignment - 1)) == 0; }
+
+static int cells_aligned(void* const* cells, int k, size_t alignment) {
+    for (int i = 0; i < k; i++) {
+        if (!aligned(cells[i], alignment)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// SSE2, one round at a time
+static int sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+
+ALWAYS_INLINE void store128(void* p, __m128i v, int nt) {
+    if (nt) {
+        _mm_stream_si128((__m128i*)p, v);
+    } else {
+        _mm_storeu_si128((__m128i*)p, v);
+    }
+}
+
+// Rounds [first, rounds) of spread and unspread, shared by the wider kernels for what they leave over
+ALWAYS_INLINE void spread_rounds_sse2(const uint8_t* src, void* const* cells, size_t first, size_t rounds, int k, int nt) {
+    for (size_t r = first; r < rounds; r++) {
+        for (int i = 0; i < k; i++) {
+            store128((uint8_t*)cells[i] + r * 16, _mm_loadu_si128((const __m128i*)(src + (r * k + i) * 16)), nt);
+        }
+    }
+}
+
+ALWAYS_INLINE void unspread_rounds_sse2(void* const* cells, uint8_t* dest, size_t first, size_t rounds, int k, int nt) {
+    for (size_t r = first; r < rounds; r++) {
+        for (int i = 0; i < k; i++) {
+            store128(dest + (r * k + i) * 16, _mm_loadu_si128((const __m128i*)((const uint8_t*)cells[i] + r * 16)), nt);
+        }
+    }
+}
+
+static void spread_sse2(const void* input, void* const* cells, size_t input_size, int k, int nontemporal) {
+    const size_t rounds = input_size / (16 * (size_t)k);
+    if (nontemporal && cells_aligned(cells, k, 16)) {
+        spread_rounds_sse2((const uint8_t*)input, cells, 0, rounds, k, 1);
+        _mm_sfence();
+    } else {
+        spread_rounds_sse2((const uint8_t*)input, cells, 0, rounds, k, 0);
+    }
+}
+
+static void unspread_sse2(void* const* cells, void* output, size_t output_size, int k, int nontemporal) {
+    const size_t rounds = output_size / (16 * (size_t)k);
+    if (nontemporal && aligned(output, 16)) {
+        unspread_rounds_sse2(cells, (uint8_t*)output, 0, rounds, k, 1);
+        _mm_sfence();
+    } else {
+        unspread_rounds_sse2(cells, (uint8_t*)output, 0, rounds, k, 0);
+    }
+}
+
+const spread_kernels spread_kernels_sse2 = {"sse2", sse2_supported, spread_sse2, unspread_sse2};
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+// AVX2, four rounds at a time: a whole cache line of each cell
+static int avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+
+ALWAYS_INLINE void store256(void* p, __m256i v, int nt) {
+    if (nt) {
+        _mm256_stream_si256((__m256i*)p, v);
+    } else {
+        _mm256_storeu_si256((__m256i*)p, v);
+    }
+}
+
+// Lane 16 bytes of rounds r and r + 1
+ALWAYS_INLINE __m256i load_lane_pair(const uint8_t* src, size_t r, int k, int i) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(src + (r * k + i) * 16));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(src + ((r + 1) * k + i) * 16));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+ALWAYS_INLINE void spread_avx2_impl(const uint8_t* src, void* const* cells, size_t rounds, int k, int nt) {
+    size_t r = 0;
+    for (; r + 4 <= rounds; r += 4) {
+        for (int i = 0; i < k; i++) {
+            uint8_t* dest = (uint8_t*)cells[i] + r * 16;
+            store256(dest, load_lane_pair(src, r, k, i), nt);
+            store256(dest + 32, load_lane_pair(src, r + 2, k, i), nt);
+        }
+    }
+    spread_rounds_sse2(src, cells, r, rounds, k, nt);
+}
+
+// Cells i and i + 1 of rounds r .. r + 3 into the payload, 32 bytes per store
+ALWAYS_INLINE void unspread_pair_avx2(void* const* cells, uint8_t* dest, size_t r, int k, int i, int nt) {
+    const uint8_t* a = (const uint8_t*)cells[i] + r * 16;
+    const uint8_t* b = (const uint8_t*)cells[i + 1] + r * 16;
+    __m256i a01 = _mm256_loadu_si256((const __m256i*)a);
+    __m256i a23 = _mm256_loadu_si256((const __m256i*)(a + 32));
+    __m256i b01 = _mm256_loadu_si256((const __m256i*)b);
+    __m256i b23 = _mm256_loadu_si256((const __m256i*)(b + 32));
+    store256(dest + (r * k + i) * 16, _mm256_permute2x128_si256(a01, b01, 0x20), nt);
+    store256(dest + ((r + 1) * k + i) * 16, _mm256_permute2x128_si256(a01, b01, 0x31), nt);
+    store256(dest + ((r + 2) * k + i) * 16, _mm256_permute2x128_si256(a23, b23, 0x20), nt);
+    store256(dest + ((r + 3) * k + i) * 16, _mm256_permute2x128_si256(a23, b23, 0x31), nt);
+}
+
+// Cell i of rounds r .. r + 3 into the payload, an odd cell out
+ALWAYS_INLINE void unspread_single_avx2(void* const* cells, uint8_t* dest, size_t r, int k, int i, int nt) {
+    const uint8_t* a = (const uint8_t*)cells[i] + r * 16;
+    __m256i a01 = _mm256_loadu_si256((const __m256i*)a);
+    __m256i a23 = _mm256_loadu_si256((const __m256i*)(a + 32));
+    store128(dest + (r * k + i) * 16, _mm256_castsi256_si128(a01), nt);
+    store128(dest + ((r + 1) * k + i) * 16, _mm256_extracti128_si256(a01, 1), nt);
+    store128(dest + ((r + 2) * k + i) * 16, _mm256_castsi256_si128(a23), nt);
+    store128(dest + ((r + 3) * k + i) * 16, _mm256_extracti128_si256(a23, 1), nt);
+}
+
+ALWAYS_INLINE void unspread_avx2_impl(void* const* cells, uint8_t* dest, size_t rounds, int k, int nt) {
+    size_t r = 0;
+    for (; r + 4 <= rounds; r += 4) {
+        int i = 0;
+        for (; i + 2 <= k; i += 2) {
+            unspread_pair_avx2(cells, dest, r, k, i, nt);
+        }
+        if (i < k) {
+            unspread_single_avx2(cells, dest, r, k, i, nt);
+        }
+    }
+    unspread_rounds_sse2(cells, dest, r, rounds, k, nt);
+}
+
+// k is a constant in each branch, so k = 8 gets fully unrolled loops
+static void spread_avx2(const void* input, void* const* cells, size_t input_size, int k, int nontemporal) {
+    const uint8_t* src = (const uint8_t*)input;
+    const size_t rounds = input_size / (16 * (size_t)k);
+    if (nontemporal && cells_aligned(cells, k, 32)) {
+        if (k == 8) {
+            spread_avx2_impl(src, cells, rounds, 8, 1);
+        } else {
+            spread_avx2_impl(src, cells, rounds, k, 1);
+        }
+        _mm_sfence();
+    } else if (k == 8) {
+        spread_avx2_impl(src, cells, rounds, 8, 0);
+    } else {
+        spread_avx2_impl(src, cells, rounds, k, 0);
+    }
+}
+
+static void unspread_avx2(void* const* cells, void* output, size_t output_size, int k, int nontemporal) {
+    uint8_t* dest = (uint8_t*)output;
+    const size_t rounds = output_size / (16 * (size_t)k);
+    // Pair stores land on 32 byte boundaries when k is even
+    if (nontemporal && k % 2 == 0 && aligned(output, 32)) {
+        if (k == 8) {
+            unspread_avx2_impl(cells, dest, rounds, 8, 1);
+        } else {
+            unspread_avx2_impl(cells, dest, rounds, k, 1);
+        }
+        _mm_sfence();
+    } else if (k == 8) {
+        unspread_avx2_impl(cells, dest, rounds, 8, 0);
+    } else {
+        unspread_avx2_impl(cells, dest, rounds, k, 0);
+    }
+}
+
+const spread_kernels spread_kernels_avx2 = {"avx2", avx2_supported, spread_avx2, unspread_avx2};
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2")
+
+// AVX-512, four rounds at a time in one register
+static int avx512_supported(void) { return __builtin_cpu_supports("avx512f"); }
+
+ALWAYS_INLINE void store512(void* p, __m512i v, int nt) {
+    if (nt) {
+        _mm512_stream_si512((__m512i*)p, v);
+    } else {
+        _mm512_storeu_si512(p, v);
+    }
+}
+
+ALWAYS_INLINE void spread_avx512_impl(const uint8_t* src, void* const* cells, size_t rounds, int k, int nt) {
+    size_t r = 0;
+    for (; r + 4 <= rounds; r += 4) {
+        for (int i = 0; i < k; i++) {
+            __m512i v = _mm512_inserti64x4(_mm512_castsi256_si512(load_lane_pair(src, r, k, i)), load_lane_pair(src, r + 2, k, i), 1);
+            store512((uint8_t*)cells[i] + r * 16, v, nt);
+        }
+    }
+    spread_rounds_sse2(src, cells, r, rounds, k, nt);
+}
+
+// Cells i .. i + 3 of rounds r .. r + 3, a 4x4 transpose of 16 byte lanes
+ALWAYS_INLINE void unspread_quad_avx512(void* const* cells, uint8_t* dest, size_t r, int k, int i, int nt) {
+    __m512i a = _mm512_loadu_si512((const uint8_t*)cells[i] + r * 16);
+    __m512i b = _mm512_loadu_si512((const uint8_t*)cells[i + 1] + r * 16);
+    __m512i c = _mm512_loadu_si512((const uint8_t*)cells[i + 2] + r * 16);
+    __m512i d = _mm512_loadu_si512((const uint8_t*)cells[i + 3] + r * 16);
+    __m512i ab01 = _mm512_shuffle_i64x2(a, b, 0x44);  // a0 a1 b0 b1
+    __m512i ab23 = _mm512_shuffle_i64x2(a, b, 0xee);  // a2 a3 b2 b3
+    __m512i cd01 = _mm512_shuffle_i64x2(c, d, 0x44);
+    __m512i cd23 = _mm512_shuffle_i64x2(c, d, 0xee);
+    store512(dest + (r * k + i) * 16, _mm512_shuffle_i64x2(ab01, cd01, 0x88), nt);        // a0 b0 c0 d0
+    store512(dest + ((r + 1) * k + i) * 16, _mm512_shuffle_i64x2(ab01, cd01, 0xdd), nt);  // a1 b1 c1 d1
+    store512(dest + ((r + 2) * k + i) * 16, _mm512_shuffle_i64x2(ab23, cd23, 0x88), nt);
+    store512(dest + ((r + 3) * k + i) * 16, _mm512_shuffle_i64x2(ab23, cd23, 0xdd), nt);
+}
+
+ALWAYS_INLINE void unspread_avx512_impl(void* const* cells, uint8_t* dest, size_t rounds, int k, int nt) {
+    size_t r = 0;
+    for (; r + 4 <= rounds; r += 4) {
+        int i = 0;
+        for (; i + 4 <= k; i += 4) {
+            unspread_quad_avx512(cells, dest, r, k, i, nt);
+        }
+        for (; i + 2 <= k; i += 2) {
+            unspread_pair_avx2(cells, dest, r, k, i, nt);
+        }
+        if (i < k) {
+            unspread_single_avx2(cells, dest, r, k, i, nt);
+        }
+    }
+    unspread_rounds_sse2(cells, dest, r, rounds, k, nt);
+}
+
+static void spread_avx512(const void* input, void* const* cells, size_t input_size, int k, int nontemporal) {
+    const uint8_t* src = (const uint8_t*)input;
+    const size_t rounds = input_size / (16 * (size_t)k);
+    if (nontemporal && cells_aligned(cells, k, 64)) {
+        if (k == 8) {
+            spread_avx512_impl(src, cells, rounds, 8, 1);
+        } else {
+            spread_avx512_impl(src, cells, rounds, k, 1);
+        }
+        _mm_sfence();
+    } else if (k == 8) {
+        spread_avx512_impl(src, cells, rounds, 8, 0);
+    } else {
+        spread_avx512_impl(src, cells, rounds, k, 0);
+    }
+}
+
+static void unspread_avx512(void* const* cells, void* output, size_t output_size, int k, int nontemporal) {
+    uint8_t* dest = (uint8_t*)output;
+    const size_t rounds = output_size / (16 * (size_t)k);
+    // Quad stores land on 64 byte boundaries when k is a multiple of 4
+    if (nontemporal && k % 4 == 0 && aligned(output, 64)) {
+        if (k == 8) {
+            unspread_avx512_impl(cells, dest, rounds, 8, 1);
+        } else {
+            unspread_avx512_impl(cells, dest, rounds, k, 1);
+        }
+        _mm_sfence();
+    } else if (k == 8) {
+        unspread_avx512_impl(cells, dest, rounds, 8, 0);
+    } else {
+        unspread_avx512_impl(cells, dest, rounds, k, 0);
+    }
+}
+
+const spread_kernels spread_kernels_avx512 = {"avx512", avx512_supported, spread_avx512, unspread_avx512};
+
+#pragma GCC pop_options
+#endif
+
+const spread_kernels* const spread_all_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    &spread_kernels_avx512,
+    &spread_kernels_avx2,
+    &spread_kernels_sse2,
+#endif
+    &spread_kernels_generic,
+    NULL
+};
+
+const spread_kernels* spread_find_kernels(const char* name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+    for (int i = 0; spread_all_kernels[i] != NULL; i++) {
+        const spread_kernels* kernels = spread_all_kernels[i];
+        if ((name == NULL || strcmp(name, kernels->name) == 0) && kernels->supported()) {
+            return kernels;
+        }
+    }
+    return NULL;
+}
+
+static const spread_kernels* selected_kernels = NULL;
+
+const spread_kernels* spread_kernel(void) {
+    // Racing first calls pick the same backend, so a plain store is enough
+    const spread_kernels* kernels = __atomic_load_n(&selected_kernels, __ATOMIC_ACQUIRE);
+    if (kernels == NULL) {
+        const char* name = getenv("KELP_SPREAD_BACKEND");
+        kernels = name != NULL ? spread_find_kernels(name) : NULL;
+        if (kernels == NULL) {
+            kernels = spread_find_kernels(NULL);
+        }
+        __atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+    }
+    return kernels;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Spreading a payload over k cells, 16 bytes to each cell in turn, and back
+// A round is k 16 byte lanes of the payload, lane i of round r is bytes r * 16 of cell i
+// Only whole rounds are copied, so the size should be a multiple of 16 * k
+
+// Kernel backends
+// Each backend moves several rounds per iteration with the widest registers it has.  nontemporal
+// streams the stores past the cache, for large payloads headed straight to DMA that won't be read
+// again, and is only honoured when the destination alignment allows it
+typedef struct {
+    const char* name;
+    int (*supported)(void);
+    void (*spread)(const void* input, void* const* cells, size_t input_size, int k, int nontemporal);
+    void (*unspread)(void* const* cells, void* output, size_t output_size, int k, int nontemporal);
+} spread_kernels;
+
+extern const spread_kernels spread_kernels_generic;
+extern const spread_kernels spread_kernels_sse2;
+extern const spread_kernels spread_kernels_avx2;
+extern const spread_kernels spread_kernels_avx512;
+
+extern const spread_kernels* const spread_all_kernels[];  // in order of preference, NULL terminated
+
+// Find a supported backend by name, or the best supported one for NULL
+// Returns NULL if the backend is unknown or not supported by this cpu
+const spread_kernels* spread_find_kernels(const char* name);
+
+// The backend spread_cells/unspread_cells use: the KELP_SPREAD_BACKEND environment variable, or the best
+const spread_kernels* spread_kernel(void);
+
+static inline void spread_cells(const void* input, void* const* cells, size_t input_size, int k, int nontemporal) {
+    spread_kernel()->spread(input, cells, input_size, k, nontemporal);
+}
+static inline void unspread_cells(void* const* cells, void* output, size_t output_size, int k, int nontemporal) {
+    spread_kernel()->unspread(cells, output, output_size, k, nontemporal);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,227 @@
+#include "stripecache.hpp"
+#include "stripereader.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+// Hits an entry can bank for laps of the main queue
+constexpr int MAX_FREQ = 3;
+
+CachedStripe::CachedStripe(size_t size)
+    : volume_prefix_id(0), stripe_number(0), sequence_number(0), crc32c(0), size(size),
+      payload(allocAligned<unsigned char>(PAGE_SIZE, size)) {
+}
+
+CachedStripe::~CachedStripe() {
+    free(payload);
+}
+
+StripeCache::StripeCache(size_t payload_bytes, const StripeCacheConfig& config)
+    : payload_bytes_(payload_bytes), config_(config) {
+    const int shards = std::max(config.shards, 1);
+    shard_entries_ = std::max<size_t>(config.capacity_bytes / payload_bytes / shards, 1);
+    small_entries_ = std::max<size_t>(shard_entries_ * config.small_fraction, 1);
+    for (int i = 0; i < shards; i++) {
+        shards_.emplace_back(new Shard);
+        std::memset(&shards_.back()->stats, 0, sizeof(StripeCacheStats));
+    }
+}
+
+StripeCache::Shard& StripeCache::shardFor(const Key& key) {
+    // The high bits, the index's buckets use the low ones
+    return *shards_[(KeyHash()(key) >> 32) % shards_.size()];
+}
+
+StripeCache::Handle StripeCache::lookup(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t min_sequence) {
+    const Key key = {volume_prefix_id, stripe_number};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        shard.stats.misses++;
+        return nullptr;
+    }
+    if (it->second.stripe->sequence_number < min_sequence) {
+        remove(shard, it);
+        shard.stats.stale++;
+        shard.stats.misses++;
+        return nullptr;
+    }
+    if (config_.verify_hits && crc32c(it->second.stripe->payload, payload_bytes_, 0) != it->second.stripe->crc32c) {
+        remove(shard, it);
+        shard.stats.verify_failures++;
+        shard.stats.misses++;
+        return nullptr;
+    }
+    it->second.freq = std::min(it->second.freq + 1, MAX_FREQ);
+    shard.stats.hits++;
+    return it->second.stripe;
+}
+
+StripeCache::Handle StripeCache::insert(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t sequence_number, const void* payload) {
+    std::shared_ptr<CachedStripe> stripe = std::make_shared<CachedStripe>(payload_bytes_);
+    std::memcpy(stripe->payload, payload, payload_bytes_);
+    stripe->volume_prefix_id = volume_prefix_id;
+    stripe->stripe_number = stripe_number;
+    stripe->sequence_number = sequence_number;
+    stripe->crc32c = crc32c(stripe->payload, payload_bytes_, 0);
+    const Key key = {volume_prefix_id, stripe_number};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return insertLocked(shard, key, std::move(stripe));
+}
+
+StripeCache::Handle StripeCache::insertLocked(Shard& shard, const Key& key, std::shared_ptr<CachedStripe> stripe) {
+    bool main = false;
+    auto ghost = shard.ghosts.find(key);
+    if (ghost != shard.ghosts.end()) {
+        if (stripe->sequence_number < ghost->second.floor) {
+            shard.stats.stale++;
+            return nullptr;
+        }
+        shard.ghost_order.erase(ghost->second.position);
+        shard.ghosts.erase(ghost);
+        shard.stats.ghost_hits++;
+        main = true;
+    }
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        if (it->second.stripe->sequence_number >= stripe->sequence_number) {
+            return it->second.stripe;
+        }
+        // A newer payload takes the old one's place in the queues
+        Node& node = it->second;
+        node.stripe = std::move(stripe);
+        shard.stats.inserts++;
+        return node.stripe;
+    }
+
+    std::list<Key>& queue = main ? shard.main : shard.small;
+    queue.push_front(key);
+    Node& node = shard.index[key];
+    node.stripe = std::move(stripe);
+    node.freq = 0;
+    node.main = main;
+    node.position = queue.begin();
+    shard.stats.inserts++;
+    Handle handle = node.stripe;
+    while (shard.index.size() > shard_entries_) {
+        evict(shard);
+    }
+    return handle;
+}
+
+void StripeCache::invalidate(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t sequence_number) {
+    const Key key = {volume_prefix_id, stripe_number};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && it->second.stripe->sequence_number < sequence_number) {
+        remove(shard, it);
+    }
+    remember(shard, key, sequence_number);
+}
+
+int StripeCache::read(StripeReader& reader, uint32_t volume_prefix_id, uint64_t stripe_number, Handle* handle, int hedge) {
+    *handle = lookup(volume_prefix_id, stripe_number);
+    if (*handle != nullptr) {
+        return 0;
+    }
+    // Decode straight into the entry, so a miss costs no more copies than an uncached read
+    std::shared_ptr<CachedStripe> stripe = std::make_shared<CachedStripe>(payload_bytes_);
+    int ret = reader.readStripe(stripe_number, stripe->payload, hedge);
+    if (ret != 0) {
+        return ret;
+    }
+    stripe->volume_prefix_id = volume_prefix_id;
+    stripe->stripe_number = stripe_number;
+    stripe->sequence_number = reader.lastSequence();
+    stripe->crc32c = crc32c(stripe->payload, payload_bytes_, 0);
+    const Key key = {volume_prefix_id, stripe_number};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    *handle = insertLocked(shard, key, std::move(stripe));
+    return *handle != nullptr ? 0 : -ESTALE;
+}
+
+void StripeCache::remember(Shard& shard, const Key& key, uint32_t floor) {
+    auto ghost = shard.ghosts.find(key);
+    if (ghost != shard.ghosts.end()) {
+        ghost->second.floor = std::max(ghost->second.floor, floor);
+        shard.ghost_order.splice(shard.ghost_order.begin(), shard.ghost_order, ghost->second.position);
+        return;
+    }
+    shard.ghost_order.push_front(key);
+    shard.ghosts[key] = {floor, shard.ghost_order.begin()};
+    // As many ghosts as entries, enough to recognise a key coming back within one lap of the cache
+    if (shard.ghost_order.size() > shard_entries_) {
+        shard.ghosts.erase(shard.ghost_order.back());
+        shard.ghost_order.pop_back();
+    }
+}
+
+void StripeCache::remove(Shard& shard, std::unordered_map<Key, Node, KeyHash>::iterator it) {
+    (it->second.main ? shard.main : shard.small).erase(it->second.position);
+    shard.index.erase(it);
+}
+
+void StripeCache::evict(Shard& shard) {
+    for (;;) {
+        if (shard.small.size() >= small_entries_ || shard.main.empty()) {
+            const Key key = shard.small.back();
+            auto it = shard.index.find(key);
+            Node& node = it->second;
+            if (node.freq > 0) {
+                // Hit on probation, on to the main queue
+                shard.main.splice(shard.main.begin(), shard.small, node.position);
+                node.main = true;
+                node.freq = 0;
+                shard.stats.promotions++;
+                continue;
+            }
+            // Anything older than what was cached is stale, so that is the ghost's floor
+            const uint32_t floor = node.stripe->sequence_number;
+            remove(shard, it);
+            remember(shard, key, floor);
+            shard.stats.evictions++;
+            return;
+        }
+        auto it = shard.index.find(shard.main.back());
+        Node& node = it->second;
+        if (node.freq > 0) {
+            node.freq--;
+            shard.main.splice(shard.main.begin(), shard.main, node.position);
+            continue;
+        }
+        remove(shard, it);
+        shard.stats.evictions++;
+        return;
+    }
+}
+
+size_t StripeCache::entries() const {
+    size_t count = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        count += shard->index.size();
+    }
+    return count;
+}
+
+StripeCacheStats StripeCache::stats() const {
+    StripeCacheStats total;
+    std::memset(&total, 0, sizeof(total));
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total.hits += shard->stats.hits;
+        total.misses += shard->stats.misses;
+        total.inserts += shard->stats.inserts;
+        total.stale += shard->stats.stale;
+        total.promotions += shard->stats.promotions;
+        total.ghost_hits += shard->stats.ghost_hits;
+        total.evictions += shard->stats.evictions;
+        total.verify_failures += shard->stats.verify_failures;
+    }
+    return total;
+}
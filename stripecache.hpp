@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "blockaio.hpp"
+
+class StripeReader;
+
+/**
+ * Stripe cache settings.
+ */
+struct StripeCacheConfig {
+    size_t capacity_bytes = 64 << 20;   // of payloads, entries pinned by handles after eviction are extra
+    int shards = 16;                    // independently locked parts, by key hash
+    double small_fraction = 0.1;        // of each shard's entries for the probationary queue
+    bool verify_hits = false;           // check each hit's payload against its crc32c from insertion
+};
+
+struct StripeCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t stale;          // entries older than what a lookup wanted, or inserts older than an invalidation
+    uint64_t promotions;     // entries hit while on probation, moved to the main queue
+    uint64_t ghost_hits;     // inserts of keys recently evicted from probation, straight to the main queue
+    uint64_t evictions;
+    uint64_t verify_failures;
+};
+
+/**
+ * A decoded stripe payload in the cache, immutable once inserted.
+ */
+struct CachedStripe {
+    uint32_t volume_prefix_id;
+    uint64_t stripe_number;
+    uint32_t sequence_number;   // the newest block_sequence_number of the cells it was decoded from
+    uint32_t crc32c;            // of the payload
+    size_t size;
+    unsigned char* payload;     // page aligned
+
+    /**
+     * Allocates the payload, aborts if the allocation fails.
+     */
+    CachedStripe(size_t size);
+    ~CachedStripe();
+    CachedStripe(const CachedStripe&) = delete;
+    CachedStripe& operator=(const CachedStripe&) = delete;
+};
+
+/**
+ * In-process cache of decoded stripe payloads keyed by (volume_prefix_id, stripe_number), so hot
+ * stripes skip the reads, validateBlocks() and the unspread.  A hit is a shared pointer to the payload,
+ * nothing is copied, and an entry evicted while a reader holds it lives until the reader lets go.
+ *
+ * Eviction is S3-FIFO per shard: new keys go on a small probationary FIFO and are only kept, moved to
+ * the main FIFO, if they are hit again before they reach its end.  Keys evicted from probation are
+ * remembered in a ghost FIFO so coming back soon goes straight to main.  Entries leaving main get
+ * another lap for each hit (up to 3).  A scrub or compaction pass touches each stripe once, so it cycles
+ * through probation without pushing out the hot stripes.
+ *
+ * Entries carry the block_sequence_number they were decoded from.  When the holdfast updates a stripe it
+ * calls invalidate() with the new sequence number, which drops older entries and leaves the number in the
+ * ghost FIFO as a floor, so a reader that decoded the old cells just before the update can't insert them
+ * afterwards.  lookup() can also ask for a minimum sequence number.
+ */
+class StripeCache {
+public:
+    using Handle = std::shared_ptr<const CachedStripe>;
+
+    /**
+     * @param payload_bytes The payload size of every stripe, k * 4080.
+     * @param config The settings.
+     */
+    StripeCache(size_t payload_bytes, const StripeCacheConfig& config = StripeCacheConfig());
+    StripeCache(const StripeCache&) = delete;
+    StripeCache& operator=(const StripeCache&) = delete;
+
+    /**
+     * @param min_sequence The oldest sequence number wanted, an older entry is dropped.
+     * @return Returns the entry, or nullptr on a miss.
+     */
+    Handle lookup(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t min_sequence = 0);
+
+    /**
+     * Copies a payload into the cache.
+     * @param sequence_number The newest block_sequence_number of the cells the payload was decoded from.
+     * @param payload payloadBytes() bytes.
+     * @return Returns the entry, which is the one already cached if that isn't older, or nullptr if an
+     *         invalidation says the payload is stale.
+     */
+    Handle insert(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t sequence_number, const void* payload);
+
+    /**
+     * Drops the entry if it is older than sequence_number, and refuses older inserts while the key is
+     * remembered.
+     */
+    void invalidate(uint32_t volume_prefix_id, uint64_t stripe_number, uint32_t sequence_number);
+
+    /**
+     * Looks a stripe up, and on a miss reads it with the reader straight into a new entry.
+     * @param reader The reader of the stripe's volumes.
+     * @param handle Receives the entry.
+     * @param hedge Passed to StripeReader::readStripe().
+     * @return Returns 0, or the error from readStripe(), or -ESTALE if the read raced an invalidation.
+     */
+    int read(StripeReader& reader, uint32_t volume_prefix_id, uint64_t stripe_number, Handle* handle, int hedge = -1);
+
+    size_t payloadBytes() const { return payload_bytes_; }
+    size_t entries() const;
+    StripeCacheStats stats() const;
+
+private:
+    struct Key {
+        uint32_t volume_prefix_id;
+        uint64_t stripe_number;
+        bool operator==(const Key& other) const {
+            return volume_prefix_id == other.volume_prefix_id && stripe_number == other.stripe_number;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return (key.stripe_number * 0x9e3779b97f4a7c15ull) ^ (uint64_t(key.volume_prefix_id) << 17) ^ (key.stripe_number >> 29);
+        }
+    };
+    struct Node {
+        std::shared_ptr<CachedStripe> stripe;
+        int freq;
+        bool main;
+        std::list<Key>::iterator position;
+    };
+    struct Ghost {
+        uint32_t floor;   // inserts older than this are stale
+        std::list<Key>::iterator position;
+    };
+    struct alignas(64) Shard {
+        std::mutex lock;
+        std::unordered_map<Key, Node, KeyHash> index;
+        std::list<Key> small;    // newest at the front
+        std::list<Key> main;
+        std::list<Key> ghost_order;
+        std::unordered_map<Key, Ghost, KeyHash> ghosts;
+        StripeCacheStats stats;
+    };
+
+    Shard& shardFor(const Key& key);
+    Handle insertLocked(Shard& shard, const Key& key, std::shared_ptr<CachedStripe> stripe);
+    void remember(Shard& shard, const Key& key, uint32_t floor);
+    void remove(Shard& shard, std::unordered_map<Key, Node, KeyHash>::iterator it);
+    void evict(Shard& shard);
+
+    size_t payload_bytes_;
+    StripeCacheConfig config_;
+    size_t shard_entries_;
+    size_t small_entries_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
@@ -0,0 +1,247 @@
+#include "stripereader.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+
+// Reads between refreshes of the schedule from the latency histograms
+constexpr int SCHEDULE_REFRESH = 64;
+
+StripeReader::StripeReader(const VolumeMap& map, reed_solomon* rs, io_context_t io_ctx, int max_reads, LatencyTracker* tracker)
+    : map_(map), rs_(rs), batch_(io_ctx, max_reads), blocks_(nullptr), slots_(max_reads), free_(nullptr),
+      events_(max_reads), scratch_(nullptr), tracker_(tracker), expected_us_(map.volumes.size(), 0),
+      slow_(map.volumes.size(), false), refresh_countdown_(0), generation_(0), cell_reads_(0),
+      decoded_reads_(0), valid_(0), outstanding_(0), stripe_number_(0), sequence_number_(0) {
+    if (tracker_ == nullptr) {
+        own_tracker_.reset(new LatencyTracker(map));
+        tracker_ = own_tracker_.get();
+    }
+    const int n = rs->data_shards + rs->parity_shards;
+    blocks_ = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * max_reads);
+    scratch_ = allocAligned<unsigned char>(PAGE_SIZE, sizeof(Block::data) * rs->data_shards);
+    for (int i = max_reads - 1; i >= 0; i--) {
+        slots_[i].block = &blocks_[i];
+        slots_[i].next = free_;
+        free_ = &slots_[i];
+    }
+    for (int i = 0; i < n; i++) {
+        shard_volume_.push_back(findVolumeForShard(map, i));
+    }
+    order_.reserve(n);
+    issued_.reserve(n);
+    cells_.resize(n);
+}
+
+StripeReader::~StripeReader() {
+    // Wait out the stragglers, the kernel still owns their buffers
+    while (batch_.inFlight() > 0) {
+        reap(true);
+    }
+    free(blocks_);
+    free(scratch_);
+}
+
+StripeReader::Slot* StripeReader::acquire() {
+    Slot* slot = free_;
+    if (slot != nullptr) {
+        free_ = slot->next;
+    }
+    return slot;
+}
+
+void StripeReader::refreshSchedule() {
+    std::fill(slow_.begin(), slow_.end(), false);
+    for (int v : tracker_->slowVolumes()) {
+        slow_[v] = true;
+    }
+    for (size_t v = 0; v < expected_us_.size(); v++) {
+        expected_us_[v] = tracker_->expectedUs(v);
+    }
+    refresh_countdown_ = SCHEDULE_REFRESH;
+}
+
+int StripeReader::chooseHedge() const {
+    // One extra read always, plus one for each data shard on a slow drive
+    int hedge = 1;
+    for (int i = 0; i < rs_->data_shards; i++) {
+        int v = shard_volume_[i];
+        if (v >= 0 && slow_[v]) {
+            hedge++;
+        }
+    }
+    return std::min(hedge, rs_->parity_shards);
+}
+
+int StripeReader::issue(int shard) {
+    Slot* slot;
+    while ((slot = acquire()) == nullptr) {
+        // Out of slots, so they're all in flight or queued, and queued reads only complete once submitted
+        if (valid_ >= rs_->data_shards) {
+            return 0;
+        }
+        int ret = submit();
+        if (ret == 0 && batch_.inFlight() == 0) {
+            ret = -EIO;
+        }
+        if (ret == 0) {
+            ret = std::min(reap(true), 0);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    const Volume& vol = map_.volumes[shard_volume_[shard]];
+    slot->generation = generation_;
+    slot->shard = shard;
+    slot->volume = shard_volume_[shard];
+    slot->submit_ns = monotonicNs();
+    batch_.queueRead(vol.fd, computeOffsetToBlock(vol.header, stripe_number_, shard), slot->block, sizeof(Block), slot - slots_.data());
+    issued_.push_back(slot);
+    outstanding_++;
+    cell_reads_++;
+    return 0;
+}
+
+int StripeReader::submit() {
+    while (batch_.queued() > 0) {
+        int submitted = batch_.flush();
+        if (submitted < 0 && submitted != -EAGAIN) {
+            // The unsubmitted reads are the last ones issued, they'll never complete
+            for (size_t i = issued_.size() - batch_.queued(); i < issued_.size(); i++) {
+                issued_[i]->next = free_;
+                free_ = issued_[i];
+            }
+            outstanding_ -= batch_.queued();
+            batch_.clear();
+            return submitted;
+        }
+    }
+    return 0;
+}
+
+int StripeReader::reap(bool wait) {
+    int completed = batch_.reap(events_.data(), events_.size(), wait ? 1 : 0);
+    if (completed < 0) {
+        return completed;
+    }
+    uint64_t now = monotonicNs();
+    const uint64_t expected_stripe = stripe_number_ << 8;
+    for (int i = 0; i < completed; i++) {
+        Slot* slot = &slots_[events_[i].user_tag];
+        tracker_->recordVolume(slot->volume, now - slot->submit_ns);
+
+        bool current = slot->generation == generation_;
+        if (current) {
+            outstanding_--;
+        }
+        const Block& block = *slot->block;
+        if (current && events_[i].result == long(sizeof(Block)) && cells_[slot->shard] == nullptr
+            && block.stripe_number == (expected_stripe | slot->shard) && validateBlock(block)) {
+            cells_[slot->shard] = slot;
+            valid_++;
+            continue;
+        }
+        // A straggler from an earlier read, or a bad cell
+        slot->next = free_;
+        free_ = slot;
+    }
+    return completed;
+}
+
+int StripeReader::readStripe(uint64_t stripe_number, void* payload, int hedge) {
+    const int k = rs_->data_shards;
+    const int n = rs_->data_shards + rs_->parity_shards;
+    generation_++;
+    stripe_number_ = stripe_number;
+    std::fill(cells_.begin(), cells_.end(), nullptr);
+    valid_ = 0;
+    outstanding_ = 0;
+    issued_.clear();
+
+    if (--refresh_countdown_ <= 0) {
+        refreshSchedule();
+    }
+
+    // Healthy drives before slow ones, fastest first, data before parity on ties since parity costs a decode
+    order_.clear();
+    for (int i = 0; i < n; i++) {
+        if (shard_volume_[i] >= 0) {
+            order_.push_back(i);
+        }
+    }
+    std::stable_sort(order_.begin(), order_.end(), [&](int a, int b) {
+        int va = shard_volume_[a];
+        int vb = shard_volume_[b];
+        if (slow_[va] != slow_[vb]) {
+            return !slow_[va];
+        }
+        // Compare by doubling, so small differences between healthy drives don't cost a decode
+        return std::ilogb(expected_us_[va] + 1) < std::ilogb(expected_us_[vb] + 1);
+    });
+
+    const int target = k + (hedge < 0 ? chooseHedge() : std::min(hedge, n - k));
+    size_t next = 0;
+    int ret = 0;
+    while (valid_ < k) {
+        // The first k + h cells, then more whenever bad cells leave too few in flight to make k
+        while (ret == 0 && valid_ < k && next < order_.size() && (int(next) < target || valid_ + outstanding_ < k)) {
+            ret = issue(order_[next++]);
+        }
+        if (ret == 0) {
+            ret = submit();
+        }
+        // Waiting for a slot can have reaped enough cells already
+        if (ret == 0 && valid_ >= k) {
+            break;
+        }
+        if (ret == 0 && outstanding_ == 0) {
+            ret = -EIO;
+        }
+        if (ret == 0) {
+            ret = std::min(reap(true), 0);
+        }
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        unsigned char* shards[MAX_TOTAL_SHARDS];
+        int erasures[MAX_TOTAL_SHARDS];
+        bool decode = false;
+        sequence_number_ = 0;
+        for (int i = 0; i < n; i++) {
+            erasures[i] = cells_[i] == nullptr;
+            if (cells_[i] != nullptr) {
+                sequence_number_ = std::max(sequence_number_, cells_[i]->block->block_sequence_number);
+            }
+            shards[i] = cells_[i] != nullptr ? cells_[i]->block->data.data() : nullptr;
+            if (i < k && erasures[i]) {
+                shards[i] = scratch_ + size_t(i) * sizeof(Block::data);
+                decode = true;
+            }
+        }
+        // Parity cells we didn't read are never decoded, but need a pointer
+        for (int i = k; i < n; i++) {
+            if (shards[i] == nullptr) {
+                shards[i] = scratch_;
+            }
+        }
+        if (decode) {
+            decoded_reads_++;
+        }
+        if (!readStripeRange(rs_, shards, erasures, 0, k * sizeof(Block::data), payload)) {
+            ret = -EIO;
+        }
+    }
+
+    // The cells we kept go back to the pool, stragglers are reclaimed as they complete
+    for (Slot*& slot : cells_) {
+        if (slot != nullptr) {
+            slot->next = free_;
+            free_ = slot;
+            slot = nullptr;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "blockaio.hpp"
+#include "latency.hpp"
+
+/**
+ * Hedged k-of-n stripe reads.  A read issues k + h cell reads across the volumes, validates each
+ * cell as it completes and decodes as soon as any k valid cells are in.  The stragglers are ignored,
+ * their buffers are reclaimed when they complete.  Which cells to read, and h, come from the per
+ * drive latency histograms: cells on slow drives are read last, and each data shard on a slow
+ * drive adds a hedge read.  Like the io_context_t it uses, a reader is used by one thread.
+ */
+class StripeReader {
+public:
+    /**
+     * @param map The volumes.  Must outlive the reader.
+     * @param rs The Reed-Solomon codec.  Must outlive the reader.
+     * @param io_ctx The I/O context, set up for at least max_reads events.
+     * @param max_reads The most cell reads in flight, including stragglers from earlier reads.
+     * @param tracker Latency histograms to record into and schedule from, shared with other users of
+     *                the drives, or nullptr for the reader's own.
+     */
+    StripeReader(const VolumeMap& map, reed_solomon* rs, io_context_t io_ctx, int max_reads, LatencyTracker* tracker = nullptr);
+    ~StripeReader();
+    StripeReader(const StripeReader&) = delete;
+    StripeReader& operator=(const StripeReader&) = delete;
+
+    /**
+     * Reads the payload of a stripe.
+     * @param stripe_number The stripe number.
+     * @param payload Receives the k * 4080 byte payload.
+     * @param hedge Extra cells to read beyond k, or -1 to choose from the latency stats.
+     * @return Returns 0, -EIO if fewer than k cells are valid, or a negative error code.
+     */
+    int readStripe(uint64_t stripe_number, void* payload, int hedge = -1);
+
+    const LatencyTracker& latency() const { return *tracker_; }
+
+    /**
+     * @return Returns the number of extra reads readStripe picks with hedge = -1.
+     */
+    int chooseHedge() const;
+
+    // Reads issued and stripes that needed a decode, for tuning the hedge
+    uint64_t cellReads() const { return cell_reads_; }
+    uint64_t decodedReads() const { return decoded_reads_; }
+
+    /**
+     * @return Returns the newest block_sequence_number among the cells the last successful readStripe
+     *         decoded from.
+     */
+    uint32_t lastSequence() const { return sequence_number_; }
+
+private:
+    struct Slot {
+        Block* block;
+        uint64_t generation;  // readStripe call the read belongs to
+        int shard;
+        int volume;
+        uint64_t submit_ns;
+        Slot* next;
+    };
+
+    void refreshSchedule();
+    Slot* acquire();
+    int issue(int shard);
+    int submit();
+    int reap(bool wait);
+
+    const VolumeMap& map_;
+    reed_solomon* rs_;
+    IoBatch batch_;
+    Block* blocks_;
+    std::vector<Slot> slots_;
+    Slot* free_;
+    std::vector<IoCompletion> events_;
+    std::vector<int> order_;
+    unsigned char* scratch_;  // k cells to reconstruct missing data cells into
+    std::unique_ptr<LatencyTracker> own_tracker_;
+    LatencyTracker* tracker_;
+    // Per volume expected latency and slowness, refreshed every SCHEDULE_REFRESH reads
+    std::vector<double> expected_us_;
+    std::vector<bool> slow_;
+    int refresh_countdown_;
+    std::vector<int> shard_volume_;
+    uint64_t generation_;
+    uint64_t cell_reads_;
+    uint64_t decoded_reads_;
+
+    // State of the current readStripe
+    std::vector<Slot*> cells_;
+    std::vector<Slot*> issued_;
+    int valid_;
+    int outstanding_;
+    uint64_t stripe_number_;
+    uint32_t sequence_number_;
+};
@@ -0,0 +1,362 @@
+#include "taillog.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <unistd.h>
+
+namespace {
+
+// The first block of a record, followed by cell_count backups
+struct TailRecord {
+    uint32_t checksum;  // crc32c of the fields after it, seeded with RECORD_MAGIC so no cell passes for a record
+    uint32_t magic;
+    uint32_t sequence_number;  // of the commit's new cells
+    uint32_t cell_count;       // backups in this record
+    uint64_t stripe_number;
+    uint32_t total_cells;      // backups of the commit across all volumes
+    uint32_t backups_crc;      // crc32c of the backup blocks
+    uint8_t shards[8];         // shard of each backup, the backup itself may be garbage
+    uint64_t commit;           // the commit's place in the log, newer commits have higher numbers
+    unsigned char padding[4096 - 48];
+};
+static_assert(sizeof(TailRecord) == sizeof(Block), "a record is one block");
+
+const size_t RECORD_FIELDS = offsetof(TailRecord, padding) - offsetof(TailRecord, magic);
+
+void sealRecord(TailRecord& record) {
+    record.checksum = crc32c(&record.magic, RECORD_FIELDS, TailLog::RECORD_MAGIC);
+}
+
+bool validRecord(const TailRecord& record) {
+    return record.magic == TailLog::RECORD_MAGIC && record.checksum == crc32c(&record.magic, RECORD_FIELDS, TailLog::RECORD_MAGIC)
+           && record.cell_count > 0 && record.cell_count < TailLog::RECORD_BLOCKS;
+}
+
+// Reads a cell in place, a short read leaves zeros that don't validate
+int readCell(const Volume& vol, uint64_t stripe_number, int shard, Block& cell) {
+    ssize_t ret = pread(vol.fd, &cell, sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, shard));
+    if (ret < 0) {
+        return -errno;
+    }
+    std::memset(reinterpret_cast<unsigned char*>(&cell) + ret, 0, sizeof(Block) - ret);
+    return 0;
+}
+
+}  // namespace
+
+TailLog::TailLog(const VolumeMap& map, uint32_t capacity_blocks)
+    : map_(map), capacity_(capacity_blocks), recovered_(false), next_sequence_(1), next_commit_(1),
+      positions_(map.volumes.size(), 0), buffer_(nullptr) {
+    buffer_ = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * RECORD_BLOCKS * std::max<size_t>(map.volumes.size(), 1));
+}
+
+TailLog::~TailLog() {
+    free(buffer_);
+}
+
+uint64_t TailLog::tailOffset(int volume, uint32_t position) const {
+    return map_.volumes[volume].header.tail_offset + uint64_t(position) * sizeof(Block);
+}
+
+int TailLog::syncVolumes(const std::vector<bool>& touched) {
+    for (size_t v = 0; v < touched.size(); v++) {
+        if (touched[v] && fdatasync(map_.volumes[v].fd) != 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+int TailLog::retire(const std::vector<bool>& touched, const std::vector<uint32_t>& positions) {
+    // Zeroing the record block is enough, the backups after it no longer belong to a record
+    std::memset(buffer_, 0, sizeof(Block));
+    for (size_t v = 0; v < touched.size(); v++) {
+        if (touched[v] && pwrite(map_.volumes[v].fd, buffer_, sizeof(Block), tailOffset(v, positions[v])) != sizeof(Block)) {
+            return errno != 0 ? -errno : -EIO;
+        }
+    }
+    return syncVolumes(touched);
+}
+
+int TailLog::recover() {
+    struct Found {
+        int volume;
+        uint32_t position;
+        const TailRecord* record;
+    };
+    const size_t volumes = map_.volumes.size();
+    std::vector<Block*> regions(volumes, nullptr);
+    std::map<uint64_t, std::vector<Found>> commits;  // by commit number
+    std::vector<Found> found;
+    int ret = 0;
+
+    // Read each tail sequentially and pick out the complete records
+    for (size_t v = 0; v < volumes && ret == 0; v++) {
+        const Volume& vol = map_.volumes[v];
+        if (vol.header.tail_offset == 0 || capacity_ == 0) {
+            continue;
+        }
+        if (posix_memalign(reinterpret_cast<void**>(&regions[v]), PAGE_SIZE, size_t(capacity_) * sizeof(Block)) != 0) {
+            ret = -ENOMEM;
+            break;
+        }
+        ssize_t got = pread(vol.fd, regions[v], size_t(capacity_) * sizeof(Block), vol.header.tail_offset);
+        if (got < 0) {
+            ret = -errno;
+            break;
+        }
+        std::memset(reinterpret_cast<unsigned char*>(regions[v]) + got, 0, size_t(capacity_) * sizeof(Block) - got);
+
+        for (uint32_t p = 0; p < capacity_;) {
+            const TailRecord* record = reinterpret_cast<const TailRecord*>(&regions[v][p]);
+            if (!validRecord(*record) || p + 1 + record->cell_count > capacity_
+                || crc32c(&regions[v][p + 1], size_t(record->cell_count) * sizeof(Block), 0) != record->backups_crc) {
+                p++;
+                continue;
+            }
+            Found f = {int(v), p, record};
+            commits[record->commit].push_back(f);
+            found.push_back(f);
+            next_sequence_ = std::max(next_sequence_, record->sequence_number + 1);
+            next_commit_ = std::max(next_commit_, record->commit + 1);
+            p += 1 + record->cell_count;
+        }
+    }
+
+    // Commits run one at a time and retire their records once their cells are down, so only the newest
+    // commit can be in flight.  Older records are left over from a crash while retiring them.
+    const std::vector<Found>* newest = commits.empty() || ret != 0 ? nullptr : &commits.rbegin()->second;
+    uint32_t sequence = 0;
+    uint64_t stripe = 0;
+    if (newest != nullptr) {
+        const TailRecord* first = (*newest)[0].record;
+        sequence = first->sequence_number;
+        stripe = first->stripe_number;
+        uint32_t backups = 0;
+        bool same = true;
+        for (const Found& f : *newest) {
+            backups += f.record->cell_count;
+            same = same && f.record->sequence_number == sequence && f.record->stripe_number == stripe;
+        }
+        if (!same || backups < first->total_cells) {
+            newest = nullptr;  // Phase 1 didn't finish, so phase 2 never started
+        }
+    }
+
+    // state: 0 old, 1 written by this commit or torn, 2 newer than this commit
+    std::vector<int> state;
+    bool done = true;
+    bool newer = false;
+    for (size_t r = 0; newest != nullptr && r < newest->size() && ret == 0; r++) {
+        const Found& f = (*newest)[r];
+        const Volume& vol = map_.volumes[f.volume];
+        for (uint32_t i = 0; i < f.record->cell_count && ret == 0; i++) {
+            const int shard = f.record->shards[i];
+            Block cell;
+            if (findVolumeForShard(map_, shard) != f.volume || (ret = readCell(vol, stripe, shard, cell)) != 0) {
+                state.push_back(0);
+                continue;
+            }
+            const bool valid = validateBlock(cell) && cell.stripe_number == ((stripe << 8) | uint8_t(shard));
+            const int s = !valid ? 1 : cell.block_sequence_number < sequence ? 0 : cell.block_sequence_number == sequence ? 1 : 2;
+            done = done && valid && s != 0;
+            newer = newer || s == 2;
+            state.push_back(s);
+        }
+    }
+
+    // Roll back the cells it wrote or tore, unless it finished or the stripe has been written since
+    int rolled_back = 0;
+    std::vector<bool> touched(volumes, false);
+    if (newest != nullptr && ret == 0 && !done && !newer) {
+        size_t index = 0;
+        for (size_t r = 0; r < newest->size() && ret == 0; r++) {
+            const Found& f = (*newest)[r];
+            const Volume& vol = map_.volumes[f.volume];
+            const Block* backup = &regions[f.volume][f.position + 1];
+            for (uint32_t i = 0; i < f.record->cell_count; i++) {
+                if (state[index++] != 1) {
+                    continue;
+                }
+                const int shard = f.record->shards[i];
+                if (pwrite(vol.fd, &backup[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)) != sizeof(Block)) {
+                    ret = errno != 0 ? -errno : -EIO;
+                    break;
+                }
+                touched[f.volume] = true;
+            }
+        }
+        rolled_back = 1;
+    }
+    if (ret == 0) {
+        ret = syncVolumes(touched);
+    }
+
+    // Only then clear the records, so a crash during recovery just recovers again
+    if (ret == 0) {
+        std::memset(buffer_, 0, sizeof(Block));
+        for (const Found& f : found) {
+            if (pwrite(map_.volumes[f.volume].fd, buffer_, sizeof(Block), tailOffset(f.volume, f.position)) != sizeof(Block)) {
+                ret = errno != 0 ? -errno : -EIO;
+                break;
+            }
+            touched[f.volume] = true;
+        }
+    }
+    if (ret == 0) {
+        ret = syncVolumes(touched);
+    }
+    for (Block* region : regions) {
+        free(region);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    std::fill(positions_.begin(), positions_.end(), 0);
+    recovered_ = true;
+    return rolled_back;
+}
+
+int TailLog::commit(uint64_t stripe_number, const Block* const* cells, int count) {
+    if (!recovered_ || count <= 0 || count > MAX_TOTAL_SHARDS) {
+        return -EINVAL;
+    }
+    const size_t volumes = map_.volumes.size();
+    const uint32_t sequence = cells[0]->block_sequence_number;
+    int volume_of[MAX_TOTAL_SHARDS];
+    bool seen[256] = {};
+    for (int i = 0; i < count; i++) {
+        const Block* cell = cells[i];
+        const int shard = cell->stripe_number & 0xff;
+        if ((cell->stripe_number >> 8) != stripe_number || cell->block_sequence_number != sequence || seen[shard]
+            || !validateBlock(*cell)) {
+            return -EINVAL;
+        }
+        seen[shard] = true;
+        volume_of[i] = findVolumeForShard(map_, shard);
+        if (volume_of[i] < 0 || map_.volumes[volume_of[i]].header.tail_offset == 0) {
+            return -EINVAL;
+        }
+    }
+
+    // Back up the old cells, each into its own volume's record
+    std::vector<bool> touched(volumes, false);
+    std::vector<uint32_t> positions(volumes, 0);
+    for (int i = 0; i < count; i++) {
+        const int v = volume_of[i];
+        TailRecord* record = reinterpret_cast<TailRecord*>(buffer_ + size_t(v) * RECORD_BLOCKS);
+        if (!touched[v]) {
+            std::memset(record, 0, sizeof(TailRecord));
+            touched[v] = true;
+        }
+        const int shard = cells[i]->stripe_number & 0xff;
+        Block& backup = buffer_[size_t(v) * RECORD_BLOCKS + 1 + record->cell_count];
+        int ret = readCell(map_.volumes[v], stripe_number, shard, backup);
+        if (ret != 0) {
+            return ret;
+        }
+        if (validateBlock(backup) && backup.stripe_number == cells[i]->stripe_number && backup.block_sequence_number >= sequence) {
+            return -EINVAL;
+        }
+        record->shards[record->cell_count++] = shard;
+    }
+
+    // Phase 1: one sequential append per volume
+    for (size_t v = 0; v < volumes; v++) {
+        if (!touched[v]) {
+            continue;
+        }
+        TailRecord* record = reinterpret_cast<TailRecord*>(buffer_ + v * RECORD_BLOCKS);
+        const uint32_t blocks = 1 + record->cell_count;
+        if (blocks > capacity_) {
+            return -ENOSPC;
+        }
+        if (positions_[v] + blocks > capacity_) {
+            positions_[v] = 0;
+        }
+        record->magic = RECORD_MAGIC;
+        record->sequence_number = sequence;
+        record->stripe_number = stripe_number;
+        record->total_cells = count;
+        record->commit = next_commit_;
+        record->backups_crc = crc32c(buffer_ + v * RECORD_BLOCKS + 1, size_t(record->cell_count) * sizeof(Block), 0);
+        sealRecord(*record);
+        const ssize_t bytes = ssize_t(blocks) * sizeof(Block);
+        if (pwrite(map_.volumes[v].fd, record, bytes, tailOffset(v, positions_[v])) != bytes) {
+            return errno != 0 ? -errno : -EIO;
+        }
+        positions[v] = positions_[v];
+        positions_[v] += blocks;
+    }
+    next_commit_++;
+    int ret = syncVolumes(touched);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Phase 2: the new cells in place, an error from here on needs recovery
+    for (int i = 0; i < count && ret == 0; i++) {
+        const Volume& vol = map_.volumes[volume_of[i]];
+        if (pwrite(vol.fd, cells[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe_number, cells[i]->stripe_number & 0xff)) != sizeof(Block)) {
+            ret = errno != 0 ? -errno : -EIO;
+        }
+    }
+    if (ret == 0) {
+        ret = syncVolumes(touched);
+    }
+    // Every cell is down, so the commit no longer needs its records
+    if (ret == 0) {
+        ret = retire(touched, positions);
+    }
+    if (ret != 0) {
+        recovered_ = false;
+        return ret;
+    }
+    next_sequence_ = std::max(next_sequence_, sequence + 1);
+    return 0;
+}
+
+int TailLog::writeStripe(reed_solomon* rs, uint64_t stripe_number, const void* payload, uint32_t sequence_number) {
+    const int n = rs->data_shards + rs->parity_shards;
+    std::vector<Block> blocks(n);
+    const Block* cells[MAX_TOTAL_SHARDS];
+    buildStripe(rs, payload, stripe_number, sequence_number, blocks.data());
+    for (int i = 0; i < n; i++) {
+        cells[i] = &blocks[i];
+    }
+    return commit(stripe_number, cells, n);
+}
+
+int TailLog::updateStripeCell(reed_solomon* rs, uint64_t stripe_number, int shard_id, const void* new_data, uint32_t sequence_number) {
+    const int k = rs->data_shards;
+    const int m = rs->parity_shards;
+    if (shard_id < 0 || shard_id >= k) {
+        return -EINVAL;
+    }
+
+    // Cell 0 is the data cell, then the parity cells
+    std::vector<Block> blocks(1 + m);
+    Block* parity[MAX_TOTAL_SHARDS];
+    const Block* cells[MAX_TOTAL_SHARDS];
+    for (int i = 0; i <= m; i++) {
+        const int shard = i == 0 ? shard_id : k + i - 1;
+        const int v = findVolumeForShard(map_, shard);
+        if (v < 0) {
+            return -ENOENT;
+        }
+        int ret = readCell(map_.volumes[v], stripe_number, shard, blocks[i]);
+        if (ret != 0) {
+            return ret;
+        }
+        if (i > 0) {
+            parity[i - 1] = &blocks[i];
+        }
+        cells[i] = &blocks[i];
+    }
+    if (!::updateCell(rs, blocks[0], parity, new_data, sequence_number)) {
+        return -EIO;
+    }
+    return commit(stripe_number, cells, 1 + m);
+}
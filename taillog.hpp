@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "blockaio.hpp"
+
+/**
+ * Write-ahead tail for atomic in-place stripe updates.  Each volume has a tail region of
+ * capacity blocks at header.tail_offset, used as a ring.  A commit is two phases:
+ *
+ * 1. The old cells are appended to the tail of the volume they live on, one record block followed
+ *    by the backups, in one sequential write per volume, and the tails are synced.
+ * 2. The new cells are written in place and synced, then the records are retired and synced.
+ *
+ * Commits run one at a time, so only the newest commit in the tails can have been interrupted, and
+ * only one whose records weren't retired.  Records are numbered in commit order to find it.  Recovery
+ * rolls it back from the backups if its records are all in the tails but not every cell in place is
+ * valid with its block_sequence_number, and leaves it alone if its records didn't all make it, since
+ * then it never touched the cells.  Cells that go bad after their commit are the scrubber's business and
+ * are never replaced by an older backup.  A cell newer than the commit means something else wrote the
+ * stripe since, then the commit isn't rolled back at all rather than only in part.
+ * Like the fds it uses, a tail log isn't shared between threads.
+ */
+class TailLog {
+public:
+    static constexpr uint32_t RECORD_MAGIC = 0x6c696174;  // "tail"
+    // The record block and at most 8 backups, a volume holds at most 8 shards
+    static constexpr int RECORD_BLOCKS = 9;
+
+    /**
+     * @param map The volumes, every volume a commit touches needs a tail_offset.  Must outlive the log.
+     * @param capacity_blocks The size of each volume's tail region in blocks.
+     */
+    TailLog(const VolumeMap& map, uint32_t capacity_blocks);
+    ~TailLog();
+    TailLog(const TailLog&) = delete;
+    TailLog& operator=(const TailLog&) = delete;
+
+    /**
+     * Rolls back the interrupted commit, if there is one, and clears the tails.  Call once before the
+     * first commit.
+     * @return Returns the number of commits rolled back, 0 or 1, or a negative error code.
+     */
+    int recover();
+
+    /**
+     * Atomically replaces cells of a stripe.
+     * @param stripe_number The stripe number.
+     * @param cells The new cells, sealed, of this stripe and all with the same block_sequence_number.
+     * @param count The number of cells, at most one per shard.
+     * @return Returns 0, -EINVAL if the cells aren't a valid update (including a sequence number that
+     *         doesn't increase) or recover() hasn't run, -ENOSPC if a volume's record doesn't fit its tail,
+     *         or a negative error code.  An error after the backups are in the tails leaves the update
+     *         half done or its records unretired, recover() must run before the next commit.
+     */
+    int commit(uint64_t stripe_number, const Block* const* cells, int count);
+
+    /**
+     * Atomically writes a whole stripe, see buildStripe().
+     * @return Returns the result of commit().
+     */
+    int writeStripe(reed_solomon* rs, uint64_t stripe_number, const void* payload, uint32_t sequence_number);
+
+    /**
+     * Atomic version of updateStripeCell(): reads the data cell and the parity cells, updates them with
+     * updateCell() and commits them together.
+     * @return Returns 0, -EIO if the old cells don't validate, or the result of commit().
+     */
+    int updateStripeCell(reed_solomon* rs, uint64_t stripe_number, int shard_id, const void* new_data, uint32_t sequence_number);
+
+    /**
+     * @return Returns a sequence number higher than any the log has seen.
+     */
+    uint32_t nextSequence() const { return next_sequence_; }
+
+    /**
+     * @param volume Index into map.volumes.
+     * @return Returns the block of the volume's tail the next record goes to.
+     */
+    uint32_t tailPosition(int volume) const { return positions_[volume]; }
+
+private:
+    uint64_t tailOffset(int volume, uint32_t position) const;
+    int syncVolumes(const std::vector<bool>& touched);
+    int retire(const std::vector<bool>& touched, const std::vector<uint32_t>& positions);
+
+    const VolumeMap& map_;
+    uint32_t capacity_;
+    bool recovered_;
+    uint32_t next_sequence_;
+    uint64_t next_commit_;  // numbers records in commit order
+    std::vector<uint32_t> positions_;
+    Block* buffer_;  // a record and its backups for each volume, RECORD_BLOCKS apart
+};
@@ -1,6 +1,88 @@
 #include <gtest/gtest.h>
 #include "blockaio.hpp"
+#include "ioengine.hpp"
+#include "reactor.hpp"
+#include "stripereader.hpp"
+#include "latency.hpp"
+#include "mappedvolume.hpp"
+#include "scrubber.hpp"
+#include "taillog.hpp"
+#include "groupcommit.hpp"
+#include "blobindex.hpp"
+#include "refscan.hpp"
+#include "compactor.hpp"
+#include "reparity.hpp"
+#include "rebuild.hpp"
+#include "shardtransport.hpp"
+#include "stripecache.hpp"
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <thread>
 #include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace {
+
+// Unlinked temp files standing in for volumes, closed when it goes out of scope
+class TempVolumes {
+public:
+    TempVolumes() = default;
+    TempVolumes(const TempVolumes&) = delete;
+    TempVolumes& operator=(const TempVolumes&) = delete;
+    ~TempVolumes() {
+        for (int fd : fds_) close(fd);
+    }
+
+    int file() {
+        char path[] = "/tmp/blockaio-test-XXXXXX";
+        int fd = mkstemp(path);
+        EXPECT_GE(fd, 0);
+        unlink(path);
+        fds_.push_back(fd);
+        return fd;
+    }
+
+    // A volume with a zeroed header, for blob and index volumes
+    Volume volume() {
+        Volume vol;
+        vol.fd = file();
+        std::memset(&vol.header, 0, sizeof(HeaderBlock));
+        return vol;
+    }
+
+    // A volume holding shards first_shard to last_shard, with a sealed header
+    Volume volume(int first_shard, int last_shard) {
+        Volume vol = volume();
+        vol.header.version_number = 1;
+        vol.header.volume_prefix_id = 1 << 24;
+        for (int i = 0; i < 8; ++i) vol.header.shard_ids[i] = std::min(first_shard + i, last_shard);
+        sealHeader(vol.header);
+        return vol;
+    }
+
+    // Shards 0 to shards - 1 dealt out in order over volumes volumes, e.g. two each for 6 over 3
+    VolumeMap volumeMap(int shards, int volumes) {
+        VolumeMap map;
+        const int per_volume = (shards + volumes - 1) / volumes;
+        for (int v = 0; v < volumes; ++v) {
+            map.volumes.push_back(volume(v * per_volume, std::min((v + 1) * per_volume, shards) - 1));
+        }
+        return map;
+    }
+
+private:
+    std::vector<int> fds_;
+};
+
+}  // namespace
 
 TEST(BlockAIOTest, GetKBlocksInStripe) {
     HeaderBlock header;
@@ -25,6 +107,10 @@ TEST(BlockAIOTest, ComputeOffsetToBlock) {
     EXPECT_EQ(computeOffsetToBlock(header, 0, 1), 0);
     EXPECT_EQ(computeOffsetToBlock(header, 0, 2), 4096);
     EXPECT_EQ(computeOffsetToBlock(header, 1, 1), 3 * 4096);
+
+    // Stripes past 2 GiB
+    std::fill(header.shard_ids.begin() + 3, header.shard_ids.end(), 3);
+    EXPECT_EQ(computeOffsetToBlock(header, 1 << 20, 2), (uint64_t(3) << 32) + 4096);
 }
 
 TEST(BlockAIOTest, CRC32C) {
@@ -36,6 +122,65 @@ TEST(BlockAIOTest, CRC32C) {
     EXPECT_EQ(crc, crc2);
 }
 
+TEST(BlockAIOTest, CRC32CInterleaved) {
+    std::vector<unsigned char> data(3 * 4096 * 4 + 64);
+    std::mt19937 rng(16);
+    for (auto& byte : data) byte = rng();
+
+    // Every lane length up to a few rounds, every alignment, chained from a previous crc
+    for (size_t length = 0; length < data.size() - 8; length += 1 + length / 16) {
+        for (size_t offset = 0; offset < 8; ++offset) {
+            ASSERT_EQ(crc32c(data.data() + offset, length, 0), crc32cSerial(data.data() + offset, length, 0)) << length << " " << offset;
+            ASSERT_EQ(crc32c(data.data() + offset, length, 0x12345678), crc32cSerial(data.data() + offset, length, 0x12345678));
+        }
+    }
+
+    // Chaining pieces gives the crc of the whole
+    uint32_t crc = 0;
+    for (size_t offset = 0; offset < 40000 && offset < data.size(); offset += 1000) {
+        crc = crc32c(data.data() + offset, std::min<size_t>(1000, data.size() - offset), crc);
+    }
+    EXPECT_EQ(crc, crc32cSerial(data.data(), std::min<size_t>(40000, data.size()), 0));
+
+    // The check value of the CRC32C standard
+    EXPECT_EQ(crc32c("123456789", 9, 0), 0xe3069283u);
+}
+
+TEST(BlockAIOTest, CRC32CBatch) {
+    std::vector<unsigned char> data(8 * 4096 + 8);
+    std::mt19937 rng(17);
+    for (auto& byte : data) byte = rng();
+
+    std::vector<const void*> buffers;
+    for (int i = 0; i < 8; ++i) buffers.push_back(data.data() + i * 4096 + i % 5);
+    uint32_t crcs[8];
+    for (int count = 0; count <= 8; ++count) {
+        for (size_t length : {0, 1, 7, 8, 100, 4092}) {
+            std::fill(crcs, crcs + 8, 0);
+            crc32cBatch(buffers.data(), length, 3, crcs, count);
+            for (int i = 0; i < count; ++i) {
+                EXPECT_EQ(crcs[i], crc32cSerial(buffers[i], length, 3)) << count << " " << length << " " << i;
+            }
+            for (int i = count; i < 8; ++i) EXPECT_EQ(crcs[i], 0u);
+        }
+    }
+}
+
+TEST(BlockAIOTest, ValidateBlocks) {
+    std::vector<Block> blocks(7);
+    std::vector<const Block*> pointers;
+    for (int i = 0; i < 7; ++i) {
+        std::memset(&blocks[i], i, sizeof(Block));
+        sealBlock(blocks[i]);
+        pointers.push_back(&blocks[i]);
+    }
+    blocks[2].data[100] ^= 1;
+    blocks[6].block_sequence_number++;
+    bool valid[7];
+    EXPECT_EQ(validateBlocks(pointers.data(), 7, valid), 5);
+    for (int i = 0; i < 7; ++i) EXPECT_EQ(valid[i], validateBlock(blocks[i])) << i;
+}
+
 TEST(BlockAIOTest, SpreadAndUnspreadData) {
     const int k = 3;
     const size_t input_size = 16 * k * 2;  // 2 rounds of spreading
@@ -58,6 +203,59 @@ TEST(BlockAIOTest, SpreadAndUnspreadData) {
     EXPECT_EQ(input, result);
 }
 
+class SpreadKernelTest : public testing::TestWithParam<const spread_kernels*> {};
+
+TEST_P(SpreadKernelTest, MatchesGeneric) {
+    const spread_kernels* kernels = GetParam();
+    if (!kernels->supported()) GTEST_SKIP() << kernels->name << " not supported";
+    std::mt19937 rng(17);
+    for (int k : {1, 2, 3, 4, 5, 6, 8, 12, 16}) {
+        for (size_t rounds : {0, 1, 3, 4, 5, 8, 13, 255}) {
+            const size_t size = rounds * 16 * k + 5;  // a partial round is left alone
+            // Page aligned cells and payload for the streaming stores, offset by 16 for the unaligned paths
+            for (size_t misalign : {0, 16}) {
+                for (int nt : {0, 1}) {
+                    std::vector<unsigned char> buffer(size + 4096 + misalign);
+                    unsigned char* payload = reinterpret_cast<unsigned char*>((reinterpret_cast<uintptr_t>(buffer.data()) + 4095) & ~uintptr_t(4095)) + misalign;
+                    for (size_t i = 0; i < size; ++i) payload[i] = rng();
+
+                    const size_t cell_size = rounds * 16 + 64;
+                    std::vector<unsigned char> arena((cell_size + 64) * k + 64, 0xaa);
+                    std::vector<unsigned char> expected_arena = arena;
+                    auto cellPointers = [&](std::vector<unsigned char>& storage) {
+                        std::vector<void*> cells(k);
+                        unsigned char* base = reinterpret_cast<unsigned char*>((reinterpret_cast<uintptr_t>(storage.data()) + 63) & ~uintptr_t(63));
+                        for (int i = 0; i < k; ++i) cells[i] = base + i * (cell_size + 64) + misalign;
+                        return cells;
+                    };
+                    std::vector<void*> cells = cellPointers(arena);
+                    std::vector<void*> expected_cells = cellPointers(expected_arena);
+                    kernels->spread(payload, cells.data(), size, k, nt);
+                    spread_kernels_generic.spread(payload, expected_cells.data(), size, k, 0);
+                    for (int i = 0; i < k; ++i) {
+                        ASSERT_EQ(std::memcmp(cells[i], expected_cells[i], cell_size), 0) << kernels->name << " k=" << k << " rounds=" << rounds << " nt=" << nt;
+                        EXPECT_EQ(static_cast<unsigned char*>(cells[i])[rounds * 16], 0xaa);
+                    }
+
+                    std::vector<unsigned char> out_buffer(size + 4096 + misalign, 0x55);
+                    std::vector<unsigned char> expected_buffer = out_buffer;
+                    const size_t out_offset = ((4096 - reinterpret_cast<uintptr_t>(out_buffer.data())) & 4095) + misalign;
+                    const size_t expected_offset = ((4096 - reinterpret_cast<uintptr_t>(expected_buffer.data())) & 4095) + misalign;
+                    kernels->unspread(cells.data(), out_buffer.data() + out_offset, size, k, nt);
+                    spread_kernels_generic.unspread(cells.data(), expected_buffer.data() + expected_offset, size, k, 0);
+                    ASSERT_TRUE(std::equal(out_buffer.begin() + out_offset, out_buffer.begin() + out_offset + size, expected_buffer.begin() + expected_offset))
+                        << kernels->name << " k=" << k << " rounds=" << rounds << " nt=" << nt;
+                    ASSERT_TRUE(std::equal(payload, payload + rounds * 16 * k, out_buffer.begin() + out_offset));
+                }
+            }
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Kernels, SpreadKernelTest,
+                         testing::Values(&spread_kernels_generic, &spread_kernels_sse2, &spread_kernels_avx2, &spread_kernels_avx512),
+                         [](const testing::TestParamInfo<const spread_kernels*>& info) { return std::string(info.param->name); });
+
 TEST(BlockAIOTest, ValidateHeader) {
     HeaderBlock header;
     std::memset(&header, 0, sizeof(HeaderBlock));
@@ -82,6 +280,2276 @@ TEST(BlockAIOTest, ValidateBlock) {
     EXPECT_FALSE(validateBlock(block));
 }
 
+TEST(BlockAIOTest, BuildStripe) {
+    init_gf();
+    const int k = 8, m = 4;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    std::vector<unsigned char> payload(k * 4080);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = static_cast<unsigned char>(i * 131 + 7);
+    }
+    std::vector<Block> blocks(k + m);
+    buildStripe(rs, payload.data(), 0x123456, 42, blocks.data());
+
+    // Same cells as spreadData + rs_encode, with valid headers
+    std::vector<std::vector<unsigned char>> cells(k + m, std::vector<unsigned char>(4080));
+    std::vector<void*> data_ptrs(k);
+    std::vector<unsigned char*> ptrs(k + m);
+    for (int i = 0; i < k + m; ++i) {
+        ptrs[i] = cells[i].data();
+        if (i < k) data_ptrs[i] = cells[i].data();
+    }
+    spreadData(payload.data(), data_ptrs, payload.size(), k);
+    rs_encode(rs, ptrs.data(), ptrs.data() + k, 4080);
+
+    for (int i = 0; i < k + m; ++i) {
+        EXPECT_TRUE(validateBlock(blocks[i]));
+        EXPECT_EQ(blocks[i].block_sequence_number, 42u);
+        EXPECT_EQ(blocks[i].stripe_number, (0x123456ull << 8) | i);
+        EXPECT_EQ(std::memcmp(blocks[i].data.data(), cells[i].data(), 4080), 0) << "shard " << i;
+    }
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, UpdateCell) {
+    init_gf();
+    const int k = 8, m = 4;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    std::vector<unsigned char> payload(k * 4080);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = static_cast<unsigned char>(i * 29 + 3);
+    }
+    std::vector<Block> blocks(k + m);
+    buildStripe(rs, payload.data(), 77, 1, blocks.data());
+
+    std::vector<unsigned char> new_data(4080);
+    for (size_t i = 0; i < new_data.size(); ++i) {
+        new_data[i] = static_cast<unsigned char>(i * 7 + 1);
+    }
+    std::vector<Block*> parity_cells(m);
+    for (int i = 0; i < m; ++i) parity_cells[i] = &blocks[k + i];
+
+    ASSERT_TRUE(updateCell(rs, blocks[5], parity_cells.data(), new_data.data(), 2));
+
+    // Parity must match a full re-encode of the modified stripe
+    std::vector<unsigned char*> ptrs(k + m);
+    std::vector<std::vector<unsigned char>> expected(m, std::vector<unsigned char>(4080));
+    for (int i = 0; i < k; ++i) ptrs[i] = blocks[i].data.data();
+    for (int i = 0; i < m; ++i) ptrs[k + i] = expected[i].data();
+    rs_encode(rs, ptrs.data(), ptrs.data() + k, 4080);
+
+    EXPECT_EQ(std::memcmp(blocks[5].data.data(), new_data.data(), 4080), 0);
+    EXPECT_TRUE(validateBlock(blocks[5]));
+    EXPECT_EQ(blocks[5].block_sequence_number, 2u);
+    for (int i = 0; i < m; ++i) {
+        EXPECT_TRUE(validateBlock(blocks[k + i]));
+        EXPECT_EQ(blocks[k + i].block_sequence_number, 2u);
+        EXPECT_EQ(std::memcmp(blocks[k + i].data.data(), expected[i].data(), 4080), 0) << "parity " << i;
+    }
+
+    // Parity cells from a different stripe or a corrupt cell are rejected
+    Block saved = blocks[5];
+    std::swap(parity_cells[0], parity_cells[1]);
+    EXPECT_FALSE(updateCell(rs, blocks[5], parity_cells.data(), payload.data(), 3));
+    EXPECT_EQ(std::memcmp(&blocks[5], &saved, sizeof(Block)), 0);
+    std::swap(parity_cells[0], parity_cells[1]);
+    blocks[5].data[0] ^= 1;
+    EXPECT_FALSE(updateCell(rs, blocks[5], parity_cells.data(), payload.data(), 3));
+    // Parity shards can't be updated this way
+    EXPECT_FALSE(updateCell(rs, blocks[k], parity_cells.data(), payload.data(), 3));
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, UpdateStripeCell) {
+    init_gf();
+    const int k = 4, m = 2, stripe = 3;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    // Two volumes with three shards each
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 2);
+    EXPECT_EQ(findVolumeForShard(map, 1), 0);
+    EXPECT_EQ(findVolumeForShard(map, 4), 1);
+    EXPECT_EQ(findVolumeForShard(map, 6), -1);
+
+    std::vector<unsigned char> payload(k * 4080);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = static_cast<unsigned char>(i * 13 + 5);
+    }
+    std::vector<Block> blocks(k + m);
+    buildStripe(rs, payload.data(), stripe, 1, blocks.data());
+    for (int i = 0; i < k + m; ++i) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+        ASSERT_EQ(pwrite(vol.fd, &blocks[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe, i)), (ssize_t)sizeof(Block));
+    }
+
+    std::vector<unsigned char> new_data(4080, 0x5a);
+    EXPECT_EQ(updateStripeCell(map, rs, stripe, 2, new_data.data(), 9), m);
+    EXPECT_EQ(updateStripeCell(map, rs, stripe, k, new_data.data(), 9), -EINVAL);
+
+    // Read back, and check the stripe still decodes from any k cells
+    std::vector<Block> read(k + m);
+    for (int i = 0; i < k + m; ++i) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+        ASSERT_EQ(pread(vol.fd, &read[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe, i)), (ssize_t)sizeof(Block));
+        EXPECT_TRUE(validateBlock(read[i]));
+    }
+    EXPECT_EQ(std::memcmp(read[2].data.data(), new_data.data(), 4080), 0);
+    EXPECT_EQ(read[2].block_sequence_number, 9u);
+    EXPECT_EQ(read[0].block_sequence_number, 1u);
+
+    std::vector<unsigned char*> shards(k + m);
+    for (int i = 0; i < k + m; ++i) shards[i] = read[i].data.data();
+    std::vector<unsigned char> saved(read[2].data.begin(), read[2].data.end());
+    int erasures[k + m] = {1, 0, 1, 0, 0, 0};
+    std::memset(read[0].data.data(), 0, 4080);
+    std::memset(read[2].data.data(), 0, 4080);
+    ASSERT_EQ(rs_decode(rs, shards.data(), erasures, 2, 4080), 1);
+    EXPECT_EQ(std::memcmp(read[2].data.data(), saved.data(), 4080), 0);
+    EXPECT_EQ(std::memcmp(read[0].data.data(), blocks[0].data.data(), 4080), 0);
+
+    // A stripe past 2^31 is updated in place, one shard per volume puts it 8 TiB in
+    const uint64_t far = (uint64_t(1) << 31) + 1;
+    VolumeMap wide = temp.volumeMap(6, 6);
+    buildStripe(rs, payload.data(), far, 1, blocks.data());
+    for (int i = 0; i < k + m; ++i) {
+        ASSERT_EQ(pwrite(wide.volumes[i].fd, &blocks[i], sizeof(Block), computeOffsetToBlock(wide.volumes[i].header, far, i)), (ssize_t)sizeof(Block));
+    }
+    EXPECT_EQ(updateStripeCell(wide, rs, far, 1, new_data.data(), 9), m);
+    for (int i = 0; i < k + m; ++i) {
+        ASSERT_EQ(pread(wide.volumes[i].fd, &read[i], sizeof(Block), computeOffsetToBlock(wide.volumes[i].header, far, i)), (ssize_t)sizeof(Block));
+        EXPECT_TRUE(validateBlock(read[i]));
+        EXPECT_EQ(read[i].stripe_number, far << 8 | i);
+    }
+    EXPECT_EQ(std::memcmp(read[1].data.data(), new_data.data(), 4080), 0);
+    EXPECT_EQ(read[k].block_sequence_number, 9u);
+
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, ReadStripeRange) {
+    init_gf();
+    const int k = 8, m = 4;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    std::vector<unsigned char> payload(k * 4080);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = static_cast<unsigned char>(i * 151 + 11);
+    }
+    std::vector<Block> blocks(k + m);
+    buildStripe(rs, payload.data(), 5, 1, blocks.data());
+
+    srand(7);
+    std::vector<unsigned char> out(payload.size());
+    for (int test = 0; test < 200; ++test) {
+        std::vector<Block> damaged = blocks;
+        std::vector<unsigned char*> cells(k + m);
+        int erasures[k + m] = {0};
+        for (int i = 0; i < k + m; ++i) cells[i] = damaged[i].data.data();
+        int lost = test % (m + 1);
+        for (int e = 0; e < lost;) {
+            int i = rand() % (k + m);
+            if (!erasures[i]) {
+                erasures[i] = 1;
+                std::memset(cells[i], 0, 4080);
+                e++;
+            }
+        }
+        size_t start = rand() % payload.size();
+        size_t length = test < 100 ? rand() % 600 : rand() % (payload.size() - start);
+        length = std::min(length, payload.size() - start);
+        ASSERT_TRUE(readStripeRange(rs, cells.data(), erasures, start, length, out.data()));
+        EXPECT_EQ(std::memcmp(out.data(), payload.data() + start, length), 0) << start << "+" << length;
+    }
+
+    // The whole payload, and out of range reads
+    std::vector<unsigned char*> cells(k + m);
+    int erasures[k + m] = {0};
+    for (int i = 0; i < k + m; ++i) cells[i] = blocks[i].data.data();
+    ASSERT_TRUE(readStripeRange(rs, cells.data(), erasures, 0, payload.size(), out.data()));
+    EXPECT_EQ(out, payload);
+    EXPECT_FALSE(readStripeRange(rs, cells.data(), erasures, 1, payload.size(), out.data()));
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, IoPool) {
+    IoPool pool(nullptr, 2, 1);
+    IoPool::Stats stats = pool.stats();
+    EXPECT_EQ(stats.small_capacity, 2);
+    EXPECT_EQ(stats.large_capacity, 1);
+
+    WriteContext* a = pool.acquire(1);
+    WriteContext* b = pool.acquire(1);
+    WriteContext* c = pool.acquire(1);  // falls back to the large slot
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    ASSERT_NE(c, nullptr);
+    EXPECT_EQ(a->capacity_pages, IoPool::SMALL_PAGES);
+    EXPECT_EQ(c->capacity_pages, IoPool::LARGE_PAGES);
+    for (WriteContext* ctx : {a, b, c}) {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(ctx->buffer) % PAGE_SIZE, 0u);
+    }
+    EXPECT_EQ(pool.acquire(1), nullptr);
+    EXPECT_EQ(pool.acquire(IoPool::LARGE_PAGES + 1), nullptr);
+
+    stats = pool.stats();
+    EXPECT_EQ(stats.small_in_use, 2);
+    EXPECT_EQ(stats.large_in_use, 1);
+    EXPECT_EQ(stats.acquired, 3u);
+    EXPECT_EQ(stats.exhausted, 1u);
+
+    pool.release(c);
+    pool.release(a);
+    WriteContext* d = pool.acquire(8);
+    EXPECT_EQ(d, c);
+    EXPECT_EQ(pool.acquire(1), a);
+    pool.release(a);
+    pool.release(b);
+    pool.release(d);
+    stats = pool.stats();
+    EXPECT_EQ(stats.small_in_use, 0);
+    EXPECT_EQ(stats.large_in_use, 0);
+    EXPECT_EQ(stats.small_high_water, 2);
+    EXPECT_EQ(stats.large_high_water, 1);
+}
+
+TEST(BlockAIOTest, IoPoolSubmit) {
+    TempVolumes temp;
+    const int fd = temp.file();
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+
+    {
+        IoPool pool(io_ctx, 4, 2);
+        ASSERT_EQ(submitWrite(pool, fd, 0, 8), 0);
+        ASSERT_EQ(submitWrite(pool, fd, 8, 1), 0);
+        int done = 0;
+        while (done < 9) done += checkCompleted(pool);
+        ASSERT_EQ(submitRead(pool, fd, 8, 1), 0);
+        ASSERT_EQ(submitRead(pool, fd, 0, 8), 0);
+        ASSERT_EQ(submitRead(pool, fd, 0, 8), 0);
+        EXPECT_EQ(submitRead(pool, fd, 0, 8), -EAGAIN);
+        EXPECT_EQ(pool.stats().large_in_use, 2);
+        done = 0;
+        while (done < 17) done += checkCompleted(pool);
+        EXPECT_EQ(pool.stats().small_in_use, 0);
+        EXPECT_EQ(pool.stats().large_in_use, 0);
+    }
+
+    std::vector<unsigned char> page(PAGE_SIZE);
+    ASSERT_EQ(pread(fd, page.data(), PAGE_SIZE, 8 * PAGE_SIZE), PAGE_SIZE);
+    EXPECT_EQ(page[0], 'A' + 8);
+    io_destroy(io_ctx);
+}
+
+TEST(BlockAIOTest, IoBatch) {
+    init_gf();
+    const int k = 4, m = 2, stripe = 2;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+
+    // Three volumes with two shards each
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+
+    std::vector<unsigned char> payload(k * 4080, 0x33);
+    Block* blocks = nullptr;
+    ASSERT_EQ(posix_memalign(reinterpret_cast<void**>(&blocks), PAGE_SIZE, sizeof(Block) * (k + m)), 0);
+    buildStripe(rs, payload.data(), stripe, 1, blocks);
+
+    IoBatch batch(io_ctx, 8);
+    EXPECT_EQ(queueStripeWrite(batch, map, stripe, blocks, k + m, 77), 3);
+    EXPECT_EQ(batch.queued(), 3);
+    EXPECT_EQ(batch.flush(), 3);
+    EXPECT_EQ(batch.inFlight(), 3);
+    IoCompletion done[8];
+    int reaped = 0;
+    while (reaped < 3) {
+        int n = batch.reap(done + reaped, 8 - reaped, 1);
+        ASSERT_GT(n, 0);
+        reaped += n;
+    }
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(done[i].user_tag, 77u);
+        EXPECT_EQ(done[i].result, long(2 * sizeof(Block)));
+    }
+
+    // Read the cells back one by one, tagged with their shard
+    Block* read = nullptr;
+    ASSERT_EQ(posix_memalign(reinterpret_cast<void**>(&read), PAGE_SIZE, sizeof(Block) * (k + m)), 0);
+    for (int i = 0; i < k + m; ++i) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+        ASSERT_TRUE(batch.queueRead(vol.fd, computeOffsetToBlock(vol.header, stripe, i), &read[i], sizeof(Block), 100 + i));
+    }
+    EXPECT_EQ(batch.flush(), k + m);
+    for (reaped = 0; reaped < k + m;) {
+        IoCompletion c;
+        ASSERT_EQ(batch.reap(&c, 1, 1), 1);
+        EXPECT_EQ(c.result, long(sizeof(Block)));
+        int shard = c.user_tag - 100;
+        ASSERT_TRUE(shard >= 0 && shard < k + m);
+        EXPECT_EQ(std::memcmp(&read[shard], &blocks[shard], sizeof(Block)), 0);
+        reaped++;
+    }
+    EXPECT_EQ(batch.inFlight(), 0);
+
+    // Fixed capacity
+    for (int i = 0; i < 8; ++i) EXPECT_TRUE(batch.queueRead(map.volumes[0].fd, 0, &read[0], sizeof(Block), i));
+    EXPECT_FALSE(batch.queueRead(map.volumes[0].fd, 0, &read[0], sizeof(Block), 8));
+    struct iovec iov = {&read[0], sizeof(Block)};
+    EXPECT_FALSE(batch.queueReadv(map.volumes[0].fd, 0, &iov, 1, 8));
+    EXPECT_EQ(batch.flush(), 8);
+    for (reaped = 0; reaped < 8;) reaped += batch.reap(done, 8, 1);
+
+    // A stripe past 2^31 with one shard per volume lands 8 TiB in, not at a sign-extended offset
+    const uint64_t far = (uint64_t(1) << 31) + 1;
+    VolumeMap wide = temp.volumeMap(6, 6);
+    buildStripe(rs, payload.data(), far, 1, blocks);
+    EXPECT_EQ(queueStripeWrite(batch, wide, far, blocks, k + m, 78), 6);
+    EXPECT_EQ(batch.flush(), 6);
+    for (reaped = 0; reaped < 6;) {
+        int n = batch.reap(done, 8, 1);
+        ASSERT_GT(n, 0);
+        for (int i = 0; i < n; ++i) EXPECT_EQ(done[i].result, long(sizeof(Block)));
+        reaped += n;
+    }
+    ASSERT_EQ(pread(wide.volumes[5].fd, &read[0], sizeof(Block), far * sizeof(Block)), (ssize_t)sizeof(Block));
+    EXPECT_EQ(std::memcmp(&read[0], &blocks[5], sizeof(Block)), 0);
+
+    free(read);
+    free(blocks);
+    io_destroy(io_ctx);
+    rs_free(rs);
+}
+
+class IoEngineTest : public testing::TestWithParam<const char*> {};
+
+TEST_P(IoEngineTest, WriteThenRead) {
+    IoEngineConfig config;
+    config.small_slots = 4;
+    config.large_slots = 2;
+    std::unique_ptr<IoEngine> engine = makeIoEngine(GetParam(), config);
+    if (!engine) {
+        GTEST_SKIP() << GetParam() << " is not available";
+    }
+    EXPECT_STREQ(engine->name(), GetParam());
+
+    TempVolumes temp;
+    const int fd = temp.file();
+    ASSERT_EQ(engine->registerFiles({fd}), 0);
+
+    ASSERT_EQ(engine->submitWrite(fd, 0, 8), 0);
+    ASSERT_EQ(engine->submitWrite(fd, 8, 8), 0);
+    ASSERT_EQ(engine->submitWrite(fd, 16, 1), 0);
+    int done = 0;
+    while (done < 17) done += engine->checkCompleted();
+    EXPECT_EQ(engine->pool().stats().large_in_use, 0);
+
+    ASSERT_EQ(engine->submitRead(fd, 0, 8), 0);
+    ASSERT_EQ(engine->submitRead(fd, 8, 8), 0);
+    EXPECT_EQ(engine->submitRead(fd, 0, 8), -EAGAIN);
+    done = 0;
+    while (done < 16) done += engine->checkCompleted();
+
+    // Unregistered fds work too
+    ASSERT_EQ(engine->registerFiles({}), 0);
+    ASSERT_EQ(engine->submitRead(fd, 16, 1), 0);
+    while (engine->checkCompleted() == 0) {}
+
+    std::vector<unsigned char> page(PAGE_SIZE);
+    for (int p : {0, 9, 16}) {
+        ASSERT_EQ(pread(fd, page.data(), PAGE_SIZE, p * PAGE_SIZE), PAGE_SIZE);
+        EXPECT_EQ(page[0], 'A' + (p < 8 ? 0 : p < 16 ? 8 : 16));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Engines, IoEngineTest, testing::Values("libaio", "io_uring"));
+
+TEST(BlockAIOTest, UnknownIoEngine) {
+    EXPECT_EQ(makeIoEngine("posix"), nullptr);
+}
+
+TEST(BlockAIOTest, SpscQueue) {
+    SpscQueue<int> queue(100);
+    EXPECT_EQ(queue.capacity(), 128u);
+    int item;
+    EXPECT_FALSE(queue.tryPop(item));
+    for (int i = 0; i < 128; ++i) EXPECT_TRUE(queue.tryPush(i));
+    EXPECT_FALSE(queue.tryPush(128));
+    EXPECT_TRUE(queue.tryPop(item));
+    EXPECT_EQ(item, 0);
+
+    // Producer and consumer threads, everything arrives once and in order
+    SpscQueue<int> pipe(16);
+    const int count = 100000;
+    std::thread producer([&] {
+        for (int i = 0; i < count; ++i) {
+            while (!pipe.tryPush(i)) std::this_thread::yield();
+        }
+    });
+    for (int i = 0; i < count; ++i) {
+        while (!pipe.tryPop(item)) std::this_thread::yield();
+        ASSERT_EQ(item, i);
+    }
+    producer.join();
+}
+
+static int addOne(void* arg) {
+    return ++*static_cast<int*>(arg);
+}
+
+TEST(BlockAIOTest, StripeRuntime) {
+    init_gf();
+    const int k = 4, m = 2, stripes = 40;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    // Three volumes (drives) with two shards each
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+    std::vector<std::vector<unsigned char>> payloads(stripes, std::vector<unsigned char>(k * 4080));
+    for (int s = 0; s < stripes; ++s) {
+        for (size_t i = 0; i < payloads[s].size(); ++i) payloads[s][i] = static_cast<unsigned char>(i * 3 + s);
+    }
+
+    int counter = 0;
+    {
+        StripeRuntime runtime(map, rs, 3, 8, false);
+        std::vector<int> done(stripes + 1, 0);
+        int submitted = 0, completed = 0;
+        bool task_submitted = false;
+        JobCompletion out[8];
+        while (completed < stripes + 1) {
+            if (!task_submitted && runtime.submitTask(addOne, &counter, stripes)) {
+                task_submitted = true;
+            }
+            while (submitted < stripes && runtime.submitStripe(payloads[submitted].data(), submitted, 7, submitted)) {
+                submitted++;
+            }
+            int n = runtime.poll(out, 8);
+            for (int i = 0; i < n; ++i) {
+                EXPECT_EQ(out[i].result, out[i].user_tag == uint64_t(stripes) ? 1 : 0);
+                done[out[i].user_tag]++;
+            }
+            completed += n;
+            if (n == 0) std::this_thread::yield();
+        }
+        EXPECT_EQ(runtime.inFlight(), 0);
+        for (int d : done) EXPECT_EQ(d, 1);
+    }
+    EXPECT_EQ(counter, 1);
+
+    // Stripes still queued when the runtime goes away are written anyway
+    const int rewritten = 8;
+    {
+        StripeRuntime runtime(map, rs, 2, rewritten, false);
+        ASSERT_EQ(runtime.error(), 0);
+        for (int s = 0; s < rewritten; ++s) {
+            ASSERT_TRUE(runtime.submitStripe(payloads[s].data(), s, 9, s));
+        }
+    }
+
+    // Every stripe is on disk
+    std::vector<Block> expected(k + m);
+    Block cell;
+    for (int s = 0; s < stripes; ++s) {
+        buildStripe(rs, payloads[s].data(), s, s < rewritten ? 9 : 7, expected.data());
+        for (int i = 0; i < k + m; ++i) {
+            const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+            ASSERT_EQ(pread(vol.fd, &cell, sizeof(Block), computeOffsetToBlock(vol.header, s, i)), (ssize_t)sizeof(Block));
+            EXPECT_EQ(std::memcmp(&cell, &expected[i], sizeof(Block)), 0) << "stripe " << s << " shard " << i;
+        }
+    }
+
+    // A stripe past 2^31 with one shard per volume lands 8 TiB in, not at a sign-extended offset
+    const uint64_t far = (uint64_t(1) << 31) + 1;
+    VolumeMap wide = temp.volumeMap(6, 6);
+    {
+        StripeRuntime runtime(wide, rs, 1, 1, false);
+        ASSERT_EQ(runtime.error(), 0);
+        ASSERT_TRUE(runtime.submitStripe(payloads[0].data(), far, 5, 0));
+    }
+    buildStripe(rs, payloads[0].data(), far, 5, expected.data());
+    for (int i = 0; i < k + m; ++i) {
+        ASSERT_EQ(pread(wide.volumes[i].fd, &cell, sizeof(Block), computeOffsetToBlock(wide.volumes[i].header, far, i)), (ssize_t)sizeof(Block));
+        EXPECT_EQ(std::memcmp(&cell, &expected[i], sizeof(Block)), 0) << "shard " << i;
+    }
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, LatencyHistogram) {
+    EXPECT_EQ(LatencyHistogram::bucket(0), 0);
+    EXPECT_EQ(LatencyHistogram::bucket(1), 0);
+    EXPECT_EQ(LatencyHistogram::bucket(3), 6);
+    EXPECT_EQ(LatencyHistogram::bucket(100), 26);
+    EXPECT_EQ(LatencyHistogram::bucket(uint64_t(1) << 40), LatencyHistogram::BUCKETS - 1);
+    for (int i = 8; i < LatencyHistogram::BUCKETS; ++i) {
+        EXPECT_EQ(LatencyHistogram::bucket(uint64_t(LatencyHistogram::bucketMidUs(i))), i);
+    }
+
+    // Lognormal samples fit back to their mu and sigma
+    LatencyHistogram histogram;
+    std::mt19937 rng(3);
+    std::lognormal_distribution<double> dist(std::log(200.0), 0.5);
+    for (int i = 0; i < 100000; ++i) histogram.record(uint64_t(dist(rng) * 1000));
+    LatencyHistogram::Fit fit = histogram.fit();
+    EXPECT_EQ(fit.samples, 100000u);
+    EXPECT_NEAR(fit.mu, std::log(200.0), 0.05);
+    EXPECT_NEAR(fit.sigma, 0.5, 0.05);
+    EXPECT_NEAR(histogram.quantileUs(0.5), 200, 30);
+
+    histogram.decay();
+    EXPECT_NEAR(double(histogram.samples()), 50000, 100);
+}
+
+TEST(BlockAIOTest, HdrHistogram) {
+    EXPECT_EQ(HdrHistogram::bucket(0), 0);
+    EXPECT_EQ(HdrHistogram::bucket(127), 127);
+    EXPECT_EQ(HdrHistogram::bucket(128), 128);
+    EXPECT_EQ(HdrHistogram::bucket(256), 256);
+    EXPECT_EQ(HdrHistogram::bucket(257), 256);
+    EXPECT_EQ(HdrHistogram::bucket(uint64_t(1) << 50), HdrHistogram::BUCKETS - 1);
+    for (int i = 1; i < HdrHistogram::BUCKETS; ++i) {
+        // Buckets tile the range, each within 1/128 of its values
+        uint64_t high = HdrHistogram::bucketHighNs(i);
+        EXPECT_EQ(HdrHistogram::bucket(high), i);
+        EXPECT_EQ(HdrHistogram::bucket(high + 1), std::min(i + 1, HdrHistogram::BUCKETS - 1));
+        EXPECT_LE(high - HdrHistogram::bucketHighNs(i - 1), high / 128 + 1);
+    }
+
+    // Uniform 1..100000 ns split over two histograms, the quantiles merge back within 1%
+    HdrHistogram a, b;
+    for (uint64_t ns = 1; ns <= 100000; ++ns) (ns & 1 ? a : b).record(ns);
+    a.merge(b);
+    EXPECT_EQ(a.samples(), 100000u);
+    EXPECT_EQ(a.maxNs(), 100000u);
+    EXPECT_NEAR(a.meanNs(), 50000.5, 0.01);
+    EXPECT_NEAR(double(a.quantileNs(0.5)), 50000, 500);
+    EXPECT_NEAR(double(a.quantileNs(0.99)), 99000, 990);
+    EXPECT_NEAR(double(a.quantileNs(0.999)), 99900, 999);
+    EXPECT_EQ(a.quantileNs(1), 100000u);
+    EXPECT_EQ(HdrHistogram().quantileNs(0.5), 0u);
+}
+
+TEST(BlockAIOTest, LatencyTracker) {
+    VolumeMap map;
+    for (int v = 0; v < 3; ++v) map.volumes.push_back(Volume{100 + v, HeaderBlock()});
+    LatencyTracker tracker(map);
+    EXPECT_TRUE(tracker.slowVolumes().empty());
+    EXPECT_EQ(tracker.expectedUs(0), 0);
+
+    std::mt19937 rng(5);
+    std::lognormal_distribution<double> healthy(std::log(80.0), 0.3);
+    for (int i = 0; i < 1000; ++i) {
+        tracker.record(100, uint64_t(healthy(rng) * 1000));
+        tracker.record(101, uint64_t(healthy(rng) * 1000));
+        tracker.record(102, uint64_t(healthy(rng) * 1000));
+        tracker.record(7, 1000000000);  // not a volume
+    }
+    EXPECT_TRUE(tracker.slowVolumes().empty());
+    EXPECT_NEAR(tracker.expectedUs(1), 80 * std::exp(1.2816 * 0.3), 15);
+
+    // A sick disk: the median is fine but one read in ten takes 20 ms
+    for (int i = 0; i < 2000; ++i) tracker.record(102, i % 10 ? 80000 : 20000000);
+    EXPECT_EQ(tracker.slowVolumes(), std::vector<int>{2});
+    EXPECT_TRUE(tracker.isSlow(2));
+    EXPECT_FALSE(tracker.isSlow(0));
+}
+
+// The pool stamps submits and records completions into the tracker
+TEST(BlockAIOTest, IoPoolLatency) {
+    TempVolumes temp;
+    const int fd = temp.file();
+    VolumeMap map;
+    map.volumes.push_back(Volume{fd, HeaderBlock()});
+    LatencyTracker tracker(map);
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    {
+        IoPool pool(io_ctx, 4, 0);
+        pool.setLatencyTracker(&tracker);
+        for (int i = 0; i < 4; ++i) ASSERT_EQ(submitWrite(pool, fd, i, 1), 0);
+        int done = 0;
+        while (done < 4) done += checkCompleted(pool);
+    }
+    EXPECT_EQ(tracker.volume(0).samples(), 4u);
+    io_destroy(io_ctx);
+}
+
+TEST(BlockAIOTest, StripeReader) {
+    init_gf();
+    const int k = 4, m = 2;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+
+    // Three volumes with two shards each
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+    auto writeCell = [&](int stripe, int shard, const Block& block) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        ASSERT_EQ(pwrite(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+    };
+    std::vector<unsigned char> payload(k * 4080);
+    std::vector<Block> blocks(k + m);
+    for (int stripe = 0; stripe < 4; ++stripe) {
+        for (size_t i = 0; i < payload.size(); ++i) payload[i] = static_cast<unsigned char>(i * 7 + stripe);
+        buildStripe(rs, payload.data(), stripe, 1, blocks.data());
+        for (int i = 0; i < k + m; ++i) writeCell(stripe, i, blocks[i]);
+    }
+
+    std::vector<unsigned char> out(k * 4080);
+    {
+        StripeReader reader(map, rs, io_ctx, 32);
+        EXPECT_EQ(reader.chooseHedge(), 1);
+
+        // Healthy read, no hedge: just the data cells, no decode
+        ASSERT_EQ(reader.readStripe(3, out.data(), 0), 0);
+        EXPECT_EQ(out, payload);
+        EXPECT_EQ(reader.cellReads(), uint64_t(k));
+        EXPECT_EQ(reader.decodedReads(), 0u);
+        EXPECT_GT(reader.latency().volume(0).samples(), 0u);
+        EXPECT_GT(reader.latency().volume(1).samples(), 0u);
+        EXPECT_EQ(reader.latency().volume(2).samples(), 0u);  // parity only
+
+        // Fully hedged reads leave stragglers behind, the next reads must not see them
+        for (int i = 0; i < 20; ++i) {
+            ASSERT_EQ(reader.readStripe(3, out.data(), m), 0);
+            EXPECT_EQ(out, payload);
+        }
+
+        // A corrupt data cell and a cell from the wrong stripe are replaced by parity reads
+        Block bad = blocks[1];
+        bad.data[10] ^= 1;
+        writeCell(3, 1, bad);
+        std::vector<Block> other(k + m);
+        std::vector<unsigned char> other_payload(k * 4080, 9);
+        buildStripe(rs, other_payload.data(), 2, 1, other.data());
+        writeCell(3, 2, other[2]);
+        uint64_t decoded = reader.decodedReads();
+        ASSERT_EQ(reader.readStripe(3, out.data(), 0), 0);
+        EXPECT_EQ(out, payload);
+        EXPECT_EQ(reader.decodedReads(), decoded + 1);
+
+        // More bad cells than parity
+        writeCell(3, 4, bad);
+        EXPECT_EQ(reader.readStripe(3, out.data(), 1), -EIO);
+
+        // Other stripes still read fine
+        for (size_t i = 0; i < payload.size(); ++i) payload[i] = static_cast<unsigned char>(i * 7 + 0);
+        ASSERT_EQ(reader.readStripe(0, out.data()), 0);
+        EXPECT_EQ(out, payload);
+    }
+
+    // Fewer slots than k + hedge, the queued reads are submitted before waiting for a slot
+    {
+        StripeReader reader(map, rs, io_ctx, k + 1);
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_EQ(reader.readStripe(0, out.data(), m), 0);
+            EXPECT_EQ(out, payload);
+        }
+    }
+
+    // With volume 0 slow its data cells are read from parity instead, and each adds a hedge
+    LatencyTracker tracker(map);
+    for (int i = 0; i < 100; ++i) {
+        tracker.recordVolume(0, 5000000);
+        tracker.recordVolume(1, 50000);
+        tracker.recordVolume(2, 50000);
+    }
+    {
+        StripeReader reader(map, rs, io_ctx, 32, &tracker);
+        EXPECT_EQ(reader.readStripe(0, out.data(), 0), 0);
+        EXPECT_EQ(out, payload);
+        EXPECT_EQ(reader.decodedReads(), 1u);
+        EXPECT_EQ(reader.latency().volume(0).samples(), 100u);
+        EXPECT_EQ(reader.chooseHedge(), 2);
+        EXPECT_EQ(&reader.latency(), &tracker);
+    }
+
+    // A stripe past 2^31 with one shard per volume is read from 8 TiB in, not a sign-extended offset
+    const uint64_t far = (uint64_t(1) << 31) + 1;
+    VolumeMap wide = temp.volumeMap(6, 6);
+    buildStripe(rs, payload.data(), far, 1, blocks.data());
+    for (int i = 0; i < k + m; ++i) {
+        ASSERT_EQ(pwrite(wide.volumes[i].fd, &blocks[i], sizeof(Block), computeOffsetToBlock(wide.volumes[i].header, far, i)), (ssize_t)sizeof(Block));
+    }
+    {
+        StripeReader reader(wide, rs, io_ctx, 32);
+        ASSERT_EQ(reader.readStripe(far, out.data(), 0), 0);
+        EXPECT_EQ(out, payload);
+        EXPECT_EQ(reader.decodedReads(), 0u);
+    }
+
+    io_destroy(io_ctx);
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, MappedVolume) {
+    init_gf();
+    const int k = 4, m = 2, stripes = 5;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    // Three volumes with two shards each, the header in the header stripe and then the stripes
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(k + m, 3);
+    std::vector<int> fds;
+    for (const Volume& vol : map.volumes) {
+        ASSERT_TRUE(validateHeader(vol.header));
+        ASSERT_EQ(pwrite(vol.fd, &vol.header, sizeof(HeaderBlock), 0), (ssize_t)sizeof(HeaderBlock));
+        fds.push_back(vol.fd);
+    }
+    auto writeCell = [&](int stripe, int shard, const Block& block) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        ASSERT_EQ(pwrite(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+    };
+    std::vector<std::vector<unsigned char>> payloads(stripes, std::vector<unsigned char>(k * 4080));
+    std::vector<Block> blocks(k + m);
+    for (int stripe = 1; stripe < stripes; ++stripe) {
+        for (size_t i = 0; i < payloads[stripe].size(); ++i) payloads[stripe][i] = static_cast<unsigned char>(i * 13 + stripe);
+        buildStripe(rs, payloads[stripe].data(), stripe, 1, blocks.data());
+        for (int i = 0; i < k + m; ++i) writeCell(stripe, i, blocks[i]);
+    }
+
+    std::vector<MappedVolume> volumes(3);
+    std::vector<const MappedVolume*> mapped;
+    for (int v = 0; v < 3; ++v) {
+        ASSERT_EQ(volumes[v].open(fds[v]), 0);
+        mapped.push_back(&volumes[v]);
+        EXPECT_EQ(volumes[v].cellsPerStripe(), 2);
+        EXPECT_EQ(volumes[v].stripeCount(), uint64_t(stripes));
+        EXPECT_EQ(volumes[v].header().shard_ids[0], v * 2);
+    }
+    EXPECT_EQ(volumes[0].stripe(0), nullptr);
+    EXPECT_EQ(volumes[0].cell(0, 0), nullptr);
+    EXPECT_EQ(volumes[0].cell(2, 1), volumes[0].stripe(2) + 1);
+    EXPECT_EQ(volumes[0].cell(2, 2), nullptr);
+    EXPECT_EQ(volumes[0].stripe(stripes), nullptr);
+    EXPECT_TRUE(validateBlock(*volumes[1].cell(3, 3)));
+    EXPECT_EQ(volumes[1].cell(3, 3)->stripe_number, (3u << 8) | 3u);
+
+    EXPECT_EQ(volumes[0].adviseSequential(true), 0);
+    EXPECT_EQ(volumes[0].prefetch(0, 2), 0);
+    EXPECT_EQ(volumes[0].prefetch(3, 100), 0);
+    EXPECT_EQ(volumes[0].release(1, 2), 0);
+    EXPECT_EQ(volumes[0].adviseSequential(false), 0);
+
+    // Healthy stripes decode straight from the mappings
+    std::vector<unsigned char> scratch((k + m) * 4080);
+    std::vector<unsigned char*> cells(k + m);
+    std::vector<int> erasures(k + m);
+    std::vector<unsigned char> out(k * 4080);
+    for (int stripe = 1; stripe < stripes; ++stripe) {
+        ASSERT_EQ(mapStripeCells(mapped, stripe, k + m, scratch.data(), cells.data(), erasures.data()), 0);
+        EXPECT_EQ(cells[0], volumes[0].cell(stripe, 0)->data.data());
+        ASSERT_TRUE(readStripeRange(rs, cells.data(), erasures.data(), 0, out.size(), out.data()));
+        EXPECT_EQ(out, payloads[stripe]);
+    }
+
+    // Writes through the fd show up in the mapping: a corrupt cell and a misplaced cell are erased
+    Block bad = blocks[1];
+    bad.data[0] ^= 1;
+    writeCell(1, 1, bad);
+    writeCell(1, 2, blocks[2]);
+    ASSERT_EQ(mapStripeCells(mapped, 1, k + m, scratch.data(), cells.data(), erasures.data()), 2);
+    EXPECT_TRUE(erasures[1] && erasures[2]);
+    EXPECT_EQ(cells[1], scratch.data() + 4080);
+    ASSERT_TRUE(readStripeRange(rs, cells.data(), erasures.data(), 100, 9000, out.data()));
+    EXPECT_TRUE(std::equal(out.begin(), out.begin() + 9000, payloads[1].begin() + 100));
+
+    // A missing volume erases its shards
+    std::vector<const MappedVolume*> partial = {mapped[0], mapped[1]};
+    EXPECT_EQ(mapStripeCells(partial, 4, k + m, scratch.data(), cells.data(), erasures.data()), 2);
+    ASSERT_TRUE(readStripeRange(rs, cells.data(), erasures.data(), 0, out.size(), out.data()));
+    EXPECT_EQ(out, payloads[4]);
+
+    // Bad headers are refused
+    HeaderBlock corrupt = map.volumes[0].header;
+    corrupt.volume_prefix_id++;
+    ASSERT_EQ(pwrite(fds[0], &corrupt, sizeof(HeaderBlock), 0), (ssize_t)sizeof(HeaderBlock));
+    MappedVolume refused;
+    EXPECT_EQ(refused.open(fds[0]), -EINVAL);
+    EXPECT_FALSE(refused.isOpen());
+    EXPECT_EQ(refused.open("/nonexistent/volume"), -ENOENT);
+
+    volumes[0].close();
+    EXPECT_EQ(volumes[0].stripe(1), nullptr);
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, TokenBucket) {
+    const uint64_t base = 1000000000;
+    TokenBucket bucket(1000, 100);
+    EXPECT_TRUE(bucket.tryConsume(60, base));
+    EXPECT_FALSE(bucket.tryConsume(60, base));
+    EXPECT_EQ(bucket.delayNs(60, base), 20000000u);
+    EXPECT_TRUE(bucket.tryConsume(60, base + 20000000));
+    // Bigger than the bucket: waits for a full bucket, then goes into debt
+    EXPECT_EQ(bucket.delayNs(250, base + 20000000), 100000000u);
+    EXPECT_TRUE(bucket.tryConsume(250, base + 120000000));
+    EXPECT_DOUBLE_EQ(bucket.tokens(), -150);
+    bucket.consume(10, base + 120000000);
+    EXPECT_GT(bucket.delayNs(1, base + 200000000), 0u);
+
+    TokenBucket unlimited(0, 0);
+    EXPECT_TRUE(unlimited.tryConsume(1e12, base));
+}
+
+TEST(BlockAIOTest, Scrubber) {
+    init_gf();
+    const int k = 4, m = 2, stripes = 6;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    // Three volumes with two shards each, their headers in stripe 0 and the data in stripes 1 to 5
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+    for (const Volume& vol : map.volumes) {
+        ASSERT_EQ(pwrite(vol.fd, &vol.header, sizeof(HeaderBlock), 0), (ssize_t)sizeof(HeaderBlock));
+    }
+    auto writeCell = [&](int stripe, int shard, const Block& block) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        ASSERT_EQ(pwrite(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+    };
+    auto readCell = [&](int stripe, int shard) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        Block block;
+        EXPECT_EQ(pread(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+        return block;
+    };
+    std::vector<std::vector<Block>> blocks(stripes, std::vector<Block>(k + m));
+    std::vector<unsigned char> payload(k * 4080);
+    for (int stripe = 1; stripe < stripes; ++stripe) {
+        for (size_t i = 0; i < payload.size(); ++i) payload[i] = static_cast<unsigned char>(i * 5 + stripe);
+        buildStripe(rs, payload.data(), stripe, 7, blocks[stripe].data());
+        for (int i = 0; i < k + m; ++i) writeCell(stripe, i, blocks[stripe][i]);
+    }
+
+    // A corrupt cell, a misplaced cell, a stripe beyond repair, and the last stripe missing on volume 2
+    Block bad = blocks[1][1];
+    bad.data[7] ^= 0x80;
+    writeCell(1, 1, bad);
+    writeCell(2, 3, blocks[2][2]);
+    for (int shard : {0, 2, 4}) {
+        bad = blocks[3][shard];
+        bad.block_sequence_number++;
+        writeCell(3, shard, bad);
+    }
+    ASSERT_EQ(ftruncate(map.volumes[2].fd, (stripes - 1) * 2 * sizeof(Block)), 0);
+
+    char checkpoint_path[] = "/tmp/blockaio-scrub-XXXXXX";
+    int checkpoint_fd = mkstemp(checkpoint_path);
+    ASSERT_GE(checkpoint_fd, 0);
+    close(checkpoint_fd);
+    unlink(checkpoint_path);
+
+    ScrubConfig config;
+    config.bytes_per_sec = 0;
+    config.checkpoint_path = checkpoint_path;
+    {
+        Scrubber scrubber(map, rs, config);
+        EXPECT_EQ(scrubber.loadCheckpoint(), -ENOENT);
+        EXPECT_EQ(scrubber.stripeCount(), uint64_t(stripes));
+        ASSERT_EQ(scrubber.run(), 0);
+        EXPECT_TRUE(scrubber.done());
+        const ScrubStats& stats = scrubber.stats();
+        EXPECT_EQ(stats.stripes, uint64_t(stripes - 1));
+        EXPECT_EQ(stats.cells, uint64_t((stripes - 1) * (k + m)));
+        EXPECT_EQ(stats.bad_cells, 5u);
+        EXPECT_EQ(stats.missing_cells, 2u);
+        EXPECT_EQ(stats.repaired_cells, 4u);
+        EXPECT_EQ(stats.unrecoverable_stripes, 1u);
+        EXPECT_EQ(stats.write_errors, 0u);
+    }
+
+    // The header stripe isn't scrubbed
+    for (const Volume& vol : map.volumes) {
+        HeaderBlock header;
+        ASSERT_EQ(pread(vol.fd, &header, sizeof(HeaderBlock), 0), (ssize_t)sizeof(HeaderBlock));
+        EXPECT_EQ(std::memcmp(&header, &vol.header, sizeof(HeaderBlock)), 0);
+    }
+
+    // Repaired cells are valid, in place, and newer than the rest of the stripe
+    for (auto cell : {std::make_pair(1, 1), std::make_pair(2, 3), std::make_pair(5, 4), std::make_pair(5, 5)}) {
+        Block block = readCell(cell.first, cell.second);
+        EXPECT_TRUE(validateBlock(block));
+        EXPECT_EQ(block.stripe_number, (uint64_t(cell.first) << 8) | cell.second);
+        EXPECT_EQ(block.block_sequence_number, 8u);
+        EXPECT_EQ(block.data, blocks[cell.first][cell.second].data);
+    }
+
+    // A finished pass resumes as finished, the next pass only finds the unrecoverable stripe
+    {
+        Scrubber scrubber(map, rs, config);
+        ASSERT_EQ(scrubber.loadCheckpoint(), 0);
+        EXPECT_TRUE(scrubber.done());
+        EXPECT_EQ(scrubber.pass(), 0u);
+        scrubber.restart();
+        ASSERT_EQ(scrubber.run(), 0);
+        EXPECT_EQ(scrubber.pass(), 1u);
+        EXPECT_EQ(scrubber.stats().bad_cells, 3u);
+        EXPECT_EQ(scrubber.stats().missing_cells, 0u);
+        EXPECT_EQ(scrubber.stats().repaired_cells, 0u);
+    }
+
+    // With a budget of one stripe per second per drive, each step scrubs one stripe and checkpoints
+    config.bytes_per_sec = 2 * sizeof(Block);
+    config.burst_bytes = 2 * sizeof(Block);
+    config.checkpoint_interval = 1;
+    const uint64_t base = 1000000000;
+    {
+        Scrubber scrubber(map, rs, config);
+        ASSERT_EQ(scrubber.loadCheckpoint(), 0);
+        scrubber.restart();
+        EXPECT_EQ(scrubber.step(base), 0u);
+        EXPECT_EQ(scrubber.nextStripe(), 2u);
+        uint64_t wait = scrubber.step(base);
+        EXPECT_EQ(wait, 1000000000u);
+        EXPECT_EQ(scrubber.stats().throttled, 1u);
+        EXPECT_EQ(scrubber.step(base + wait), 0u);
+        EXPECT_EQ(scrubber.nextStripe(), 3u);
+    }
+    {
+        Scrubber scrubber(map, rs, config);
+        ASSERT_EQ(scrubber.loadCheckpoint(), 0);
+        EXPECT_EQ(scrubber.pass(), 2u);
+        EXPECT_EQ(scrubber.nextStripe(), 3u);
+    }
+
+    // A corrupt checkpoint is refused
+    int fd = open(checkpoint_path, O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pwrite(fd, "x", 1, 12), 1);
+    close(fd);
+    {
+        Scrubber scrubber(map, rs, config);
+        EXPECT_EQ(scrubber.loadCheckpoint(), -EINVAL);
+        EXPECT_EQ(scrubber.nextStripe(), config.first_stripe);
+    }
+    unlink(checkpoint_path);
+
+    // A volume with a bad header isn't touched, its cells count as bad
+    map.volumes[0].header.version_number = 2;
+    {
+        ScrubConfig unlimited;
+        unlimited.bytes_per_sec = 0;
+        Scrubber scrubber(map, rs, unlimited);
+        ASSERT_EQ(scrubber.run(), 0);
+        EXPECT_EQ(scrubber.stats().bad_cells, uint64_t((stripes - 1) * 2 + 2));
+        EXPECT_EQ(scrubber.stats().repaired_cells, 0u);
+    }
+
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, TailLog) {
+    init_gf();
+    const int k = 4, m = 2;
+    const uint64_t tail_offset = 1 << 20;
+    const rlim_t file_limit = 4 << 20;
+    const int stripe = 1024;  // past file_limit, the tails are below it
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    // Three volumes with two shards each, parity on volume 2
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+    for (Volume& vol : map.volumes) {
+        vol.header.tail_offset = tail_offset;
+        sealHeader(vol.header);
+    }
+    auto writeCell = [&](int shard, const Block& block) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        ASSERT_EQ(pwrite(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+    };
+    auto readCell = [&](int shard) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        Block block;
+        EXPECT_EQ(pread(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+        return block;
+    };
+    // Decodes the data cells from the parity and checks them against the cells in place
+    auto consistent = [&]() {
+        std::vector<Block> cells(k + m);
+        unsigned char* shards[k + m];
+        int erasures[k + m] = {1, 1, 0, 0, 0, 0};
+        for (int i = 0; i < k + m; ++i) {
+            cells[i] = readCell(i);
+            shards[i] = cells[i].data.data();
+        }
+        std::array<unsigned char, 4080> want0 = cells[0].data, want1 = cells[1].data;
+        std::memset(shards[0], 0, 4080);
+        std::memset(shards[1], 0, 4080);
+        return rs_decode(rs, shards, erasures, 2, 4080) && cells[0].data == want0 && cells[1].data == want1;
+    };
+    // Runs a commit with the in-place writes refused by a file size limit, as if it crashed after phase 1
+    auto crashAfterPhase1 = [&](auto commit) {
+        struct rlimit old;
+        EXPECT_EQ(getrlimit(RLIMIT_FSIZE, &old), 0);
+        struct rlimit limit = old;
+        limit.rlim_cur = file_limit;
+        void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+        EXPECT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+        int ret = commit();
+        EXPECT_EQ(setrlimit(RLIMIT_FSIZE, &old), 0);
+        signal(SIGXFSZ, handler);
+        return ret;
+    };
+
+    std::vector<unsigned char> payload(k * 4080);
+    for (size_t i = 0; i < payload.size(); ++i) payload[i] = static_cast<unsigned char>(i * 7);
+    std::vector<unsigned char> new_data(4080);
+
+    // Nothing commits before recovery
+    TailLog log(map, 64);
+    EXPECT_EQ(log.writeStripe(rs, stripe, payload.data(), 1), -EINVAL);
+    ASSERT_EQ(log.recover(), 0);
+    ASSERT_EQ(log.writeStripe(rs, stripe, payload.data(), 1), 0);
+    EXPECT_EQ(log.tailPosition(0), uint32_t(3));
+    EXPECT_EQ(log.nextSequence(), 2u);
+    for (int i = 0; i < k + m; ++i) {
+        Block cell = readCell(i);
+        EXPECT_TRUE(validateBlock(cell));
+        EXPECT_EQ(cell.block_sequence_number, 1u);
+    }
+    EXPECT_TRUE(consistent());
+
+    for (size_t i = 0; i < new_data.size(); ++i) new_data[i] = static_cast<unsigned char>(i * 3 + 1);
+    ASSERT_EQ(log.updateStripeCell(rs, stripe, 1, new_data.data(), 2), 0);
+    EXPECT_EQ(std::memcmp(readCell(1).data.data(), new_data.data(), 4080), 0);
+    EXPECT_TRUE(consistent());
+
+    // A crash in phase 2 after the parity went down but before the data cell did rolls the parity back
+    const Block old_parity = readCell(4);
+    for (size_t i = 0; i < new_data.size(); ++i) new_data[i] = static_cast<unsigned char>(i * 11 + 2);
+    EXPECT_EQ(crashAfterPhase1([&] { return log.updateStripeCell(rs, stripe, 2, new_data.data(), 3); }), -EFBIG);
+    EXPECT_EQ(log.updateStripeCell(rs, stripe, 2, new_data.data(), 3), -EINVAL);
+    Block data = readCell(2), parity0 = readCell(4), parity1 = readCell(5);
+    Block* parity[2] = {&parity0, &parity1};
+    ASSERT_TRUE(updateCell(rs, data, parity, new_data.data(), 3));
+    writeCell(4, parity0);
+    writeCell(5, parity1);
+    EXPECT_FALSE(consistent());
+    EXPECT_EQ(log.recover(), 1);
+    EXPECT_EQ(readCell(4).block_sequence_number, old_parity.block_sequence_number);
+    EXPECT_EQ(readCell(4).data, old_parity.data);
+    EXPECT_TRUE(consistent());
+    EXPECT_EQ(log.nextSequence(), 4u);
+
+    // A torn cell is restored from the backup too
+    const Block old0 = readCell(0);
+    EXPECT_EQ(crashAfterPhase1([&] { return log.updateStripeCell(rs, stripe, 0, new_data.data(), 4); }), -EFBIG);
+    Block torn = old0;
+    torn.data[100] ^= 1;
+    writeCell(0, torn);
+    EXPECT_EQ(log.recover(), 1);
+    EXPECT_EQ(readCell(0).data, old0.data);
+    EXPECT_EQ(readCell(4).data, old_parity.data);
+    EXPECT_TRUE(consistent());
+
+    // A crash after every cell went down leaves the commit done
+    std::vector<Block> built(k + m);
+    buildStripe(rs, payload.data(), stripe, 5, built.data());
+    EXPECT_EQ(crashAfterPhase1([&] { return log.writeStripe(rs, stripe, payload.data(), 5); }), -EFBIG);
+    for (int i = 0; i < k + m; ++i) writeCell(i, built[i]);
+    EXPECT_EQ(log.recover(), 0);
+    EXPECT_EQ(readCell(0).block_sequence_number, 5u);
+    EXPECT_TRUE(consistent());
+
+    // A cell written since the commit stops the roll back, rather than rolling back only the rest
+    std::vector<Block> newer(k + m);
+    buildStripe(rs, payload.data(), stripe, 7, newer.data());
+    EXPECT_EQ(crashAfterPhase1([&] { return log.writeStripe(rs, stripe, payload.data(), 6); }), -EFBIG);
+    buildStripe(rs, payload.data(), stripe, 6, built.data());
+    writeCell(0, built[0]);
+    writeCell(1, newer[1]);
+    torn = built[2];
+    torn.data[0] ^= 1;
+    writeCell(2, torn);
+    EXPECT_EQ(log.recover(), 0);
+    EXPECT_EQ(readCell(0).block_sequence_number, 6u);
+    EXPECT_EQ(readCell(1).block_sequence_number, 7u);
+    EXPECT_FALSE(validateBlock(readCell(2)));
+    ASSERT_EQ(log.writeStripe(rs, stripe, payload.data(), 8), 0);
+    EXPECT_TRUE(consistent());
+
+    // Finished commits retire their records, so a cell that goes bad afterwards is left for the
+    // scrubber instead of being rolled back to an older backup
+    ASSERT_EQ(log.updateStripeCell(rs, stripe, 0, new_data.data(), 9), 0);
+    const Block current0 = readCell(0);
+    Block rotten = current0;
+    rotten.data[5] ^= 1;
+    writeCell(0, rotten);
+    EXPECT_EQ(log.recover(), 0);
+    EXPECT_EQ(readCell(0).data, rotten.data);
+    writeCell(0, current0);
+    EXPECT_EQ(log.recover(), 0);
+    EXPECT_EQ(std::memcmp(readCell(0).data.data(), new_data.data(), 4080), 0);
+    EXPECT_EQ(readCell(0).block_sequence_number, 9u);
+    EXPECT_TRUE(consistent());
+
+    // The sequence number has to increase, and the old cells have to be there
+    EXPECT_EQ(log.updateStripeCell(rs, stripe, 1, new_data.data(), 9), -EINVAL);
+    EXPECT_EQ(log.updateStripeCell(rs, stripe, 9, new_data.data(), 10), -EINVAL);
+    const Block old3 = readCell(3);
+    torn = old3;
+    torn.data[0] ^= 1;
+    writeCell(3, torn);
+    EXPECT_EQ(log.updateStripeCell(rs, stripe, 3, new_data.data(), 10), -EIO);
+    writeCell(3, old3);
+
+    // Every volume a commit touches needs a tail
+    map.volumes[0].header.tail_offset = 0;
+    EXPECT_EQ(log.writeStripe(rs, stripe, payload.data(), 10), -EINVAL);
+    map.volumes[0].header.tail_offset = tail_offset;
+
+    // Without the record on volume 2 the commit never reached phase 2, so recovery leaves the cells alone
+    const uint32_t position = log.tailPosition(2);
+    EXPECT_EQ(crashAfterPhase1([&] { return log.writeStripe(rs, stripe, payload.data(), 10); }), -EFBIG);
+    Block zero;
+    std::memset(&zero, 0, sizeof(zero));
+    ASSERT_EQ(pwrite(map.volumes[2].fd, &zero, sizeof(Block), tail_offset + position * sizeof(Block)), (ssize_t)sizeof(Block));
+    writeCell(0, rotten);
+    EXPECT_EQ(log.recover(), 0);
+    EXPECT_EQ(readCell(0).data, rotten.data);
+    EXPECT_EQ(readCell(4).block_sequence_number, 9u);
+    writeCell(0, current0);
+    EXPECT_TRUE(consistent());
+
+    // A small tail wraps, and a record that can't fit is refused
+    TailLog small(map, 5);
+    ASSERT_EQ(small.recover(), 0);
+    ASSERT_EQ(small.writeStripe(rs, stripe, payload.data(), 11), 0);
+    ASSERT_EQ(small.updateStripeCell(rs, stripe, 0, new_data.data(), 12), 0);
+    EXPECT_EQ(small.tailPosition(0), 5u);
+    EXPECT_EQ(small.tailPosition(2), 3u);
+    ASSERT_EQ(small.updateStripeCell(rs, stripe, 1, new_data.data(), 13), 0);
+    EXPECT_EQ(small.tailPosition(0), 2u);
+    EXPECT_EQ(small.tailPosition(2), 3u);
+    EXPECT_TRUE(consistent());
+    EXPECT_EQ(small.recover(), 0);
+    EXPECT_TRUE(consistent());
+    TailLog tiny(map, 2);
+    ASSERT_EQ(tiny.recover(), 0);
+    EXPECT_EQ(tiny.writeStripe(rs, stripe, payload.data(), 14), -ENOSPC);
+    EXPECT_TRUE(consistent());
+
+    // Stripes past 2^31 commit and roll back at their 64-bit offsets, one shard per volume puts them 8 TiB in
+    const uint64_t far = (uint64_t(1) << 31) + 1;
+    VolumeMap wide = temp.volumeMap(6, 6);
+    for (Volume& vol : wide.volumes) {
+        vol.header.tail_offset = tail_offset;
+        sealHeader(vol.header);
+    }
+    auto readFar = [&](int shard) {
+        Block block;
+        EXPECT_EQ(pread(wide.volumes[shard].fd, &block, sizeof(Block), computeOffsetToBlock(wide.volumes[shard].header, far, shard)), (ssize_t)sizeof(Block));
+        return block;
+    };
+    TailLog far_log(wide, 16);
+    ASSERT_EQ(far_log.recover(), 0);
+    ASSERT_EQ(far_log.writeStripe(rs, far, payload.data(), 1), 0);
+    EXPECT_EQ(crashAfterPhase1([&] { return far_log.updateStripeCell(rs, far, 2, new_data.data(), 2); }), -EFBIG);
+    EXPECT_EQ(readFar(2).block_sequence_number, 1u);
+    EXPECT_EQ(far_log.recover(), 1);
+    std::vector<Block> expected(k + m);
+    buildStripe(rs, payload.data(), far, 1, expected.data());
+    for (int i = 0; i < k + m; ++i) {
+        Block cell = readFar(i);
+        EXPECT_EQ(std::memcmp(&cell, &expected[i], sizeof(Block)), 0) << "shard " << i;
+    }
+    ASSERT_EQ(far_log.updateStripeCell(rs, far, 2, new_data.data(), 2), 0);
+    EXPECT_EQ(std::memcmp(readFar(2).data.data(), new_data.data(), 4080), 0);
+    EXPECT_EQ(readFar(k).block_sequence_number, 2u);
+
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, GroupCommit) {
+    init_gf();
+    const int k = 4, m = 2, threads = 4, appends = 60;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(6, 3);
+    // Reads an append back through the stripe's cells
+    auto readBack = [&](uint64_t stripe, size_t offset, size_t length) {
+        std::vector<Block> cells(k + m);
+        unsigned char* shards[k + m];
+        int erasures[k + m] = {};
+        for (int i = 0; i < k + m; ++i) {
+            const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+            EXPECT_EQ(pread(vol.fd, &cells[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe, i)), (ssize_t)sizeof(Block));
+            EXPECT_TRUE(validateBlock(cells[i]));
+            shards[i] = cells[i].data.data();
+        }
+        erasures[1] = 1;  // and through a decode
+        std::vector<unsigned char> out(length);
+        EXPECT_TRUE(readStripeRange(rs, shards, erasures, offset, length, out.data()));
+        return out;
+    };
+    auto record = [](int thread, int i) {
+        std::vector<unsigned char> data(1 + (thread * 37 + i * 53) % 300);
+        for (size_t j = 0; j < data.size(); ++j) data[j] = static_cast<unsigned char>(thread * 61 + i * 7 + j);
+        return data;
+    };
+
+    GroupCommitConfig config;
+    config.blade = 5;
+    config.first_stripe = 2;
+    config.max_delay_us = 2000;
+    std::vector<std::vector<uint64_t>> addresses(threads, std::vector<uint64_t>(appends));
+    {
+        GroupCommit group(map, rs, config);
+        EXPECT_EQ(group.stripeBytes(), size_t(k * 4080));
+        uint64_t address;
+        EXPECT_EQ(group.append("x", 0, &address), -EINVAL);
+        std::vector<unsigned char> big(k * 4080 + 1);
+        EXPECT_EQ(group.append(big.data(), big.size(), &address), -EINVAL);
+
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&, t] {
+                for (int i = 0; i < appends; ++i) {
+                    std::vector<unsigned char> data = record(t, i);
+                    EXPECT_EQ(group.append(data.data(), data.size(), &addresses[t][i]), 0);
+                }
+            });
+        }
+        for (std::thread& writer : writers) writer.join();
+
+        // A stripe sized append fills a stripe of its own
+        big.resize(k * 4080);
+        std::fill(big.begin(), big.end(), 0x5a);
+        const uint64_t before = group.stats().full_stripes;
+        ASSERT_EQ(group.append(big.data(), big.size(), &address), 0);
+        EXPECT_EQ(group.stats().full_stripes, before + 1);
+        uint64_t stripe;
+        size_t offset;
+        group.decodeAddress(address, &stripe, &offset);
+        EXPECT_EQ(offset, 0u);
+        EXPECT_EQ(readBack(stripe, 0, big.size()), big);
+
+        GroupCommitStats stats = group.stats();
+        EXPECT_EQ(stats.appends, uint64_t(threads * appends + 1));
+        EXPECT_EQ(stats.write_errors, 0u);
+        EXPECT_LT(stats.stripes, stats.appends);
+        EXPECT_EQ(group.nextStripe(), config.first_stripe + stats.stripes);
+    }
+
+    // Every append is 8 byte aligned, in the blade, doesn't overlap the others and reads back
+    std::vector<std::pair<uint64_t, size_t>> ranges;
+    for (int t = 0; t < threads; ++t) {
+        for (int i = 0; i < appends; ++i) {
+            const uint64_t address = addresses[t][i];
+            const size_t length = record(t, i).size();
+            EXPECT_EQ(address >> 32, 5u);
+            const uint64_t stripe = ((address & 0xffffffff) * 8) / (k * 4080);
+            const size_t offset = ((address & 0xffffffff) * 8) % (k * 4080);
+            EXPECT_GE(stripe, 2u);
+            EXPECT_LE(offset + length, size_t(k * 4080));
+            EXPECT_EQ(readBack(stripe, offset, length), record(t, i));
+            ranges.emplace_back((address & 0xffffffff) * 8, length);
+        }
+    }
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        EXPECT_LE(ranges[i - 1].first + ranges[i - 1].second, ranges[i].first);
+    }
+
+    // A lone append goes out on its deadline, flush() doesn't wait for it
+    config.max_delay_us = 100000000;
+    {
+        GroupCommit group(map, rs, config);
+        uint64_t address = 0;
+        std::thread writer([&] { EXPECT_EQ(group.append("frond", 5, &address), 0); });
+        while (group.stats().appends == 0) std::this_thread::yield();
+        group.flush();
+        writer.join();
+        EXPECT_EQ(group.stats().stripes, 1u);
+        EXPECT_EQ(group.stats().full_stripes, 0u);
+        EXPECT_EQ(address, uint64_t(5) << 32 | 2 * k * 4080 / 8);
+    }
+
+    // Stripe 0 holds the headers, so it can't be the first stripe
+    EXPECT_EQ(GroupCommitConfig().first_stripe, 1u);
+    config.first_stripe = 0;
+    {
+        GroupCommit group(map, rs, config);
+        uint64_t address = 0;
+        EXPECT_EQ(group.error(), -EINVAL);
+        EXPECT_EQ(group.append("frond", 5, &address), -EINVAL);
+    }
+
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, BlobIndex) {
+    const uint32_t max_pages = 64;
+    TempVolumes temp;
+    Volume vol = temp.volume();
+    vol.header.primary_index_offset = PAGE_SIZE;
+    vol.header.secondary_index_offset = PAGE_SIZE * (1 + max_pages);
+
+    // A blank volume has an empty index
+    BlobIndex index(vol, max_pages);
+    ASSERT_EQ(index.load(), 0);
+    EXPECT_EQ(index.save(), 0);
+
+    // Blobs laid out back to back with gaps, special blobs first as in blobindex4.py
+    const int count = 1000;
+    uint64_t offset = 1 << 20;
+    for (int i = 0; i < count; ++i) {
+        const uint32_t size = 8 + (i * 37) % 500;
+        ASSERT_EQ(index.add(offset, size, i < 3 ? BlobIndex::GROWABLE : 0), i);
+        offset += size + (i % 3) * 8;
+    }
+    const int pages = (count + BlobIndex::ENTRIES_PER_PAGE - 1) / BlobIndex::ENTRIES_PER_PAGE;
+    EXPECT_EQ(index.dirtyPages(), size_t(pages));
+    ASSERT_EQ(index.save(), pages);
+    EXPECT_EQ(index.dirtyPages(), 0u);
+
+    auto check = [&](const BlobIndex& loaded) {
+        ASSERT_EQ(loaded.size(), index.size());
+        for (uint32_t id = 0; id < index.size(); ++id) {
+            EXPECT_EQ(std::memcmp(loaded.get(id), index.get(id), sizeof(BlobEntry)), 0);
+        }
+    };
+    {
+        BlobIndex loaded(vol, max_pages);
+        ASSERT_EQ(loaded.load(), count);
+        check(loaded);
+    }
+
+    // Lookups by offset land on the blob holding the byte, gaps and the ends hold nothing
+    for (int id : {0, 1, 500, count - 1}) {
+        const BlobEntry& entry = *index.get(id);
+        EXPECT_EQ(index.find(entry.offset), id);
+        EXPECT_EQ(index.find(entry.offset + entry.size - 1), id);
+    }
+    EXPECT_EQ(index.find(0), -ENOENT);
+    EXPECT_EQ(index.find(index.get(1)->offset + index.get(1)->size), -ENOENT);
+    EXPECT_EQ(index.nextOffset(index.get(7)->offset), index.get(8)->offset);
+    EXPECT_EQ(index.nextOffset(index.get(count - 1)->offset), UINT64_MAX);
+
+    // A move and a delete only rewrite their pages
+    BlobEntry moved = *index.get(10);
+    moved.offset = offset + 4096;
+    ASSERT_EQ(index.update(10, moved), 0);
+    ASSERT_EQ(index.remove(600), 0);
+    EXPECT_EQ(index.update(count, moved), -ENOENT);
+    EXPECT_EQ(index.find(moved.offset + 1), 10);
+    EXPECT_EQ(index.find(index.get(9)->offset + index.get(9)->size + 16), -ENOENT);
+    EXPECT_NE(index.get(600)->flags & BlobIndex::DELETED, 0u);
+    EXPECT_EQ(index.get(600)->size, 0u);
+    EXPECT_EQ(index.save(), 2);
+    {
+        BlobIndex loaded(vol, max_pages);
+        ASSERT_EQ(loaded.load(), count);
+        check(loaded);
+        EXPECT_EQ(loaded.find(moved.offset), 10);
+        EXPECT_EQ(loaded.dirtyPages(), 0u);
+    }
+
+    // A torn primary page falls back to the secondary copy, and the next save repairs it
+    ASSERT_EQ(pwrite(vol.fd, "torn", 4, vol.header.primary_index_offset + PAGE_SIZE + 100), 4);
+    {
+        BlobIndex loaded(vol, max_pages);
+        ASSERT_EQ(loaded.load(), count);
+        check(loaded);
+        EXPECT_EQ(loaded.dirtyPages(), 1u);
+        EXPECT_EQ(loaded.save(), 1);
+    }
+    // A crash before the secondary copy was written leaves a stale page that loses to the primary
+    std::vector<unsigned char> stale(PAGE_SIZE);
+    ASSERT_EQ(pread(vol.fd, stale.data(), PAGE_SIZE, vol.header.secondary_index_offset), PAGE_SIZE);
+    moved.offset += 4096;
+    ASSERT_EQ(index.update(11, moved), 0);
+    ASSERT_EQ(index.save(), 1);
+    ASSERT_EQ(pwrite(vol.fd, stale.data(), PAGE_SIZE, vol.header.secondary_index_offset), PAGE_SIZE);
+    {
+        BlobIndex loaded(vol, max_pages);
+        ASSERT_EQ(loaded.load(), count);
+        check(loaded);
+    }
+
+    // The index is bounded by its pages
+    BlobIndex small(vol, 1);
+    ASSERT_EQ(small.load(), BlobIndex::ENTRIES_PER_PAGE);
+    EXPECT_EQ(small.add(0, 8, 0), -ENOSPC);
+}
+
+TEST(BlockAIOTest, ReferenceSet) {
+    ReferenceSet set;
+    EXPECT_TRUE(set.add(uint64_t(3) << 32 | 7));
+    EXPECT_FALSE(set.add(uint64_t(3) << 32 | 7));
+    EXPECT_TRUE(set.contains(uint64_t(3) << 32 | 7));
+    EXPECT_FALSE(set.contains(uint64_t(4) << 32 | 7));
+
+    // A dense group turns into a bitmap and stays exact
+    ReferenceSet dense;
+    for (uint64_t i = 0; i < 3 * ReferenceSet::ARRAY_MAX; i += 2) dense.add(uint64_t(3) << 32 | i);
+    EXPECT_EQ(dense.size(), uint64_t(3 * ReferenceSet::ARRAY_MAX / 2));
+    EXPECT_TRUE(dense.contains(uint64_t(3) << 32 | 100));
+    EXPECT_FALSE(dense.contains(uint64_t(3) << 32 | 101));
+    EXPECT_LE(dense.memoryBytes(), size_t(8192 + 64));
+
+    set.merge(dense);
+    set.add(5);
+    EXPECT_EQ(set.size(), dense.size() + 2);
+    std::vector<uint64_t> addresses = set.addresses();
+    ASSERT_EQ(addresses.size(), set.size());
+    EXPECT_TRUE(std::is_sorted(addresses.begin(), addresses.end()));
+    EXPECT_EQ(addresses.front(), 5u);
+}
+
+TEST(BlockAIOTest, ScanCborReferences) {
+    auto ref = [](std::vector<unsigned char>& out, uint64_t tag, uint64_t address) {
+        out.insert(out.end(), {0xd9, uint8_t(tag >> 8), uint8_t(tag), 0x48});
+        for (int i = 7; i >= 0; --i) out.push_back(uint8_t(address >> (i * 8)));
+    };
+    const uint64_t a = uint64_t(2) << 32 | 0x10, b = uint64_t(2) << 32 | 0x20, c = uint64_t(9) << 32, d = 0x1234;
+
+    // {"a": 1000(a), "list": [1, -2, 1.5, "x", 1001(b), {_ 1000(c)}], 0: 1(h'..'), "d": [_ 1000(d)], "n": null}
+    std::vector<unsigned char> cbor = {0xa5, 0x61, 'a'};
+    ref(cbor, CBOR_REF_TAG, a);
+    cbor.insert(cbor.end(), {0x64, 'l', 'i', 's', 't', 0x86, 0x01, 0x21, 0xf9, 0x3e, 0x00, 0x61, 'x'});
+    ref(cbor, CBOR_WEAK_REF_TAG, b);
+    cbor.insert(cbor.end(), {0xbf, 0x61, 'k'});
+    ref(cbor, CBOR_REF_TAG, c);
+    cbor.insert(cbor.end(), {0xff, 0x00, 0xc1, 0x48, 1, 2, 3, 4, 5, 6, 7, 8, 0x61, 'd', 0x9f});
+    ref(cbor, CBOR_REF_TAG, d);
+    cbor.insert(cbor.end(), {0xff, 0x61, 'n', 0xf6});
+
+    ReferenceSet strong, weak;
+    ReferenceScanStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+    EXPECT_EQ(scanCborReferences(cbor.data(), cbor.size(), strong, &weak, &stats), 4);
+    EXPECT_EQ(strong.addresses(), (std::vector<uint64_t>{d, a, c}));
+    EXPECT_EQ(weak.addresses(), std::vector<uint64_t>{b});
+    EXPECT_EQ(stats.strong, 3u);
+    EXPECT_EQ(stats.weak, 1u);
+    EXPECT_EQ(stats.malformed, 0u);
+
+    // Weak references can be ignored, a reference tag on anything but 8 bytes isn't one
+    ReferenceSet only;
+    EXPECT_EQ(scanCborReferences(cbor.data(), cbor.size(), only, nullptr), 3);
+    const unsigned char short_ref[] = {0xd9, 0x03, 0xe8, 0x44, 1, 2, 3, 4};
+    EXPECT_EQ(scanCborReferences(short_ref, sizeof(short_ref), only, nullptr), 0);
+
+    // Truncated CBOR is malformed but keeps what it found
+    ReferenceSet partial;
+    EXPECT_EQ(scanCborReferences(cbor.data(), cbor.size() - 3, partial, nullptr, &stats), -EINVAL);
+    EXPECT_EQ(partial.size(), 3u);
+    EXPECT_EQ(stats.malformed, 1u);
+    const unsigned char stray_break[] = {0x81, 0xff};
+    EXPECT_EQ(scanCborReferences(stray_break, sizeof(stray_break), partial, nullptr), -EINVAL);
+    const unsigned char huge[] = {0x5b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    EXPECT_EQ(scanCborReferences(huge, sizeof(huge), partial, nullptr), -EINVAL);
+}
+
+TEST(BlockAIOTest, ScanVolumeReferences) {
+    const int volumes = 3, fronds = 50;
+    TempVolumes temp;
+    std::vector<Volume> vols(volumes);
+    std::vector<std::unique_ptr<BlobIndex>> indexes;
+    std::vector<ReferenceSource> sources;
+    for (int v = 0; v < volumes; ++v) {
+        vols[v] = temp.volume();
+        vols[v].header.primary_index_offset = PAGE_SIZE;
+        vols[v].header.secondary_index_offset = 2 * PAGE_SIZE;
+        indexes.emplace_back(new BlobIndex(vols[v], 1));
+        ASSERT_EQ(indexes[v]->load(), 0);
+
+        // Each metadata frond is [1000(ref), 1001(weak)], data fronds with references don't count
+        uint64_t offset = 4 * PAGE_SIZE;
+        for (int i = 0; i < fronds; ++i) {
+            std::vector<unsigned char> frond = {0x82, 0xd9, 0x03, 0xe8, 0x48};
+            const uint64_t strong = uint64_t(v + 1) << 32 | (i * 8), weak = uint64_t(100) << 32 | i;
+            for (int j = 7; j >= 0; --j) frond.push_back(uint8_t(strong >> (j * 8)));
+            frond.insert(frond.end(), {0xd9, 0x03, 0xe9, 0x48});
+            for (int j = 7; j >= 0; --j) frond.push_back(uint8_t(weak >> (j * 8)));
+            uint32_t flags = i % 5 == 4 ? 0 : BlobIndex::METADATA;
+            if (i % 7 == 3) {
+                flags |= BlobIndex::MAGICED;
+                frond.insert(frond.begin(), 36, 0xee);
+                frond.insert(frond.end(), 32, 0xee);
+            }
+            if (i == 11) flags |= BlobIndex::COMPRESSED;
+            ASSERT_EQ(pwrite(vols[v].fd, frond.data(), frond.size(), offset), (ssize_t)frond.size());
+            ASSERT_GE(indexes[v]->add(offset, frond.size(), flags), 0);
+            offset += frond.size();
+        }
+        sources.push_back({vols[v].fd, indexes[v].get()});
+    }
+
+    ReferenceSet strong, weak;
+    ReferenceScanStats stats;
+    // A compressed frond can't be scanned, so the scan is incomplete, but the rest still count
+    ASSERT_EQ(scanVolumeReferences(sources, 2, strong, &weak, &stats), -ENOTSUP);
+    const int metadata = fronds - fronds / 5 - 1;
+    EXPECT_EQ(stats.fronds, uint64_t(volumes * metadata));
+    EXPECT_EQ(stats.skipped, uint64_t(volumes));
+    EXPECT_EQ(stats.malformed, 0u);
+    EXPECT_EQ(strong.size(), uint64_t(volumes * metadata));
+    EXPECT_EQ(weak.size(), uint64_t(metadata));
+    EXPECT_TRUE(strong.contains(uint64_t(2) << 32 | 3 * 8));
+    EXPECT_FALSE(strong.contains(uint64_t(2) << 32 | 4 * 8));
+    EXPECT_FALSE(strong.contains(uint64_t(2) << 32 | 11 * 8));
+
+    // Truncated CBOR and a frond shorter than its framing fail the scan ahead of the compressed fronds
+    const std::vector<unsigned char> bad = {0x82, 0xd9, 0x03, 0xe8, 0x48, 0x01, 0x02};
+    ASSERT_EQ(pwrite(vols[1].fd, bad.data(), bad.size(), 1 << 20), (ssize_t)bad.size());
+    ASSERT_GE(indexes[1]->add(1 << 20, bad.size(), BlobIndex::METADATA), 0);
+    ASSERT_GE(indexes[2]->add(4 * PAGE_SIZE, 40, BlobIndex::METADATA | BlobIndex::MAGICED), 0);
+    ReferenceSet partial;
+    EXPECT_EQ(scanVolumeReferences(sources, 2, partial, nullptr, &stats), -EBADMSG);
+    EXPECT_EQ(stats.malformed, 2u);
+    EXPECT_EQ(partial.size(), strong.size());
+
+    // A frond past the end of its volume is an error, the rest still count
+    ASSERT_GE(indexes[0]->add(1 << 30, 16, BlobIndex::METADATA), 0);
+    ReferenceSet again;
+    EXPECT_EQ(scanVolumeReferences(sources, 1, again, nullptr), -EINVAL);
+    EXPECT_EQ(again.size(), strong.size());
+
+}
+
+TEST(BlockAIOTest, Compactor) {
+    init_gf();
+    const int k = 4, m = 2, fronds = 300;
+    const size_t stripe_bytes = k * 4080;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    TempVolumes temp;
+
+    // Two blob volumes of fronds of all sizes, some bigger than a stripe, a quarter of them deleted
+    std::mt19937 gen(7);
+    std::vector<Volume> sources;
+    std::vector<std::unique_ptr<BlobIndex>> indexes;
+    std::vector<std::vector<std::vector<unsigned char>>> contents(2);
+    for (int v = 0; v < 2; ++v) {
+        sources.push_back(temp.volume());
+        sources[v].header.primary_index_offset = PAGE_SIZE;
+        sources[v].header.secondary_index_offset = 9 * PAGE_SIZE;
+        indexes.emplace_back(new BlobIndex(sources[v], 8));
+        ASSERT_EQ(indexes[v]->load(), 0);
+        uint64_t offset = 1 << 20;
+        for (int i = 0; i < fronds; ++i) {
+            std::vector<unsigned char> frond(1 + gen() % (i % 50 == 0 ? 40000 : 3000));
+            for (auto& byte : frond) byte = static_cast<unsigned char>(gen());
+            ASSERT_EQ(pwrite(sources[v].fd, frond.data(), frond.size(), offset), (ssize_t)frond.size());
+            ASSERT_EQ(indexes[v]->add(offset, frond.size(), i % 3 == 0 ? BlobIndex::METADATA : 0), i);
+            offset += frond.size() + (gen() % 4 == 0 ? 100000 : 0);
+            contents[v].push_back(frond);
+        }
+        for (int i = 1; i < fronds; i += 4) ASSERT_EQ(indexes[v]->remove(i), 0);
+    }
+
+    // Both compact into one blade, each into its own stripes and with its own index volume
+    VolumeMap map;
+    for (int v = 0; v < 3; ++v) {
+        Volume vol = temp.volume();
+        std::fill(vol.header.shard_ids.begin(), vol.header.shard_ids.end(), v * 2 + 1);
+        vol.header.shard_ids[0] = v * 2;
+        map.volumes.push_back(vol);
+    }
+    std::vector<Volume> index_volumes = {temp.volume(), temp.volume()};
+    for (Volume& vol : index_volumes) {
+        vol.header.version_number = 1;
+        vol.header.volume_prefix_id = 1 << 24;
+    }
+    std::vector<io_context_t> contexts(2, 0);
+    std::vector<std::unique_ptr<Compactor>> compactors;
+    std::vector<Compactor*> jobs;
+    CompactConfig config;
+    config.read_bytes = 64 << 10;
+    config.read_depth = 2;
+    config.stripe_depth = 2;
+    config.bytes_per_sec = 256 << 20;
+    config.burst_bytes = 256 << 10;
+    config.index_primary_offset = 16 * PAGE_SIZE;
+    config.index_secondary_offset = 32 * PAGE_SIZE;
+    config.index_pages = 8;
+    for (int v = 0; v < 2; ++v) {
+        ASSERT_EQ(io_setup(MAX_EVENTS, &contexts[v]), 0);
+        config.first_stripe = 1 + v * 1000;
+        compactors.emplace_back(new Compactor(sources[v], *indexes[v], map, rs, index_volumes[v], contexts[v], config));
+        jobs.push_back(compactors[v].get());
+    }
+    ASSERT_EQ(compactVolumes(jobs, 2), 0);
+
+    // Reads the blade's payload bytes back through the cells, a range can span stripes
+    auto readBlade = [&](uint64_t offset, size_t length) {
+        std::vector<unsigned char> out(length);
+        for (size_t done = 0; done < length;) {
+            const uint64_t stripe = (offset + done) / stripe_bytes;
+            const size_t start = (offset + done) % stripe_bytes;
+            const size_t chunk = std::min(length - done, stripe_bytes - start);
+            std::vector<Block> cells(k + m);
+            unsigned char* shards[k + m];
+            int erasures[k + m] = {};
+            for (int i = 0; i < k + m; ++i) {
+                const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+                EXPECT_EQ(pread(vol.fd, &cells[i], sizeof(Block), computeOffsetToBlock(vol.header, stripe, i)), (ssize_t)sizeof(Block));
+                EXPECT_TRUE(validateBlock(cells[i]));
+                shards[i] = cells[i].data.data();
+            }
+            EXPECT_TRUE(readStripeRange(rs, shards, erasures, start, chunk, out.data() + done));
+            done += chunk;
+        }
+        return out;
+    };
+
+    for (int v = 0; v < 2; ++v) {
+        const CompactStats& stats = compactors[v]->stats();
+        const int live = fronds - fronds / 4;
+        EXPECT_EQ(stats.fronds, uint64_t(live));
+        EXPECT_EQ(stats.dropped, uint64_t(fronds / 4));
+        EXPECT_GT(stats.reads, 1u);
+        EXPECT_LT(stats.reads, uint64_t(live));
+        EXPECT_EQ(stats.stripes, compactors[v]->endStripe() - (1 + v * 1000));
+        EXPECT_EQ(stats.stripes, (stats.bytes + 8 * live + stripe_bytes - 1) / stripe_bytes);
+
+        // The header now points at the new index, which keeps every ID and finds every live frond in the blade
+        EXPECT_TRUE(validateHeader(index_volumes[v].header));
+        HeaderBlock header;
+        ASSERT_EQ(pread(index_volumes[v].fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+        EXPECT_EQ(std::memcmp(&header, &index_volumes[v].header, sizeof(header)), 0);
+        EXPECT_EQ(header.primary_index_offset, config.index_primary_offset);
+        BlobIndex compacted(index_volumes[v], config.index_pages);
+        ASSERT_EQ(compacted.load(), fronds);
+        for (int i = 0; i < fronds; ++i) {
+            const BlobEntry& entry = *compacted.get(i);
+            EXPECT_EQ(entry.flags, indexes[v]->get(i)->flags);
+            if (i % 4 == 1) {
+                EXPECT_EQ(entry.size, 0u);
+                continue;
+            }
+            EXPECT_EQ(entry.offset % 8, 0u);
+            EXPECT_GE(entry.offset, (1 + v * 1000) * stripe_bytes);
+            ASSERT_EQ(entry.size, contents[v][i].size());
+            EXPECT_EQ(readBlade(entry.offset, entry.size), contents[v][i]);
+        }
+    }
+
+    // Stripes past 2^31 are written where their cells say they are, one shard per volume puts them 8 TiB in
+    {
+        VolumeMap wide = temp.volumeMap(k + m, k + m);
+        CompactConfig far = config;
+        far.first_stripe = uint64_t(1) << 31;
+        Compactor compactor(sources[1], *indexes[1], wide, rs, index_volumes[1], contexts[1], far);
+        ASSERT_EQ(compactor.run(), 0);
+        EXPECT_GT(compactor.endStripe(), far.first_stripe);
+        for (int i = 0; i < k + m; ++i) {
+            Block cell;
+            const Volume& vol = wide.volumes[i];
+            ASSERT_EQ(pread(vol.fd, &cell, sizeof(Block), computeOffsetToBlock(vol.header, far.first_stripe, i)), (ssize_t)sizeof(Block));
+            EXPECT_TRUE(validateBlock(cell));
+            EXPECT_EQ(cell.stripe_number, far.first_stripe << 8 | i);
+        }
+    }
+
+    // Index offsets left unset, overlapping or in the header stripe are refused before anything is written
+    const HeaderBlock before = index_volumes[0].header;
+    config.first_stripe = 2000;
+    config.bytes_per_sec = 0;
+    const uint64_t page = PAGE_SIZE;
+    const std::vector<std::pair<uint64_t, uint64_t>> refused = {
+        {0, 32 * page}, {16 * page, 0}, {16 * page, 20 * page}, {16 * page, 16 * page + 100}, {100, 32 * page}};
+    for (auto offsets : refused) {
+        CompactConfig bad = config;
+        bad.index_primary_offset = offsets.first;
+        bad.index_secondary_offset = offsets.second;
+        Compactor compactor(sources[0], *indexes[0], map, rs, index_volumes[0], contexts[0], bad);
+        EXPECT_EQ(compactor.run(), -EINVAL);
+        EXPECT_EQ(compactor.stats().reads, 0u);
+    }
+    EXPECT_EQ(std::memcmp(&before, &index_volumes[0].header, sizeof(before)), 0);
+
+    // A frond past the end of its volume fails the compaction and leaves the header alone
+    ASSERT_GE(indexes[0]->add(1ull << 32, 100, 0), 0);
+    {
+        Compactor compactor(sources[0], *indexes[0], map, rs, index_volumes[0], contexts[0], config);
+        EXPECT_EQ(compactor.run(), -EIO);
+    }
+    EXPECT_EQ(std::memcmp(&before, &index_volumes[0].header, sizeof(before)), 0);
+
+    compactors.clear();
+    for (io_context_t ctx : contexts) io_destroy(ctx);
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, Reparity) {
+    init_gf();
+    const int k = 4, stripes = 100;
+    reed_solomon* rs = rs_new_nested(k, 2);
+    reed_solomon* grown = rs_new_nested(k, 4);
+    ASSERT_NE(rs, nullptr);
+    ASSERT_NE(grown, nullptr);
+    TempVolumes temp;
+    auto payloadOf = [&](int stripe) {
+        std::vector<unsigned char> payload(k * 4080);
+        std::mt19937 gen(stripe);
+        for (auto& byte : payload) byte = static_cast<unsigned char>(gen());
+        return payload;
+    };
+
+    // RS(4, 2) stripes 1 to 100 over three volumes, stripe 7 lost a data cell and stripe 9 three cells
+    VolumeMap map;
+    for (int v = 0; v < 3; ++v) map.volumes.push_back(temp.volume(v * 2, v * 2 + 1));
+    Block blocks[8];
+    for (int s = 1; s <= stripes; ++s) {
+        buildStripe(rs, payloadOf(s).data(), s, s + 10, blocks);
+        if (s == 7) blocks[1].data[5] ^= 1;
+        if (s == 9) blocks[0].block_checksum = blocks[2].block_checksum = blocks[4].block_checksum = 0;
+        for (int shard = 0; shard < k + 2; ++shard) {
+            const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+            ASSERT_EQ(pwrite(vol.fd, &blocks[shard], sizeof(Block), computeOffsetToBlock(vol.header, s, shard)), (ssize_t)sizeof(Block));
+        }
+    }
+
+    // Grow to RS(4, 4), shards 6 and 7 on a new volume
+    std::vector<Volume> added = {temp.volume(6, 7)};
+    EXPECT_EQ(addParityShards(map, grown, {temp.volume(3, 6)}, ReparityConfig()), -EINVAL);
+    EXPECT_EQ(addParityShards(map, rs, added, ReparityConfig()), -EINVAL);
+    ReparityConfig config;
+    config.batch_stripes = 16;
+    ReparityStats stats;
+    ASSERT_EQ(addParityShards(map, grown, added, config, &stats), 0);
+    EXPECT_EQ(stats.stripes, uint64_t(stripes));
+    // The parity volume is only read for stripes 7 and 9
+    EXPECT_EQ(stats.bytes_read, uint64_t((2 * stripes + 2) * 2 * sizeof(Block)));
+    EXPECT_EQ(stats.decoded, 1u);
+    EXPECT_EQ(stats.unrecoverable, 1u);
+    EXPECT_EQ(stats.cells_written, uint64_t(2 * (stripes - 1)));
+    ASSERT_EQ(map.volumes.size(), 4u);
+    EXPECT_EQ(findVolumeForShard(map, 7), 3);
+    HeaderBlock on_disk;
+    ASSERT_EQ(pread(map.volumes[3].fd, &on_disk, sizeof(on_disk), 0), (ssize_t)sizeof(on_disk));
+    EXPECT_TRUE(validateHeader(on_disk));
+
+    // The new cells are what RS(4, 4) stripes would have had
+    auto readCell = [&](int stripe, int shard) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+        Block block;
+        EXPECT_EQ(pread(vol.fd, &block, sizeof(Block), computeOffsetToBlock(vol.header, stripe, shard)), (ssize_t)sizeof(Block));
+        return block;
+    };
+    for (int s = 1; s <= stripes; ++s) {
+        buildStripe(grown, payloadOf(s).data(), s, s + 10, blocks);
+        for (int shard = k + 2; shard < k + 4; ++shard) {
+            const Block cell = readCell(s, shard);
+            if (s == 9) {
+                EXPECT_FALSE(validateBlock(cell));
+            } else {
+                EXPECT_EQ(std::memcmp(&cell, &blocks[shard], sizeof(Block)), 0) << "stripe " << s << " shard " << shard;
+            }
+        }
+    }
+
+    // Dropping shards 4 and 5 retires their volume, dropping 6 only marks its slot
+    std::vector<Volume> retired;
+    EXPECT_EQ(dropParityShards(map, k, {0}), -EINVAL);
+    ASSERT_EQ(dropParityShards(map, k, {4, 5}, &retired), 1);
+    ASSERT_EQ(retired.size(), 1u);
+    ASSERT_EQ(map.volumes.size(), 3u);
+    EXPECT_EQ(findVolumeForShard(map, 4), -1);
+    EXPECT_EQ(dropParityShards(map, k, {5}), -EINVAL);
+    const uint64_t offset7 = computeOffsetToBlock(map.volumes[2].header, 20, 7);
+    ASSERT_EQ(dropParityShards(map, k, {6}), 1);
+    EXPECT_TRUE(isDroppedShard(map.volumes[2].header.shard_ids[0]));
+    EXPECT_EQ(getKBlocksInStripe(map.volumes[2].header), 2);
+    EXPECT_EQ(computeOffsetToBlock(map.volumes[2].header, 20, 7), offset7);
+    ASSERT_EQ(pread(map.volumes[2].fd, &on_disk, sizeof(on_disk), 0), (ssize_t)sizeof(on_disk));
+    EXPECT_TRUE(validateHeader(on_disk));
+    EXPECT_EQ(on_disk.shard_ids, map.volumes[2].header.shard_ids);
+
+    // What is left still decodes a stripe missing a data cell
+    std::vector<Block> cells(k + 4);
+    unsigned char* shards[k + 4];
+    int erasures[k + 4] = {1, 0, 0, 0, 1, 1, 1, 0};
+    for (int shard = 0; shard < k + 4; ++shard) {
+        if (!erasures[shard]) cells[shard] = readCell(20, shard);
+        shards[shard] = cells[shard].data.data();
+    }
+    ASSERT_EQ(rs_decode(grown, shards, erasures, 4, 4080), 1);
+    buildStripe(grown, payloadOf(20).data(), 20, 30, blocks);
+    EXPECT_EQ(std::memcmp(shards[0], blocks[0].data.data(), 4080), 0);
+
+    // New stripes still write to the volume with a dropped slot, a zeroed cell takes its place
+    auto checkStripe = [&](int stripe) {
+        buildStripe(grown, payloadOf(stripe).data(), stripe, 1, blocks);
+        for (int shard : {0, 1, 2, 3, 7}) {
+            const Block cell = readCell(stripe, shard);
+            EXPECT_EQ(std::memcmp(&cell, &blocks[shard], sizeof(Block)), 0) << "stripe " << stripe << " shard " << shard;
+        }
+        Block dropped;
+        ASSERT_EQ(pread(map.volumes[2].fd, &dropped, sizeof(Block), computeOffsetToBlock(map.volumes[2].header, stripe, 7) - sizeof(Block)),
+                  (ssize_t)sizeof(Block));
+        EXPECT_EQ(std::memcmp(&dropped, droppedCell(), sizeof(Block)), 0) << "stripe " << stripe;
+    };
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    Block* aligned = allocAligned<Block>(PAGE_SIZE, sizeof(Block) * (k + 4));
+    buildStripe(grown, payloadOf(101).data(), 101, 1, aligned);
+    {
+        IoBatch batch(io_ctx, 8);
+        ASSERT_EQ(queueStripeWrite(batch, map, 101, aligned, k + 4, 0), 3);
+        ASSERT_EQ(batch.flush(), 3);
+        IoCompletion done[3];
+        for (int reaped = 0; reaped < 3;) {
+            const int got = batch.reap(done + reaped, 3 - reaped, 1);
+            ASSERT_GT(got, 0);
+            for (int i = reaped; i < reaped + got; ++i) EXPECT_EQ(done[i].result, long(2 * sizeof(Block)));
+            reaped += got;
+        }
+    }
+    free(aligned);
+    io_destroy(io_ctx);
+    checkStripe(101);
+    {
+        StripeRuntime runtime(map, grown, 1, 1, false);
+        ASSERT_EQ(runtime.error(), 0);
+        const std::vector<unsigned char> payload = payloadOf(102);
+        ASSERT_TRUE(runtime.submitStripe(payload.data(), 102, 1, 0));
+        JobCompletion out;
+        while (runtime.poll(&out, 1) == 0) std::this_thread::yield();
+        EXPECT_EQ(out.result, 0);
+    }
+    checkStripe(102);
+    {
+        GroupCommitConfig group_config;
+        group_config.first_stripe = 103;
+        GroupCommit group(map, grown, group_config);
+        ASSERT_EQ(group.error(), 0);
+        const std::vector<unsigned char> payload = payloadOf(103);
+        uint64_t address;
+        ASSERT_EQ(group.append(payload.data(), payload.size(), &address), 0);
+    }
+    checkStripe(103);
+
+    rs_free(rs);
+    rs_free(grown);
+}
+
+TEST(BlockAIOTest, Rebuilder) {
+    init_gf();
+    const int k = 4, m = 4, stripes = 200;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    TempVolumes temp;
+    auto payloadOf = [&](int stripe) {
+        std::vector<unsigned char> payload(k * 4080);
+        std::mt19937 gen(stripe);
+        for (auto& byte : payload) byte = static_cast<unsigned char>(gen());
+        return payload;
+    };
+
+    // Volume 0 holds shards 0 and 1, volumes 1 to 6 one shard each.  Stripe 50 has a bad cell on a
+    // volume its batch reads, stripe 60 has only one good survivor
+    VolumeMap map;
+    map.volumes.push_back(temp.volume(0, 1));
+    for (int shard = 2; shard < k + m; ++shard) map.volumes.push_back(temp.volume(shard, shard));
+    Block blocks[8];
+    for (int s = 1; s <= stripes; ++s) {
+        buildStripe(rs, payloadOf(s).data(), s, s + 10, blocks);
+        if (s == 50) blocks[3].block_checksum ^= 1;
+        if (s == 60) {
+            for (int shard = 2; shard < 7; ++shard) blocks[shard].block_checksum ^= 1;
+        }
+        for (int shard = 0; shard < k + m; ++shard) {
+            const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+            ASSERT_EQ(pwrite(vol.fd, &blocks[shard], sizeof(Block), computeOffsetToBlock(vol.header, s, shard)), (ssize_t)sizeof(Block));
+        }
+    }
+
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    RebuildConfig config;
+    config.batch_stripes = 32;
+    config.bytes_per_sec = 16 << 20;
+    config.burst_bytes = 128 << 10;
+    {
+        // The spares must take exactly the lost shards
+        Rebuilder rebuilder(map, 0, {temp.volume(0, 0)}, rs, io_ctx, config);
+        EXPECT_EQ(rebuilder.run(), -EINVAL);
+    }
+
+    // The failed volume's two shards go to two spares
+    std::vector<Volume> spares = {temp.volume(0, 0), temp.volume(1, 1)};
+    Rebuilder rebuilder(map, 0, spares, rs, io_ctx, config);
+    EXPECT_EQ(rebuilder.progress().eta_sec, -1);
+    ASSERT_EQ(rebuilder.run(), 0);
+    const RebuildStats& stats = rebuilder.stats();
+    EXPECT_EQ(stats.stripes, uint64_t(stripes));
+    EXPECT_EQ(stats.cells, uint64_t(2 * (stripes - 1)));
+    EXPECT_EQ(stats.unrecoverable, 1u);
+    EXPECT_EQ(stats.empty, 0u);
+    // Four of the six survivors per stripe, and the two others for stripes 50 and 60
+    EXPECT_EQ(stats.extra_reads, 4u);
+    EXPECT_EQ(stats.bytes_read, uint64_t(stripes * k + 4) * sizeof(Block));
+    EXPECT_EQ(stats.bytes_written, uint64_t(2 * stripes) * sizeof(Block));
+    EXPECT_GT(stats.throttled, 0u);
+    const RebuildProgress progress = rebuilder.progress();
+    EXPECT_EQ(progress.stripes_done, uint64_t(stripes));
+    EXPECT_EQ(progress.stripes_total, uint64_t(stripes));
+    EXPECT_EQ(progress.eta_sec, 0);
+    EXPECT_GT(progress.bytes_per_sec, 0);
+
+    // The spares replace the failed volume and hold its cells
+    ASSERT_EQ(map.volumes.size(), 8u);
+    EXPECT_EQ(findVolumeForShard(map, 0), 6);
+    EXPECT_EQ(findVolumeForShard(map, 1), 7);
+    for (int s = 1; s <= stripes; ++s) {
+        buildStripe(rs, payloadOf(s).data(), s, s + 10, blocks);
+        for (int shard = 0; shard < 2; ++shard) {
+            const Volume& vol = map.volumes[findVolumeForShard(map, shard)];
+            Block cell;
+            ASSERT_EQ(pread(vol.fd, &cell, sizeof(Block), computeOffsetToBlock(vol.header, s, shard)), (ssize_t)sizeof(Block));
+            if (s == 60) {
+                EXPECT_FALSE(validateBlock(cell));
+                continue;
+            }
+            EXPECT_TRUE(validateBlock(cell));
+            EXPECT_EQ(cell.stripe_number, blocks[shard].stripe_number);
+            EXPECT_EQ(cell.block_sequence_number, uint32_t(s + 11));
+            EXPECT_EQ(cell.data, blocks[shard].data) << "stripe " << s << " shard " << shard;
+        }
+    }
+    HeaderBlock on_disk;
+    ASSERT_EQ(pread(map.volumes[7].fd, &on_disk, sizeof(on_disk), 0), (ssize_t)sizeof(on_disk));
+    EXPECT_TRUE(validateHeader(on_disk));
+
+    io_destroy(io_ctx);
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, Metrics) {
+    init_gf();
+    const int k = 4, m = 2;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    auto delta = [](kelp_metric metric, uint64_t before) { return kelp_metric_read(metric) - before; };
+
+    // Encoded and decoded bytes, and the decode cache, from another thread so the slabs are summed
+    const uint64_t encoded = kelp_metric_read(KELP_METRIC_RS_ENCODED_BYTES);
+    const uint64_t decoded = kelp_metric_read(KELP_METRIC_RS_DECODED_BYTES);
+    const uint64_t hits = kelp_metric_read(KELP_METRIC_DECODE_CACHE_HITS);
+    const uint64_t misses = kelp_metric_read(KELP_METRIC_DECODE_CACHE_MISSES);
+    const uint64_t failures = kelp_metric_read(KELP_METRIC_RS_DECODE_FAILURES);
+    std::thread([&] {
+        std::vector<std::vector<unsigned char>> cells(k + m, std::vector<unsigned char>(64, 7));
+        std::vector<unsigned char*> shards;
+        for (auto& cell : cells) shards.push_back(cell.data());
+        rs_encode(rs, shards.data(), shards.data() + k, 64);
+        int erasures[k + m] = {1, 0, 0, 1, 0, 0};
+        EXPECT_EQ(rs_decode(rs, shards.data(), erasures, 2, 64), 1);
+        EXPECT_EQ(rs_decode(rs, shards.data(), erasures, 2, 64), 1);
+        int too_many[k + m] = {1, 1, 1, 0, 0, 0};
+        EXPECT_EQ(rs_decode(rs, shards.data(), too_many, 3, 64), 0);
+    }).join();
+    EXPECT_EQ(delta(KELP_METRIC_RS_ENCODED_BYTES, encoded), uint64_t(k * 64));
+    EXPECT_EQ(delta(KELP_METRIC_RS_DECODED_BYTES, decoded), uint64_t(2 * 2 * 64));
+    EXPECT_EQ(delta(KELP_METRIC_DECODE_CACHE_MISSES, misses), 1u);
+    EXPECT_EQ(delta(KELP_METRIC_DECODE_CACHE_HITS, hits), 1u);
+    EXPECT_EQ(delta(KELP_METRIC_RS_DECODE_FAILURES, failures), 1u);
+
+    // CRC failures
+    const uint64_t crc_failures = kelp_metric_read(KELP_METRIC_CRC_FAILURES);
+    Block blocks[2];
+    std::memset(blocks, 0, sizeof(blocks));
+    sealBlock(blocks[0]);
+    EXPECT_TRUE(validateBlock(blocks[0]));
+    EXPECT_FALSE(validateBlock(blocks[1]));
+    const Block* cells[2] = {&blocks[0], &blocks[1]};
+    bool valid[2];
+    EXPECT_EQ(validateBlocks(cells, 2, valid), 1);
+    EXPECT_EQ(delta(KELP_METRIC_CRC_FAILURES, crc_failures), 2u);
+
+    // Submits, completions and the queue depth at the reap
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    TempVolumes temp;
+    const int fd = temp.file();
+    const uint64_t submitted = kelp_metric_read(KELP_METRIC_IO_SUBMITTED);
+    const uint64_t completed = kelp_metric_read(KELP_METRIC_IO_COMPLETED);
+    const uint64_t depth_sum = kelp_metric_read(KELP_METRIC_IO_DEPTH_SUM);
+    IoBatch batch(io_ctx, 4);
+    for (int i = 0; i < 3; ++i) ASSERT_TRUE(batch.queueWrite(fd, i * sizeof(Block), &blocks[0], sizeof(Block), i));
+    ASSERT_EQ(batch.flush(), 3);
+    IoCompletion events[4];
+    int reaped = 0;
+    while (reaped < 3) {
+        int got = batch.reap(events, 4, 3 - reaped);
+        ASSERT_GT(got, 0);
+        reaped += got;
+    }
+    EXPECT_EQ(delta(KELP_METRIC_IO_SUBMITTED, submitted), 3u);
+    EXPECT_EQ(delta(KELP_METRIC_IO_COMPLETED, completed), 3u);
+    EXPECT_GE(delta(KELP_METRIC_IO_DEPTH_SUM, depth_sum), 3u);
+
+    // Prometheus text, and the size it needs when truncated
+    char text[4096];
+    size_t length = kelp_metrics_prometheus(text, sizeof(text));
+    ASSERT_LT(length, sizeof(text));
+    EXPECT_EQ(strlen(text), length);
+    EXPECT_NE(strstr(text, "# TYPE kelp_crc_failures_total counter\nkelp_crc_failures_total "), nullptr);
+    EXPECT_NE(strstr(text, "# TYPE kelp_io_in_flight gauge\nkelp_io_in_flight "), nullptr);
+    char small[16];
+    EXPECT_EQ(kelp_metrics_prometheus(small, sizeof(small)), length);
+    EXPECT_EQ(strlen(small), sizeof(small) - 1);
+    EXPECT_STREQ(kelp_metric_name(KELP_METRIC_RS_ENCODED_BYTES), "kelp_rs_encoded_bytes_total");
+
+    io_destroy(io_ctx);
+    rs_free(rs);
+}
+
+TEST(BlockAIOTest, ShardTransport) {
+    // Two loopback UDP sockets
+    int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_GE(rx, 0);
+    ASSERT_GE(tx, 0);
+    const int buffer_bytes = 4 << 20;
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &buffer_bytes, sizeof(buffer_bytes));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(rx, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    socklen_t addr_len = sizeof(addr);
+    ASSERT_EQ(getsockname(rx, reinterpret_cast<sockaddr*>(&addr), &addr_len), 0);
+
+    // Two volumes, shards {0, 1} and {2}, and stripes 1 and 2 of every shard
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(3, 2);
+    std::vector<Block> blocks(6);
+    std::vector<const Block*> cells;
+    for (int i = 0; i < 6; ++i) {
+        blocks[i].stripe_number = (uint64_t(1 + i / 3) << 8) | (i % 3);
+        blocks[i].block_sequence_number = 5;
+        blocks[i].data.fill(static_cast<unsigned char>(i + 1));
+        sealBlock(blocks[i]);
+        cells.push_back(&blocks[i]);
+    }
+    blocks[5].data[0] ^= 1;  // fails its checksum
+
+    ShardSender sender(tx, 8);
+    EXPECT_FALSE(sender.queue(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 1, cells.data(), 0));
+    EXPECT_FALSE(sender.queue(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 1, cells.data(), SHARD_MAX_BLOCKS + 1));
+    ASSERT_TRUE(sender.queue(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 10, cells.data(), 4));
+    ASSERT_TRUE(sender.queue(reinterpret_cast<sockaddr*>(&addr), sizeof(addr), 11, cells.data() + 4, 2));
+    EXPECT_EQ(sender.queued(), 2);
+    ASSERT_EQ(sender.flush(), 2);
+    EXPECT_EQ(sender.inFlight(), 2);
+    // Not a shard message, dropped
+    const char junk[] = "not cells";
+    ASSERT_EQ(sendto(tx, junk, sizeof(junk), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), ssize_t(sizeof(junk)));
+
+    ShardReceiver receiver(rx, 4);
+    ShardMessage messages[4];
+    int got = 0;
+    for (int tries = 0; got < 2 && tries < 1000; ++tries) {
+        int ret = receiver.receive(messages + got, 4 - got);
+        ASSERT_GE(ret, 0);
+        got += ret;
+    }
+    ASSERT_EQ(got, 2);
+    EXPECT_EQ(receiver.stats().dropped, 1u);
+    EXPECT_EQ(receiver.freeSlots(), 2);
+    EXPECT_EQ(messages[0].tag, 10u);
+    EXPECT_EQ(messages[0].count, 4);
+    EXPECT_EQ(messages[0].valid_mask, 0xfu);
+    EXPECT_EQ(messages[1].tag, 11u);
+    EXPECT_EQ(messages[1].valid_mask, 0x1u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(messages[0].blocks) % PAGE_SIZE, 0u);
+    EXPECT_EQ(std::memcmp(messages[0].blocks, blocks.data(), 4 * sizeof(Block)), 0);
+    EXPECT_EQ(receiver.stats().invalid_blocks, 1u);
+
+    // The valid cells land where the map puts them, shards 0 and 1 of a stripe as one write
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    IoBatch batch(io_ctx, 8);
+    EXPECT_EQ(queueCellWrites(batch, map, messages[0], 1), 3);  // {0, 1}, {2}, {0 of stripe 2}
+    EXPECT_EQ(queueCellWrites(batch, map, messages[1], 2), 1);
+    // Cells claiming the header stripe, or a shard no volume holds, are skipped
+    std::vector<Block> stray = {blocks[0], blocks[1]};
+    stray[0].stripe_number = 0;
+    stray[1].stripe_number = (uint64_t(1) << 8) | 7;
+    ShardMessage forged = messages[0];
+    forged.blocks = stray.data();
+    forged.count = 2;
+    forged.valid_mask = 0x3;
+    EXPECT_EQ(queueCellWrites(batch, map, forged, 3), 0);
+    ASSERT_EQ(batch.flush(), 4);
+    IoCompletion events[8];
+    int reaped = 0;
+    while (reaped < 4) {
+        int n = batch.reap(events, 8, 4 - reaped);
+        ASSERT_GT(n, 0);
+        reaped += n;
+    }
+    for (int i = 0; i < 5; ++i) {
+        Block cell;
+        const Volume& vol = map.volumes[findVolumeForShard(map, i % 3)];
+        ASSERT_EQ(pread(vol.fd, &cell, sizeof(cell), computeOffsetToBlock(vol.header, 1 + i / 3, i % 3)), ssize_t(sizeof(cell)));
+        EXPECT_EQ(std::memcmp(&cell, &blocks[i], sizeof(cell)), 0) << i;
+    }
+    receiver.release(messages[0].slot);
+    receiver.release(messages[1].slot);
+    EXPECT_EQ(receiver.freeSlots(), 4);
+
+    // The sender hands the buffers back once the kernel is done with them
+    IoCompletion done[8];
+    int completed = 0;
+    for (int tries = 0; completed < 2 && tries < 1000; ++tries) {
+        completed += sender.reap(done + completed, 8 - completed);
+        if (completed < 2) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    ASSERT_EQ(completed, 2);
+    EXPECT_EQ(done[0].user_tag, 10u);
+    EXPECT_EQ(done[0].result, long(sizeof(ShardHeader) + 4 * sizeof(Block)));
+    EXPECT_EQ(done[1].user_tag, 11u);
+    EXPECT_EQ(sender.inFlight(), 0);
+
+    io_destroy(io_ctx);
+    close(rx);
+    close(tx);
+}
+
+TEST(BlockAIOTest, StripeCache) {
+    const size_t bytes = 2 * 4080;
+    std::vector<unsigned char> payload(bytes);
+    auto fill = [&](int value) {
+        for (size_t i = 0; i < bytes; ++i) payload[i] = static_cast<unsigned char>(i * 3 + value);
+    };
+    StripeCacheConfig config;
+    config.capacity_bytes = 20 * bytes;
+    config.shards = 1;
+    config.small_fraction = 0.2;
+    config.verify_hits = true;
+    StripeCache cache(bytes, config);
+
+    // Hits hand out the cached payload itself, and outlive its eviction
+    EXPECT_EQ(cache.lookup(1, 5), nullptr);
+    fill(5);
+    StripeCache::Handle inserted = cache.insert(1, 5, 10, payload.data());
+    ASSERT_NE(inserted, nullptr);
+    StripeCache::Handle hit = cache.lookup(1, 5);
+    ASSERT_EQ(hit, inserted);
+    EXPECT_EQ(std::memcmp(hit->payload, payload.data(), bytes), 0);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(hit->payload) % PAGE_SIZE, 0u);
+    EXPECT_EQ(cache.lookup(2, 5), nullptr);  // another volume prefix
+
+    // Sequence numbers: older inserts and lookups wanting newer data miss
+    fill(6);
+    EXPECT_EQ(cache.insert(1, 5, 9, payload.data()), inserted);
+    EXPECT_EQ(cache.lookup(1, 5, 10), inserted);
+    EXPECT_EQ(cache.lookup(1, 5, 11), nullptr);
+    EXPECT_EQ(cache.insert(1, 5, 10, payload.data())->sequence_number, 10u);
+    cache.invalidate(1, 5, 12);
+    EXPECT_EQ(cache.lookup(1, 5), nullptr);
+    EXPECT_EQ(cache.insert(1, 5, 11, payload.data()), nullptr);  // decoded before the update
+    ASSERT_NE(cache.insert(1, 5, 12, payload.data()), nullptr);
+    EXPECT_EQ(std::memcmp(cache.lookup(1, 5)->payload, payload.data(), bytes), 0);
+    fill(5);
+    EXPECT_EQ(std::memcmp(hit->payload, payload.data(), bytes), 0);  // the old handle is untouched
+    hit.reset();
+    inserted.reset();
+
+    // A corrupted entry fails verification and is dropped
+    fill(7);
+    const_cast<unsigned char*>(cache.insert(1, 7, 1, payload.data())->payload)[100] ^= 1;
+    EXPECT_EQ(cache.lookup(1, 7), nullptr);
+    EXPECT_EQ(cache.stats().verify_failures, 1u);
+    EXPECT_EQ(cache.lookup(1, 7), nullptr);
+
+    // Hot stripes survive a scan of many more stripes than fit
+    for (int s = 100; s < 110; ++s) {
+        fill(s);
+        cache.insert(1, s, 1, payload.data());
+        cache.lookup(1, s);
+    }
+    for (int s = 1000; s < 1200; ++s) {
+        fill(s);
+        cache.insert(1, s, 1, payload.data());
+    }
+    EXPECT_LE(cache.entries(), 20u);
+    for (int s = 100; s < 110; ++s) {
+        StripeCache::Handle hot = cache.lookup(1, s);
+        ASSERT_NE(hot, nullptr) << s;
+        fill(s);
+        EXPECT_EQ(std::memcmp(hot->payload, payload.data(), bytes), 0);
+    }
+    // A scanned stripe coming back soon goes straight to the main queue
+    fill(1190);
+    cache.insert(1, 1190, 1, payload.data());
+    StripeCacheStats stats = cache.stats();
+    EXPECT_GE(stats.promotions, 10u);
+    EXPECT_GE(stats.ghost_hits, 1u);
+    EXPECT_GT(stats.evictions, 180u);
+
+    // Reads through a StripeReader cache the payload at the cells' sequence number
+    init_gf();
+    const int k = 2, m = 1;
+    reed_solomon* rs = rs_new(k, m);
+    ASSERT_NE(rs, nullptr);
+    io_context_t io_ctx = 0;
+    ASSERT_EQ(io_setup(MAX_EVENTS, &io_ctx), 0);
+    TempVolumes temp;
+    VolumeMap map = temp.volumeMap(3, 3);
+    std::vector<Block> blocks(k + m);
+    fill(42);
+    buildStripe(rs, payload.data(), 3, 8, blocks.data());
+    for (int i = 0; i < k + m; ++i) {
+        const Volume& vol = map.volumes[findVolumeForShard(map, i)];
+        ASSERT_EQ(pwrite(vol.fd, &blocks[i], sizeof(Block), computeOffsetToBlock(vol.header, 3, i)), (ssize_t)sizeof(Block));
+    }
+    {
+        StripeReader reader(map, rs, io_ctx, 8);
+        StripeCache::Handle read;
+        ASSERT_EQ(cache.read(reader, 9, 3, &read), 0);
+        ASSERT_NE(read, nullptr);
+        EXPECT_EQ(read->sequence_number, 8u);
+        EXPECT_EQ(std::memcmp(read->payload, payload.data(), bytes), 0);
+        const uint64_t reads = reader.cellReads();
+        StripeCache::Handle again;
+        ASSERT_EQ(cache.read(reader, 9, 3, &again), 0);
+        EXPECT_EQ(again, read);
+        EXPECT_EQ(reader.cellReads(), reads);
+
+        // A read that raced an update isn't cached
+        cache.invalidate(9, 3, 9);
+        EXPECT_EQ(cache.read(reader, 9, 3, &again), -ESTALE);
+        EXPECT_EQ(cache.lookup(9, 3), nullptr);
+
+        // Stripes past 2^31 are read and keyed by their full 64-bit number
+        const uint64_t far = (uint64_t(1) << 31) + 3;
+        buildStripe(rs, payload.data(), far, 8, blocks.data());
+        for (int i = 0; i < k + m; ++i) {
+            ASSERT_EQ(pwrite(map.volumes[i].fd, &blocks[i], sizeof(Block), computeOffsetToBlock(map.volumes[i].header, far, i)), (ssize_t)sizeof(Block));
+        }
+        ASSERT_EQ(cache.read(reader, 9, far, &read), 0);
+        EXPECT_EQ(read->stripe_number, far);
+        EXPECT_EQ(std::memcmp(read->payload, payload.data(), bytes), 0);
+        EXPECT_EQ(cache.lookup(9, far), read);
+        EXPECT_EQ(cache.lookup(9, 3), nullptr);
+    }
+    io_destroy(io_ctx);
+    rs_free(rs);
+}
+
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();